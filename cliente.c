@@ -1,34 +1,2007 @@
 /*
- * Uso: ./cliente <servidor> <puerto>
+ * Uso: ./cliente <servidor> <puerto> [--batch ARCHIVO] [--pipeline N] [--canales N] [--sin-compresion]
+ *                [--flujos N] [--control RUTA]
+ *      ./cliente <servidor> <puerto> --maestro RUTA [--inactividad S] [--sin-compresion]
+ *      ./cliente <servidor> <puerto> --bench MEZCLA [--conexiones C] [--duracion S]
+ *                [--peticiones N] [--reconectar] [--json ARCHIVO]
  * 
- * Compilación: gcc -o cliente cliente.c
+ * Compilación: gcc -o cliente cliente.c -pthread -lz
  * 
  * Descripción:
  * Este programa implementa un cliente simple tipo SSH, que permite conectar a un servidor TCP
  * remoto, enviarle comandos y recibir la respuesta. Permite salir escribiendo 'exit' o 'salir',
  * o forzar la desconexión con Ctrl+C (SIGINT).
+ * Toda la comunicación con el servidor viaja en tramas (ver protocolo.h).
+ * Con --batch lee los comandos de un archivo (o de la entrada estándar con '-') y los
+ * envía por adelantado, con hasta N comandos sin respuesta en vuelo (--pipeline N),
+ * repartidos entre varios canales que el servidor atiende en paralelo (--canales N).
+ * Con --bench genera carga sobre el servidor con C conexiones y mide el rendimiento y
+ * las latencias (ver ejecutar_bench).
+ * Si el servidor la ofrece, se pide la salida comprimida, que se descomprime a medida
+ * que llega (--sin-compresion la recibe tal cual).
+ * En la sesión interactiva, 'get' y 'put' descargan y suben archivos en trozos
+ * verificados, con varios trozos en paralelo (--flujos N), y muestran la velocidad.
+ * Con --maestro mantiene abierta la conexión y la comparte, por un socket Unix, con
+ * los clientes que se lancen con --control (ver ejecutar_maestro).
  */
 
+#define _GNU_SOURCE     // fallocate
 #include <stdio.h>      // Entrada/Salida estándar (printf, fgets, etc)
 #include <stdlib.h>     // Funciones generales (exit, atoi, etc)
 #include <string.h>     // Manejo de cadenas (memset, strcmp, etc)
 #include <sys/types.h>  // Tipos de datos para sockets
 #include <sys/socket.h> // Funciones y constantes para sockets
+#include <sys/un.h>     // sockaddr_un (conexión compartida)
 #include <netinet/in.h> // Estructuras para direcciones de red
+#include <netinet/tcp.h> // TCP_NODELAY
 #include <arpa/inet.h>  // Conversión de direcciones IP
 #include <netdb.h>      // Resolución de nombres de host (gethostbyname)
 #include <unistd.h>     // Funciones POSIX (close, write, etc)
 #include <limits.h>     // Constantes de límites (no se usa en este código)
 #include <signal.h>     // Manejo de señales (signal)
 #include <errno.h>      // Manejo de errores (perror)
+#include <fcntl.h>      // fcntl (socket no bloqueante en modo batch), fallocate
+#include <sys/stat.h>   // fstat, stat (get y put), umask (socket del maestro)
+#include <poll.h>       // poll (envío y recepción simultáneos en modo batch)
+#include <getopt.h>     // getopt_long (opciones de línea de comandos)
+#include <time.h>       // clock_gettime (resumen del modo batch)
+#include <pthread.h>    // pthread_create (un hilo por conexión en modo bench)
+#include <stdatomic.h>  // atomic_long (peticiones repartidas entre hilos en modo bench)
+#include <zlib.h>       // inflate (salida comprimida)
+#include "protocolo.h"  // Tramas del protocolo (compartido con el servidor)
 
-#define CMD_EOF_MARKER "<CMD_EOF>"     // Marcador de fin de salida de comando (debe coincidir con el servidor)
 #define CLIENT_BUFFER_SIZE 4096       // Tamaño del buffer para la respuesta del servidor
+#define PIPELINE_POR_DEFECTO 32       // Comandos en vuelo en modo batch (--pipeline)
+#define LOTE_MAX_POR_ENVIAR (64 * 1024) // Bytes de comandos preparados sin enviar en modo batch
+#define MAX_CANALES_LOTE 64           // Máximo de canales en modo batch (--canales)
+#define VENTANA_MIN_CONCESION (256 * 1024) // Bytes consumidos de un canal que se conceden juntos
 
 // Variable global para el descriptor de socket. 
 // Se usa en el handler de señales para cerrar el socket al salir.
 int sd = -1;
 
+// Destino de los mensajes informativos: en modo batch van a stderr para que la
+// salida estándar contenga sólo la salida de los comandos
+static FILE *info = NULL;
+
+// 1 si se pide al servidor la salida comprimida (--sin-compresion lo desactiva)
+static int pedir_compresion = 1;
+
+// Capacidades (PROTO_CAP_*) que ofreció el servidor en su saludo
+static int capacidades_servidor = 0;
+
+/*
+ * Envía una trama completa (cabecera + carga) al servidor.
+ */
+static int enviar_trama(int fd, uint8_t tipo, uint32_t id, int32_t estado,
+                        const void *carga, uint32_t longitud) {
+    uint8_t trama[PROTO_CABECERA + CLIENT_BUFFER_SIZE];
+    if (longitud > CLIENT_BUFFER_SIZE) return -1;
+    trama_codificar(trama, tipo, 0, id, longitud, estado);
+    if (longitud > 0) memcpy(trama + PROTO_CABECERA, carga, longitud);
+    size_t total = PROTO_CABECERA + longitud, enviados = 0;
+    while (enviados < total) {
+        ssize_t n = send(fd, trama + enviados, total - enviados, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        enviados += n;
+    }
+    return 0;
+}
+
+/*
+ * Recibe exactamente 'n' bytes. Devuelve 1 si se recibieron, 0 si el servidor cerró
+ * la conexión y -1 si hubo error.
+ */
+static int recibir_exacto(int fd, void *buf, size_t n) {
+    size_t recibidos = 0;
+    while (recibidos < n) {
+        ssize_t r = recv(fd, (char *) buf + recibidos, n - recibidos, 0);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) return 0;
+        recibidos += r;
+    }
+    return 1;
+}
+
+/*
+ * Recibe la cabecera de la siguiente trama. Devuelve 1 si se recibió, 0 si el
+ * servidor cerró la conexión y -1 si hubo error o la trama no es válida.
+ */
+static int recibir_cabecera(int fd, cabecera_trama_t *c) {
+    uint8_t buf[PROTO_CABECERA];
+    int r = recibir_exacto(fd, buf, sizeof(buf));
+    if (r <= 0) return r;
+    if (trama_decodificar(buf, c) == -1) {
+        fprintf(stderr, "[CLIENTE] Trama inválida del servidor (versión %u, se esperaba %u)\n",
+                buf[0], PROTO_VERSION);
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Recibe la carga de una trama y la escribe en 'fd_salida' por partes, sin guardarla
+ * completa en memoria. Con fd_salida = -1 la carga sólo se descarta.
+ */
+static int volcar_carga(int fd, uint32_t longitud, int fd_salida) {
+    char buf[CLIENT_BUFFER_SIZE];
+    while (longitud > 0) {
+        size_t n = longitud < sizeof(buf) ? longitud : sizeof(buf);
+        int r = recibir_exacto(fd, buf, n);
+        if (r <= 0) return r;
+        if (fd_salida != -1) write(fd_salida, buf, n);
+        longitud -= n;
+    }
+    return 1;
+}
+
+/*
+ * Escribe 'n' bytes completos en 'fd'.
+ */
+static void escribir_todo(int fd, const void *datos, size_t n) {
+    const char *p = datos;
+    while (n > 0) {
+        ssize_t r = write(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return;
+        p += r;
+        n -= r;
+    }
+}
+
+/*
+ * Salida comprimida (TRAMA_DATOS_Z, ver protocolo.h): cada canal tiene su propio
+ * descompresor. Los bytes se descomprimen según llegan, aunque sean sólo una parte de
+ * una trama, y lo que sale se entrega a 'destino'; al terminar un flujo el
+ * descompresor queda listo para la siguiente respuesta.
+ * Devuelve -1 si los datos no son un flujo deflate válido o si 'destino' falla.
+ */
+typedef int (*destino_salida_t)(void *arg, const void *datos, size_t n);
+
+static int destino_fd(void *arg, const void *datos, size_t n) {
+    escribir_todo(*(int *) arg, datos, n);
+    return 0;
+}
+
+static int descomprimir(z_stream **pz, const void *datos, size_t n, destino_salida_t destino, void *arg) {
+    unsigned char salida[64 * 1024];
+    if (*pz == NULL) {
+        z_stream *z = calloc(1, sizeof(z_stream));
+        if (z == NULL || inflateInit2(z, -MAX_WBITS) != Z_OK) {
+            fprintf(stderr, "[CLIENTE] No se pudo iniciar la descompresión\n");
+            free(z);
+            return -1;
+        }
+        *pz = z;
+    }
+    z_stream *z = *pz;
+    z->next_in = (Bytef *) datos;
+    z->avail_in = (uInt) n;
+    do {
+        z->next_out = salida;
+        z->avail_out = sizeof(salida);
+        int r = inflate(z, Z_NO_FLUSH);
+        if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+            fprintf(stderr, "[CLIENTE] Salida comprimida inválida (%s)\n", z->msg ? z->msg : zError(r));
+            return -1;
+        }
+        size_t producidos = sizeof(salida) - z->avail_out;
+        if (producidos > 0 && destino(arg, salida, producidos) == -1) return -1;
+        if (r == Z_STREAM_END) inflateReset(z);
+        else if (r == Z_BUF_ERROR && producidos == 0) break; // Falta el resto de la trama
+    } while (z->avail_in > 0 || z->avail_out == 0);
+    return 0;
+}
+
+static void liberar_descompresor(z_stream **pz) {
+    if (*pz == NULL) return;
+    inflateEnd(*pz);
+    free(*pz);
+    *pz = NULL;
+}
+
+/*
+ * Como volcar_carga, para la carga de una TRAMA_DATOS_Z.
+ */
+static int volcar_comprimida(int fd, uint32_t longitud, z_stream **pz, int fd_salida) {
+    char buf[CLIENT_BUFFER_SIZE];
+    while (longitud > 0) {
+        size_t n = longitud < sizeof(buf) ? longitud : sizeof(buf);
+        int r = recibir_exacto(fd, buf, n);
+        if (r <= 0) return r;
+        if (descomprimir(pz, buf, n, destino_fd, &fd_salida) == -1) return -1;
+        longitud -= n;
+    }
+    return 1;
+}
+
+static double segundos_desde(const struct timespec *inicio) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec - inicio->tv_sec) + (t.tv_nsec - inicio->tv_nsec) / 1e9;
+}
+
+/*
+ * Recibe la trama de saludo (del servidor o de un maestro) y pide la salida
+ * comprimida si se ofrece. Devuelve 'fd', o -1 (tras cerrarlo) si falló.
+ */
+static int recibir_saludo(int fd, FILE *log, int *capacidades) {
+    cabecera_trama_t cab;
+    int n_recv = recibir_cabecera(fd, &cab);
+    if (n_recv > 0 && cab.tipo == TRAMA_HOLA) {
+        if (log) fflush(log);
+        // Mostrar lo que envíe el servidor (info conexión + bienvenida)
+        if (volcar_carga(fd, cab.longitud, log ? fileno(log) : -1) > 0) {
+            if (capacidades != NULL) *capacidades = cab.estado;
+            // Pedir la salida comprimida si el servidor la ofrece
+            if (!pedir_compresion || !(cab.estado & PROTO_CAP_ZLIB)) return fd;
+            if (enviar_trama(fd, TRAMA_OPCIONES, 0, PROTO_CAP_ZLIB, NULL, 0) == 0) return fd;
+        }
+        n_recv = -1;
+    }
+    if (n_recv == 0) {
+        fprintf(stderr, "El servidor cerró la conexión inmediatamente.\n");
+    } else if (n_recv > 0) {
+        fprintf(stderr, "Trama inicial inesperada (tipo %u)\n", cab.tipo);
+    } else {
+        perror("Error al recibir mensaje inicial del servidor");
+    }
+    close(fd);
+    return -1;
+}
+
+/*
+ * Conecta con el servidor y recibe su trama de saludo. Con 'log' distinto de NULL se
+ * muestran los pasos y el saludo, como en una sesión normal; el modo bench conecta en
+ * silencio. Si 'capacidades' no es NULL, recibe las que ofrece el servidor.
+ * Devuelve el socket, o -1 si falló.
+ */
+static int conectar(const struct sockaddr_in *dir, FILE *log, int *capacidades) {
+    // ---------------------- 2. CREAR SOCKET ----------------------
+    if (log) fprintf(log, "2. Creando socket del cliente...\n");
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP); // Socket TCP
+    if (fd < 0) {
+        perror("[CLIENTE] Error al crear socket");
+        return -1;
+    }
+
+    // ---------------------- 3. CONECTAR AL SERVIDOR ----------------------
+    if (log) fprintf(log, "3. Conectando al servidor...\n");
+    if (connect(fd, (const struct sockaddr *) dir, sizeof(struct sockaddr_in)) < 0) {
+        perror("Error al conectar");
+        if (log) {
+            printf("Verificar que:\n");
+            printf("- El servidor esté ejecutándose en %s:%u\n", inet_ntoa(dir->sin_addr), ntohs(dir->sin_port));
+            printf("- La dirección IP y puerto sean correctos\n");
+            printf("- No haya firewall bloqueando la conexión\n");
+        }
+        close(fd);
+        return -1;
+    }
+
+    if (log) fprintf(log, "¡Conexión establecida exitosamente!\n\n");
+    int uno = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &uno, sizeof(uno)); // Cada comando sale sin esperar
+
+    // ---------------------- 4. RECIBIR MENSAJES INICIALES DEL SERVIDOR ----------------------
+    return recibir_saludo(fd, log, capacidades);
+}
+
+/*
+ * Comando enviado que aún espera su trama de fin. Mientras no sea el más antiguo en
+ * vuelo, su salida se guarda en 'salida' para escribirla en orden.
+ */
+typedef struct {
+    uint32_t id;
+    uint16_t canal;
+    char *comando;
+    char *salida;
+    size_t len, cap;
+    size_t cable;           // Bytes recibidos (tal como viajan) de lo guardado en 'salida'
+    int terminado;
+    int32_t estado;
+} en_vuelo_t;
+
+static int guardar_salida(en_vuelo_t *v, const void *datos, size_t n) {
+    if (v->len + n > v->cap) {
+        size_t nueva = v->cap ? v->cap : CLIENT_BUFFER_SIZE;
+        while (nueva < v->len + n) nueva *= 2;
+        char *p = realloc(v->salida, nueva);
+        if (p == NULL) return -1;
+        v->salida = p;
+        v->cap = nueva;
+    }
+    memcpy(v->salida + v->len, datos, n);
+    v->len += n;
+    return 0;
+}
+
+static int destino_guardar(void *arg, const void *datos, size_t n) {
+    if (guardar_salida(arg, datos, n) == 0) return 0;
+    perror("[CLIENTE] Error al reservar memoria para la salida");
+    return -1;
+}
+
+/*
+ * Modo batch: envía los comandos de 'entrada' sin esperar cada respuesta, con hasta
+ * 'profundidad' comandos en vuelo repartidos entre 'num_canales' canales (cada uno va
+ * al canal con menos comandos pendientes). Cada canal responde en orden; los canales
+ * distintos, en paralelo.
+ * La salida de los comandos va a stdout en el orden del archivo: la del comando más
+ * antiguo en vuelo se escribe al llegar y la de los demás se guarda hasta que les
+ * toque. Sólo se concede ventana al servidor por lo ya escrito, así que lo guardado
+ * de cada canal, antes de descomprimirlo, no supera su ventana. Los códigos de salida
+ * distintos de cero se informan en stderr.
+ * El socket se usa sin bloqueo y con poll(): si el cliente se quedara bloqueado
+ * enviando mientras el servidor espera que lea las respuestas, ninguno avanzaría.
+ * Devuelve el número de comandos que fallaron, o -1 si se perdió la conexión.
+ */
+static int ejecutar_lote(FILE *entrada, int profundidad, int num_canales) {
+    en_vuelo_t *ventana = calloc(profundidad, sizeof(en_vuelo_t));
+    size_t primero = 0, num_vuelo = 0;
+    size_t cap_por_enviar = LOTE_MAX_POR_ENVIAR + PROTO_CABECERA + CLIENT_BUFFER_SIZE + num_canales * PROTO_CABECERA;
+    uint8_t *por_enviar = malloc(cap_por_enviar);
+    size_t pend_inicio = 0, pend_fin = 0;
+    int en_canal[MAX_CANALES_LOTE] = { 0 };       // Comandos en vuelo por canal
+    uint32_t credito[MAX_CANALES_LOTE] = { 0 };   // Bytes escritos aún no concedidos al servidor
+    z_stream *inflado[MAX_CANALES_LOTE] = { NULL }; // Descompresor de cada canal
+    int fd_salida = STDOUT_FILENO;
+    uint8_t cab_buf[PROTO_CABECERA];
+    size_t cab_len = 0;
+    cabecera_trama_t cab;
+    en_vuelo_t *actual = NULL;                     // Comando de la trama en curso
+    uint32_t carga_restante = 0;
+    int en_carga = 0, fin_entrada = 0, despedida = 0;
+    uint32_t id_peticion = 0, completados = 0;
+    int fallidos = 0;
+    char *linea = NULL;
+    size_t cap_linea = 0;
+    struct timespec inicio;
+
+    if (ventana == NULL || por_enviar == NULL) {
+        perror("[CLIENTE] Error al reservar memoria para el modo batch");
+        free(ventana); free(por_enviar);
+        return -1;
+    }
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
+    clock_gettime(CLOCK_MONOTONIC, &inicio);
+
+    while (!fin_entrada || num_vuelo > 0 || pend_fin > pend_inicio) {
+        if (pend_inicio > 0) {
+            memmove(por_enviar, por_enviar + pend_inicio, pend_fin - pend_inicio);
+            pend_fin -= pend_inicio;
+            pend_inicio = 0;
+        }
+        // Conceder ventana por lo escrito (acumulado, para no enviar una trama por cada recv)
+        for (int c = 0; c < num_canales; c++) {
+            if (credito[c] < VENTANA_MIN_CONCESION && !(credito[c] > 0 && en_canal[c] == 0)) continue;
+            trama_codificar(por_enviar + pend_fin, TRAMA_VENTANA, (uint16_t) c, 0, 0, (int32_t) credito[c]);
+            pend_fin += PROTO_CABECERA;
+            credito[c] = 0;
+        }
+        // Preparar comandos mientras haya lugar en la ventana
+        while (!fin_entrada && num_vuelo < (size_t) profundidad && pend_fin < LOTE_MAX_POR_ENVIAR) {
+            ssize_t largo = getline(&linea, &cap_linea, entrada);
+            if (largo < 0) { fin_entrada = 1; break; }
+            linea[strcspn(linea, "\r\n")] = '\0';
+            if (linea[0] == '\0' || linea[0] == '#') continue; // Líneas vacías y comentarios
+            if (strcmp(linea, "salir") == 0 || strcmp(linea, "exit") == 0) { fin_entrada = 1; break; }
+            largo = strlen(linea);
+            if (largo > CLIENT_BUFFER_SIZE - 1) {
+                fprintf(stderr, "[CLIENTE] Comando demasiado largo, se omite: %.40s...\n", linea);
+                fallidos++;
+                continue;
+            }
+            int canal = 0;
+            for (int c = 1; c < num_canales; c++) {
+                if (en_canal[c] < en_canal[canal]) canal = c;
+            }
+            id_peticion++;
+            trama_codificar(por_enviar + pend_fin, TRAMA_COMANDO, (uint16_t) canal, id_peticion, (uint32_t) largo, 0);
+            memcpy(por_enviar + pend_fin + PROTO_CABECERA, linea, largo);
+            pend_fin += PROTO_CABECERA + largo;
+            en_vuelo_t *v = &ventana[(primero + num_vuelo) % profundidad];
+            memset(v, 0, sizeof(*v));
+            v->id = id_peticion;
+            v->canal = (uint16_t) canal;
+            v->comando = strdup(linea);
+            en_canal[canal]++;
+            num_vuelo++;
+        }
+        if (fin_entrada && num_vuelo == 0 && pend_fin == pend_inicio) break;
+
+        struct pollfd pfd = { .fd = sd, .events = POLLIN };
+        if (pend_fin > pend_inicio) pfd.events |= POLLOUT;
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("[CLIENTE] Error en poll");
+            fallidos = -1;
+            break;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = send(sd, por_enviar + pend_inicio, pend_fin - pend_inicio, MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Error al enviar comando");
+                fallidos = -1;
+                break;
+            }
+            if (n > 0) pend_inicio += n;
+            if (pend_inicio == pend_fin) pend_inicio = pend_fin = 0;
+        }
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+        uint8_t buf[64 * 1024];
+        ssize_t n = recv(sd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+            perror("Error al recibir respuesta");
+            fallidos = -1;
+            break;
+        }
+        if (n == 0) {
+            fprintf(stderr, "Servidor cerró conexión inesperadamente.\n");
+            fallidos = -1;
+            break;
+        }
+
+        // Un recv() puede traer varias tramas o partes de ellas
+        for (size_t i = 0; i < (size_t) n && fallidos >= 0; ) {
+            if (!en_carga) {
+                size_t k = PROTO_CABECERA - cab_len;
+                if (k > (size_t) n - i) k = n - i;
+                memcpy(cab_buf + cab_len, buf + i, k);
+                cab_len += k;
+                i += k;
+                if (cab_len < PROTO_CABECERA) break;
+                cab_len = 0;
+                if (trama_decodificar(cab_buf, &cab) == -1) {
+                    fprintf(stderr, "[CLIENTE] Trama inválida del servidor (versión %u, se esperaba %u)\n",
+                            cab_buf[0], PROTO_VERSION);
+                    fallidos = -1;
+                    break;
+                }
+                actual = NULL;
+                if (cab.tipo == TRAMA_DATOS || cab.tipo == TRAMA_DATOS_Z || cab.tipo == TRAMA_FIN) {
+                    // Los ids en vuelo son consecutivos a partir del más antiguo
+                    uint32_t pos = num_vuelo > 0 ? cab.id - ventana[primero].id : 0;
+                    if (num_vuelo > 0 && pos < num_vuelo) actual = &ventana[(primero + pos) % profundidad];
+                    if (actual == NULL || actual->canal != cab.canal || actual->terminado) {
+                        fprintf(stderr, "[CLIENTE] Respuesta inesperada (id %u, canal %u)\n", cab.id, cab.canal);
+                        fallidos = -1;
+                        break;
+                    }
+                }
+                carga_restante = cab.longitud;
+                en_carga = 1;
+            }
+            size_t k = carga_restante < (size_t) n - i ? carga_restante : (size_t) n - i;
+            if (cab.tipo == TRAMA_DATOS || cab.tipo == TRAMA_DATOS_Z) {
+                int directo = actual == &ventana[primero];
+                destino_salida_t destino = directo ? destino_fd : destino_guardar;
+                void *arg = directo ? (void *) &fd_salida : (void *) actual;
+                int r = cab.tipo == TRAMA_DATOS ? destino(arg, buf + i, k)
+                                                : descomprimir(&inflado[cab.canal], buf + i, k, destino, arg);
+                if (r == -1) {
+                    fallidos = -1;
+                    break;
+                }
+                if (directo) credito[cab.canal] += k;
+                else actual->cable += k;
+            } else if (cab.tipo == TRAMA_ADIOS) {
+                escribir_todo(STDERR_FILENO, buf + i, k);
+            }
+            i += k;
+            carga_restante -= k;
+            if (carga_restante > 0) break;
+            en_carga = 0;
+
+            if (cab.tipo == TRAMA_ADIOS) {
+                fprintf(stderr, "El servidor cerró la sesión.\n");
+                despedida = 1;
+                fallidos = -1;
+            } else if (cab.tipo == TRAMA_FIN) {
+                actual->terminado = 1;
+                actual->estado = cab.estado;
+                en_canal[cab.canal]--;
+            }
+            // Retirar los comandos terminados en orden; el siguiente pasa a escribirse directamente
+            while (num_vuelo > 0 && (cab.tipo == TRAMA_FIN || cab.tipo == TRAMA_DATOS || cab.tipo == TRAMA_DATOS_Z)) {
+                en_vuelo_t *v = &ventana[primero];
+                if (v->len > 0 || v->cable > 0) {
+                    escribir_todo(STDOUT_FILENO, v->salida, v->len);
+                    credito[v->canal] += v->cable;
+                    v->len = v->cable = 0;
+                }
+                if (!v->terminado) break;
+                if (v->estado != 0) {
+                    fprintf(stderr, "[CLIENTE] '%s' terminó con código de salida %d\n", v->comando, v->estado);
+                    fallidos++;
+                }
+                free(v->comando);
+                free(v->salida);
+                v->comando = v->salida = NULL;
+                v->cap = 0;
+                primero = (primero + 1) % profundidad;
+                num_vuelo--;
+                completados++;
+            }
+        }
+        if (fallidos < 0) break;
+    }
+
+    double t = segundos_desde(&inicio);
+    fprintf(stderr, "[CLIENTE] %u comandos en %.3f s (%.0f comandos/s, pipeline %d",
+            completados, t, t > 0 ? completados / t : 0.0, profundidad);
+    if (num_canales > 1) fprintf(stderr, ", %d canales", num_canales);
+    fprintf(stderr, ")");
+    if (fallidos > 0) fprintf(stderr, ", %d con error", fallidos);
+    fprintf(stderr, "\n");
+
+    for (size_t i = 0; i < num_vuelo; i++) {
+        free(ventana[(primero + i) % profundidad].comando);
+        free(ventana[(primero + i) % profundidad].salida);
+    }
+    for (int c = 0; c < MAX_CANALES_LOTE; c++) liberar_descompresor(&inflado[c]);
+    free(ventana);
+    free(por_enviar);
+    free(linea);
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) & ~O_NONBLOCK);
+    if (despedida) { close(sd); sd = -1; }
+    return fallidos;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Transferencias de archivos: 'get' y 'put' del modo interactivo.
+ * Si el servidor ofrece PROTO_CAP_TRANSFERENCIA, los archivos viajan con
+ * TRAMA_DESCARGA y TRAMA_SUBIDA (ver protocolo.h) en lugar de pasar por 'cat'. El
+ * archivo se divide en trozos de TROZO_TRANSFERENCIA bytes que van en paralelo, cada
+ * uno por su canal (--flujos N), y cada trozo se verifica con el CRC-32 que devuelve
+ * el otro extremo: un trozo dañado se repite. Con -r, antes de transferir un trozo se
+ * pide sólo su suma y, si coincide con la del archivo local, el trozo se da por
+ * transferido; así se reanuda una transferencia interrumpida.
+ */
+#define TROZO_TRANSFERENCIA (8 * 1024 * 1024) // Bytes de cada trozo (una petición por trozo)
+#define TRAMA_SUBIDA_MAX (256 * 1024)         // Bytes de datos por trama al subir
+#define SUBIDA_MAX_POR_ENVIAR (1024 * 1024)   // Bytes de datos preparados sin enviar al subir
+#define FLUJOS_POR_DEFECTO 4                  // Trozos en paralelo (--flujos)
+#define MAX_INTENTOS_TROZO 3                  // Veces que se transfiere un trozo antes de desistir
+#define INTERVALO_PROGRESO 0.5                // Segundos entre actualizaciones del progreso
+
+static int num_flujos = FLUJOS_POR_DEFECTO;
+
+typedef enum { TROZO_PENDIENTE, TROZO_EN_CURSO, TROZO_HECHO } estado_trozo_t;
+
+typedef struct {
+    uint64_t desplazamiento;
+    uint64_t longitud;
+    estado_trozo_t estado;
+    int intentos;
+    int comprobado;         // 1 si ya no hace falta comparar su suma (-r)
+} trozo_t;
+
+/*
+ * Trozo en curso en un canal.
+ */
+typedef struct {
+    trozo_t *trozo;         // NULL si el canal está libre
+    uint32_t id;
+    int suma;               // 1 si se pidió sólo la suma del trozo
+    uint64_t hecho;         // Bytes del trozo escritos (get) o preparados para enviar (put)
+    uLong crc;              // CRC-32 de esos bytes
+    uint32_t credito;       // get: bytes escritos aún no concedidos al servidor
+} flujo_t;
+
+typedef struct {
+    int subir;              // 1 en 'put', 0 en 'get'
+    int fd;                 // Archivo local
+    const char *remoto;
+    uint64_t tamano;
+    trozo_t *trozos;
+    size_t num_trozos;
+    size_t siguiente;       // Primer trozo que puede estar pendiente
+    size_t hechos;          // Trozos terminados
+    size_t omitidos;        // Trozos que ya estaban completos (-r)
+    uint64_t bytes;         // Bytes transferidos (sin contar los omitidos)
+    int reanudar;
+    int cancelar;           // 1 tras un error: se esperan los trozos en curso y no se empiezan más
+    flujo_t flujos[MAX_CANALES_LOTE];
+    uint32_t *id_peticion;
+    uint8_t *salida;        // Tramas preparadas sin enviar
+    size_t sal_inicio, sal_fin;
+} transferencia_t;
+
+/*
+ * Envía 'n' bytes completos por el socket (bloqueante).
+ */
+static int enviar_todo(int fd, const void *datos, size_t n) {
+    size_t enviados = 0;
+    while (enviados < n) {
+        ssize_t r = send(fd, (const char *) datos + enviados, n - enviados, MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        enviados += r;
+    }
+    return 0;
+}
+
+/*
+ * Arma en 'buf' una trama TRAMA_DESCARGA o TRAMA_SUBIDA. Devuelve sus bytes.
+ */
+static size_t armar_peticion(uint8_t *buf, uint8_t tipo, uint16_t canal, uint32_t id, int32_t opciones,
+                             const peticion_transferencia_t *p, const char *ruta) {
+    size_t largo = strlen(ruta);
+    trama_codificar(buf, tipo, canal, id, (uint32_t) (PROTO_PETICION_TRANSFERENCIA + largo), opciones);
+    peticion_codificar(buf + PROTO_CABECERA, p);
+    memcpy(buf + PROTO_CABECERA + PROTO_PETICION_TRANSFERENCIA, ruta, largo);
+    return PROTO_CABECERA + PROTO_PETICION_TRANSFERENCIA + largo;
+}
+
+/*
+ * Pide en el canal 0 la suma de un trozo vacío de 'remoto', cuyo resumen trae el
+ * tamaño del archivo. Devuelve 0, el código errno del servidor, o -1 si se perdió
+ * la conexión.
+ */
+static int tamano_remoto(const char *remoto, uint32_t id, uint64_t *tamano) {
+    uint8_t peticion[PROTO_CABECERA + PROTO_PETICION_TRANSFERENCIA + PATH_MAX];
+    peticion_transferencia_t p = { 0, 0, 0 };
+    cabecera_trama_t cab;
+    size_t n = armar_peticion(peticion, TRAMA_DESCARGA, 0, id, PROTO_SOLO_SUMA, &p, remoto);
+    if (enviar_todo(sd, peticion, n) == -1) return -1;
+    while (recibir_cabecera(sd, &cab) > 0) {
+        if (cab.tipo != TRAMA_FIN || cab.id != id || cab.longitud < PROTO_RESUMEN_TRANSFERENCIA) {
+            if (cab.tipo == TRAMA_ADIOS) return -1;
+            if (volcar_carga(sd, cab.longitud, -1) <= 0) return -1;
+            continue;
+        }
+        uint8_t buf[PROTO_RESUMEN_TRANSFERENCIA];
+        resumen_transferencia_t r;
+        if (recibir_exacto(sd, buf, sizeof(buf)) <= 0 ||
+            volcar_carga(sd, cab.longitud - sizeof(buf), -1) <= 0) return -1;
+        resumen_decodificar(buf, &r);
+        *tamano = r.tamano;
+        return cab.estado;
+    }
+    return -1;
+}
+
+/*
+ * Suma los bytes del archivo local en [desde, desde + n). Devuelve cuántos se
+ * pudieron leer.
+ */
+static uint64_t sumar_local(int fd, uint64_t desde, uint64_t n, uLong *crc) {
+    unsigned char buf[64 * 1024];
+    uint64_t leidos = 0;
+    *crc = crc32(0, NULL, 0);
+    while (leidos < n) {
+        size_t k = n - leidos < sizeof(buf) ? (size_t) (n - leidos) : sizeof(buf);
+        ssize_t r = pread(fd, buf, k, (off_t) (desde + leidos));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        *crc = crc32(*crc, buf, (uInt) r);
+        leidos += r;
+    }
+    return leidos;
+}
+
+/*
+ * Escribe 'n' bytes completos en 'fd' a partir de 'offset'.
+ */
+static int escribir_en(int fd, const void *datos, size_t n, off_t offset) {
+    const char *p = datos;
+    while (n > 0) {
+        ssize_t r = pwrite(fd, p, n, offset);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        n -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+/*
+ * El trozo vuelve a esperar un canal libre.
+ */
+static void trozo_pendiente(transferencia_t *t, trozo_t *tr) {
+    tr->estado = TROZO_PENDIENTE;
+    if ((size_t) (tr - t->trozos) < t->siguiente) t->siguiente = (size_t) (tr - t->trozos);
+}
+
+/*
+ * Empieza el trozo en el canal: con -r, la primera vez sólo se pide su suma.
+ */
+static void empezar_trozo(transferencia_t *t, int canal, trozo_t *tr) {
+    flujo_t *f = &t->flujos[canal];
+    peticion_transferencia_t p = { tr->desplazamiento, tr->longitud, t->tamano };
+    f->trozo = tr;
+    f->id = ++*t->id_peticion;
+    f->suma = t->reanudar && !tr->comprobado;
+    f->hecho = 0;
+    f->crc = crc32(0, NULL, 0);
+    tr->estado = TROZO_EN_CURSO;
+    uint8_t tipo = t->subir && !f->suma ? TRAMA_SUBIDA : TRAMA_DESCARGA;
+    t->sal_fin += armar_peticion(t->salida + t->sal_fin, tipo, (uint16_t) canal, f->id,
+                                 f->suma ? PROTO_SOLO_SUMA : 0, &p, t->remoto);
+}
+
+/*
+ * Prepara tramas de datos de los trozos que se están subiendo, por turnos entre los
+ * canales, hasta SUBIDA_MAX_POR_ENVIAR bytes pendientes. Devuelve -1 si no se pudo
+ * leer el archivo local.
+ */
+static int preparar_subida(transferencia_t *t) {
+    static int turno = 0;
+    for (int vueltas = 0; vueltas < num_flujos && t->sal_fin < SUBIDA_MAX_POR_ENVIAR; ) {
+        flujo_t *f = &t->flujos[turno];
+        int canal = turno;
+        turno = (turno + 1) % num_flujos;
+        if (f->trozo == NULL || f->suma || f->hecho == f->trozo->longitud) {
+            vueltas++;
+            continue;
+        }
+        vueltas = 0;
+        uint64_t resta = f->trozo->longitud - f->hecho;
+        size_t n = resta < TRAMA_SUBIDA_MAX ? (size_t) resta : TRAMA_SUBIDA_MAX;
+        uint8_t *datos = t->salida + t->sal_fin + PROTO_CABECERA;
+        ssize_t r;
+        do {
+            r = pread(t->fd, datos, n, (off_t) (f->trozo->desplazamiento + f->hecho));
+        } while (r < 0 && errno == EINTR);
+        if (r <= 0) {
+            if (r == 0) errno = EIO; // El archivo local se acortó
+            perror("[CLIENTE] Error al leer el archivo local");
+            return -1;
+        }
+        trama_codificar(t->salida + t->sal_fin, TRAMA_DATOS, (uint16_t) canal, f->id, (uint32_t) r, 0);
+        t->sal_fin += PROTO_CABECERA + r;
+        f->crc = crc32(f->crc, datos, (uInt) r);
+        f->hecho += r;
+    }
+    return 0;
+}
+
+/*
+ * Llegó la trama de fin del trozo en curso del canal. Devuelve -1 si la transferencia
+ * no puede seguir.
+ */
+static int terminar_trozo(transferencia_t *t, int canal, int32_t estado, const resumen_transferencia_t *r) {
+    flujo_t *f = &t->flujos[canal];
+    trozo_t *tr = f->trozo;
+    f->trozo = NULL;
+    if (t->cancelar) return 0;
+
+    if (f->suma) {
+        // -r: el trozo ya está completo si el otro extremo tiene los mismos bytes. Al
+        // subir, el último trozo se envía igual si el tamaño remoto es otro: su
+        // TRAMA_SUBIDA deja el archivo con el tamaño correcto
+        uLong crc;
+        int ultimo = tr == &t->trozos[t->num_trozos - 1];
+        tr->comprobado = 1;
+        if (estado == 0 && r->bytes == tr->longitud && (r->tamano == t->tamano || (t->subir && !ultimo)) &&
+            sumar_local(t->fd, tr->desplazamiento, tr->longitud, &crc) == tr->longitud && crc == r->crc) {
+            tr->estado = TROZO_HECHO;
+            t->hechos++;
+            t->omitidos++;
+        } else {
+            trozo_pendiente(t, tr);
+        }
+        return 0;
+    }
+    if (estado != 0) {
+        fprintf(stderr, "\n[CLIENTE] %s: %s\n", t->remoto, estado > 0 ? strerror(estado) : "error del servidor");
+        return -1;
+    }
+    if (r->tamano != t->tamano && !t->subir) {
+        fprintf(stderr, "\n[CLIENTE] %s cambió de tamaño durante la transferencia\n", t->remoto);
+        return -1;
+    }
+    if (r->bytes == tr->longitud && f->hecho == tr->longitud && r->crc == (uint32_t) f->crc) {
+        tr->estado = TROZO_HECHO;
+        t->hechos++;
+        t->bytes += tr->longitud;
+        return 0;
+    }
+    if (++tr->intentos >= MAX_INTENTOS_TROZO) {
+        fprintf(stderr, "\n[CLIENTE] El trozo en %llu llegó dañado %d veces; se desiste\n",
+                (unsigned long long) tr->desplazamiento, tr->intentos);
+        return -1;
+    }
+    fprintf(stderr, "\n[CLIENTE] Suma distinta en el trozo en %llu; se repite\n",
+            (unsigned long long) tr->desplazamiento);
+    tr->comprobado = 1;
+    trozo_pendiente(t, tr);
+    return 0;
+}
+
+static void mostrar_progreso(const transferencia_t *t, const struct timespec *inicio, int final) {
+    uint64_t en_curso = 0;
+    for (int c = 0; c < num_flujos; c++) {
+        if (t->flujos[c].trozo != NULL && !t->flujos[c].suma) en_curso += t->flujos[c].hecho;
+    }
+    uint64_t bytes = t->bytes + en_curso;
+    double s = segundos_desde(inicio);
+    double mb_s = s > 0 ? bytes / s / (1024 * 1024) : 0.0;
+    if (!final) {
+        fprintf(info, "\r%3.0f%%  %llu bytes  %.1f MB/s ", t->tamano ? 100.0 * (t->bytes + en_curso) / t->tamano : 100.0,
+                (unsigned long long) bytes, mb_s);
+        fflush(info);
+        return;
+    }
+    fprintf(info, "\r[CLIENTE] %llu bytes en %.3f s (%.1f MB/s), %zu trozos por %d flujos",
+            (unsigned long long) t->bytes, s, mb_s, t->num_trozos, num_flujos);
+    if (t->omitidos > 0) fprintf(info, ", %zu ya completos", t->omitidos);
+    fprintf(info, "\n");
+}
+
+/*
+ * get/put: transfiere el archivo entre 'local' y 'remoto' (subir = 1 en put).
+ * Devuelve 0 si terminó bien y -1 si no; si se perdió la conexión, sd queda en -1.
+ */
+static int transferir(int subir, const char *remoto, const char *local, int reanudar, uint32_t *id_peticion) {
+    transferencia_t t;
+    struct stat st;
+    struct timespec inicio, ultimo;
+    uint8_t cab_buf[PROTO_CABECERA], resumen_buf[PROTO_RESUMEN_TRANSFERENCIA];
+    size_t cab_len = 0, resumen_len = 0;
+    cabecera_trama_t cab;
+    uint32_t carga_restante = 0;
+    int en_carga = 0, resultado = 0;
+
+    memset(&t, 0, sizeof(t));
+    t.subir = subir;
+    t.remoto = remoto;
+    t.reanudar = reanudar;
+    t.id_peticion = id_peticion;
+    if (strlen(remoto) >= PATH_MAX) {
+        fprintf(stderr, "[CLIENTE] Ruta remota demasiado larga\n");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &inicio);
+    if (subir) {
+        t.fd = open(local, O_RDONLY | O_CLOEXEC);
+        if (t.fd == -1 || fstat(t.fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+            if (t.fd != -1 && !S_ISREG(st.st_mode)) errno = EINVAL;
+            perror(local);
+            if (t.fd != -1) close(t.fd);
+            return -1;
+        }
+        t.tamano = (uint64_t) st.st_size;
+    } else {
+        int r = tamano_remoto(remoto, ++*id_peticion, &t.tamano);
+        if (r == -1) {
+            fprintf(stderr, "[CLIENTE] Se perdió la conexión con el servidor\n");
+            close(sd);
+            sd = -1;
+            return -1;
+        }
+        if (r != 0) {
+            fprintf(stderr, "[CLIENTE] %s: %s\n", remoto, r > 0 ? strerror(r) : "error del servidor");
+            return -1;
+        }
+        // Sin -r el archivo local se reemplaza; con -r se conserva lo que ya tenga
+        t.fd = open(local, O_RDWR | O_CREAT | O_CLOEXEC | (reanudar ? 0 : O_TRUNC), 0666);
+        if (t.fd == -1 || ftruncate(t.fd, (off_t) t.tamano) == -1 ||
+            (t.tamano > 0 && fallocate(t.fd, 0, 0, (off_t) t.tamano) == -1 && errno != EOPNOTSUPP)) {
+            perror(local);
+            if (t.fd != -1) close(t.fd);
+            return -1;
+        }
+    }
+    // Un archivo vacío es un trozo vacío, que igual lo crea (o lo vacía) del otro lado
+    t.num_trozos = t.tamano > 0 ? (size_t) ((t.tamano + TROZO_TRANSFERENCIA - 1) / TROZO_TRANSFERENCIA) : 1;
+    t.trozos = calloc(t.num_trozos, sizeof(trozo_t));
+    t.salida = malloc(SUBIDA_MAX_POR_ENVIAR + PROTO_CABECERA + TRAMA_SUBIDA_MAX +
+                      (size_t) num_flujos * (2 * PROTO_CABECERA + PROTO_PETICION_TRANSFERENCIA + PATH_MAX));
+    if (t.trozos == NULL || t.salida == NULL) {
+        perror("[CLIENTE] Error al reservar memoria para la transferencia");
+        free(t.trozos); free(t.salida);
+        close(t.fd);
+        return -1;
+    }
+    for (size_t i = 0; i < t.num_trozos; i++) {
+        t.trozos[i].desplazamiento = (uint64_t) i * TROZO_TRANSFERENCIA;
+        t.trozos[i].longitud = t.tamano - t.trozos[i].desplazamiento < TROZO_TRANSFERENCIA ?
+                               t.tamano - t.trozos[i].desplazamiento : TROZO_TRANSFERENCIA;
+    }
+    fprintf(info, "[CLIENTE] %s '%s' -> '%s' (%llu bytes)\n", subir ? "put" : "get", subir ? local : remoto,
+            subir ? remoto : local, (unsigned long long) t.tamano);
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
+    ultimo = inicio;
+
+    while (1) {
+        int activos = 0;
+        if (t.sal_inicio > 0) {
+            memmove(t.salida, t.salida + t.sal_inicio, t.sal_fin - t.sal_inicio);
+            t.sal_fin -= t.sal_inicio;
+            t.sal_inicio = 0;
+        }
+        // Conceder ventana por lo escrito y empezar trozos en los canales libres
+        for (int c = 0; c < num_flujos; c++) {
+            flujo_t *f = &t.flujos[c];
+            if (f->credito >= VENTANA_MIN_CONCESION || (f->credito > 0 && f->trozo == NULL)) {
+                trama_codificar(t.salida + t.sal_fin, TRAMA_VENTANA, (uint16_t) c, 0, 0, (int32_t) f->credito);
+                t.sal_fin += PROTO_CABECERA;
+                f->credito = 0;
+            }
+            while (f->trozo == NULL && !t.cancelar && t.siguiente < t.num_trozos) {
+                trozo_t *tr = &t.trozos[t.siguiente++];
+                if (tr->estado == TROZO_PENDIENTE) empezar_trozo(&t, c, tr);
+            }
+            if (f->trozo != NULL) activos++;
+        }
+        if (subir && preparar_subida(&t) == -1) {
+            // Los trozos en curso no pueden completarse: sólo queda cortar la conexión
+            resultado = -1;
+            break;
+        }
+        if (activos == 0 && t.sal_fin == 0) break;
+
+        struct pollfd pfd = { .fd = sd, .events = POLLIN };
+        if (t.sal_fin > t.sal_inicio) pfd.events |= POLLOUT;
+        if (poll(&pfd, 1, 500) < 0) {
+            if (errno == EINTR) continue;
+            perror("[CLIENTE] Error en poll");
+            resultado = -1;
+            break;
+        }
+        if (segundos_desde(&ultimo) >= INTERVALO_PROGRESO) {
+            clock_gettime(CLOCK_MONOTONIC, &ultimo);
+            mostrar_progreso(&t, &inicio, 0);
+        }
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = send(sd, t.salida + t.sal_inicio, t.sal_fin - t.sal_inicio, MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Error al enviar datos");
+                resultado = -1;
+                break;
+            }
+            if (n > 0) t.sal_inicio += n;
+            if (t.sal_inicio == t.sal_fin) t.sal_inicio = t.sal_fin = 0;
+        }
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+        uint8_t buf[64 * 1024];
+        ssize_t n = recv(sd, buf, sizeof(buf), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+        if (n <= 0) {
+            if (n < 0) perror("Error al recibir respuesta");
+            else fprintf(stderr, "\nServidor cerró conexión inesperadamente.\n");
+            resultado = -1;
+            break;
+        }
+
+        // Un recv() puede traer varias tramas o partes de ellas
+        for (size_t i = 0; i < (size_t) n && resultado == 0; ) {
+            if (!en_carga) {
+                size_t k = PROTO_CABECERA - cab_len;
+                if (k > (size_t) n - i) k = n - i;
+                memcpy(cab_buf + cab_len, buf + i, k);
+                cab_len += k;
+                i += k;
+                if (cab_len < PROTO_CABECERA) break;
+                cab_len = 0;
+                if (trama_decodificar(cab_buf, &cab) == -1) {
+                    fprintf(stderr, "[CLIENTE] Trama inválida del servidor\n");
+                    resultado = -1;
+                    break;
+                }
+                if ((cab.tipo == TRAMA_DATOS || cab.tipo == TRAMA_FIN) &&
+                    (cab.canal >= num_flujos || t.flujos[cab.canal].trozo == NULL ||
+                     t.flujos[cab.canal].id != cab.id)) {
+                    fprintf(stderr, "\n[CLIENTE] Respuesta inesperada (id %u, canal %u)\n", cab.id, cab.canal);
+                    resultado = -1;
+                    break;
+                }
+                if (cab.tipo == TRAMA_DATOS_Z) {
+                    fprintf(stderr, "\n[CLIENTE] Datos comprimidos en una transferencia\n");
+                    resultado = -1;
+                    break;
+                }
+                carga_restante = cab.longitud;
+                resumen_len = 0;
+                en_carga = 1;
+            }
+            size_t k = carga_restante < (size_t) n - i ? carga_restante : (size_t) n - i;
+            if (cab.tipo == TRAMA_DATOS) {
+                flujo_t *f = &t.flujos[cab.canal];
+                if (f->suma || subir || f->hecho + k > f->trozo->longitud) {
+                    fprintf(stderr, "\n[CLIENTE] Datos inesperados en el canal %u\n", cab.canal);
+                    resultado = -1;
+                    break;
+                }
+                if (escribir_en(t.fd, buf + i, k, (off_t) (f->trozo->desplazamiento + f->hecho)) == -1) {
+                    perror(local);
+                    resultado = -1;
+                    break;
+                }
+                f->crc = crc32(f->crc, buf + i, (uInt) k);
+                f->hecho += k;
+                f->credito += k;
+            } else if (cab.tipo == TRAMA_FIN) {
+                size_t m = sizeof(resumen_buf) - resumen_len < k ? sizeof(resumen_buf) - resumen_len : k;
+                memcpy(resumen_buf + resumen_len, buf + i, m);
+                resumen_len += m;
+            } else if (cab.tipo == TRAMA_ADIOS) {
+                escribir_todo(STDERR_FILENO, buf + i, k);
+            }
+            i += k;
+            carga_restante -= k;
+            if (carga_restante > 0) break;
+            en_carga = 0;
+
+            if (cab.tipo == TRAMA_ADIOS) {
+                fprintf(stderr, "El servidor cerró la sesión.\n");
+                resultado = -1;
+            } else if (cab.tipo == TRAMA_FIN) {
+                resumen_transferencia_t r = { 0, 0, 0 };
+                if (resumen_len == sizeof(resumen_buf)) resumen_decodificar(resumen_buf, &r);
+                if (terminar_trozo(&t, cab.canal, cab.estado, &r) == -1) t.cancelar = 1;
+            }
+        }
+        if (resultado != 0) break;
+    }
+
+    if (resultado == 0 && !t.cancelar) mostrar_progreso(&t, &inicio, 1);
+    else if (resultado == 0) resultado = -1;
+    if (resultado == -1 && !t.cancelar) {
+        // Conexión perdida o con tramas a medias: no se puede seguir usando
+        close(sd);
+        sd = -1;
+    } else if (sd != -1) {
+        fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) & ~O_NONBLOCK);
+    }
+    if (close(t.fd) == -1 && resultado == 0) {
+        perror(local);
+        resultado = -1;
+    }
+    free(t.trozos);
+    free(t.salida);
+    return resultado;
+}
+
+/*
+ * get [-r] REMOTO [LOCAL] y put [-r] LOCAL [REMOTO]. Sin destino, el archivo toma el
+ * nombre (sin directorios) del origen; un 'get' a un directorio local existente deja
+ * el archivo dentro de él.
+ */
+static void comando_transferencia(char *linea, uint32_t *id_peticion) {
+    int subir = linea[0] == 'p', reanudar = 0, n = 0;
+    char *args[3];
+    for (char *tok = strtok(linea + 4, " \t"); tok != NULL; tok = strtok(NULL, " \t")) {
+        if (strcmp(tok, "-r") == 0 && n == 0) reanudar = 1;
+        else if (n < 3) args[n++] = tok;
+    }
+    if (n < 1 || n > 2) {
+        fprintf(stderr, "Uso: %s\n", subir ? "put [-r] LOCAL [REMOTO]" : "get [-r] REMOTO [LOCAL]");
+        return;
+    }
+    if (!(capacidades_servidor & PROTO_CAP_TRANSFERENCIA)) {
+        fprintf(stderr, "[CLIENTE] El servidor no admite transferencias de archivos\n");
+        return;
+    }
+    const char *origen = args[0];
+    const char *nombre = strrchr(origen, '/') != NULL ? strrchr(origen, '/') + 1 : origen;
+    const char *destino = n == 2 ? args[1] : nombre;
+    char ruta[PATH_MAX];
+    struct stat st;
+    if (*destino == '\0') {
+        fprintf(stderr, "[CLIENTE] Indique el nombre de destino de '%s'\n", origen);
+        return;
+    }
+    if (!subir && n == 2 && stat(destino, &st) == 0 && S_ISDIR(st.st_mode)) {
+        if (snprintf(ruta, sizeof(ruta), "%s/%s", destino, nombre) >= (int) sizeof(ruta) || *nombre == '\0') {
+            fprintf(stderr, "[CLIENTE] Ruta de destino inválida\n");
+            return;
+        }
+        destino = ruta;
+    }
+    if (subir) transferir(1, destino, origen, reanudar, id_peticion);
+    else transferir(0, origen, destino, reanudar, id_peticion);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Conexión compartida: --maestro y --control.
+ * Un cliente con --maestro RUTA mantiene abierta una conexión con el servidor y
+ * escucha en el socket Unix RUTA. Los clientes que se lanzan después con
+ * --control RUTA se conectan a ese socket en lugar de al servidor: no hay conexión
+ * TCP nueva, ni resolución de nombres, ni saludo del servidor, y el resto del
+ * protocolo es el mismo. El maestro reparte los canales de su conexión: el primer
+ * uso de un canal de un cliente adjunto le asigna un canal libre del servidor, y las
+ * tramas se reenvían en los dos sentidos cambiando sólo el número de canal. Todos
+ * los adjuntos comparten la sesión del servidor (directorio de trabajo, modo shell).
+ * El 'exit' de un adjunto lo responde el maestro, sin cerrar la sesión.
+ * Si un adjunto se va con peticiones en curso, sus canales quedan huérfanos: el
+ * maestro descarta la salida que falte concediendo él la ventana, y completa con
+ * ceros una subida a medias. El canal vuelve a usarse tras su último TRAMA_FIN.
+ * Tras --inactividad S segundos sin adjuntos, el maestro se despide y termina.
+ */
+#define MAX_ADJUNTOS 64                       // Clientes adjuntos a la vez
+#define MAESTRO_RECEPCION (64 * 1024)         // Bytes recibidos por llamada
+#define MAESTRO_MAX_PENDIENTE (1024 * 1024)   // Bytes hacia el servidor sin enviar antes de dejar de leer a los adjuntos
+#define DESCARTE_MAX (64 * 1024 * 1024)       // Bytes que se descartan de un canal huérfano antes de dejarlo frenado
+#define INACTIVIDAD_POR_DEFECTO 300           // Segundos sin adjuntos antes de que el maestro termine (--inactividad)
+
+// Ruta del socket del maestro, para borrarlo al terminar
+static const char *ruta_maestro = NULL;
+
+/*
+ * Bytes recibidos o por enviar por una de las conexiones del maestro.
+ */
+typedef struct {
+    uint8_t *datos;
+    size_t inicio, fin, cap;
+} bytes_t;
+
+typedef struct {
+    int fd;                 // -1 si la entrada está libre
+    unsigned long num;      // Número del adjunto (para los mensajes)
+    bytes_t entrada, salida;
+    uint8_t canales[MAX_CANALES_LOTE]; // Canal del adjunto -> canal del servidor + 1 (0: sin asignar)
+    int despedido;          // 1 tras su 'exit': se cierra al vaciar la salida
+} adjunto_t;
+
+/*
+ * Canal de la conexión con el servidor (el servidor admite tantos como MAX_CANALES_LOTE).
+ */
+typedef struct {
+    int adjunto;            // Adjunto que lo usa, o -1
+    uint16_t canal_local;   // Número con que lo conoce el adjunto
+    int pendientes;         // Peticiones enviadas que aún no tienen TRAMA_FIN
+    int64_t sin_conceder;   // Bytes de datos reenviados al adjunto que aún no devolvió con TRAMA_VENTANA
+    uint32_t subida_id;     // Subida en curso y bytes que el adjunto aún debe enviar
+    uint64_t subida_restante;
+    uint64_t descartados;   // Bytes descartados desde que quedó huérfano
+} canal_maestro_t;
+
+static struct {
+    int fd_escucha;
+    char saludo[256];       // Carga del TRAMA_HOLA para los adjuntos
+    adjunto_t adjuntos[MAX_ADJUNTOS];
+    int num_adjuntos;
+    unsigned long total_adjuntos;
+    canal_maestro_t canales[MAX_CANALES_LOTE];
+    bytes_t hacia_servidor, desde_servidor;
+    struct timespec sin_adjuntos; // Desde cuándo no hay adjuntos
+} maestro;
+
+static size_t bytes_pendiente(const bytes_t *b) {
+    return b->fin - b->inicio;
+}
+
+/*
+ * Devuelve lugar para 'n' bytes más al final de 'b' (sin contarlos aún), o NULL si
+ * no hay memoria.
+ */
+static uint8_t *bytes_reservar(bytes_t *b, size_t n) {
+    if (b->inicio == b->fin) b->inicio = b->fin = 0;
+    if (b->fin + n > b->cap && b->inicio > 0) {
+        memmove(b->datos, b->datos + b->inicio, b->fin - b->inicio);
+        b->fin -= b->inicio;
+        b->inicio = 0;
+    }
+    if (b->fin + n > b->cap) {
+        size_t cap = b->cap > 0 ? b->cap : MAESTRO_RECEPCION;
+        while (cap < b->fin + n) cap *= 2;
+        uint8_t *datos = realloc(b->datos, cap);
+        if (datos == NULL) return NULL;
+        b->datos = datos;
+        b->cap = cap;
+    }
+    return b->datos + b->fin;
+}
+
+static int bytes_agregar(bytes_t *b, const void *datos, size_t n) {
+    uint8_t *destino = bytes_reservar(b, n);
+    if (destino == NULL) return -1;
+    memcpy(destino, datos, n);
+    b->fin += n;
+    return 0;
+}
+
+static void bytes_liberar(bytes_t *b) {
+    free(b->datos);
+    memset(b, 0, sizeof(*b));
+}
+
+/*
+ * Recibe lo que haya en 'fd' (sin bloquear). Devuelve los bytes recibidos, 0 si el
+ * otro extremo cerró, o -1 (con errno) si no había nada o hubo un error.
+ */
+static ssize_t bytes_recibir(int fd, bytes_t *b) {
+    uint8_t *destino = bytes_reservar(b, MAESTRO_RECEPCION);
+    ssize_t n;
+    if (destino == NULL) return -1;
+    do {
+        n = recv(fd, destino, MAESTRO_RECEPCION, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) b->fin += n;
+    return n;
+}
+
+/*
+ * Envía lo que admita 'fd' (sin bloquear). Devuelve -1 si la conexión falló.
+ */
+static int bytes_enviar(int fd, bytes_t *b) {
+    while (b->fin > b->inicio) {
+        ssize_t n = send(fd, b->datos + b->inicio, b->fin - b->inicio, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        b->inicio += n;
+    }
+    return 0;
+}
+
+/*
+ * Devuelve 1 si 'b' empieza con una trama completa (y su cabecera en 't'), 0 si aún
+ * falta parte de ella y -1 si no es válida.
+ */
+static int trama_completa(const bytes_t *b, cabecera_trama_t *t) {
+    if (bytes_pendiente(b) < PROTO_CABECERA) return 0;
+    if (trama_decodificar(b->datos + b->inicio, t) == -1) return -1;
+    return bytes_pendiente(b) >= PROTO_CABECERA + (size_t) t->longitud;
+}
+
+/*
+ * Agrega a 'b' una trama con 'n' bytes de carga (ceros si 'carga' es NULL).
+ */
+static int agregar_trama(bytes_t *b, uint8_t tipo, uint16_t canal, uint32_t id, int32_t estado,
+                         const void *carga, size_t n) {
+    uint8_t *destino = bytes_reservar(b, PROTO_CABECERA + n);
+    if (destino == NULL) return -1;
+    trama_codificar(destino, tipo, canal, id, (uint32_t) n, estado);
+    if (carga != NULL) memcpy(destino + PROTO_CABECERA, carga, n);
+    else memset(destino + PROTO_CABECERA, 0, n);
+    b->fin += PROTO_CABECERA + n;
+    return 0;
+}
+
+/*
+ * 'exit' o 'salir', con espacios alrededor o sin ellos (como los reconoce el servidor).
+ */
+static int es_despedida(const char *texto, size_t n) {
+    while (n > 0 && strchr(" \t\r\n", texto[0]) != NULL) { texto++; n--; }
+    while (n > 0 && strchr(" \t\r\n", texto[n - 1]) != NULL) n--;
+    return (n == 4 && memcmp(texto, "exit", 4) == 0) || (n == 5 && memcmp(texto, "salir", 5) == 0);
+}
+
+/*
+ * Canal del servidor que usa el canal 'local' del adjunto 'i'; en su primer uso se
+ * le asigna uno libre. Devuelve -1 si no queda ninguno libre.
+ */
+static int canal_del_servidor(int i, uint16_t local) {
+    adjunto_t *a = &maestro.adjuntos[i];
+    if (a->canales[local] != 0) return a->canales[local] - 1;
+    for (int c = 0; c < MAX_CANALES_LOTE; c++) {
+        canal_maestro_t *cm = &maestro.canales[c];
+        if (cm->adjunto != -1 || cm->pendientes > 0) continue;
+        memset(cm, 0, sizeof(*cm));
+        cm->adjunto = i;
+        cm->canal_local = local;
+        a->canales[local] = (uint8_t) (c + 1);
+        return c;
+    }
+    return -1;
+}
+
+/*
+ * Libera al adjunto 'i'. Sus canales con peticiones en curso quedan huérfanos; lo
+ * que el adjunto recibió sin conceder se concede ahora, para que el canal vuelva a
+ * tener su ventana completa cuando otro lo use.
+ */
+static void cerrar_adjunto(int i) {
+    adjunto_t *a = &maestro.adjuntos[i];
+    for (int c = 0; c < MAX_CANALES_LOTE; c++) {
+        canal_maestro_t *cm = &maestro.canales[c];
+        if (cm->adjunto != i) continue;
+        cm->adjunto = -1;
+        if (cm->sin_conceder > 0) {
+            agregar_trama(&maestro.hacia_servidor, TRAMA_VENTANA, (uint16_t) c, 0, (int32_t) cm->sin_conceder, NULL, 0);
+        }
+        cm->sin_conceder = 0;
+        cm->descartados = 0;
+        // El servidor espera el resto de la subida antes de responder
+        while (cm->subida_restante > 0) {
+            size_t n = cm->subida_restante < TRAMA_SUBIDA_MAX ? cm->subida_restante : TRAMA_SUBIDA_MAX;
+            if (agregar_trama(&maestro.hacia_servidor, TRAMA_DATOS, (uint16_t) c, cm->subida_id, 0, NULL, n) == -1) break;
+            cm->subida_restante -= n;
+        }
+    }
+    close(a->fd);
+    bytes_liberar(&a->entrada);
+    bytes_liberar(&a->salida);
+    fprintf(info, "[CLIENTE] Adjunto #%lu desconectado\n", a->num);
+    memset(a, 0, sizeof(*a));
+    a->fd = -1;
+    if (--maestro.num_adjuntos == 0) clock_gettime(CLOCK_MONOTONIC, &maestro.sin_adjuntos);
+}
+
+/*
+ * Reenvía a los adjuntos las tramas completas recibidas del servidor. Las de un canal
+ * huérfano se descartan. Devuelve -1 si el servidor se despidió.
+ */
+static int procesar_servidor(void) {
+    bytes_t *b = &maestro.desde_servidor;
+    cabecera_trama_t t;
+    int r;
+
+    while ((r = trama_completa(b, &t)) == 1) {
+        uint8_t *trama = b->datos + b->inicio;
+        size_t largo = PROTO_CABECERA + t.longitud;
+        if (t.tipo == TRAMA_ADIOS) {
+            fflush(info);
+            escribir_todo(fileno(info), trama + PROTO_CABECERA, t.longitud);
+            return -1;
+        }
+        if (t.canal < MAX_CANALES_LOTE && (t.tipo == TRAMA_DATOS || t.tipo == TRAMA_DATOS_Z || t.tipo == TRAMA_FIN)) {
+            canal_maestro_t *cm = &maestro.canales[t.canal];
+            int datos = t.tipo != TRAMA_FIN;
+            if (!datos && cm->pendientes > 0) {
+                cm->pendientes--;
+                if (t.id == cm->subida_id) cm->subida_restante = 0; // Respondida (quizá rechazada)
+            }
+            if (cm->adjunto != -1) {
+                adjunto_t *a = &maestro.adjuntos[cm->adjunto];
+                uint16_t canal = htons(cm->canal_local);
+                memcpy(trama + 2, &canal, 2);
+                if (datos) cm->sin_conceder += t.longitud;
+                if (bytes_agregar(&a->salida, trama, largo) == -1) {
+                    perror("[CLIENTE] Error al reservar memoria para un adjunto");
+                    cerrar_adjunto(cm->adjunto);
+                }
+            } else if (datos) {
+                // Canal huérfano: se descarta la salida, concediendo la ventana hasta un límite
+                cm->descartados += t.longitud;
+                if (cm->descartados <= DESCARTE_MAX) {
+                    agregar_trama(&maestro.hacia_servidor, TRAMA_VENTANA, t.canal, 0, (int32_t) t.longitud, NULL, 0);
+                }
+            }
+        }
+        b->inicio += largo;
+    }
+    if (r == -1) {
+        fprintf(stderr, "[CLIENTE] Trama inválida del servidor\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Pasa al servidor las tramas completas del adjunto 'i', mientras quede lugar para
+ * enviarlas y canales libres. Devuelve -1 si el adjunto envió algo inválido.
+ */
+static int procesar_adjunto(int i) {
+    adjunto_t *a = &maestro.adjuntos[i];
+    cabecera_trama_t t;
+    int r = 0;
+
+    while (!a->despedido && bytes_pendiente(&maestro.hacia_servidor) < MAESTRO_MAX_PENDIENTE &&
+           (r = trama_completa(&a->entrada, &t)) == 1) {
+        uint8_t *trama = a->entrada.datos + a->entrada.inicio;
+        size_t largo = PROTO_CABECERA + t.longitud;
+        if (t.tipo == TRAMA_OPCIONES) {
+            // La compresión de la conexión la eligió el maestro; los clientes entienden las dos formas
+            a->entrada.inicio += largo;
+            continue;
+        }
+        if (t.tipo == TRAMA_COMANDO && es_despedida((const char *) trama + PROTO_CABECERA, t.longitud)) {
+            // El 'exit' de un adjunto no debe cerrar la sesión de todos
+            static const char adios[] = "Desconectado de la conexión compartida.\n";
+            agregar_trama(&a->salida, TRAMA_ADIOS, 0, t.id, 0, adios, sizeof(adios) - 1);
+            a->despedido = 1;
+            return 0;
+        }
+        if (t.canal >= MAX_CANALES_LOTE || (t.tipo != TRAMA_COMANDO && t.tipo != TRAMA_VENTANA &&
+            t.tipo != TRAMA_DATOS && t.tipo != TRAMA_DESCARGA && t.tipo != TRAMA_SUBIDA)) {
+            return -1;
+        }
+        int c;
+        if (t.tipo == TRAMA_VENTANA) {
+            if (a->canales[t.canal] == 0) {
+                a->entrada.inicio += largo;
+                continue;
+            }
+            c = a->canales[t.canal] - 1;
+            if (t.estado > 0) maestro.canales[c].sin_conceder -= t.estado;
+        } else {
+            c = canal_del_servidor(i, t.canal);
+            if (c == -1) return 0; // Sin canales libres: la trama espera a que se libere uno
+            canal_maestro_t *cm = &maestro.canales[c];
+            if (t.tipo == TRAMA_DATOS) {
+                if (t.id == cm->subida_id && cm->subida_restante > 0) {
+                    cm->subida_restante -= t.longitud < cm->subida_restante ? t.longitud : cm->subida_restante;
+                }
+            } else {
+                cm->pendientes++;
+            }
+            if (t.tipo == TRAMA_SUBIDA && t.longitud >= PROTO_PETICION_TRANSFERENCIA) {
+                peticion_transferencia_t p;
+                peticion_decodificar(trama + PROTO_CABECERA, &p);
+                cm->subida_id = t.id;
+                cm->subida_restante = p.longitud;
+            }
+        }
+        uint16_t canal = htons((uint16_t) c);
+        memcpy(trama + 2, &canal, 2);
+        if (bytes_agregar(&maestro.hacia_servidor, trama, largo) == -1) return -1;
+        a->entrada.inicio += largo;
+    }
+    return r == -1 ? -1 : 0;
+}
+
+static void aceptar_adjunto(void) {
+    int fd = accept4(maestro.fd_escucha, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+    for (int i = 0; i < MAX_ADJUNTOS; i++) {
+        adjunto_t *a = &maestro.adjuntos[i];
+        if (a->fd != -1) continue;
+        a->fd = fd;
+        a->num = ++maestro.total_adjuntos;
+        maestro.num_adjuntos++;
+        if (agregar_trama(&a->salida, TRAMA_HOLA, 0, 0, capacidades_servidor, maestro.saludo,
+                          strlen(maestro.saludo)) == -1) {
+            cerrar_adjunto(i);
+            return;
+        }
+        fprintf(info, "[CLIENTE] Adjunto #%lu conectado (%d en total)\n", a->num, maestro.num_adjuntos);
+        return;
+    }
+    close(fd);
+}
+
+/*
+ * Crea el socket Unix del maestro. Si la ruta ya existe pero nadie escucha en ella
+ * (quedó de un maestro anterior), se reemplaza. Sólo el usuario puede conectarse.
+ */
+static int escuchar_control(const char *ruta) {
+    struct sockaddr_un dir = { .sun_family = AF_UNIX };
+    if (strlen(ruta) >= sizeof(dir.sun_path)) {
+        fprintf(stderr, "[CLIENTE] Ruta de control demasiado larga: %s\n", ruta);
+        return -1;
+    }
+    strcpy(dir.sun_path, ruta);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("[CLIENTE] Error al crear el socket de control");
+        return -1;
+    }
+    mode_t mascara = umask(077);
+    int r = bind(fd, (struct sockaddr *) &dir, sizeof(dir));
+    if (r == -1 && errno == EADDRINUSE) {
+        int prueba = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (prueba >= 0 && connect(prueba, (struct sockaddr *) &dir, sizeof(dir)) == 0) {
+            fprintf(stderr, "[CLIENTE] Ya hay un maestro escuchando en %s\n", ruta);
+        } else {
+            unlink(ruta);
+            r = bind(fd, (struct sockaddr *) &dir, sizeof(dir));
+            if (r == -1) perror("[CLIENTE] Error al crear el socket de control");
+        }
+        if (prueba >= 0) close(prueba);
+    } else if (r == -1) {
+        perror("[CLIENTE] Error al crear el socket de control");
+    }
+    umask(mascara);
+    if (r == -1 || listen(fd, MAX_ADJUNTOS) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Avisa a los adjuntos que se perdió la conexión con el servidor (sin esperarlos).
+ */
+static void despedir_adjuntos(void) {
+    static const char adios[] = "Se perdió la conexión compartida con el servidor.\n";
+    for (int i = 0; i < MAX_ADJUNTOS; i++) {
+        adjunto_t *a = &maestro.adjuntos[i];
+        if (a->fd == -1) continue;
+        if (agregar_trama(&a->salida, TRAMA_ADIOS, 0, 0, 0, adios, sizeof(adios) - 1) == 0) {
+            bytes_enviar(a->fd, &a->salida);
+        }
+        cerrar_adjunto(i);
+    }
+}
+
+/*
+ * Modo maestro: comparte la conexión 'sd', ya establecida con el servidor, con los
+ * clientes que se conecten a 'ruta'. Devuelve 0 al terminar por inactividad y -1 si
+ * se perdió la conexión o no se pudo crear el socket.
+ */
+static int ejecutar_maestro(const char *ruta, int inactividad, const char *host, const char *puerto) {
+    struct pollfd pfd[2 + MAX_ADJUNTOS];
+    int indice[2 + MAX_ADJUNTOS];
+
+    maestro.fd_escucha = escuchar_control(ruta);
+    if (maestro.fd_escucha == -1) return -1;
+    ruta_maestro = ruta;
+    snprintf(maestro.saludo, sizeof(maestro.saludo), "Conexión compartida con %s:%s (maestro PID %d, %s)\n",
+             host, puerto, (int) getpid(), ruta);
+    for (int i = 0; i < MAX_ADJUNTOS; i++) maestro.adjuntos[i].fd = -1;
+    for (int c = 0; c < MAX_CANALES_LOTE; c++) maestro.canales[c].adjunto = -1;
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
+    clock_gettime(CLOCK_MONOTONIC, &maestro.sin_adjuntos);
+    fprintf(info, "[CLIENTE] Maestro escuchando en %s", ruta);
+    if (inactividad > 0) fprintf(info, " (termina tras %d s sin clientes)", inactividad);
+    fprintf(info, "\n");
+    fflush(info);
+
+    int perdida = 0;
+    while (!perdida) {
+        int n = 0;
+        pfd[n++] = (struct pollfd) { .fd = maestro.fd_escucha,
+                                     .events = maestro.num_adjuntos < MAX_ADJUNTOS ? POLLIN : 0 };
+        pfd[n++] = (struct pollfd) { .fd = sd,
+                                     .events = POLLIN | (bytes_pendiente(&maestro.hacia_servidor) > 0 ? POLLOUT : 0) };
+        for (int i = 0; i < MAX_ADJUNTOS; i++) {
+            adjunto_t *a = &maestro.adjuntos[i];
+            if (a->fd == -1) continue;
+            short eventos = 0;
+            // Un adjunto que no puede avanzar (servidor lento o sin canales libres) deja de leerse
+            if (!a->despedido && bytes_pendiente(&a->entrada) < MAESTRO_MAX_PENDIENTE) eventos |= POLLIN;
+            if (bytes_pendiente(&a->salida) > 0) eventos |= POLLOUT;
+            indice[n] = i;
+            pfd[n++] = (struct pollfd) { .fd = a->fd, .events = eventos };
+        }
+
+        int espera = -1;
+        if (inactividad > 0 && maestro.num_adjuntos == 0) {
+            double resta = inactividad - segundos_desde(&maestro.sin_adjuntos);
+            if (resta <= 0) break;
+            espera = (int) (resta * 1000) + 1;
+        }
+        if (poll(pfd, n, espera) < 0) {
+            if (errno == EINTR) continue;
+            perror("[CLIENTE] Error en poll");
+            perdida = 1;
+            break;
+        }
+
+        // Servidor
+        if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t r = bytes_recibir(sd, &maestro.desde_servidor);
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                fprintf(stderr, "[CLIENTE] Se perdió la conexión con el servidor.\n");
+                perdida = 1;
+            } else if (procesar_servidor() == -1) {
+                perdida = 1;
+            }
+        }
+
+        // Adjuntos
+        for (int k = 2; k < n && !perdida; k++) {
+            int i = indice[k];
+            adjunto_t *a = &maestro.adjuntos[i];
+            if (a->fd == -1) continue;
+            if (pfd[k].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t r = bytes_recibir(a->fd, &a->entrada);
+                if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    cerrar_adjunto(i);
+                    continue;
+                }
+            }
+            if (bytes_enviar(a->fd, &a->salida) == -1 || (a->despedido && bytes_pendiente(&a->salida) == 0)) {
+                cerrar_adjunto(i);
+            }
+        }
+        if (perdida) break;
+
+        // Pasar lo recibido de los adjuntos: un canal liberado o lugar en el envío
+        // pueden destrabar tramas que esperaban
+        for (int i = 0; i < MAX_ADJUNTOS; i++) {
+            if (maestro.adjuntos[i].fd != -1 && procesar_adjunto(i) == -1) {
+                fprintf(stderr, "[CLIENTE] Trama inválida del adjunto #%lu\n", maestro.adjuntos[i].num);
+                cerrar_adjunto(i);
+            }
+        }
+        if (bytes_enviar(sd, &maestro.hacia_servidor) == -1) {
+            fprintf(stderr, "[CLIENTE] Se perdió la conexión con el servidor.\n");
+            perdida = 1;
+        }
+        if (pfd[0].revents & POLLIN) aceptar_adjunto();
+    }
+
+    despedir_adjuntos();
+    close(maestro.fd_escucha);
+    unlink(ruta);
+    ruta_maestro = NULL;
+    if (perdida) return -1;
+
+    // Despedirse del servidor, como al terminar una sesión
+    fprintf(info, "[CLIENTE] Maestro inactivo durante %d s, terminando.\n", inactividad);
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) & ~O_NONBLOCK);
+    cabecera_trama_t cab;
+    if (enviar_todo(sd, maestro.hacia_servidor.datos + maestro.hacia_servidor.inicio,
+                    bytes_pendiente(&maestro.hacia_servidor)) == 0 &&
+        enviar_trama(sd, TRAMA_COMANDO, 0, 0, "exit", 4) == 0 && recibir_cabecera(sd, &cab) > 0) {
+        volcar_carga(sd, cab.longitud, -1);
+    }
+    return 0;
+}
+
+/*
+ * Se conecta al maestro que escucha en 'ruta' y recibe su saludo. Devuelve el
+ * socket, o -1 si no hay un maestro (el cliente se conecta entonces directamente).
+ */
+static int adjuntar(const char *ruta, FILE *log, int *capacidades) {
+    struct sockaddr_un dir = { .sun_family = AF_UNIX };
+    if (strlen(ruta) >= sizeof(dir.sun_path)) return -1;
+    strcpy(dir.sun_path, ruta);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *) &dir, sizeof(dir)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return recibir_saludo(fd, log, capacidades);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Modo bench: generador de carga.
+ * Abre C conexiones, cada una atendida por su propio hilo, y en cada una envía los
+ * comandos de la mezcla uno tras otro (en lazo cerrado: el siguiente sale al recibir
+ * el fin del anterior) durante un tiempo fijo o hasta completar un número de
+ * peticiones. Mide por separado la conexión (connect + saludo), el primer byte de la
+ * respuesta y la respuesta completa, y resume cada medida con un histograma.
+ */
+
+/*
+ * Histograma de latencias al estilo HDR: valores en nanosegundos en cubetas
+ * log-lineales, HIST_SUB por cada potencia de 2 (error relativo menor al 1%), con
+ * memoria fija y sin reservas durante la medición. Los histogramas de los hilos se
+ * suman al final.
+ */
+#define HIST_BITS_SUB 8
+#define HIST_SUB (1 << HIST_BITS_SUB)
+#define HIST_MITAD (HIST_SUB / 2)
+#define HIST_MAX_DESPLAZAMIENTO 40   // Valores de hasta 2^48 ns
+#define HIST_CUBETAS (HIST_SUB + HIST_MAX_DESPLAZAMIENTO * HIST_MITAD)
+
+typedef struct {
+    uint64_t cubetas[HIST_CUBETAS];
+    uint64_t total;
+    uint64_t min, max;
+    double suma;
+} histograma_t;
+
+static int hist_indice(uint64_t v) {
+    if (v < HIST_SUB) return (int) v;
+    int desplazamiento = 63 - __builtin_clzll(v) - (HIST_BITS_SUB - 1);
+    if (desplazamiento > HIST_MAX_DESPLAZAMIENTO) return HIST_CUBETAS - 1;
+    // v >> desplazamiento queda entre HIST_MITAD y HIST_SUB - 1
+    return HIST_SUB + (desplazamiento - 1) * HIST_MITAD + (int) (v >> desplazamiento) - HIST_MITAD;
+}
+
+/*
+ * Valor representativo (el punto medio) de una cubeta.
+ */
+static uint64_t hist_valor(int i) {
+    if (i < HIST_SUB) return (uint64_t) i;
+    int desplazamiento = (i - HIST_SUB) / HIST_MITAD + 1;
+    uint64_t sub = (uint64_t) ((i - HIST_SUB) % HIST_MITAD + HIST_MITAD);
+    return (sub << desplazamiento) + ((1ULL << desplazamiento) >> 1);
+}
+
+static void hist_registrar(histograma_t *h, uint64_t v) {
+    h->cubetas[hist_indice(v)]++;
+    if (h->total == 0 || v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+    h->total++;
+    h->suma += (double) v;
+}
+
+static void hist_sumar(histograma_t *dst, const histograma_t *src) {
+    if (src->total == 0) return;
+    for (int i = 0; i < HIST_CUBETAS; i++) dst->cubetas[i] += src->cubetas[i];
+    if (dst->total == 0 || src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+    dst->total += src->total;
+    dst->suma += src->suma;
+}
+
+/*
+ * Valor por debajo del cual queda el 'p' por ciento de las muestras.
+ */
+static uint64_t hist_percentil(const histograma_t *h, double p) {
+    if (h->total == 0) return 0;
+    double x = p / 100.0 * (double) h->total;
+    uint64_t objetivo = (uint64_t) x, acumulado = 0;
+    if ((double) objetivo < x || objetivo == 0) objetivo++;
+    for (int i = 0; i < HIST_CUBETAS; i++) {
+        acumulado += h->cubetas[i];
+        if (acumulado >= objetivo) {
+            uint64_t v = hist_valor(i);
+            return v < h->min ? h->min : v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+typedef struct {
+    int conexiones;       // Conexiones simultáneas (--conexiones)
+    double duracion;      // Segundos de medición si no se fija un número de peticiones
+    long peticiones;      // Total de peticiones (--peticiones); 0 para medir por tiempo
+    int reconectar;       // 1 para abrir una conexión nueva por petición (--reconectar)
+    const char *json;     // Archivo del resultado en JSON ("-": stdout)
+} opciones_bench_t;
+
+/*
+ * Estado de un hilo del bench: sus contadores e histogramas se leen sólo al final.
+ */
+typedef struct {
+    pthread_t hilo;
+    int num;
+    histograma_t conexion, primer_byte, respuesta;
+    uint64_t peticiones, bytes, fallidos, errores;
+} trabajador_t;
+
+static struct {
+    struct sockaddr_in dir;
+    char **comandos;
+    size_t num_comandos;
+    const opciones_bench_t *op;
+    atomic_long emitidas;           // Peticiones repartidas (si hay un límite)
+    uint64_t fin_ns;                // Momento de terminar (si se mide por tiempo)
+    volatile sig_atomic_t detener;  // Ctrl+C: terminar y mostrar lo medido
+} bench;
+
+static uint64_t ahora_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000ULL + (uint64_t) t.tv_nsec;
+}
+
+static void detener_bench(int sig) {
+    (void) sig;
+    bench.detener = 1;
+}
+
+/*
+ * Ejecuta un comando y espera su trama de fin. Devuelve 1 si la respuesta llegó
+ * completa y -1 si la conexión falló.
+ */
+static int peticion_bench(trabajador_t *t, int fd, uint32_t id, const char *comando, uint32_t *credito) {
+    cabecera_trama_t cab;
+    uint64_t inicio = ahora_ns();
+    int primera = 1;
+
+    if (enviar_trama(fd, TRAMA_COMANDO, id, 0, comando, strlen(comando)) < 0) return -1;
+    while (1) {
+        if (recibir_cabecera(fd, &cab) <= 0) return -1;
+        if (primera) {
+            hist_registrar(&t->primer_byte, ahora_ns() - inicio);
+            primera = 0;
+        }
+        if (volcar_carga(fd, cab.longitud, -1) <= 0) return -1;
+        if (cab.tipo == TRAMA_DATOS || cab.tipo == TRAMA_DATOS_Z) {
+            t->bytes += cab.longitud;
+            *credito += cab.longitud;
+            // Devolver la ventana por tandas: una trama más por petición falsearía la medida
+            if (*credito >= VENTANA_MIN_CONCESION) {
+                if (enviar_trama(fd, TRAMA_VENTANA, 0, (int32_t) *credito, NULL, 0) < 0) return -1;
+                *credito = 0;
+            }
+        } else if (cab.tipo == TRAMA_FIN && cab.id == id) {
+            break;
+        } else if (cab.tipo == TRAMA_ADIOS) {
+            return -1;
+        }
+    }
+    hist_registrar(&t->respuesta, ahora_ns() - inicio);
+    t->peticiones++;
+    if (cab.estado != 0) t->fallidos++;
+    return 1;
+}
+
+static void *trabajador_bench(void *arg) {
+    trabajador_t *t = arg;
+    int fd = -1;
+    uint32_t id = 0, credito = 0;
+    size_t siguiente = (size_t) t->num % bench.num_comandos; // Cada conexión empieza en otro punto de la mezcla
+
+    while (!bench.detener) {
+        if (bench.op->peticiones > 0) {
+            if (atomic_fetch_add(&bench.emitidas, 1) >= bench.op->peticiones) break;
+        } else if (ahora_ns() >= bench.fin_ns) {
+            break;
+        }
+        if (fd == -1) {
+            uint64_t inicio = ahora_ns();
+            fd = conectar(&bench.dir, NULL, NULL);
+            if (fd == -1) {
+                t->errores++;
+                break;
+            }
+            hist_registrar(&t->conexion, ahora_ns() - inicio);
+            credito = 0;
+        }
+        const char *comando = bench.comandos[siguiente];
+        siguiente = (siguiente + 1) % bench.num_comandos;
+        if (peticion_bench(t, fd, ++id, comando, &credito) < 0) {
+            t->errores++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        if (bench.op->reconectar) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd != -1) close(fd);
+    return NULL;
+}
+
+static void imprimir_fila(FILE *f, const char *nombre, const histograma_t *h) {
+    fprintf(f, "%-12s %9llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", nombre,
+            (unsigned long long) h->total, h->min / 1e3, hist_percentil(h, 50) / 1e3,
+            hist_percentil(h, 90) / 1e3, hist_percentil(h, 99) / 1e3, hist_percentil(h, 99.9) / 1e3,
+            h->max / 1e3, h->total ? h->suma / h->total / 1e3 : 0.0);
+}
+
+static void json_latencia(FILE *f, const char *nombre, const histograma_t *h, int ultima) {
+    fprintf(f, "    \"%s\": {\"n\": %llu, \"min\": %.3f, \"media\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+               "\"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}%s\n", nombre,
+            (unsigned long long) h->total, h->min / 1e3, h->total ? h->suma / h->total / 1e3 : 0.0,
+            hist_percentil(h, 50) / 1e3, hist_percentil(h, 90) / 1e3, hist_percentil(h, 99) / 1e3,
+            hist_percentil(h, 99.9) / 1e3, h->max / 1e3, ultima ? "" : ",");
+}
+
+static void json_texto(FILE *f, const char *texto) {
+    fputc('"', f);
+    for (const unsigned char *p = (const unsigned char *) texto; *p; p++) {
+        if (*p == '"' || *p == '\\') fprintf(f, "\\%c", *p);
+        else if (*p < 0x20) fprintf(f, "\\u%04x", *p);
+        else fputc(*p, f);
+    }
+    fputc('"', f);
+}
+
+/*
+ * Lee la mezcla de comandos (uno por línea, como en el modo batch; repetir una
+ * línea le da más peso), lanza los hilos y resume el resultado en stderr y, si se
+ * pidió, en JSON. Devuelve 0 si todas las peticiones se completaron.
+ */
+static int ejecutar_bench(const struct sockaddr_in *dir, const char *host, const char *puerto,
+                          const char *archivo, const opciones_bench_t *op) {
+    FILE *entrada = strcmp(archivo, "-") == 0 ? stdin : fopen(archivo, "r");
+    char *linea = NULL;
+    size_t cap_linea = 0, cap_comandos = 0;
+
+    if (entrada == NULL) {
+        perror(archivo);
+        return -1;
+    }
+    while (getline(&linea, &cap_linea, entrada) >= 0) {
+        linea[strcspn(linea, "\r\n")] = '\0';
+        if (linea[0] == '\0' || linea[0] == '#') continue;
+        if (strcmp(linea, "salir") == 0 || strcmp(linea, "exit") == 0) continue;
+        if (strlen(linea) > CLIENT_BUFFER_SIZE - 1) {
+            fprintf(stderr, "[BENCH] Comando demasiado largo, se omite: %.40s...\n", linea);
+            continue;
+        }
+        if (bench.num_comandos == cap_comandos) {
+            cap_comandos = cap_comandos ? cap_comandos * 2 : 16;
+            bench.comandos = realloc(bench.comandos, cap_comandos * sizeof(char *));
+            if (bench.comandos == NULL) {
+                perror("[BENCH] Error al reservar memoria");
+                return -1;
+            }
+        }
+        bench.comandos[bench.num_comandos++] = strdup(linea);
+    }
+    free(linea);
+    if (entrada != stdin) fclose(entrada);
+    if (bench.num_comandos == 0) {
+        fprintf(stderr, "[BENCH] La mezcla '%s' no tiene comandos\n", archivo);
+        return -1;
+    }
+
+    trabajador_t *trabajadores = calloc(op->conexiones, sizeof(trabajador_t));
+    if (trabajadores == NULL) {
+        perror("[BENCH] Error al reservar memoria");
+        return -1;
+    }
+    bench.dir = *dir;
+    bench.op = op;
+    atomic_init(&bench.emitidas, 0);
+    signal(SIGINT, detener_bench);
+    signal(SIGTERM, detener_bench);
+
+    fprintf(stderr, "[BENCH] %s:%s, %d conexiones, %zu comandos en la mezcla, ", host, puerto,
+            op->conexiones, bench.num_comandos);
+    if (op->peticiones > 0) fprintf(stderr, "%ld peticiones", op->peticiones);
+    else fprintf(stderr, "%.1f s", op->duracion);
+    fprintf(stderr, "%s\n", op->reconectar ? ", una conexión por petición" : "");
+
+    uint64_t inicio = ahora_ns();
+    bench.fin_ns = inicio + (uint64_t) (op->duracion * 1e9);
+    int lanzados = 0;
+    for (; lanzados < op->conexiones; lanzados++) {
+        trabajadores[lanzados].num = lanzados;
+        if (pthread_create(&trabajadores[lanzados].hilo, NULL, trabajador_bench, &trabajadores[lanzados]) != 0) {
+            perror("[BENCH] Error al crear hilo");
+            break;
+        }
+    }
+    histograma_t *total = calloc(3, sizeof(histograma_t));
+    uint64_t peticiones = 0, bytes = 0, fallidos = 0, errores = 0;
+    for (int i = 0; i < lanzados; i++) {
+        trabajador_t *t = &trabajadores[i];
+        pthread_join(t->hilo, NULL);
+        if (total == NULL) continue;
+        hist_sumar(&total[0], &t->conexion);
+        hist_sumar(&total[1], &t->primer_byte);
+        hist_sumar(&total[2], &t->respuesta);
+        peticiones += t->peticiones;
+        bytes += t->bytes;
+        fallidos += t->fallidos;
+        errores += t->errores;
+    }
+    double segundos = (ahora_ns() - inicio) / 1e9;
+    if (total == NULL) {
+        perror("[BENCH] Error al reservar memoria");
+        return -1;
+    }
+
+    fprintf(stderr, "[BENCH] %llu peticiones en %.3f s: %.1f peticiones/s, %.2f MB/s",
+            (unsigned long long) peticiones, segundos, peticiones / segundos, bytes / segundos / 1e6);
+    fprintf(stderr, ", %llu errores, %llu con código de salida distinto de cero\n",
+            (unsigned long long) errores, (unsigned long long) fallidos);
+    fprintf(stderr, "%-12s %9s %9s %9s %9s %9s %9s %9s %9s   (µs)\n", "",
+            "n", "min", "p50", "p90", "p99", "p99.9", "max", "media");
+    imprimir_fila(stderr, "conexión", &total[0]);
+    imprimir_fila(stderr, "primer byte", &total[1]);
+    imprimir_fila(stderr, "respuesta", &total[2]);
+
+    if (op->json != NULL) {
+        FILE *f = strcmp(op->json, "-") == 0 ? stdout : fopen(op->json, "w");
+        if (f == NULL) {
+            perror(op->json);
+        } else {
+            fprintf(f, "{\n  \"servidor\": ");
+            json_texto(f, host);
+            fprintf(f, ",\n  \"puerto\": %s,\n  \"conexiones\": %d,\n  \"reconectar\": %s,\n",
+                    puerto, lanzados, op->reconectar ? "true" : "false");
+            fprintf(f, "  \"comandos\": [");
+            for (size_t i = 0; i < bench.num_comandos; i++) {
+                if (i > 0) fprintf(f, ", ");
+                json_texto(f, bench.comandos[i]);
+            }
+            fprintf(f, "],\n  \"duracion_s\": %.6f,\n  \"peticiones\": %llu,\n  \"errores\": %llu,\n"
+                       "  \"fallidos\": %llu,\n  \"bytes\": %llu,\n  \"peticiones_por_s\": %.3f,\n"
+                       "  \"bytes_por_s\": %.3f,\n  \"latencia_us\": {\n",
+                    segundos, (unsigned long long) peticiones, (unsigned long long) errores,
+                    (unsigned long long) fallidos, (unsigned long long) bytes,
+                    peticiones / segundos, bytes / segundos);
+            json_latencia(f, "conexion", &total[0], 0);
+            json_latencia(f, "primer_byte", &total[1], 0);
+            json_latencia(f, "respuesta", &total[2], 1);
+            fprintf(f, "  }\n}\n");
+            if (f != stdout) fclose(f);
+        }
+    }
+
+    for (size_t i = 0; i < bench.num_comandos; i++) free(bench.comandos[i]);
+    free(bench.comandos);
+    free(trabajadores);
+    free(total);
+    return errores == 0 && lanzados == op->conexiones ? 0 : -1;
+}
+
 /*
  * Handler de señales (por ejemplo, Ctrl+C).
  * Si el usuario interrumpe el programa, se envía un mensaje de salida al servidor
@@ -36,9 +2009,10 @@ int sd = -1;
  */
 void signal_handler(int sig) {
     printf("\n[CLIENTE] Interrupción recibida (señal %d). Desconectando...\n", sig);
+    if (ruta_maestro != NULL) unlink(ruta_maestro);
     if (sd != -1) {
         const char* salir_cmd = "exit"; // Comando para avisar al servidor
-        send(sd, salir_cmd, strlen(salir_cmd), MSG_NOSIGNAL); // Avisar al servidor antes de cerrar
+        enviar_trama(sd, TRAMA_COMANDO, 0, 0, salir_cmd, strlen(salir_cmd)); // Avisar al servidor antes de cerrar
         close(sd);
         sd = -1; 
     }
@@ -49,84 +2023,210 @@ void signal_handler(int sig) {
 int main(int argc, char *argv[]) {
     struct sockaddr_in server_addr; // Estructura con la dirección del servidor
     struct hostent *sp;            // Estructura para resolución DNS
-    int n_recv;                    // Para almacenar el número de bytes leídos/escritos
+    int n_recv;                    // Resultado de recibir una trama
     char *host;                    // Nombre o IP del host (servidor)
     char buf_comando[256];         // Buffer para leer comandos del usuario
-    char buf_respuesta[CLIENT_BUFFER_SIZE]; // Buffer para la respuesta del servidor
+    cabecera_trama_t cab;          // Cabecera de la trama recibida
+    uint32_t id_peticion = 0;      // Id de la última petición enviada
+    z_stream *inflado = NULL;      // Descompresor de la salida comprimida
+    const char *archivo_lote = NULL; // Archivo de comandos del modo batch ("-": stdin)
+    int profundidad = PIPELINE_POR_DEFECTO; // Comandos en vuelo en modo batch
+    int num_canales = 1;           // Canales del modo batch
+    const char *mezcla_bench = NULL; // Comandos del modo bench
+    opciones_bench_t opciones_bench = { 4, 10.0, 0, 0, NULL };
+    const char *ruta_nuevo_maestro = NULL; // Socket en que escucha este cliente como maestro
+    const char *ruta_control = NULL; // Socket de un maestro al que adjuntarse
+    int inactividad = INACTIVIDAD_POR_DEFECTO; // Segundos sin adjuntos antes de que el maestro termine
+    int opcion;
+
+    static const struct option opciones[] = {
+        { "batch",      required_argument, NULL, 'b' },
+        { "pipeline",   required_argument, NULL, 'p' },
+        { "canales",    required_argument, NULL, 'c' },
+        { "bench",      required_argument, NULL, 'B' },
+        { "conexiones", required_argument, NULL, 'C' },
+        { "duracion",   required_argument, NULL, 'D' },
+        { "peticiones", required_argument, NULL, 'N' },
+        { "reconectar", no_argument,       NULL, 'R' },
+        { "json",       required_argument, NULL, 'J' },
+        { "sin-compresion", no_argument,   NULL, 'Z' },
+        { "flujos",     required_argument, NULL, 'F' },
+        { "maestro",    required_argument, NULL, 'M' },
+        { "control",    required_argument, NULL, 'S' },
+        { "inactividad", required_argument, NULL, 'I' },
+        { NULL, 0, NULL, 0 }
+    };
     
     // ---------------------- VALIDACIÓN DE ARGUMENTOS ----------------------
-    if (argc != 3) {
-        fprintf(stderr, "Uso: %s <servidor> <puerto>\n", argv[0]);
+    while ((opcion = getopt_long(argc, argv, "b:p:c:", opciones, NULL)) != -1) {
+        switch (opcion) {
+            case 'b':
+                archivo_lote = optarg;
+                break;
+            case 'p':
+                profundidad = atoi(optarg);
+                if (profundidad <= 0) {
+                    fprintf(stderr, "Profundidad de pipeline inválida: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                num_canales = atoi(optarg);
+                if (num_canales <= 0 || num_canales > MAX_CANALES_LOTE) {
+                    fprintf(stderr, "Número de canales inválido: %s (1 a %d)\n", optarg, MAX_CANALES_LOTE);
+                    exit(1);
+                }
+                break;
+            case 'B':
+                mezcla_bench = optarg;
+                break;
+            case 'C':
+                opciones_bench.conexiones = atoi(optarg);
+                if (opciones_bench.conexiones <= 0) {
+                    fprintf(stderr, "Número de conexiones inválido: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'D':
+                opciones_bench.duracion = atof(optarg);
+                if (opciones_bench.duracion <= 0) {
+                    fprintf(stderr, "Duración inválida: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'N':
+                opciones_bench.peticiones = atol(optarg);
+                if (opciones_bench.peticiones <= 0) {
+                    fprintf(stderr, "Número de peticiones inválido: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'R':
+                opciones_bench.reconectar = 1;
+                break;
+            case 'J':
+                opciones_bench.json = optarg;
+                break;
+            case 'Z':
+                pedir_compresion = 0;
+                break;
+            case 'F':
+                num_flujos = atoi(optarg);
+                if (num_flujos <= 0 || num_flujos > MAX_CANALES_LOTE) {
+                    fprintf(stderr, "Número de flujos inválido: %s (1 a %d)\n", optarg, MAX_CANALES_LOTE);
+                    exit(1);
+                }
+                break;
+            case 'M':
+                ruta_nuevo_maestro = optarg;
+                break;
+            case 'S':
+                ruta_control = optarg;
+                break;
+            case 'I':
+                inactividad = atoi(optarg);
+                if (inactividad < 0) {
+                    fprintf(stderr, "Tiempo de inactividad inválido: %s (0: sin límite)\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                argc = 0; // Mostrar el uso
+        }
+    }
+    if (ruta_nuevo_maestro != NULL && (archivo_lote != NULL || mezcla_bench != NULL)) {
+        fprintf(stderr, "--maestro no se combina con --batch ni con --bench\n");
+        argc = 0;
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "Uso: %s <servidor> <puerto> [--batch ARCHIVO] [--pipeline N] [--canales N]"
+                        " [--sin-compresion] [--flujos N] [--control RUTA]\n", argv[0]);
+        fprintf(stderr, "     %s <servidor> <puerto> --maestro RUTA [--inactividad S] [--sin-compresion]\n", argv[0]);
         fprintf(stderr, "Ejemplos:\n  %s localhost 8080\n  %s 192.168.1.100 8080\n", argv[0], argv[0]);
+        fprintf(stderr, "  %s localhost 8080 --batch comandos.txt --pipeline 64\n", argv[0]);
+        fprintf(stderr, "  ... | %s localhost 8080 --batch - --canales 8\n", argv[0]);
+        fprintf(stderr, "  %s localhost 8080 --bench mezcla.txt --conexiones 16 --duracion 30 --json res.json\n", argv[0]);
+        fprintf(stderr, "  %s localhost 8080 --maestro /tmp/ssh-8080 &  (y después: ... --control /tmp/ssh-8080)\n", argv[0]);
         exit(1);
     }
-    host = argv[1]; // Guardar el host recibido por argumento
+    host = argv[optind]; // Guardar el host recibido por argumento
+    const char *puerto = argv[optind + 1];
+    info = archivo_lote != NULL || mezcla_bench != NULL ? stderr : stdout;
+
+    FILE *entrada_lote = NULL;
+    if (archivo_lote != NULL) {
+        entrada_lote = strcmp(archivo_lote, "-") == 0 ? stdin : fopen(archivo_lote, "r");
+        if (entrada_lote == NULL) {
+            perror(archivo_lote);
+            exit(1);
+        }
+    }
     
     // ---------------------- CONFIGURACIÓN DE SEÑALES ----------------------
     signal(SIGINT, signal_handler);  // Ctrl+C
     signal(SIGTERM, signal_handler); // Terminación estándar
     signal(SIGPIPE, SIG_IGN);
     
-    printf("=== CLIENTE SSH ===\n");
-    printf("Conectando a: %s:%s\n", host, argv[2]);
+    fprintf(info, "=== CLIENTE SSH ===\n");
+    fprintf(info, "Conectando a: %s:%s\n", host, puerto);
     
-    // ---------------------- 1. CREAR SOCKET ----------------------
-    printf("1. Creando socket del cliente...\n");
-    sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP); // Socket TCP
-    if (sd < 0) {
-        perror("[CLIENTE] Error al crear socket");
-        exit(1);
+    // Con un maestro escuchando no hace falta resolver el nombre ni conectar
+    if (ruta_control != NULL && ruta_nuevo_maestro == NULL && mezcla_bench == NULL) {
+        sd = adjuntar(ruta_control, info, &capacidades_servidor);
     }
+    if (sd == -1) {
+        // ---------------------- 1. CONFIGURAR DIRECCIÓN DEL SERVIDOR ----------------------
+        fprintf(info, "1. Configurando dirección del servidor...\n");
+        memset((char *) &server_addr, 0, sizeof(struct sockaddr_in)); // Inicializar en cero
+        server_addr.sin_family = AF_INET; // IPv4
+        server_addr.sin_port = htons((u_short) atoi(puerto)); // Puerto recibido como argumento
     
-    // ---------------------- 2. CONFIGURAR DIRECCIÓN DEL SERVIDOR ----------------------
-    printf("2. Configurando dirección del servidor...\n");
-    memset((char *) &server_addr, 0, sizeof(struct sockaddr_in)); // Inicializar en cero
-    server_addr.sin_family = AF_INET; // IPv4
-    server_addr.sin_port = htons((u_short) atoi(argv[2])); // Puerto recibido como argumento
-    
-    // Resolver el nombre de host a dirección IP
-    if (inet_pton(AF_INET, argv[1], &server_addr.sin_addr) <= 0) {
-        sp = gethostbyname(argv[1]); // Si falla, intenta resolver hostname
-        if (sp == NULL) {
-            fprintf(stderr, "Error: No se pudo resolver hostname '%s'\n", argv[1]);
-            close(sd);
-            exit(1);
+        // Resolver el nombre de host a dirección IP
+        if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
+            sp = gethostbyname(host); // Si falla, intenta resolver hostname
+            if (sp == NULL) {
+                fprintf(stderr, "Error: No se pudo resolver hostname '%s'\n", host);
+                exit(1);
+            }
+            // Copiar la dirección IP obtenida a la estructura 'server'
+            memcpy(&server_addr.sin_addr, sp->h_addr_list[0], sp->h_length);
+        }
+
+        if (mezcla_bench != NULL) {
+            // ---------------------- MODO BENCH ----------------------
+            exit(ejecutar_bench(&server_addr, host, puerto, mezcla_bench, &opciones_bench) == 0 ? 0 : 1);
         }
-        // Copiar la dirección IP obtenida a la estructura 'server'
-        memcpy(&server_addr.sin_addr, sp->h_addr_list[0], sp->h_length);
+
+        sd = conectar(&server_addr, info, &capacidades_servidor);
+        if (sd == -1) exit(1);
     }
-    
-    // ---------------------- 3. CONECTAR AL SERVIDOR ----------------------
-    printf("3. Conectando al servidor...\n");
-    if (connect(sd, (struct sockaddr *) &server_addr, sizeof(struct sockaddr_in)) < 0) {
-        perror("Error al conectar");
-        printf("Verificar que:\n");
-        printf("- El servidor esté ejecutándose en %s:%s\n", host, argv[2]);
-        printf("- La dirección IP y puerto sean correctos\n");
-        printf("- No haya firewall bloqueando la conexión\n");
-        close(sd);
-        exit(1);
+
+    if (ruta_nuevo_maestro != NULL) {
+        // ---------------------- 5c. MODO MAESTRO ----------------------
+        exit(ejecutar_maestro(ruta_nuevo_maestro, inactividad, host, puerto) == 0 ? 0 : 1);
     }
     
-    printf("¡Conexión establecida exitosamente!\n\n");
-    
-    // ---------------------- 4. RECIBIR MENSAJES INICIALES DEL SERVIDOR ----------------------
-    memset(buf_respuesta, 0, sizeof(buf_respuesta));
-    n_recv = recv(sd, buf_respuesta, sizeof(buf_respuesta) - 1, 0);
-    if (n_recv > 0) {
-        buf_respuesta[n_recv] = '\0';  // Terminar la cadena para impresión segura
-        printf("%s", buf_respuesta); // Mostrar lo que envíe el servidor (info conexión + bienvenida)
-    } else if (n_recv == 0) {
-        printf("El servidor cerró la conexión inmediatamente.\n");
-        close(sd); exit(1);
-    } else {
-        perror("Error al recibir mensaje inicial del servidor");
-        close(sd); exit(1);
+    if (entrada_lote != NULL) {
+        // ---------------------- 5b. MODO BATCH ----------------------
+        int fallidos = ejecutar_lote(entrada_lote, profundidad, num_canales);
+        if (sd != -1) {
+            const char *salir_cmd = "exit";
+            if (enviar_trama(sd, TRAMA_COMANDO, 0, 0, salir_cmd, strlen(salir_cmd)) == 0 &&
+                recibir_cabecera(sd, &cab) > 0) {
+                volcar_carga(sd, cab.longitud, -1); // Despedida
+            }
+            close(sd);
+            sd = -1;
+        }
+        exit(fallidos == 0 ? 0 : 1);
     }
-    
+
     printf("=== SESIÓN SSH INICIADA ===\n");
     printf("Escriba comandos para ejecutar en el servidor remoto.\n");
     printf("Comandos especiales: 'salir' o 'exit' para desconectar\n");
+    if (capacidades_servidor & PROTO_CAP_TRANSFERENCIA) {
+        printf("Archivos: 'get [-r] REMOTO [LOCAL]' descarga y 'put [-r] LOCAL [REMOTO]' sube (-r reanuda)\n");
+    }
     printf("Presione Ctrl+C para forzar desconexión\n\n");
     
     // ---------------------- 5. BUCLE PRINCIPAL DE COMUNICACIÓN ----------------------
@@ -143,56 +2243,75 @@ int main(int argc, char *argv[]) {
         buf_comando[strcspn(buf_comando, "\n")] = '\0'; // Quitar newline de fgets
 
         if (strlen(buf_comando) == 0) continue; // Si solo se presiona Enter
+
+        // get y put no son comandos remotos: el cliente transfiere el archivo
+        if (strncmp(buf_comando, "get ", 4) == 0 || strncmp(buf_comando, "put ", 4) == 0) {
+            comando_transferencia(buf_comando, &id_peticion);
+            if (sd == -1) break;
+            continue;
+        }
         
         printf("Enviando comando: '%s'\n", buf_comando);
         
         // Enviar el comando al servidor
-        if (send(sd, buf_comando, strlen(buf_comando), 0) < 0) {
+        id_peticion++;
+        if (enviar_trama(sd, TRAMA_COMANDO, id_peticion, 0, buf_comando, strlen(buf_comando)) < 0) {
             perror("Error al enviar comando"); break;
         }
 
         if (strcmp(buf_comando, "salir") == 0 || strcmp(buf_comando, "exit") == 0) {
-            // Recibir la respuesta del servidor (bloquea hasta recibir datos)
-            memset(buf_respuesta, 0, sizeof(buf_respuesta));
-            n_recv = recv(sd, buf_respuesta, sizeof(buf_respuesta) - 1, 0);
-            if (n_recv > 0) {
-                buf_respuesta[n_recv] = '\0';
-                printf("%s", buf_respuesta); 
+            // Recibir la despedida del servidor (bloquea hasta recibir datos)
+            fflush(stdout);
+            if (recibir_cabecera(sd, &cab) > 0) {
+                volcar_carga(sd, cab.longitud, STDOUT_FILENO);
             }
             printf("Desconexión solicitada.\n");
             break; 
         }
         
-        // Mostrar la respuesta recibida
+        // Mostrar la respuesta recibida: tramas de datos hasta la trama de fin
         printf("--- Respuesta del Servidor ---\n");
-        int eof_encontrado = 0;
-        while (!eof_encontrado) {
-            memset(buf_respuesta, 0, sizeof(buf_respuesta));
-            n_recv = recv(sd, buf_respuesta, sizeof(buf_respuesta) - 1, 0);
-            
-            if (n_recv < 0) { perror("Error al recibir respuesta"); eof_encontrado = 1; break; }
-            if (n_recv == 0) { printf("Servidor cerró conexión inesperadamente.\n"); eof_encontrado = 1; break; }
-            
-            buf_respuesta[n_recv] = '\0';
-            // respuesta_total_len += n_recv;
-
-            char *eof_ptr = strstr(buf_respuesta, CMD_EOF_MARKER);
-            if (eof_ptr != NULL) {
-                *eof_ptr = '\0'; // Terminar la cadena en el marcador
-                write(STDOUT_FILENO, buf_respuesta, strlen(buf_respuesta)); // Escribir la porción útil
-                eof_encontrado = 1;
+        fflush(stdout);
+        int fin_encontrado = 0;
+        int32_t estado_salida = 0;
+        while (!fin_encontrado) {
+            n_recv = recibir_cabecera(sd, &cab);
+            if (n_recv < 0) { perror("Error al recibir respuesta"); break; }
+            if (n_recv == 0) { printf("Servidor cerró conexión inesperadamente.\n"); break; }
+
+            if (cab.tipo == TRAMA_DATOS && cab.id == id_peticion) {
+                n_recv = volcar_carga(sd, cab.longitud, STDOUT_FILENO); // Escribir la porción recibida
+            } else if (cab.tipo == TRAMA_DATOS_Z && cab.id == id_peticion) {
+                n_recv = volcar_comprimida(sd, cab.longitud, &inflado, STDOUT_FILENO);
+            } else if (cab.tipo == TRAMA_ADIOS) {
+                n_recv = volcar_carga(sd, cab.longitud, STDOUT_FILENO); // Motivo del cierre (apagado, inactividad)
             } else {
-                write(STDOUT_FILENO, buf_respuesta, n_recv); // Escribir todo el chunk
+                n_recv = volcar_carga(sd, cab.longitud, -1); // Trama ajena a esta petición
+            }
+            if (n_recv > 0 && (cab.tipo == TRAMA_DATOS || cab.tipo == TRAMA_DATOS_Z)) {
+                // Devolver al servidor la ventana del canal 0 (el único del modo interactivo)
+                if (enviar_trama(sd, TRAMA_VENTANA, 0, (int32_t) cab.longitud, NULL, 0) < 0) n_recv = -1;
+            }
+            if (n_recv <= 0) { printf("Servidor cerró conexión inesperadamente.\n"); break; }
+
+            if (cab.tipo == TRAMA_FIN && cab.id == id_peticion) {
+                estado_salida = cab.estado;
+                fin_encontrado = 1;
+            } else if (cab.tipo == TRAMA_ADIOS) {
+                printf("El servidor cerró la sesión.\n");
+                break;
             }
-            fflush(stdout);
         }
+        if (!fin_encontrado) break;
 
-        printf("--- Fin de respuesta ---\n\n");
+        if (estado_salida == 0) printf("--- Fin de respuesta ---\n\n");
+        else printf("--- Fin de respuesta (código de salida %d) ---\n\n", estado_salida);
     }
     
     // ---------------------- 6. CERRAR CONEXIÓN Y SALIR ----------------------
     printf("[CLIENTE] Cerrando conexión...\n");
     if (sd != -1) { close(sd); sd = -1; }
+    liberar_descompresor(&inflado);
     printf("¡Desconectado del servidor!\n");
     exit(0);
 }
\ No newline at end of file
@@ -0,0 +1,181 @@
+/*
+ * protocolo.h - Tramas del protocolo entre cliente y servidor.
+ *
+ * Descripción:
+ * Todo lo que viaja por la conexión va dentro de tramas con una cabecera fija de
+ * 16 bytes (en orden de red) seguida de 'longitud' bytes de carga:
+ *
+ *   0       1       2               4               8              12              16
+ *   +-------+-------+---------------+---------------+---------------+---------------+
+ *   |version| tipo  |     canal     |      id       |   longitud    |    estado     |
+ *   +-------+-------+---------------+---------------+---------------+---------------+
+ *
+ * - version: PROTO_VERSION; una trama con otra versión se rechaza.
+ * - tipo: uno de tipo_trama_t.
+ * - canal: canal lógico de la conexión. Cada canal ejecuta sus comandos en orden, uno
+ *   a la vez, y los canales distintos en paralelo; las respuestas repiten el canal
+ *   del comando y las tramas de varios canales pueden llegar intercaladas.
+ * - id: número de petición elegido por el cliente; las respuestas lo repiten.
+ * - longitud: bytes de carga que siguen a la cabecera (como máximo PROTO_MAX_CARGA).
+ * - estado: código de salida del comando en TRAMA_FIN; bytes concedidos en TRAMA_VENTANA;
+ *   opciones de la petición en TRAMA_DESCARGA.
+ *
+ * El receptor sabe cuántos bytes faltan sin examinar la carga, de modo que la salida
+ * de un comando puede contener cualquier secuencia de bytes.
+ *
+ * Control de flujo: el servidor envía en cada canal como máximo PROTO_VENTANA_INICIAL
+ * bytes de carga de TRAMA_DATOS más lo que el cliente haya concedido con TRAMA_VENTANA.
+ * Al agotarse la ventana de un canal, su comando queda frenado sin afectar a los demás.
+ *
+ * Compresión: en TRAMA_HOLA, 'estado' lleva las capacidades que ofrece el servidor
+ * (PROTO_CAP_*). El cliente activa las que quiera con una TRAMA_OPCIONES antes de su
+ * primer comando; un cliente que no la envía recibe la salida sin comprimir. Con
+ * PROTO_CAP_ZLIB, la salida de una respuesta puede llegar en tramas TRAMA_DATOS_Z:
+ * sus cargas, concatenadas, forman un flujo deflate (RFC 1951, sin cabecera zlib)
+ * que termina antes del TRAMA_FIN de la respuesta. Cada trama se puede descomprimir
+ * al llegar. Una misma respuesta puede mezclar tramas TRAMA_DATOS y TRAMA_DATOS_Z, y
+ * la ventana cuenta los bytes de carga tal como viajan.
+ *
+ * Transferencias: con PROTO_CAP_TRANSFERENCIA (no hace falta activarla) el cliente
+ * puede mover archivos sin pasar por comandos. Cada petición transfiere un trozo de un
+ * archivo: su carga es una peticion_transferencia_t codificada (desplazamiento,
+ * longitud y, en las subidas, tamaño final del archivo) seguida de la ruta, relativa
+ * al directorio de la sesión.
+ * - TRAMA_DESCARGA: el servidor responde con los bytes del trozo en tramas TRAMA_DATOS
+ *   (nunca comprimidas), sujetas a la ventana como cualquier salida. Un trozo que pasa
+ *   del final del archivo se acorta. Con PROTO_SOLO_SUMA en 'estado' no se envían los
+ *   datos, sólo su resumen (así se consulta el tamaño, con longitud 0, o se comprueba
+ *   un trozo ya transferido).
+ * - TRAMA_SUBIDA: el cliente envía a continuación, en el mismo canal y con el mismo
+ *   id, 'longitud' bytes en tramas TRAMA_DATOS.
+ * Ambas terminan con un TRAMA_FIN cuyo 'estado' es 0 o un código errno, y cuya carga
+ * es un resumen_transferencia_t: tamaño del archivo, bytes transferidos y su CRC-32.
+ * Una transferencia debe ir en un canal libre (sin comandos en curso ni en cola); si
+ * no, se responde en el acto con EBUSY. Los trozos de un archivo pueden ir en
+ * paralelo por canales distintos.
+ */
+
+#ifndef PROTOCOLO_H
+#define PROTOCOLO_H
+
+#include <stdint.h>     // uint8_t, uint32_t, uint64_t
+#include <string.h>     // memcpy
+#include <arpa/inet.h>  // htonl, ntohl, htons, ntohs
+
+#define PROTO_VERSION 2
+#define PROTO_CABECERA 16               // Tamaño de la cabecera de una trama
+#define PROTO_MAX_CARGA (1024 * 1024)   // Máximo de bytes de carga de una trama
+#define PROTO_ESTADO_ERROR (-1)         // Estado de TRAMA_FIN cuando el comando no llegó a ejecutarse
+#define PROTO_VENTANA_INICIAL (4 * 1024 * 1024) // Bytes de datos por canal antes del primer TRAMA_VENTANA
+
+typedef enum {
+    TRAMA_HOLA    = 1, // Servidor -> cliente: información de la conexión y bienvenida (texto)
+    TRAMA_COMANDO = 2, // Cliente -> servidor: línea de comando a ejecutar
+    TRAMA_DATOS   = 3, // Servidor -> cliente: una porción de la salida del comando 'id' (o, del cliente, de una subida)
+    TRAMA_FIN     = 4, // Servidor -> cliente: fin de la respuesta 'id', con su código de salida
+    TRAMA_ADIOS   = 5, // Servidor -> cliente: despedida; después se cierra la conexión
+    TRAMA_VENTANA = 6, // Cliente -> servidor: el cliente consumió 'estado' bytes más de datos del canal
+    TRAMA_OPCIONES = 7, // Cliente -> servidor: capacidades activadas ('estado', de las ofrecidas en TRAMA_HOLA)
+    TRAMA_DATOS_Z = 8, // Servidor -> cliente: una porción comprimida de la salida del comando 'id'
+    TRAMA_DESCARGA = 9, // Cliente -> servidor: enviar un trozo de un archivo
+    TRAMA_SUBIDA  = 10 // Cliente -> servidor: recibir un trozo de un archivo (sigue en TRAMA_DATOS)
+} tipo_trama_t;
+
+#define PROTO_CAP_ZLIB 0x1              // Salida comprimida con deflate (TRAMA_DATOS_Z)
+#define PROTO_CAP_TRANSFERENCIA 0x2     // TRAMA_DESCARGA y TRAMA_SUBIDA
+
+#define PROTO_SOLO_SUMA 0x1             // TRAMA_DESCARGA: sólo el resumen del trozo, sin los datos
+#define PROTO_PETICION_TRANSFERENCIA 24 // Bytes de la peticion_transferencia_t codificada
+#define PROTO_RESUMEN_TRANSFERENCIA 20  // Bytes del resumen_transferencia_t codificado
+
+typedef struct {
+    uint8_t  version;
+    uint8_t  tipo;
+    uint16_t canal;
+    uint32_t id;
+    uint32_t longitud;
+    int32_t  estado;
+} cabecera_trama_t;
+
+/*
+ * Escribe la cabecera de una trama en 'buf' (PROTO_CABECERA bytes).
+ */
+static inline void trama_codificar(uint8_t *buf, uint8_t tipo, uint16_t canal, uint32_t id,
+                                   uint32_t longitud, int32_t estado) {
+    uint32_t v;
+    uint16_t c = htons(canal);
+    buf[0] = PROTO_VERSION;
+    buf[1] = tipo;
+    memcpy(buf + 2, &c, 2);
+    v = htonl(id);                 memcpy(buf + 4, &v, 4);
+    v = htonl(longitud);           memcpy(buf + 8, &v, 4);
+    v = htonl((uint32_t) estado);  memcpy(buf + 12, &v, 4);
+}
+
+/*
+ * Lee una cabecera de 'buf'. Devuelve -1 si la versión no es la del protocolo o
+ * si la longitud excede PROTO_MAX_CARGA.
+ */
+static inline int trama_decodificar(const uint8_t *buf, cabecera_trama_t *c) {
+    uint32_t v;
+    c->version = buf[0];
+    c->tipo = buf[1];
+    uint16_t canal;
+    memcpy(&canal, buf + 2, 2); c->canal = ntohs(canal);
+    memcpy(&v, buf + 4, 4);  c->id = ntohl(v);
+    memcpy(&v, buf + 8, 4);  c->longitud = ntohl(v);
+    memcpy(&v, buf + 12, 4); c->estado = (int32_t) ntohl(v);
+    if (c->version != PROTO_VERSION || c->longitud > PROTO_MAX_CARGA) return -1;
+    return 0;
+}
+
+typedef struct {
+    uint64_t desplazamiento;    // Primer byte del trozo
+    uint64_t longitud;          // Bytes del trozo
+    uint64_t tamano;            // Subidas: tamaño final del archivo (se ignora en las descargas)
+} peticion_transferencia_t;
+
+typedef struct {
+    uint64_t tamano;            // Tamaño del archivo
+    uint64_t bytes;             // Bytes del trozo transferidos (o sumados)
+    uint32_t crc;               // CRC-32 (el de zlib) de esos bytes
+} resumen_transferencia_t;
+
+static inline void proto_u64_codificar(uint8_t *buf, uint64_t v) {
+    for (int i = 7; i >= 0; i--, v >>= 8) buf[i] = (uint8_t) v;
+}
+
+static inline uint64_t proto_u64_decodificar(const uint8_t *buf) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = v << 8 | buf[i];
+    return v;
+}
+
+static inline void peticion_codificar(uint8_t *buf, const peticion_transferencia_t *p) {
+    proto_u64_codificar(buf, p->desplazamiento);
+    proto_u64_codificar(buf + 8, p->longitud);
+    proto_u64_codificar(buf + 16, p->tamano);
+}
+
+static inline void peticion_decodificar(const uint8_t *buf, peticion_transferencia_t *p) {
+    p->desplazamiento = proto_u64_decodificar(buf);
+    p->longitud = proto_u64_decodificar(buf + 8);
+    p->tamano = proto_u64_decodificar(buf + 16);
+}
+
+static inline void resumen_codificar(uint8_t *buf, const resumen_transferencia_t *r) {
+    uint32_t v = htonl(r->crc);
+    proto_u64_codificar(buf, r->tamano);
+    proto_u64_codificar(buf + 8, r->bytes);
+    memcpy(buf + 16, &v, 4);
+}
+
+static inline void resumen_decodificar(const uint8_t *buf, resumen_transferencia_t *r) {
+    uint32_t v;
+    r->tamano = proto_u64_decodificar(buf);
+    r->bytes = proto_u64_decodificar(buf + 8);
+    memcpy(&v, buf + 16, 4);
+    r->crc = ntohl(v);
+}
+
+#endif // PROTOCOLO_H
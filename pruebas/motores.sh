@@ -0,0 +1,111 @@
+#!/bin/bash
+#
+# Compara las respuestas del servidor con el motor epoll y con --io-uring.
+# Lanza el servidor con cada motor, ejecuta los mismos lotes de comandos (en tubería
+# por un solo canal y repartidos en varios canales, con y sin compresión) y compara
+# la salida de los clientes. Termina con 0 si todo coincide, 1 si hay diferencias y
+# 77 si el kernel no admite io_uring.
+#
+# Uso: pruebas/motores.sh [PUERTO]
+# Los binarios se compilan desde el repositorio; SERVIDOR y CLIENTE permiten usar otros.
+
+set -u
+PUERTO=${1:-9390}
+RAIZ=$(cd "$(dirname "$0")/.." && pwd)
+TMP=$(mktemp -d)
+PID_SERVIDOR=
+trap '[ -n "$PID_SERVIDOR" ] && kill "$PID_SERVIDOR" 2>/dev/null; rm -rf "$TMP"' EXIT
+
+if [ -z "${SERVIDOR:-}" ]; then
+    SERVIDOR=$TMP/servidor
+    gcc -O2 -o "$SERVIDOR" "$RAIZ/servidor.c" -pthread -lz || exit 1
+fi
+if [ -z "${CLIENTE:-}" ]; then
+    CLIENTE=$TMP/cliente
+    gcc -O2 -o "$CLIENTE" "$RAIZ/cliente.c" -pthread -lz || exit 1
+fi
+
+# Directorio de trabajo del servidor: archivos pequeños, uno grande (sendfile) y un
+# subdirectorio. Los comandos no escriben nada, así el orden entre canales no importa.
+mkdir -p "$TMP/trabajo/sub"
+printf 'uno\ndos\ntres\n' > "$TMP/trabajo/datos.txt"
+seq 1 300000 > "$TMP/trabajo/grande.txt"
+printf 'dentro\n' > "$TMP/trabajo/sub/a.txt"
+cat > "$TMP/trabajo/tuberias.sh" <<'GUION'
+cat grande.txt | wc -l
+sort -r < datos.txt
+yes | head -c 300000 | wc -c
+echo fuera; echo error >&2; exit 3
+GUION
+
+for vuelta in 1 2 3; do
+    cat <<'LOTE'
+echo hola mundo
+pwd
+ls
+ls sub
+cat datos.txt sub/a.txt
+cat grande.txt
+stat -c %s datos.txt
+seq 1 50000
+sh tuberias.sh
+cat grande.txt | head -c 1500000
+sort -r < datos.txt 2>&1 | cat
+seq 1 100000 | tail -3
+ls noexiste
+nocomando_inexistente
+LOTE
+    for i in $(seq 1 50); do echo "echo linea $vuelta.$i"; done
+done > "$TMP/lote.txt"
+
+# Arranca el servidor con las opciones dadas y espera a que acepte conexiones
+iniciar_servidor() {
+    (cd "$TMP/trabajo" && exec "$SERVIDOR" "$PUERTO" "$@") > "$TMP/servidor.log" 2>&1 &
+    PID_SERVIDOR=$!
+    for _ in $(seq 1 50); do
+        echo echo listo | "$CLIENTE" localhost "$PUERTO" --batch - > /dev/null 2>&1 && return 0
+        sleep 0.1
+    done
+    echo "El servidor no arrancó ($*):" >&2
+    cat "$TMP/servidor.log" >&2
+    return 1
+}
+
+detener_servidor() {
+    kill "$PID_SERVIDOR"
+    wait "$PID_SERVIDOR" 2>/dev/null
+    PID_SERVIDOR=
+}
+
+for motor in epoll io_uring; do
+    opciones=()
+    [ "$motor" = io_uring ] && opciones=(--io-uring)
+    iniciar_servidor "${opciones[@]}" || exit 1
+    if grep -q "io_uring no disponible" "$TMP/servidor.log"; then
+        echo "io_uring no disponible en este kernel: no hay nada que comparar" >&2
+        exit 77
+    fi
+    for compresion in "" --sin-compresion; do
+        for modo in tuberia canales; do
+            args=(--batch "$TMP/lote.txt")
+            [ "$modo" = canales ] && args+=(--canales 4)
+            [ -n "$compresion" ] && args+=("$compresion")
+            timeout 120 "$CLIENTE" localhost "$PUERTO" "${args[@]}" \
+                > "$TMP/$motor.$modo$compresion" 2> /dev/null
+        done
+    done
+    detener_servidor
+done
+
+fallos=0
+for salida in "$TMP"/epoll.*; do
+    caso=${salida#"$TMP"/epoll.}
+    if cmp -s "$salida" "$TMP/io_uring.$caso"; then
+        echo "igual: $caso ($(wc -l < "$salida") líneas)"
+    else
+        echo "DISTINTO: $caso"
+        diff "$salida" "$TMP/io_uring.$caso" | head -20
+        fallos=1
+    fi
+done
+exit $fallos
@@ -1,181 +1,6342 @@
 /*
- * Uso: ./servidor <puerto>
- * Compilación: gcc -o servidor servidor.c
+ * Uso: ./servidor <puerto> [--backlog N] [--workers N [--fijar-cpu]] [--ejecutores N]
+ *                [--sin-internos] [--shell] [--sin-dns] [--io-uring] [--sin-compresion]
+ *                [--cache ARCHIVO [--cache-memoria MB]] [--metricas ARCHIVO] [--intervalo-metricas S]
+ *                [--tiempo-comando S] [--salida-maxima N] [--limite-cpu S] [--limite-memoria N]
+ *                [--inactividad S] [--log-json] [--log-nivel error|aviso|info] [--log-limite N]
+ *      ./servidor --bench-lanzamiento N [--bench-memoria MB] [--ejecutores N]
+ * Compilación: gcc -o servidor servidor.c -pthread -lz
  * Descripción:
  * Este programa implementa un servidor TCP simple tipo SSH.
+ * - Atiende muchas sesiones a la vez desde un solo hilo, con un bucle de eventos epoll
+ *   que vigila el socket de escucha, los sockets de los clientes y los pipes de los hijos.
+ *   Con --io-uring acepta y lee a los clientes con io_uring, y les envía por el mismo
+ *   anillo la salida de los comandos.
  * - Muestra logs detallados en su propia consola durante el inicio y por cada cliente/comando.
+ *   Un hilo aparte les da formato (texto o JSON) y los escribe, sin frenar al bucle.
  * - Envía información detallada de la conexión al cliente, seguida de un mensaje de bienvenida.
- * - Ejecuta comandos recibidos y devuelve la salida al cliente
+ * - Ejecuta comandos recibidos y devuelve la salida al cliente en tramas (ver protocolo.h),
+ *   terminando cada respuesta con el código de salida del comando.
+ * - Entiende comillas, escapes, tuberías (|) y redirecciones (<, >, >>, 2>, 2>&1), y
+ *   conecta las etapas de una tubería él mismo, sin pasar por /bin/sh.
+ * - Opcionalmente lanza los comandos desde procesos ejecutores creados al arrancar, para
+ *   que el servidor no tenga que hacer fork() por cada comando.
+ * - Atiende pwd, echo, ls, cat y stat sin crear procesos, y mantiene un directorio
+ *   de trabajo por sesión que cambia con 'cd'.
+ * - Con '__shell', ejecuta los comandos de la sesión en un shell persistente.
+ * - Ejecuta en paralelo los comandos de distintos canales de una misma conexión, con
+ *   control de flujo por canal (ver protocolo.h).
+ * - Con --workers reparte las conexiones entre varios procesos, cada uno con su propio
+ *   socket de escucha (SO_REUSEPORT) y su bucle de eventos.
+ * - Mide cada fase de cada comando; '__stats' muestra el resumen y --metricas lo
+ *   escribe periódicamente para Prometheus.
+ * - Comprime con deflate la salida larga de los comandos si el cliente lo pide.
+ * - Con --cache responde desde memoria los comandos de sólo lectura que se repiten.
+ * - Transfiere archivos (TRAMA_DESCARGA/TRAMA_SUBIDA) con sendfile() y fallocate(), en
+ *   rangos que el cliente verifica con CRC-32.
+ * - Limita el tiempo, la salida, la CPU y la memoria de cada comando, y cierra las
+ *   sesiones inactivas.
  */
 
+#define _GNU_SOURCE     // accept4, pipe2 y demás extensiones de Linux
 #include <stdio.h>      // printf, fprintf, perror, fgets, snprintf
 #include <stdlib.h>     // exit, malloc, free, atoi
-#include <string.h>     // strlen, strcpy, strcmp, memset, strdup, strtok, strcspn
+#include <string.h>     // strlen, strcpy, strcmp, memset, strdup, strchr, strcspn
 #include <sys/types.h>  // tipos de datos del sistema (pid_t, ssize_t)
 #include <sys/socket.h> // socket, bind, listen, accept, send, recv, setsockopt, shutdown
 #include <netinet/in.h> // estructuras sockaddr_in
+#include <netinet/tcp.h> // TCP_NODELAY
 #include <arpa/inet.h>  // inet_ntoa, htons
-#include <netdb.h>      // gethostbyaddr
+#include <netdb.h>      // getnameinfo (nombre del cliente)
 #include <unistd.h>     // close, fork, pipe, dup2, execvp, read, write, wait
 #include <time.h>       // time, localtime
 #include <fcntl.h>      // control de archivos
 #include <limits.h>     // límites del sistema
 #include <errno.h>      // códigos de error
 #include <signal.h>     // manejo de señales
-#include <ctype.h>      // isspace (para la función trim)
+#include <ctype.h>      // isspace (para la función trim), isdigit
 #include <sys/wait.h>   // wait (para esperar al proceso hijo)
+#include <sys/epoll.h>  // epoll_create1, epoll_ctl, epoll_wait (bucle de eventos)
+#include <getopt.h>     // getopt_long (opciones de línea de comandos)
+#include <sys/syscall.h> // syscall (pidfd_open)
+#include <sys/ioctl.h>  // ioctl (FIONREAD sobre el pipe)
+#include <sys/signalfd.h> // signalfd (los ejecutores esperan SIGCHLD junto con su socket)
+#include <poll.h>       // poll (bucle de los ejecutores)
+#include <stdarg.h>     // va_list (salida con formato de los comandos internos)
+#include <dirent.h>     // fdopendir, readdir (ls interno)
+#include <sys/stat.h>   // fstatat, statx (ls y stat internos)
+#include <sys/statfs.h> // fstatfs (cat interno)
+#include <linux/magic.h> // PROC_SUPER_MAGIC, SYSFS_MAGIC
+#include <sys/sendfile.h> // sendfile (cat interno de archivos grandes)
+#include <pwd.h>        // getpwuid_r (stat interno)
+#include <grp.h>        // getgrgid_r (stat interno)
+#include <locale.h>     // setlocale (orden de ls)
+#include <sys/random.h> // getrandom (marcas del modo shell)
+#include <sys/eventfd.h> // eventfd (avisos entre el bucle y los hilos)
+#include <pthread.h>    // pthread_create (hilos resolutor de nombres y de registro)
+#include <stdatomic.h>  // atomic_size_t (anillo del registro)
+#include <sched.h>      // sched_setaffinity (--fijar-cpu)
+#include <sys/mman.h>   // mmap (anillos de io_uring)
+#include <sys/resource.h> // setrlimit (--limite-cpu, --limite-memoria)
+#include <linux/io_uring.h> // io_uring_setup, io_uring_enter (motor --io-uring)
+#include <zlib.h>       // deflate (salida comprimida)
+#include "protocolo.h"  // tramas del protocolo cliente/servidor
 //Librerías necesarias para sockets, manejo de strings, tiempo y señales.
 
-#define QLEN 2                  // Cola de conexiones pendientes (para listen)
+#define QLEN_POR_DEFECTO 128    // Cola de conexiones pendientes (para listen), configurable con --backlog
 #define BUFFER_SIZE 4096        // Tamaño del buffer para E/S de comandos y pipe
 #define MAX_TOKENS 64           // Máximo de argumentos para un comando
-#define CMD_EOF_MARKER "<CMD_EOF>" // Marcador para el fin de la salida de un comando (enviado al cliente)
+#define MAX_ETAPAS 8            // Máximo de etapas de una tubería (cmd1 | cmd2 | ...)
+#define MAX_EVENTOS 256         // Eventos atendidos por cada llamada a epoll_wait
+#define SALIDA_MAX_PENDIENTE (256 * 1024) // Bytes por enviar a partir de los cuales se deja de leer el pipe del hijo
+#define INTERVALO_RECOLECCION_MS 100      // Periodo para recolectar hijos cuando no se dispone de pidfd
+#define TAMANO_PIPE (1024 * 1024)         // Capacidad pedida para el pipe del hijo (F_SETPIPE_SZ)
+#define MAX_EJECUTORES 64                 // Máximo de procesos ejecutores (--ejecutores)
+#define MAX_FDS_ADJUNTOS 2                // Descriptores por petición a un ejecutor (pipe y directorio)
+#define SHELL_MARCA 32                    // Caracteres de la marca de fin de comando del modo shell
+#define MAX_CANALES 64                    // Canales por sesión
+#define COLA_MAX_PENDIENTE (1024 * 1024)  // Bytes de comandos en cola a partir de los cuales se deja de leer al cliente
 
 // Variable global para manejo de señales
 int fd_s = -1;
 
+// Descriptor del bucle de eventos
+static int fd_epoll = -1;
+
+// Descriptor de /dev/null que reciben los hijos como entrada estándar
+static int fd_dev_null = -1;
+
+// 1 mientras splice() funcione entre el pipe del hijo y el socket del cliente
+static int splice_disponible = 1;
+
+// 1 si las sesiones empiezan en modo shell (--shell)
+static int modo_shell_por_defecto = 0;
+
+// Motor io_uring (--io-uring), si las sesiones nuevas se leen con recv multishot y si
+// las tramas de datos salen por el anillo (send y splice enlazados)
+static int motor_uring = 0;
+static int uring_recv_activo = 0;
+static int uring_envio_activo = 0;
+
+// Límites de los comandos y de las sesiones (0: sin límite), ver "Límites de recursos"
+static int limite_tiempo_comando = 0;   // --tiempo-comando: segundos de reloj por comando
+static uint64_t limite_salida = 0;      // --salida-maxima: bytes de salida por comando
+static int limite_cpu = 0;              // --limite-cpu: segundos de CPU por proceso (RLIMIT_CPU)
+static uint64_t limite_memoria = 0;     // --limite-memoria: memoria virtual por proceso (RLIMIT_AS)
+static int limite_inactividad = 0;      // --inactividad: segundos sin actividad antes de cerrar una sesión
+
+/*
+ * Tipos de descriptores registrados en epoll. Cada registro apunta a una
+ * fuente_t, que indica qué descriptor disparó el evento y a qué sesión (y canal)
+ * pertenece.
+ */
+typedef enum {
+    FUENTE_ESCUCHA,
+    FUENTE_CLIENTE,
+    FUENTE_PIPE,
+    FUENTE_HIJO,    // pidfd del hijo: se vuelve legible cuando el hijo termina
+    FUENTE_EJECUTOR, // Socket hacia un proceso ejecutor
+    FUENTE_SHELL,   // Salida del shell persistente de un canal (modo shell)
+    FUENTE_RESOLUTOR, // eventfd del hilo de resolución de nombres
+    FUENTE_URING    // Anillo de io_uring: hay peticiones completadas (motor --io-uring)
+} tipo_fuente_t;
+
+typedef struct {
+    tipo_fuente_t tipo;
+    struct sesion *sesion;
+    struct canal *canal;    // Canal dueño del descriptor (pipe, pidfd o shell)
+    int indice;             // Número de ejecutor (FUENTE_EJECUTOR)
+} fuente_t;
+
+/*
+ * Buffer dinámico de entrada o salida: los datos entre 'inicio' y 'fin' están
+ * pendientes de procesar o de enviar.
+ */
+typedef struct {
+    char  *datos;
+    size_t inicio;
+    size_t fin;
+    size_t capacidad;
+} buffer_t;
+
+/*
+ * Temporizador de la rueda (ver "Temporizadores"). Como fuente_t, indica a quién
+ * pertenece: al comando en curso de un canal o a una sesión.
+ */
+typedef enum {
+    TEMPORIZADOR_COMANDO,     // --tiempo-comando del comando en curso de un canal
+    TEMPORIZADOR_INACTIVIDAD  // --inactividad de una sesión
+} tipo_temporizador_t;
+
+typedef struct temporizador {
+    tipo_temporizador_t tipo;
+    struct sesion *sesion;
+    struct canal *canal;
+    uint64_t vence;             // Instante (ns, CLOCK_MONOTONIC) en que vence
+    int ranura;                 // Ranura de la rueda que lo contiene (-1: sin programar)
+    struct temporizador *sig;
+    struct temporizador *ant;
+} temporizador_t;
+
+/*
+ * Estados de cada sesión y de cada uno de sus canales.
+ */
+typedef enum {
+    SESION_ACTIVA,            // Recibiendo y atendiendo comandos en sus canales
+    SESION_CERRANDO           // Se envía lo pendiente y después se cierra la conexión
+} estado_sesion_t;
+
+typedef enum {
+    CANAL_ESPERANDO_COMANDO,  // Libre: el siguiente comando del canal se atiende al llegar
+    CANAL_EJECUTANDO          // Un hijo está ejecutando el comando y su salida se reenvía;
+                              // tras cerrar su salida se espera su código de salida
+} estado_canal_t;
+
+/*
+ * Límite por el que se terminó el comando en curso de un canal.
+ */
+typedef enum {
+    CORTE_NINGUNO,
+    CORTE_TIEMPO,             // --tiempo-comando
+    CORTE_SALIDA              // --salida-maxima
+} corte_t;
+
+/*
+ * Cómo se atendió un comando (para las métricas).
+ */
+typedef enum {
+    TIPO_PROCESO,   // Lanzado como proceso (fork o ejecutor)
+    TIPO_INTERNO,   // Comando interno del servidor
+    TIPO_SHELL,     // Escrito en el shell persistente del canal
+    TIPO_CACHE,     // Respondido desde la caché, o con la salida de la misma petición en curso
+    TIPO_TRANSFERENCIA, // Descarga o subida de un trozo de archivo (TRAMA_DESCARGA, TRAMA_SUBIDA)
+    TIPO_OTRO,      // Comandos reservados (__shell, __stats) y errores antes de ejecutar
+    NUM_TIPOS
+} tipo_comando_t;
+
+/*
+ * Compresión de la respuesta en curso de un canal (ver enviar_datos).
+ */
+typedef enum {
+    COMPRESION_NO_INICIADA,   // La salida va sin comprimir mientras sea corta
+    COMPRESION_ACTIVA,        // Flujo deflate abierto: la salida va en TRAMA_DATOS_Z
+    COMPRESION_DESCARTADA     // No comprimía lo suficiente: el resto va sin comprimir
+} estado_compresion_t;
+
+/*
+ * Canal lógico de una sesión (campo 'canal' de las tramas). Cada canal ejecuta un
+ * comando a la vez y los distintos canales de una sesión, en paralelo; los comandos
+ * que llegan mientras el canal está ocupado esperan en 'cola'.
+ */
+typedef struct canal {
+    struct sesion *sesion;
+    uint16_t num;               // Número de canal
+    estado_canal_t estado;
+    fuente_t f_pipe;            // Registro en epoll del pipe del hijo
+    fuente_t f_hijo;            // Registro en epoll del pidfd del hijo
+    fuente_t f_shell;           // Registro en epoll de fd_shell_salida
+    int pipe_pausado;           // 1 si se dejó de leer el pipe (salida pendiente o ventana agotada)
+    int fd_pipe;                // Extremo de lectura del pipe del hijo (-1 si no hay)
+    int fd_hijo;                // pidfd del hijo mientras se espera que termine (-1 si no hay)
+    int sondeo_hijo;            // 1 si el hijo se recolecta por sondeo (sin pidfd)
+    int por_ejecutor;           // 1 si el comando actual lo lanzó un ejecutor
+    int ranura;                 // Ranura que espera el código de salida del ejecutor (-1 si ya llegó)
+    int32_t estado_salida_hijo; // Código de salida recibido del ejecutor antes de cerrar la salida
+    pid_t pid_hijo;             // Hijo que ejecuta el comando actual
+    temporizador_t limite;      // Vence a los --tiempo-comando segundos del lanzamiento
+    corte_t corte;              // Límite que obligó a terminar el comando actual
+    uint32_t id_peticion;       // Id de la trama de comando que se está atendiendo
+    ssize_t bytes_respuesta;    // Bytes de datos del comando enviados en la respuesta actual
+    int64_t ventana;            // Bytes de datos que aún se pueden enviar (control de flujo)
+    buffer_t cola;              // Comandos recibidos mientras el canal estaba ocupado
+    int procesando_cola;        // 1 mientras procesar_cola atiende la cola
+    int *cat_fds;               // Archivos del 'cat' interno en curso (NULL si no hay)
+    int cat_num;
+    int cat_actual;             // Archivo que se está enviando
+    off_t cat_offset;           // Posición dentro de ese archivo
+    off_t cat_fin;              // Fin del rango a enviar de ese archivo (-1: hasta el final)
+    int32_t cat_estado;         // Código de salida del 'cat' (o errno de la descarga)
+    int cat_solo_suma;          // 1 si el rango sólo se suma, sin enviarlo (PROTO_SOLO_SUMA)
+    pid_t pid_shell;            // Shell del canal en modo shell (-1 si no hay)
+    int fd_shell_entrada;       // Pipe hacia la entrada del shell
+    int fd_shell_salida;        // Pipe desde la salida (y los errores) del shell
+    int shell_pausado;          // 1 si se dejó de leer el shell (salida pendiente o ventana agotada)
+    int shell_ocupado;          // 1 mientras se espera la marca del comando en curso
+    char shell_marca[SHELL_MARCA + 1];
+    char shell_cola[SHELL_MARCA + 32]; // Final de la última lectura, retenido por si es parte de la marca
+    size_t shell_cola_len;
+    tipo_comando_t tipo_comando; // Cómo se atiende el comando actual
+    uint64_t t_llegada;         // Instantes (ns, CLOCK_MONOTONIC) de las fases del comando actual;
+    uint64_t t_inicio;          // 0 si la fase no ocurrió (ver metricas_fin_comando)
+    uint64_t t_lanzado;
+    uint64_t t_primer_byte;
+    uint64_t t_salida_cerrada;
+    estado_compresion_t compresion;
+    z_stream *z;                // Compresor del canal (se crea con la primera respuesta comprimida)
+    struct entrada_cache *grabacion;  // Entrada de la caché que espera la respuesta en curso (NULL si no)
+    int grabando;               // 1 mientras esa respuesta se copia en la entrada
+    struct entrada_cache *respuesta_cache; // Entrada cuya salida se está enviando (NULL si no)
+    size_t cache_enviado;       // Bytes de esa salida ya enviados
+    struct entrada_cache *espera_cache; // Entrada en curso cuya respuesta espera el canal (NULL si no)
+    struct canal *sig_espera;   // Siguiente canal que espera la misma entrada
+    int subida;                 // 1 si la transferencia en curso es una subida
+    int fd_subida;              // Archivo que recibe la subida en curso (-1 si no hay)
+    off_t subida_offset;        // Posición del siguiente byte que llegue
+    uint64_t subida_restante;   // Bytes de la subida que faltan por llegar
+    int32_t subida_error;       // errno del primer error al escribir (0 si no hubo)
+    uint64_t transferencia_tamano; // Resumen de la transferencia en curso (trama de fin)
+    uint64_t transferencia_bytes;
+    uLong transferencia_crc;
+} canal_t;
+
+typedef struct sesion {
+    unsigned long id;           // Número de sesión (para los logs)
+    int fd;                     // Socket del cliente
+    estado_sesion_t estado;
+    fuente_t f_cliente;         // Registro en epoll del socket
+    uint32_t eventos_cliente;   // Eventos pedidos actualmente para el socket
+    size_t splice_restante;     // Bytes de la trama de datos en curso que faltan por pasar del pipe al socket
+    size_t envio_restante;      // Bytes de la trama en curso que faltan por pasar con sendfile()
+    canal_t *canal_carga;       // Canal dueño de esa trama (NULL si no hay ninguna a medias)
+    buffer_t diferida;          // Tramas de otros canales generadas mientras se completa esa carga
+    int fd_dir;                 // Directorio de trabajo de la sesión (-1: el del servidor)
+    int fd_dir_anterior;        // Directorio anterior, para 'cd -' (-1 si no hay)
+    int procesando_entrada;     // 1 mientras procesar_entrada recorre el buffer de entrada
+    int modo_shell;             // 1 si los comandos se ejecutan en el shell persistente del canal
+    int compresion;             // 1 si el cliente activó PROTO_CAP_ZLIB (salida comprimida)
+    size_t bytes_en_cola;       // Bytes de comandos esperando en las colas de los canales
+    int subidas_activas;        // Canales recibiendo una subida (el socket se lee en porciones grandes)
+    uint64_t t_recepcion;       // Instante del último recv(): llegada de las tramas que trajo
+    uint64_t t_actividad;       // Último recv() o fin de comando (para --inactividad)
+    temporizador_t inactividad; // Vence tras --inactividad segundos sin actividad
+    struct in_addr dir_cliente; // Dirección del cliente
+    int esperando_nombre;       // 1 mientras se resuelve el nombre del cliente (para el log)
+    int lectura_uring;          // 1 si el socket se lee con recv multishot de io_uring, no con EPOLLIN
+    int recv_uring;             // 1 mientras ese recv está armado (la sesión no se libera hasta que acabe)
+    int recv_cancelado;         // 1 si ya se pidió cancelarlo
+    int trama_uring;            // Peticiones de la trama de datos en curso aún en el anillo (ver uring_enviar_trama)
+    size_t cabecera_enviada;    // Bytes de esa cabecera que ya salieron
+    int socket_lleno;           // 1 si el splice de su carga encontró el socket lleno (EAGAIN)
+    uint8_t cabecera_uring[PROTO_CABECERA]; // La cabecera, que el kernel lee al enviarla
+    canal_t *canales[MAX_CANALES]; // Canales usados por el cliente (NULL si no)
+    buffer_t entrada;           // Bytes recibidos del cliente aún sin procesar
+    buffer_t salida;            // Datos pendientes de enviar al cliente
+    struct sesion *sig;         // Lista de sesiones activas
+    struct sesion *ant;
+} sesion_t;
+
+static fuente_t f_escucha = { FUENTE_ESCUCHA, NULL, NULL, 0 };
+static sesion_t *sesiones = NULL;          // Sesiones activas
+static sesion_t *sesiones_cerradas = NULL; // Sesiones por liberar al terminar la iteración
+static unsigned long siguiente_id_sesion = 1;
+static unsigned long paso_id_sesion = 1;     // Con --workers, cada worker numera con su propio desfase
+static int num_worker = -1;                  // Número de este worker (-1 sin --workers)
+static int num_workers = 0;
+static int sesiones_sin_pidfd = 0;         // Canales cuyo hijo se recolecta por sondeo
+static int sumas_pendientes = 0;           // Canales con un PROTO_SOLO_SUMA a medias (ver avanzar_suma)
+
+// Hijos cuya sesión ya terminó pero que aún no han sido recolectados
+static pid_t *hijos_pendientes = NULL;
+static size_t num_hijos_pendientes = 0;
+static size_t cap_hijos_pendientes = 0;
+
+/*
+ * Registro de eventos (log).
+ * El bucle no da formato a sus mensajes: registrar() copia en un registro de tamaño
+ * fijo (hora, nivel, sesión, errno, el formato y sus argumentos en binario) dentro de
+ * un anillo que vacía el hilo de registro. El hilo da formato al mensaje, a la hora y
+ * al nivel, o a una línea JSON por registro con --log-json, y escribe en lotes, con
+ * un write() por destino. Los formatos son siempre literales (ver el atributo format
+ * de registrar), así que basta con guardar su dirección. Sólo el hilo del
+ * bucle registra y sólo el hilo de registro lee, así que el anillo se coordina con
+ * dos contadores atómicos, sin cerrojos.
+ * registrar() nunca espera. Si el anillo está lleno, el registro se descarta y se
+ * cuenta. Con --log-limite N, los mensajes informativos que pasan de N por segundo se
+ * suprimen y también se cuentan; los errores y avisos no se suprimen nunca. Los dos
+ * contadores aparecen en '__stats' y en las métricas, y el hilo los informa en el
+ * propio log cuando crecen. Mientras el hilo no está en marcha (al arrancar, en el
+ * supervisor de los workers) los mensajes se escriben en el acto.
+ */
+#define REGISTRO_TEXTO 224              // Bytes del mensaje y de los argumentos de un registro (se truncan)
+#define REGISTROS_ANILLO 8192           // Registros del anillo (potencia de 2)
+#define REGISTRO_LOTE (64 * 1024)       // Bytes formateados que se acumulan antes de escribir
+#define REGISTRO_LINEA 4096             // Máximo de una línea formateada (JSON con escapes)
+#define REGISTRO_ESPERA_MS 1000         // Espera máxima del hilo sin registros nuevos
+
+typedef enum { NIVEL_ERROR, NIVEL_AVISO, NIVEL_INFO, NUM_NIVELES } nivel_registro_t;
+
+static const char *nombres_niveles[NUM_NIVELES] = { "error", "aviso", "info" };
+
+typedef struct {
+    struct timespec hora;       // CLOCK_REALTIME
+    unsigned long sesion;       // 0: mensaje del servidor
+    int error;                  // errno que se muestra tras el mensaje (0: ninguno)
+    uint16_t largo;             // Bytes usados de 'argumentos'
+    uint8_t nivel;
+    const char *formato;
+    char argumentos[REGISTRO_TEXTO]; // Valores de las conversiones del formato, en orden (ver empaquetar_argumentos)
+} registro_t;
+
+static struct {
+    registro_t *anillo;
+    char *lotes[2];             // Líneas formateadas para stdout y stderr, que el hilo escribe juntas
+    atomic_size_t escritos;     // Registros publicados por el bucle...
+    atomic_size_t leidos;       // ... y los ya formateados por el hilo
+    atomic_int durmiendo;       // 1 si el hilo espera en 'fd_aviso'
+    atomic_int terminar;
+    int fd_aviso;               // eventfd: el bucle despierta al hilo
+    int activo;                 // 1 con el hilo en marcha
+    pthread_t hilo;
+    nivel_registro_t nivel;     // --log-nivel: se ignoran los mensajes de nivel mayor
+    int json;                   // --log-json
+    int limite;                 // --log-limite: mensajes informativos por segundo (0: sin límite)
+    time_t segundo;             // Segundo en curso y mensajes informativos dentro de él
+    int en_segundo;
+    atomic_uint_fast64_t descartados; // Anillo lleno
+    atomic_uint_fast64_t suprimidos;  // Por encima de --log-limite
+} registro = { .fd_aviso = -1, .nivel = NIVEL_INFO };
+
+static void escribir_fd(int fd, const char *datos, size_t n) {
+    while (n > 0) {
+        ssize_t r = write(fd, datos, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return;
+        datos += r;
+        n -= r;
+    }
+}
+
+/*
+ * Copia 'n' bytes de 'texto' en 'destino' como contenido de una cadena JSON.
+ * Devuelve los bytes escritos ('destino' debe admitir 6 por cada uno de 'texto').
+ */
+static size_t escapar_json(char *destino, const char *texto, size_t n) {
+    char *p = destino;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = (unsigned char) texto[i];
+        if (c == '"' || c == '\\') { *p++ = '\\'; *p++ = (char) c; }
+        else if (c == '\n') { *p++ = '\\'; *p++ = 'n'; }
+        else if (c == '\t') { *p++ = '\\'; *p++ = 't'; }
+        else if (c < 0x20) p += sprintf(p, "\\u%04x", c);
+        else *p++ = (char) c;
+    }
+    return (size_t) (p - destino);
+}
+
+/*
+ * Tipo del argumento que consume una conversión de printf.
+ */
+typedef enum {
+    ARG_NINGUNO, ARG_INT, ARG_LONG, ARG_LLONG, ARG_SIZE, ARG_INTMAX, ARG_PTRDIFF,
+    ARG_DOUBLE, ARG_LDOUBLE, ARG_PUNTERO, ARG_TEXTO
+} tipo_argumento_t;
+
+typedef struct {
+    const char *fin;            // Primer carácter tras la conversión
+    int ancho_arg;              // 1 si el ancho es '*': un int antes del valor
+    int precision_arg;          // Lo mismo para la precisión
+    int precision;              // Precisión escrita en el formato (-1: ninguna)
+    tipo_argumento_t tipo;
+} conversion_t;
+
+/*
+ * Analiza la conversión de printf que empieza en 'p' (tras el '%').
+ */
+static void leer_conversion(const char *p, conversion_t *cv) {
+    cv->ancho_arg = cv->precision_arg = 0;
+    cv->precision = -1;
+    cv->tipo = ARG_NINGUNO;
+    while (*p != '\0' && strchr("-+ #0'", *p) != NULL) p++;
+    if (*p == '*') {
+        cv->ancho_arg = 1;
+        p++;
+    }
+    while (isdigit((unsigned char) *p)) p++;
+    if (*p == '.') {
+        p++;
+        cv->precision = 0;
+        if (*p == '*') {
+            cv->precision_arg = 1;
+            p++;
+        }
+        while (isdigit((unsigned char) *p)) cv->precision = cv->precision * 10 + (*p++ - '0');
+    }
+    tipo_argumento_t entero = ARG_INT, real = ARG_DOUBLE;
+    if (p[0] == 'h') p += p[1] == 'h' ? 2 : 1;
+    else if (p[0] == 'l' && p[1] == 'l') { entero = ARG_LLONG; p += 2; }
+    else if (p[0] == 'l') { entero = ARG_LONG; p++; }
+    else if (p[0] == 'L') { real = ARG_LDOUBLE; p++; }
+    else if (p[0] == 'z') { entero = ARG_SIZE; p++; }
+    else if (p[0] == 'j') { entero = ARG_INTMAX; p++; }
+    else if (p[0] == 't') { entero = ARG_PTRDIFF; p++; }
+    if (*p == '\0') {
+        cv->fin = p;
+        return;
+    }
+    if (strchr("diouxXc", *p) != NULL) cv->tipo = entero;
+    else if (strchr("eEfFgGaA", *p) != NULL) cv->tipo = real;
+    else if (*p == 's') cv->tipo = ARG_TEXTO;
+    else if (*p == 'p') cv->tipo = ARG_PUNTERO;
+    cv->fin = p + 1;
+}
+
+static int guardar_argumento(char *datos, size_t *n, const void *valor, size_t largo) {
+    if (*n + largo > REGISTRO_TEXTO) return -1;
+    memcpy(datos + *n, valor, largo);
+    *n += largo;
+    return 0;
+}
+
+#define GUARDAR_ARGUMENTO(tipo) do {                                                        \
+        tipo valor_ = va_arg(ap, tipo);                                                     \
+        if (guardar_argumento(datos, &n, &valor_, sizeof(valor_)) == -1) return n;          \
+    } while (0)
+
+/*
+ * Copia en 'datos' (REGISTRO_TEXTO bytes) los argumentos de 'formato', tal como se
+ * pasaron y en su orden; los textos se copian enteros, terminados en '\0', porque
+ * pueden no existir cuando el hilo los lea. Lo que no cabe se descarta y el mensaje
+ * se trunca en ese punto. Devuelve los bytes usados.
+ */
+static size_t empaquetar_argumentos(char *datos, const char *formato, va_list ap) {
+    size_t n = 0;
+    for (const char *p = strchr(formato, '%'); p != NULL; p = strchr(p, '%')) {
+        conversion_t cv;
+        leer_conversion(p + 1, &cv);
+        p = cv.fin;
+        if (cv.ancho_arg) GUARDAR_ARGUMENTO(int);
+        if (cv.precision_arg) {
+            int precision = va_arg(ap, int);
+            if (guardar_argumento(datos, &n, &precision, sizeof(precision)) == -1) return n;
+            cv.precision = precision;
+        }
+        switch (cv.tipo) {
+        case ARG_NINGUNO: break;
+        case ARG_INT: GUARDAR_ARGUMENTO(int); break;
+        case ARG_LONG: GUARDAR_ARGUMENTO(long); break;
+        case ARG_LLONG: GUARDAR_ARGUMENTO(long long); break;
+        case ARG_SIZE: GUARDAR_ARGUMENTO(size_t); break;
+        case ARG_INTMAX: GUARDAR_ARGUMENTO(intmax_t); break;
+        case ARG_PTRDIFF: GUARDAR_ARGUMENTO(ptrdiff_t); break;
+        case ARG_DOUBLE: GUARDAR_ARGUMENTO(double); break;
+        case ARG_LDOUBLE: GUARDAR_ARGUMENTO(long double); break;
+        case ARG_PUNTERO: GUARDAR_ARGUMENTO(void *); break;
+        case ARG_TEXTO: {
+            const char *texto = va_arg(ap, const char *);
+            if (texto == NULL) texto = "(null)";
+            size_t largo = cv.precision >= 0 ? strnlen(texto, (size_t) cv.precision) : strlen(texto);
+            if (n >= REGISTRO_TEXTO) return n;
+            if (largo > REGISTRO_TEXTO - n - 1) largo = REGISTRO_TEXTO - n - 1;
+            memcpy(datos + n, texto, largo);
+            datos[n + largo] = '\0';
+            n += largo + 1;
+            break;
+        }
+        }
+    }
+    return n;
+}
+
+static int leer_argumento(const registro_t *r, size_t *leido, void *valor, size_t largo) {
+    if (*leido + largo > r->largo) return -1;
+    memcpy(valor, r->argumentos + *leido, largo);
+    *leido += largo;
+    return 0;
+}
+
+#define ESCRIBIR_ARGUMENTO(tipo) do {                                                       \
+        tipo valor_;                                                                        \
+        if (leer_argumento(r, &leido, &valor_, sizeof(valor_)) == -1) return n;             \
+        w = snprintf(texto + n, REGISTRO_TEXTO - n, especificacion, valor_);                \
+    } while (0)
+
+/*
+ * Escribe en 'texto' (REGISTRO_TEXTO bytes) el mensaje del registro: su formato con
+ * los argumentos guardados. Cada conversión se pasa a snprintf() por separado, con
+ * los '*' ya reemplazados por sus valores. Devuelve la longitud del mensaje.
+ */
+static size_t expandir_mensaje(const registro_t *r, char *texto) {
+    size_t n = 0, leido = 0;
+    const char *p = r->formato;
+    while (*p != '\0' && n < REGISTRO_TEXTO - 1) {
+        if (*p != '%') {
+            texto[n++] = *p++;
+            continue;
+        }
+        conversion_t cv;
+        leer_conversion(p + 1, &cv);
+        char especificacion[64];
+        size_t e = 0;
+        for (const char *q = p; q < cv.fin && e < sizeof(especificacion) - 16; q++) {
+            if (*q != '*') {
+                especificacion[e++] = *q;
+                continue;
+            }
+            int valor;
+            if (leer_argumento(r, &leido, &valor, sizeof(valor)) == -1) return n;
+            if (q[-1] == '.' && valor < 0) e--; // Precisión negativa: como si no la hubiera
+            else e += (size_t) sprintf(especificacion + e, "%d", valor);
+        }
+        especificacion[e] = '\0';
+        p = cv.fin;
+        int w = 0;
+        switch (cv.tipo) {
+        case ARG_NINGUNO:
+            if (p[-1] == '%') w = snprintf(texto + n, REGISTRO_TEXTO - n, "%%");
+            break;
+        case ARG_INT: ESCRIBIR_ARGUMENTO(int); break;
+        case ARG_LONG: ESCRIBIR_ARGUMENTO(long); break;
+        case ARG_LLONG: ESCRIBIR_ARGUMENTO(long long); break;
+        case ARG_SIZE: ESCRIBIR_ARGUMENTO(size_t); break;
+        case ARG_INTMAX: ESCRIBIR_ARGUMENTO(intmax_t); break;
+        case ARG_PTRDIFF: ESCRIBIR_ARGUMENTO(ptrdiff_t); break;
+        case ARG_DOUBLE: ESCRIBIR_ARGUMENTO(double); break;
+        case ARG_LDOUBLE: ESCRIBIR_ARGUMENTO(long double); break;
+        case ARG_PUNTERO: ESCRIBIR_ARGUMENTO(void *); break;
+        case ARG_TEXTO: {
+            const char *valor = r->argumentos + leido;
+            const char *fin = memchr(valor, '\0', r->largo > leido ? r->largo - leido : 0);
+            if (fin == NULL) return n;
+            leido += (size_t) (fin - valor) + 1;
+            w = snprintf(texto + n, REGISTRO_TEXTO - n, especificacion, valor);
+            break;
+        }
+        }
+        if (w > 0) n += (size_t) w < REGISTRO_TEXTO - n ? (size_t) w : REGISTRO_TEXTO - 1 - n;
+    }
+    return n;
+}
+
+/*
+ * Da formato a un registro, terminado en '\n'. La fecha se calcula una vez por
+ * segundo: localtime_r() es lo más caro del formato.
+ */
+static size_t formatear_registro(const registro_t *r, char *linea) {
+    static time_t segundo = -1;
+    static char fecha[40], zona[8];
+    if (r->hora.tv_sec != segundo) {
+        struct tm tm;
+        segundo = r->hora.tv_sec;
+        localtime_r(&segundo, &tm);
+        strftime(fecha, sizeof(fecha), registro.json ? "%Y-%m-%dT%H:%M:%S" : "%Y-%m-%d %H:%M:%S", &tm);
+        strftime(zona, sizeof(zona), "%z", &tm);
+    }
+    int ms = (int) (r->hora.tv_nsec / 1000000);
+    char texto[REGISTRO_TEXTO];
+    size_t largo = expandir_mensaje(r, texto);
+    char buf_error[128];
+    // strerror_r de GNU (por _GNU_SOURCE): devuelve el texto, que puede no estar en buf_error
+    const char *descripcion = r->error != 0 ? strerror_r(r->error, buf_error, sizeof(buf_error)) : "";
+    char *p = linea;
+
+    if (registro.json) {
+        p += sprintf(p, "{\"hora\":\"%s.%03d%s\",\"nivel\":\"%s\"", fecha, ms, zona, nombres_niveles[r->nivel]);
+        if (r->sesion != 0) p += sprintf(p, ",\"sesion\":%lu", r->sesion);
+        if (num_worker >= 0) p += sprintf(p, ",\"worker\":%d", num_worker);
+        p += sprintf(p, ",\"mensaje\":\"");
+        p += escapar_json(p, texto, largo);
+        *p++ = '"';
+        if (r->error != 0) {
+            p += sprintf(p, ",\"errno\":%d,\"error\":\"", r->error);
+            p += escapar_json(p, descripcion, strlen(descripcion));
+            *p++ = '"';
+        }
+        p += sprintf(p, "}\n");
+        return (size_t) (p - linea);
+    }
+    static const char *etiquetas[NUM_NIVELES] = { "ERROR", "AVISO", "INFO" };
+    p += sprintf(p, "%s.%03d %-5s ", fecha, ms, etiquetas[r->nivel]);
+    if (r->sesion != 0) p += sprintf(p, "[#%lu] ", r->sesion);
+    else p += sprintf(p, "[SERVIDOR] ");
+    memcpy(p, texto, largo);
+    p += largo;
+    if (r->error != 0) p += sprintf(p, ": %s", descripcion);
+    *p++ = '\n';
+    return (size_t) (p - linea);
+}
+
+/*
+ * Destino de un registro: en texto, los errores y avisos van a stderr como antes; en
+ * JSON todo va a stdout, para que sea un solo flujo de líneas.
+ */
+static int destino_registro(const registro_t *r) {
+    return !registro.json && r->nivel <= NIVEL_AVISO ? STDERR_FILENO : STDOUT_FILENO;
+}
+
+static void registrar_v(nivel_registro_t nivel, unsigned long sesion, int error, const char *formato, va_list ap) {
+    if (nivel > registro.nivel) return;
+    struct timespec hora;
+    clock_gettime(CLOCK_REALTIME, &hora);
+    if (nivel == NIVEL_INFO && registro.limite > 0) {
+        if (hora.tv_sec != registro.segundo) {
+            registro.segundo = hora.tv_sec;
+            registro.en_segundo = 0;
+        }
+        if (++registro.en_segundo > registro.limite) {
+            atomic_fetch_add_explicit(&registro.suprimidos, 1, memory_order_relaxed);
+            return;
+        }
+    }
+
+    registro_t local, *r = &local;
+    size_t escritos = atomic_load_explicit(&registro.escritos, memory_order_relaxed);
+    if (registro.activo) {
+        if (escritos - atomic_load_explicit(&registro.leidos, memory_order_acquire) >= REGISTROS_ANILLO) {
+            atomic_fetch_add_explicit(&registro.descartados, 1, memory_order_relaxed);
+            return;
+        }
+        r = &registro.anillo[escritos & (REGISTROS_ANILLO - 1)];
+    }
+    r->hora = hora;
+    r->sesion = sesion;
+    r->error = error;
+    r->nivel = (uint8_t) nivel;
+    r->formato = formato;
+    r->largo = (uint16_t) empaquetar_argumentos(r->argumentos, formato, ap);
+
+    if (!registro.activo) {
+        // Sin hilo: se escribe ya, por stdio para respetar el orden con los printf del arranque
+        char linea[REGISTRO_LINEA];
+        size_t largo = formatear_registro(r, linea);
+        FILE *f = destino_registro(r) == STDERR_FILENO ? stderr : stdout;
+        fwrite(linea, 1, largo, f);
+        if (f == stdout) fflush(stdout);
+        return;
+    }
+    atomic_store_explicit(&registro.escritos, escritos + 1, memory_order_release);
+    // Despertar al hilo sólo si está dormido: con el hilo ocupado no hay llamadas al sistema
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&registro.durmiendo, memory_order_relaxed) && atomic_exchange(&registro.durmiendo, 0)) {
+        uint64_t uno = 1;
+        while (write(registro.fd_aviso, &uno, sizeof(uno)) < 0 && errno == EINTR) { }
+    }
+}
+
+static void registrar(nivel_registro_t nivel, unsigned long sesion, const char *formato, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void registrar(nivel_registro_t nivel, unsigned long sesion, const char *formato, ...) {
+    va_list ap;
+    va_start(ap, formato);
+    registrar_v(nivel, sesion, 0, formato, ap);
+    va_end(ap);
+}
+
+/*
+ * Como perror(): un error con la descripción de errno.
+ */
+static void registrar_errno(unsigned long sesion, const char *formato, ...) __attribute__((format(printf, 2, 3)));
+
+static void registrar_errno(unsigned long sesion, const char *formato, ...) {
+    int error = errno;
+    va_list ap;
+    va_start(ap, formato);
+    registrar_v(NIVEL_ERROR, sesion, error, formato, ap);
+    va_end(ap);
+    errno = error;
+}
+
+/*
+ * Agrega al lote del destino de 'r' su línea, y escribe el lote si se llenó.
+ */
+static void agregar_al_lote(const registro_t *r, char *lotes[2], size_t largos[2]) {
+    int d = destino_registro(r) == STDERR_FILENO;
+    int fd = d ? STDERR_FILENO : STDOUT_FILENO;
+    largos[d] += formatear_registro(r, lotes[d] + largos[d]);
+    if (largos[d] >= REGISTRO_LOTE) {
+        escribir_fd(fd, lotes[d], largos[d]);
+        largos[d] = 0;
+    }
+}
+
+static void *hilo_registro(void *arg) {
+    (void) arg;
+    char **lotes = registro.lotes;
+    size_t largos[2] = { 0, 0 };
+    uint64_t descartados_informados = 0, suprimidos_informados = 0;
+
+    while (1) {
+        size_t leidos = atomic_load_explicit(&registro.leidos, memory_order_relaxed);
+        size_t escritos = atomic_load_explicit(&registro.escritos, memory_order_acquire);
+        for (; leidos != escritos; leidos++) {
+            agregar_al_lote(&registro.anillo[leidos & (REGISTROS_ANILLO - 1)], lotes, largos);
+            atomic_store_explicit(&registro.leidos, leidos + 1, memory_order_release);
+        }
+
+        uint64_t descartados = atomic_load_explicit(&registro.descartados, memory_order_relaxed);
+        uint64_t suprimidos = atomic_load_explicit(&registro.suprimidos, memory_order_relaxed);
+        if (descartados != descartados_informados || suprimidos != suprimidos_informados) {
+            registro_t r = { .sesion = 0, .nivel = NIVEL_AVISO, .formato = "Registros perdidos: %llu descartados "
+                             "(anillo lleno), %llu suprimidos (--log-limite)" };
+            unsigned long long cuentas[2] = { descartados - descartados_informados, suprimidos - suprimidos_informados };
+            clock_gettime(CLOCK_REALTIME, &r.hora);
+            memcpy(r.argumentos, cuentas, sizeof(cuentas));
+            r.largo = sizeof(cuentas);
+            agregar_al_lote(&r, lotes, largos);
+            descartados_informados = descartados;
+            suprimidos_informados = suprimidos;
+        }
+        for (int d = 0; d < 2; d++) {
+            if (largos[d] > 0) escribir_fd(d ? STDERR_FILENO : STDOUT_FILENO, lotes[d], largos[d]);
+            largos[d] = 0;
+        }
+        if (atomic_load(&registro.terminar) && leidos == atomic_load(&registro.escritos)) break;
+
+        // Dormir hasta el próximo registro; se vuelve a mirar el anillo tras anunciarlo
+        atomic_store(&registro.durmiendo, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&registro.escritos, memory_order_relaxed) == leidos && !atomic_load(&registro.terminar)) {
+            struct pollfd pfd = { .fd = registro.fd_aviso, .events = POLLIN };
+            uint64_t avisos;
+            if (poll(&pfd, 1, REGISTRO_ESPERA_MS) > 0) read(registro.fd_aviso, &avisos, sizeof(avisos));
+        }
+        atomic_store(&registro.durmiendo, 0);
+    }
+    return NULL;
+}
+
+/*
+ * Arranca el hilo de registro, con el anillo y los lotes ya reservados. Si no se puede
+ * (tampoco por falta de memoria), los mensajes se siguen escribiendo en el acto.
+ */
+static void iniciar_registro(void) {
+    registro.anillo = malloc(REGISTROS_ANILLO * sizeof(registro_t));
+    registro.lotes[0] = malloc(REGISTRO_LOTE + REGISTRO_LINEA);
+    registro.lotes[1] = malloc(REGISTRO_LOTE + REGISTRO_LINEA);
+    registro.fd_aviso = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fflush(NULL); // Lo escrito con printf durante el arranque sale antes que el hilo
+    if (registro.anillo != NULL && registro.lotes[0] != NULL && registro.lotes[1] != NULL &&
+        registro.fd_aviso != -1) {
+        // El hilo no debe recibir las señales del servidor (SIGINT, SIGTERM...)
+        sigset_t todas, anteriores;
+        sigfillset(&todas);
+        pthread_sigmask(SIG_BLOCK, &todas, &anteriores);
+        int r = pthread_create(&registro.hilo, NULL, hilo_registro, NULL);
+        pthread_sigmask(SIG_SETMASK, &anteriores, NULL);
+        if (r == 0) {
+            registro.activo = 1;
+            return;
+        }
+        errno = r;
+    }
+    registrar_errno(0, "No se pudo iniciar el hilo de registro, los mensajes se escriben directamente");
+    free(registro.anillo);
+    free(registro.lotes[0]);
+    free(registro.lotes[1]);
+    registro.anillo = NULL;
+    registro.lotes[0] = registro.lotes[1] = NULL;
+}
+
+/*
+ * Espera a que el hilo escriba todo lo registrado y lo termina.
+ */
+static void terminar_registro(void) {
+    if (!registro.activo) return;
+    atomic_store(&registro.terminar, 1);
+    uint64_t uno = 1;
+    while (write(registro.fd_aviso, &uno, sizeof(uno)) < 0 && errno == EINTR) { }
+    pthread_join(registro.hilo, NULL);
+    registro.activo = 0;
+    free(registro.lotes[0]);
+    free(registro.lotes[1]);
+    registro.lotes[0] = registro.lotes[1] = NULL;
+}
+
+/*
+ * Métricas.
+ * Cada comando se divide en fases, medidas con CLOCK_MONOTONIC en su canal:
+ *  - espera:      de la recepción de la trama a que el canal empieza a atenderlo
+ *                 (incluye el tiempo en la cola del canal);
+ *  - lanzamiento: fork() o el envío al ejecutor, hasta tener el pipe registrado;
+ *  - primer_byte: del lanzamiento (o de la escritura en el shell) al primer byte de salida;
+ *  - transmision: del primer byte al cierre de la salida (o a la marca del shell);
+ *  - espera_hijo: del cierre de la salida al código de salida (waitpid o ejecutor);
+ *  - total:       de la recepción de la trama a la trama de fin.
+ * El servidor atiende todo desde un solo hilo, así que los contadores son variables
+ * simples, sin cerrojos. Se consultan con el comando reservado '__stats' y, con
+ * --metricas, se escriben periódicamente en el formato de texto de Prometheus.
+ */
+#define METRICAS_CUBETAS 28              // Cubeta i: hasta 2^i µs (la última no tiene límite)
+#define INTERVALO_METRICAS_POR_DEFECTO 10 // Segundos entre escrituras del archivo de métricas
+
+typedef enum {
+    FASE_ESPERA,
+    FASE_LANZAMIENTO,
+    FASE_PRIMER_BYTE,
+    FASE_TRANSMISION,
+    FASE_ESPERA_HIJO,
+    FASE_TOTAL,
+    NUM_FASES
+} fase_t;
+
+static const char *nombres_fases[NUM_FASES] = {
+    "espera", "lanzamiento", "primer_byte", "transmision", "espera_hijo", "total"
+};
+static const char *nombres_tipos[NUM_TIPOS] = { "proceso", "interno", "shell", "cache", "transferencia", "otro" };
+
+typedef struct {
+    uint64_t cubetas[METRICAS_CUBETAS];
+    uint64_t n;
+    uint64_t suma_ns;
+    uint64_t max_ns;
+} hist_fase_t;
+
+static struct {
+    hist_fase_t fases[NUM_FASES];
+    uint64_t comandos[NUM_TIPOS];   // Comandos terminados, por tipo
+    uint64_t salida_cero;           // Códigos de salida de los comandos terminados
+    uint64_t salida_no_cero;
+    uint64_t salida_senal;          // 128 + señal en comandos lanzados como proceso
+    uint64_t error_servidor;        // PROTO_ESTADO_ERROR: el comando no llegó a ejecutarse
+    uint64_t cancelados;            // Comandos en curso al cerrarse su sesión
+    uint64_t bytes_respuesta;
+    uint64_t respuestas_comprimidas;
+    uint64_t bytes_sin_comprimir;   // Salida que pasó por el compresor...
+    uint64_t bytes_comprimidos;     // ... y lo que produjo
+    uint64_t cache_aciertos;        // Respuestas enviadas desde la caché
+    uint64_t cache_compartidas;     // Peticiones que esperaron la misma petición en curso
+    uint64_t cache_fallos;          // Comandos cacheables que hubo que ejecutar
+    uint64_t cache_expulsiones;     // Entradas expulsadas por falta de memoria
+    uint64_t cache_entradas;        // Entradas y bytes que ocupa la caché
+    uint64_t cache_bytes;
+    uint64_t bytes_descargados;     // Datos de archivos enviados y recibidos con TRAMA_DESCARGA...
+    uint64_t bytes_subidos;         // ... y TRAMA_SUBIDA
+    uint64_t cortes_tiempo;         // Comandos terminados por --tiempo-comando...
+    uint64_t cortes_salida;         // ... y por --salida-maxima
+    uint64_t sesiones_inactivas;    // Sesiones cerradas por --inactividad
+    uint64_t sesiones_aceptadas;
+    uint64_t sesiones_activas;
+    uint64_t inicio_ns;
+} metricas;
+
+static const char *archivo_metricas = NULL; // --metricas (NULL: no se escribe)
+static int intervalo_metricas = INTERVALO_METRICAS_POR_DEFECTO;
+static uint64_t proxima_escritura_metricas = 0;
+
+static uint64_t ahora_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void hist_fase_registrar(hist_fase_t *h, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int i = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1); // Menor i con us <= 2^i
+    if (i >= METRICAS_CUBETAS) i = METRICAS_CUBETAS - 1;
+    h->cubetas[i]++;
+    h->n++;
+    h->suma_ns += ns;
+    if (ns > h->max_ns) h->max_ns = ns;
+}
+
+/*
+ * Cota superior (en µs) del percentil 'p': el límite de la cubeta donde cae, o el
+ * máximo observado si es menor. Con cubetas de potencias de 2 sirve para ver en qué
+ * fase se va el tiempo, no para medir con precisión.
+ */
+static double hist_fase_percentil(const hist_fase_t *h, double p) {
+    if (h->n == 0) return 0;
+    uint64_t objetivo = (uint64_t) (p / 100.0 * h->n + 0.999999), acumulado = 0;
+    if (objetivo == 0) objetivo = 1;
+    for (int i = 0; i < METRICAS_CUBETAS - 1; i++) {
+        acumulado += h->cubetas[i];
+        if (acumulado >= objetivo) {
+            double limite = (double) (1ULL << i);
+            return limite < h->max_ns / 1e3 ? limite : h->max_ns / 1e3;
+        }
+    }
+    return h->max_ns / 1e3;
+}
+
+/*
+ * El comando actual del canal terminó con 'estado': registra sus fases y su código de
+ * salida, y deja el canal listo para medir el siguiente. Devuelve la duración total en
+ * ns (0 si el comando no se estaba midiendo).
+ */
+static uint64_t metricas_fin_comando(canal_t *c, int32_t estado) {
+    if (c->t_llegada == 0) return 0;
+    uint64_t ahora = ahora_ns();
+    uint64_t fin_salida = c->t_salida_cerrada != 0 ? c->t_salida_cerrada : ahora;
+
+    if (c->t_inicio >= c->t_llegada) hist_fase_registrar(&metricas.fases[FASE_ESPERA], c->t_inicio - c->t_llegada);
+    if (c->t_lanzado != 0 && c->tipo_comando == TIPO_PROCESO) {
+        hist_fase_registrar(&metricas.fases[FASE_LANZAMIENTO], c->t_lanzado - c->t_inicio);
+    }
+    if (c->t_primer_byte != 0 && c->t_lanzado != 0) {
+        hist_fase_registrar(&metricas.fases[FASE_PRIMER_BYTE], c->t_primer_byte - c->t_lanzado);
+        hist_fase_registrar(&metricas.fases[FASE_TRANSMISION], fin_salida - c->t_primer_byte);
+    }
+    if (c->t_salida_cerrada != 0 && c->tipo_comando == TIPO_PROCESO) {
+        hist_fase_registrar(&metricas.fases[FASE_ESPERA_HIJO], ahora - c->t_salida_cerrada);
+    }
+    uint64_t total = ahora - c->t_llegada;
+    hist_fase_registrar(&metricas.fases[FASE_TOTAL], total);
+
+    metricas.comandos[c->tipo_comando]++;
+    if (estado == 0) metricas.salida_cero++;
+    else if (estado == PROTO_ESTADO_ERROR) metricas.error_servidor++;
+    else if (estado > 128 && c->tipo_comando == TIPO_PROCESO) metricas.salida_senal++;
+    else metricas.salida_no_cero++;
+    if (c->bytes_respuesta > 0) metricas.bytes_respuesta += (uint64_t) c->bytes_respuesta;
+
+    c->t_llegada = c->t_inicio = c->t_lanzado = c->t_primer_byte = c->t_salida_cerrada = 0;
+    return total;
+}
+
+/*
+ * Resumen legible de las métricas (respuesta de '__stats').
+ */
+static void escribir_estadisticas(FILE *f) {
+    uint64_t total = 0;
+    for (int t = 0; t < NUM_TIPOS; t++) total += metricas.comandos[t];
+    fprintf(f, "=== ESTADÍSTICAS DEL SERVIDOR ===\n");
+    fprintf(f, "Activo desde hace %.0f s\n", (ahora_ns() - metricas.inicio_ns) / 1e9);
+    if (num_worker >= 0) fprintf(f, "Worker %d de %d (sólo sus sesiones)\n", num_worker, num_workers);
+    fprintf(f, "Sesiones: %llu activas, %llu aceptadas\n",
+            (unsigned long long) metricas.sesiones_activas, (unsigned long long) metricas.sesiones_aceptadas);
+    fprintf(f, "Comandos: %llu terminados (", (unsigned long long) total);
+    for (int t = 0; t < NUM_TIPOS; t++) {
+        fprintf(f, "%s%s %llu", t > 0 ? ", " : "", nombres_tipos[t], (unsigned long long) metricas.comandos[t]);
+    }
+    fprintf(f, "), %llu cancelados\n", (unsigned long long) metricas.cancelados);
+    fprintf(f, "Códigos de salida: %llu cero, %llu distinto de cero, %llu por señal, %llu errores del servidor\n",
+            (unsigned long long) metricas.salida_cero, (unsigned long long) metricas.salida_no_cero,
+            (unsigned long long) metricas.salida_senal, (unsigned long long) metricas.error_servidor);
+    fprintf(f, "Bytes de respuesta: %llu\n", (unsigned long long) metricas.bytes_respuesta);
+    fprintf(f, "Compresión: %llu respuestas, %llu bytes comprimidos en %llu\n",
+            (unsigned long long) metricas.respuestas_comprimidas, (unsigned long long) metricas.bytes_sin_comprimir,
+            (unsigned long long) metricas.bytes_comprimidos);
+    fprintf(f, "Caché: %llu aciertos, %llu compartidas, %llu fallos, %llu expulsiones; %llu entradas, %llu bytes\n",
+            (unsigned long long) metricas.cache_aciertos, (unsigned long long) metricas.cache_compartidas,
+            (unsigned long long) metricas.cache_fallos, (unsigned long long) metricas.cache_expulsiones,
+            (unsigned long long) metricas.cache_entradas, (unsigned long long) metricas.cache_bytes);
+    fprintf(f, "Transferencias: %llu bytes descargados, %llu bytes subidos\n",
+            (unsigned long long) metricas.bytes_descargados, (unsigned long long) metricas.bytes_subidos);
+    fprintf(f, "Límites: %llu comandos por tiempo, %llu por salida; %llu sesiones inactivas\n",
+            (unsigned long long) metricas.cortes_tiempo, (unsigned long long) metricas.cortes_salida,
+            (unsigned long long) metricas.sesiones_inactivas);
+    fprintf(f, "Registro: %llu descartados (anillo lleno), %llu suprimidos (--log-limite)\n\n",
+            (unsigned long long) atomic_load_explicit(&registro.descartados, memory_order_relaxed),
+            (unsigned long long) atomic_load_explicit(&registro.suprimidos, memory_order_relaxed));
+    fprintf(f, "%-12s %9s %10s %10s %10s %10s %10s   (µs; percentiles: cota superior)\n",
+            "fase", "n", "media", "p50", "p90", "p99", "max");
+    for (int i = 0; i < NUM_FASES; i++) {
+        const hist_fase_t *h = &metricas.fases[i];
+        fprintf(f, "%-12s %9llu %10.1f %10.0f %10.0f %10.0f %10.1f\n", nombres_fases[i],
+                (unsigned long long) h->n, h->n ? h->suma_ns / 1e3 / h->n : 0.0,
+                hist_fase_percentil(h, 50), hist_fase_percentil(h, 90), hist_fase_percentil(h, 99),
+                h->max_ns / 1e3);
+    }
+}
+
+/*
+ * Una muestra de Prometheus. Con --workers se añade la etiqueta worker, porque cada
+ * worker escribe su propio archivo y Prometheus suma las series.
+ */
+static void muestra_prometheus(FILE *f, const char *nombre, const char *etiquetas, const char *valor) {
+    char worker[32] = "";
+    if (num_worker >= 0) snprintf(worker, sizeof(worker), "worker=\"%d\"", num_worker);
+    if (*etiquetas == '\0' && *worker == '\0') fprintf(f, "%s %s\n", nombre, valor);
+    else fprintf(f, "%s{%s%s%s} %s\n", nombre, etiquetas, *etiquetas && *worker ? "," : "", worker, valor);
+}
+
+static void contador_prometheus(FILE *f, const char *nombre, const char *etiquetas, uint64_t valor) {
+    char texto[32];
+    snprintf(texto, sizeof(texto), "%llu", (unsigned long long) valor);
+    muestra_prometheus(f, nombre, etiquetas, texto);
+}
+
+/*
+ * Métricas en el formato de texto de Prometheus (archivo de --metricas, pensado para
+ * el textfile collector de node_exporter).
+ */
+static void escribir_prometheus(FILE *f) {
+    char etiquetas[64], valor[32];
+    fprintf(f, "# HELP servidor_ssh_comandos_total Comandos terminados, por forma de ejecución.\n");
+    fprintf(f, "# TYPE servidor_ssh_comandos_total counter\n");
+    for (int t = 0; t < NUM_TIPOS; t++) {
+        snprintf(etiquetas, sizeof(etiquetas), "tipo=\"%s\"", nombres_tipos[t]);
+        contador_prometheus(f, "servidor_ssh_comandos_total", etiquetas, metricas.comandos[t]);
+    }
+    fprintf(f, "# HELP servidor_ssh_resultados_total Comandos terminados, por código de salida.\n");
+    fprintf(f, "# TYPE servidor_ssh_resultados_total counter\n");
+    contador_prometheus(f, "servidor_ssh_resultados_total", "resultado=\"cero\"", metricas.salida_cero);
+    contador_prometheus(f, "servidor_ssh_resultados_total", "resultado=\"no_cero\"", metricas.salida_no_cero);
+    contador_prometheus(f, "servidor_ssh_resultados_total", "resultado=\"senal\"", metricas.salida_senal);
+    contador_prometheus(f, "servidor_ssh_resultados_total", "resultado=\"error_servidor\"", metricas.error_servidor);
+    fprintf(f, "# HELP servidor_ssh_comandos_cancelados_total Comandos en curso al cerrarse su sesión.\n");
+    fprintf(f, "# TYPE servidor_ssh_comandos_cancelados_total counter\n");
+    contador_prometheus(f, "servidor_ssh_comandos_cancelados_total", "", metricas.cancelados);
+    fprintf(f, "# HELP servidor_ssh_bytes_respuesta_total Bytes de salida de los comandos enviados.\n");
+    fprintf(f, "# TYPE servidor_ssh_bytes_respuesta_total counter\n");
+    contador_prometheus(f, "servidor_ssh_bytes_respuesta_total", "", metricas.bytes_respuesta);
+    fprintf(f, "# HELP servidor_ssh_respuestas_comprimidas_total Respuestas enviadas (en parte) comprimidas.\n");
+    fprintf(f, "# TYPE servidor_ssh_respuestas_comprimidas_total counter\n");
+    contador_prometheus(f, "servidor_ssh_respuestas_comprimidas_total", "", metricas.respuestas_comprimidas);
+    fprintf(f, "# HELP servidor_ssh_bytes_compresion_total Bytes antes y después del compresor.\n");
+    fprintf(f, "# TYPE servidor_ssh_bytes_compresion_total counter\n");
+    contador_prometheus(f, "servidor_ssh_bytes_compresion_total", "etapa=\"entrada\"", metricas.bytes_sin_comprimir);
+    contador_prometheus(f, "servidor_ssh_bytes_compresion_total", "etapa=\"salida\"", metricas.bytes_comprimidos);
+    fprintf(f, "# HELP servidor_ssh_cache_consultas_total Comandos cacheables, por resultado de la consulta.\n");
+    fprintf(f, "# TYPE servidor_ssh_cache_consultas_total counter\n");
+    contador_prometheus(f, "servidor_ssh_cache_consultas_total", "resultado=\"acierto\"", metricas.cache_aciertos);
+    contador_prometheus(f, "servidor_ssh_cache_consultas_total", "resultado=\"compartida\"", metricas.cache_compartidas);
+    contador_prometheus(f, "servidor_ssh_cache_consultas_total", "resultado=\"fallo\"", metricas.cache_fallos);
+    fprintf(f, "# HELP servidor_ssh_cache_expulsiones_total Entradas de la caché expulsadas por falta de memoria.\n");
+    fprintf(f, "# TYPE servidor_ssh_cache_expulsiones_total counter\n");
+    contador_prometheus(f, "servidor_ssh_cache_expulsiones_total", "", metricas.cache_expulsiones);
+    fprintf(f, "# HELP servidor_ssh_cache_entradas Respuestas guardadas en la caché.\n");
+    fprintf(f, "# TYPE servidor_ssh_cache_entradas gauge\n");
+    contador_prometheus(f, "servidor_ssh_cache_entradas", "", metricas.cache_entradas);
+    fprintf(f, "# HELP servidor_ssh_cache_bytes Memoria ocupada por la caché.\n");
+    fprintf(f, "# TYPE servidor_ssh_cache_bytes gauge\n");
+    contador_prometheus(f, "servidor_ssh_cache_bytes", "", metricas.cache_bytes);
+    fprintf(f, "# HELP servidor_ssh_transferencia_bytes_total Bytes de archivos transferidos con TRAMA_DESCARGA y TRAMA_SUBIDA.\n");
+    fprintf(f, "# TYPE servidor_ssh_transferencia_bytes_total counter\n");
+    contador_prometheus(f, "servidor_ssh_transferencia_bytes_total", "sentido=\"descarga\"", metricas.bytes_descargados);
+    contador_prometheus(f, "servidor_ssh_transferencia_bytes_total", "sentido=\"subida\"", metricas.bytes_subidos);
+    fprintf(f, "# HELP servidor_ssh_limites_total Comandos terminados y sesiones cerradas por un límite.\n");
+    fprintf(f, "# TYPE servidor_ssh_limites_total counter\n");
+    contador_prometheus(f, "servidor_ssh_limites_total", "motivo=\"tiempo\"", metricas.cortes_tiempo);
+    contador_prometheus(f, "servidor_ssh_limites_total", "motivo=\"salida\"", metricas.cortes_salida);
+    contador_prometheus(f, "servidor_ssh_limites_total", "motivo=\"inactividad\"", metricas.sesiones_inactivas);
+    fprintf(f, "# HELP servidor_ssh_registros_perdidos_total Mensajes del log que no se escribieron, por motivo.\n");
+    fprintf(f, "# TYPE servidor_ssh_registros_perdidos_total counter\n");
+    contador_prometheus(f, "servidor_ssh_registros_perdidos_total", "motivo=\"anillo_lleno\"",
+                        atomic_load_explicit(&registro.descartados, memory_order_relaxed));
+    contador_prometheus(f, "servidor_ssh_registros_perdidos_total", "motivo=\"limite\"",
+                        atomic_load_explicit(&registro.suprimidos, memory_order_relaxed));
+    fprintf(f, "# HELP servidor_ssh_sesiones_aceptadas_total Conexiones aceptadas.\n");
+    fprintf(f, "# TYPE servidor_ssh_sesiones_aceptadas_total counter\n");
+    contador_prometheus(f, "servidor_ssh_sesiones_aceptadas_total", "", metricas.sesiones_aceptadas);
+    fprintf(f, "# HELP servidor_ssh_sesiones_activas Conexiones abiertas.\n");
+    fprintf(f, "# TYPE servidor_ssh_sesiones_activas gauge\n");
+    contador_prometheus(f, "servidor_ssh_sesiones_activas", "", metricas.sesiones_activas);
+    fprintf(f, "# HELP servidor_ssh_fase_segundos Duración de cada fase de los comandos.\n");
+    fprintf(f, "# TYPE servidor_ssh_fase_segundos histogram\n");
+    for (int i = 0; i < NUM_FASES; i++) {
+        const hist_fase_t *h = &metricas.fases[i];
+        uint64_t acumulado = 0;
+        for (int b = 0; b <= METRICAS_CUBETAS - 1; b++) {
+            acumulado += h->cubetas[b];
+            if (b < METRICAS_CUBETAS - 1) {
+                snprintf(etiquetas, sizeof(etiquetas), "fase=\"%s\",le=\"%g\"", nombres_fases[i], (double) (1ULL << b) / 1e6);
+            } else {
+                snprintf(etiquetas, sizeof(etiquetas), "fase=\"%s\",le=\"+Inf\"", nombres_fases[i]);
+            }
+            contador_prometheus(f, "servidor_ssh_fase_segundos_bucket", etiquetas, acumulado);
+        }
+        snprintf(etiquetas, sizeof(etiquetas), "fase=\"%s\"", nombres_fases[i]);
+        snprintf(valor, sizeof(valor), "%.9f", h->suma_ns / 1e9);
+        muestra_prometheus(f, "servidor_ssh_fase_segundos_sum", etiquetas, valor);
+        contador_prometheus(f, "servidor_ssh_fase_segundos_count", etiquetas, h->n);
+    }
+}
+
+/*
+ * Reescribe el archivo de --metricas. Se escribe uno temporal y se renombra, para que
+ * quien lo lea nunca vea un archivo a medias.
+ */
+static void escribir_archivo_metricas(void) {
+    char temporal[PATH_MAX];
+    if (snprintf(temporal, sizeof(temporal), "%s.tmp", archivo_metricas) >= (int) sizeof(temporal)) return;
+    FILE *f = fopen(temporal, "w");
+    if (f == NULL) {
+        registrar_errno(0, "Error al escribir el archivo de métricas");
+        return;
+    }
+    escribir_prometheus(f);
+    if (fclose(f) != 0 || rename(temporal, archivo_metricas) == -1) {
+        registrar_errno(0, "Error al escribir el archivo de métricas");
+        unlink(temporal);
+    }
+}
+
+// SIGINT y SIGTERM sólo se atienden durante epoll_pwait, así que el bucle de eventos
+// ve el aviso en cuanto vuelve y cierra el servidor ordenadamente (ver iniciar_apagado)
+static volatile sig_atomic_t terminar = 0;
+
 // Función para manejar señales (Ctrl+C)
 void signal_handler(int sig) {
-    printf("\n[SERVIDOR] Cerrando servidor...\n");
-    if (fd_s != -1) {
-        close(fd_s);              // Cerrar socket
-        shutdown(fd_s, SHUT_RDWR); // Cerrar ambas direcciones de comunicación
+    (void) sig;
+    terminar = 1;
+}
+
+/*
+ * Elimina los espacios en blanco al inicio y al final de la cadena.
+ */
+void trim(char *str) {
+    char *start = str;
+    char *end;
+    while (isspace((unsigned char)*start)) start++;
+    if (*start == '\0') {
+        str[0] = '\0';
+        return;
+    }
+    if (start != str) {
+        memmove(str, start, strlen(start) + 1);
+    }
+    end = str + strlen(str) - 1;
+    while (end > str && isspace((unsigned char)*end)) end--;
+    *(end + 1) = '\0';
+}
+
+/*
+ * Comando analizado: una o más etapas unidas por '|' (una tubería), cada una con sus
+ * argumentos y sus redirecciones. Los textos apuntan dentro de la línea analizada,
+ * así que analizar un comando no reserva memoria.
+ */
+#define REDIR_ENTRADA          0x01 // < archivo
+#define REDIR_SALIDA           0x02 // > archivo
+#define REDIR_ANEXAR           0x04 // >> archivo (junto con REDIR_SALIDA)
+#define REDIR_ERRORES          0x08 // 2> archivo
+#define REDIR_ERRORES_A_SALIDA 0x10 // 2>&1: los errores van adonde vaya la salida de la etapa
+#define REDIR_ERRORES_HEREDADA 0x20 // 2>&1 antes de > archivo: los errores van a la salida que recibe la etapa
+#define REDIR_ERRORES_ANEXAR   0x40 // Con REDIR_ERRORES: abrir el archivo sin truncarlo (venía de >>)
+
+typedef struct {
+    char **argv;                // Argumentos, terminados en NULL
+    int argc;
+    unsigned redirecciones;     // Bits REDIR_*
+    char *entrada;              // Archivos de las redirecciones (NULL si no hay)
+    char *salida;
+    char *errores;
+} etapa_t;
+
+typedef struct {
+    etapa_t etapas[MAX_ETAPAS];
+    int num_etapas;
+    char *argumentos[MAX_TOKENS + MAX_ETAPAS]; // argv de todas las etapas, cada uno con su NULL
+} comando_t;
+
+/*
+ * Analiza la línea de comando en una sola pasada y sobre la misma línea: quita las
+ * comillas ('...' literal; "..." admite \" y \\) y las barras de escape, termina
+ * cada palabra con '\0' y reconoce los operadores |, <, >, >>, 2> y 2>&1 fuera de
+ * comillas. La escritura nunca adelanta a la lectura, por eso basta con la línea.
+ * Devuelve NULL si el comando es válido o el mensaje de error para el cliente.
+ */
+static const char *analizar_comando(char *linea, comando_t *cmd) {
+    char *r = linea, *w = linea;    // Lectura y escritura
+    char **destino = NULL;          // Redirección que espera su archivo
+    int n = 0, palabras = 0;        // Posiciones usadas en cmd->argumentos y palabras
+    etapa_t *et = &cmd->etapas[0];
+
+    memset(et, 0, sizeof(*et));
+    et->argv = cmd->argumentos;
+    cmd->num_etapas = 1;
+    while (1) {
+        while (*r == ' ' || *r == '\t') r++;
+        if (*r == '\0') break;
+
+        char op;
+        if (strchr("|<>;&", *r) != NULL) {
+            op = *r++;
+        } else if (r[0] == '2' && r[1] == '>') {
+            op = '2';
+            r += 2;
+        } else {
+            char *palabra = w;
+            while (*r != '\0' && strchr(" \t|<>;&", *r) == NULL) {
+                if (*r == '\'') {
+                    r++;
+                    while (*r != '\0' && *r != '\'') *w++ = *r++;
+                    if (*r++ == '\0') return "Error de sintaxis: comillas sin cerrar.\n";
+                } else if (*r == '"') {
+                    r++;
+                    while (*r != '\0' && *r != '"') {
+                        if (*r == '\\' && (r[1] == '"' || r[1] == '\\')) r++;
+                        *w++ = *r++;
+                    }
+                    if (*r++ == '\0') return "Error de sintaxis: comillas sin cerrar.\n";
+                } else {
+                    if (*r == '\\' && r[1] != '\0') r++;
+                    *w++ = *r++;
+                }
+            }
+            op = *r;                // Se lee antes de terminar la palabra, que puede pisarlo
+            if (op != '\0') r++;
+            *w++ = '\0';
+            if (destino != NULL) {
+                *destino = palabra;
+                destino = NULL;
+            } else {
+                if (palabras == MAX_TOKENS - 1) return "Error: demasiados argumentos.\n";
+                et->argv[et->argc++] = palabra;
+                n++;
+                palabras++;
+            }
+            if (op == '\0') break;
+            if (op == ' ' || op == '\t') continue;
+        }
+
+        if (destino != NULL) return "Error de sintaxis: falta el archivo de una redirección.\n";
+        switch (op) {
+        case '|':
+            if (et->argc == 0) return "Error de sintaxis cerca de '|'.\n";
+            if (cmd->num_etapas == MAX_ETAPAS) return "Error: demasiadas etapas en la tubería.\n";
+            cmd->argumentos[n++] = NULL;
+            et = &cmd->etapas[cmd->num_etapas++];
+            memset(et, 0, sizeof(*et));
+            et->argv = cmd->argumentos + n;
+            break;
+        case '<':
+            et->redirecciones |= REDIR_ENTRADA;
+            destino = &et->entrada;
+            break;
+        case '>':
+            if (et->redirecciones & REDIR_ERRORES_A_SALIDA) {
+                // Un 2>&1 anterior ya tomó la salida que había entonces: la de la etapa
+                // o el archivo de una redirección anterior, que pasa a ser el de errores
+                et->redirecciones &= ~REDIR_ERRORES_A_SALIDA;
+                if (et->salida == NULL) {
+                    et->redirecciones |= REDIR_ERRORES_HEREDADA;
+                } else {
+                    et->errores = et->salida;
+                    et->redirecciones |= REDIR_ERRORES;
+                    if (et->redirecciones & REDIR_ANEXAR) et->redirecciones |= REDIR_ERRORES_ANEXAR;
+                }
+            }
+            et->redirecciones |= REDIR_SALIDA;
+            if (*r == '>') {
+                et->redirecciones |= REDIR_ANEXAR;
+                r++;
+            } else {
+                et->redirecciones &= ~REDIR_ANEXAR;
+            }
+            destino = &et->salida;
+            break;
+        case '2':
+            et->redirecciones &= ~(REDIR_ERRORES | REDIR_ERRORES_ANEXAR | REDIR_ERRORES_A_SALIDA |
+                                   REDIR_ERRORES_HEREDADA);
+            et->errores = NULL;
+            if (r[0] == '&') {
+                // Tras "2>&1" debe acabar la palabra: "2>&12" no es "2>&1" más un "2".
+                // strchr también encuentra el '\0' final
+                if (r[1] != '1' || strchr(" \t|<>", r[2]) == NULL) return "Error de sintaxis cerca de '2>&'.\n";
+                et->redirecciones |= REDIR_ERRORES_A_SALIDA;
+                r += 2;
+            } else {
+                et->redirecciones |= REDIR_ERRORES;
+                destino = &et->errores;
+            }
+            break;
+        default:
+            return "Error: ';' y '&' no se admiten fuera de comillas (use '__shell').\n";
+        }
+    }
+    if (destino != NULL) return "Error de sintaxis: falta el archivo de una redirección.\n";
+    if (et->argc == 0) {
+        return cmd->num_etapas > 1 ? "Error de sintaxis cerca de '|'.\n" : "Error de sintaxis: falta el comando.\n";
+    }
+    cmd->argumentos[n] = NULL;
+    return NULL;
+}
+
+/*
+ * Arma en 'cmd' un comando de una sola etapa, sin redirecciones, con los argumentos
+ * 'argv' (terminados en NULL).
+ */
+static void comando_de_argumentos(comando_t *cmd, int argc, char *argv[]) {
+    memset(&cmd->etapas[0], 0, sizeof(etapa_t));
+    cmd->etapas[0].argv = argv;
+    cmd->etapas[0].argc = argc;
+    cmd->num_etapas = 1;
+}
+
+/*
+ * 1 si el comando es un solo programa sin redirecciones: sólo estos pueden ser
+ * comandos internos o responderse desde la caché.
+ */
+static int comando_simple(const comando_t *cmd) {
+    return cmd->num_etapas == 1 && cmd->etapas[0].redirecciones == 0;
+}
+
+/*
+ * Funciones del buffer de salida.
+ */
+static size_t buffer_pendiente(const buffer_t *b) {
+    return b->fin - b->inicio;
+}
+
+/*
+ * Asegura lugar para 'n' bytes más al final del buffer y devuelve dónde van (el
+ * llamador los escribe y avanza 'fin'), o NULL si no hay memoria.
+ */
+static char *buffer_reservar(buffer_t *b, size_t n) {
+    if (b->fin + n > b->capacidad) {
+        // Recorrer al inicio lo pendiente antes de crecer
+        if (b->inicio > 0) {
+            memmove(b->datos, b->datos + b->inicio, b->fin - b->inicio);
+            b->fin -= b->inicio;
+            b->inicio = 0;
+        }
+        if (b->fin + n > b->capacidad) {
+            size_t nueva = b->capacidad ? b->capacidad : BUFFER_SIZE;
+            while (nueva < b->fin + n) nueva *= 2;
+            char *p = realloc(b->datos, nueva);
+            if (p == NULL) return NULL;
+            b->datos = p;
+            b->capacidad = nueva;
+        }
+    }
+    return b->datos + b->fin;
+}
+
+static int buffer_agregar(buffer_t *b, const void *datos, size_t n) {
+    if (n == 0) return 0;
+    char *p = buffer_reservar(b, n);
+    if (p == NULL) return -1;
+    memcpy(p, datos, n);
+    b->fin += n;
+    return 0;
+}
+
+static void buffer_consumir(buffer_t *b, size_t n) {
+    b->inicio += n;
+    if (b->inicio == b->fin) b->inicio = b->fin = 0;
+}
+
+static void buffer_liberar(buffer_t *b) {
+    free(b->datos);
+    memset(b, 0, sizeof(*b));
+}
+
+/*
+ * Pone un descriptor en modo no bloqueante.
+ */
+static int fijar_no_bloqueante(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * Temporizadores.
+ * Una rueda de RUEDA_RANURAS ranuras de RUEDA_TIC_MS cada una: el temporizador que
+ * vence en el instante t va en la ranura del primer tic a partir de t, y el bucle
+ * recorre en cada vuelta las ranuras de los tics transcurridos. Programar y cancelar
+ * cuestan O(1) con cualquier número de sesiones; un temporizador que vence dentro de
+ * más de una vuelta de la rueda se deja en su ranura hasta que llega su vuelta. La
+ * actividad de una sesión no mueve su temporizador: sólo se anota la hora, y al vencer
+ * se vuelve a programar si hubo actividad entretanto (ver sesion_inactiva).
+ */
+#define RUEDA_RANURAS 1024              // Ranuras de la rueda (potencia de 2)
+#define RUEDA_TIC_MS 100                // Tiempo que cubre cada ranura
+#define RUEDA_TIC_NS (RUEDA_TIC_MS * 1000000ULL)
+#define RUEDA_VENCIDOS RUEDA_RANURAS    // 'ranura' de los vencidos aún sin atender
+
+static struct {
+    temporizador_t *ranuras[RUEDA_RANURAS];
+    temporizador_t *vencidos;   // Vencidos en la vuelta actual del bucle, por atender
+    uint64_t tic;               // Último tic recorrido
+    size_t programados;
+} rueda;
+
+static temporizador_t **lista_temporizador(temporizador_t *t) {
+    return t->ranura == RUEDA_VENCIDOS ? &rueda.vencidos : &rueda.ranuras[t->ranura];
+}
+
+static void insertar_temporizador(temporizador_t *t, int ranura) {
+    t->ranura = ranura;
+    t->ant = NULL;
+    t->sig = *lista_temporizador(t);
+    if (t->sig) t->sig->ant = t;
+    *lista_temporizador(t) = t;
+    rueda.programados++;
+}
+
+static void cancelar_temporizador(temporizador_t *t) {
+    if (t->ranura == -1) return;
+    if (t->ant) t->ant->sig = t->sig; else *lista_temporizador(t) = t->sig;
+    if (t->sig) t->sig->ant = t->ant;
+    t->sig = t->ant = NULL;
+    t->ranura = -1;
+    rueda.programados--;
+}
+
+/*
+ * Programa (o reprograma) 't' para el instante 'vence'.
+ */
+static void programar_temporizador(temporizador_t *t, uint64_t vence) {
+    cancelar_temporizador(t);
+    uint64_t tic = (vence + RUEDA_TIC_NS - 1) / RUEDA_TIC_NS;
+    if (tic <= rueda.tic) tic = rueda.tic + 1; // Ese tic ya se recorrió
+    t->vence = vence;
+    insertar_temporizador(t, (int) (tic & (RUEDA_RANURAS - 1)));
+}
+
+/*
+ * Pasa a 'vencidos' los temporizadores de los tics transcurridos hasta 'ahora' cuyo
+ * instante ya llegó. Si pasó más de una vuelta basta con recorrer cada ranura una vez.
+ */
+static void recorrer_rueda(uint64_t ahora) {
+    uint64_t actual = ahora / RUEDA_TIC_NS;
+    if (actual <= rueda.tic) return;
+    uint64_t pasos = actual - rueda.tic < RUEDA_RANURAS ? actual - rueda.tic : RUEDA_RANURAS;
+    for (uint64_t i = 1; i <= pasos; i++) {
+        temporizador_t *sig;
+        for (temporizador_t *t = rueda.ranuras[(rueda.tic + i) & (RUEDA_RANURAS - 1)]; t != NULL; t = sig) {
+            sig = t->sig;
+            if (t->vence > ahora) continue; // Vence en otra vuelta
+            cancelar_temporizador(t);
+            insertar_temporizador(t, RUEDA_VENCIDOS);
+        }
+    }
+    rueda.tic = actual;
+}
+
+/*
+ * Milisegundos hasta el próximo tic con temporizadores (-1 si no hay ninguno), para
+ * la espera de epoll.
+ */
+static int espera_rueda(uint64_t ahora) {
+    if (rueda.programados == 0) return -1;
+    for (uint64_t i = 1; i <= RUEDA_RANURAS; i++) {
+        if (rueda.ranuras[(rueda.tic + i) & (RUEDA_RANURAS - 1)] == NULL) continue;
+        uint64_t instante = (rueda.tic + i) * RUEDA_TIC_NS;
+        return instante > ahora ? (int) ((instante - ahora) / 1000000) + 1 : 0;
+    }
+    return -1;
+}
+
+/*
+ * Programa el límite de --tiempo-comando del comando que el canal acaba de lanzar
+ * (o de empezar a responder, si no lanza un proceso: 'cat' interno o caché).
+ */
+static void programar_limite_comando(canal_t *c) {
+    if (limite_tiempo_comando <= 0) return;
+    uint64_t desde = c->t_lanzado != 0 ? c->t_lanzado : c->t_inicio;
+    programar_temporizador(&c->limite, desde + (uint64_t) limite_tiempo_comando * 1000000000ULL);
+}
+
+/*
+ * Cambia los eventos que epoll vigila para el socket de la sesión.
+ */
+static void eventos_cliente(sesion_t *s, uint32_t eventos) {
+    if (s->eventos_cliente == eventos) return;
+    struct epoll_event ev = { .events = eventos, .data.ptr = &s->f_cliente };
+    if (epoll_ctl(fd_epoll, EPOLL_CTL_MOD, s->fd, &ev) == -1) {
+        registrar_errno(0, "Error en epoll_ctl (cliente)");
+        return;
+    }
+    s->eventos_cliente = eventos;
+}
+
+static void uring_lectura(sesion_t *s, int leer);
+static void uring_cancelar_trama(sesion_t *s);
+
+/*
+ * Eventos que corresponden al socket según el estado de la sesión: se leen comandos
+ * mientras las colas de los canales no estén llenas, y se espera EPOLLOUT sólo si hay
+ * datos pendientes. Con io_uring la lectura es un recv que se arma o se cancela; el
+ * cierre del cliente lo informa ese recv, así que EPOLLRDHUP sólo hace falta en pausa.
+ */
+static void actualizar_eventos_cliente(sesion_t *s) {
+    uint32_t eventos = EPOLLRDHUP;
+    int leer = s->estado == SESION_ACTIVA && s->bytes_en_cola < COLA_MAX_PENDIENTE;
+    if (s->lectura_uring) {
+        uring_lectura(s, leer);
+        if (leer) eventos = 0;
+    } else if (leer) {
+        eventos |= EPOLLIN;
+    }
+    if (buffer_pendiente(&s->salida) > 0 || (s->splice_restante > 0 && s->trama_uring == 0) ||
+        s->envio_restante > 0) {
+        eventos |= EPOLLOUT;
+    }
+    eventos_cliente(s, eventos);
+}
+
+static void cerrar_sesion(sesion_t *s);
+
+/*
+ * Bytes por enviar al cliente, contando los que esperan a que termine la carga en curso.
+ */
+static size_t salida_pendiente(const sesion_t *s) {
+    return buffer_pendiente(&s->salida) + buffer_pendiente(&s->diferida);
+}
+
+/*
+ * Envía datos al cliente sin bloquear. Lo que el socket no acepte se guarda en el
+ * buffer de salida y se envía cuando epoll avise que el socket vuelve a admitir datos.
+ * Devuelve -1 si la conexión falló (la sesión queda cerrada).
+ */
+static int enviar_bytes(sesion_t *s, const void *datos, size_t n) {
+    size_t enviados = 0;
+    if (buffer_pendiente(&s->salida) == 0) {
+        while (enviados < n) {
+            ssize_t r = send(s->fd, (const char *)datos + enviados, n - enviados, MSG_NOSIGNAL);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                registrar_errno(0, "Error al enviar datos al cliente");
+                cerrar_sesion(s);
+                return -1;
+            }
+            enviados += r;
+        }
+    }
+    if (enviados < n) {
+        if (buffer_agregar(&s->salida, (const char *)datos + enviados, n - enviados) == -1) {
+            registrar_errno(0, "Error al reservar memoria para la salida");
+            cerrar_sesion(s);
+            return -1;
+        }
+        actualizar_eventos_cliente(s);
+    }
+    return 0;
+}
+
+/*
+ * Como enviar_bytes, salvo mientras una trama de datos va directamente del pipe o del
+ * archivo al socket (splice_restante o envio_restante): entonces lo que generen los
+ * demás canales se aparta en 'diferida' para no intercalarlo en medio de esa trama.
+ */
+static int enviar_a_cliente(sesion_t *s, const void *datos, size_t n) {
+    if (s->canal_carga == NULL) return enviar_bytes(s, datos, n);
+    if (buffer_agregar(&s->diferida, datos, n) == -1) {
+        registrar_errno(0, "Error al reservar memoria para la salida");
+        cerrar_sesion(s);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * La trama de datos en curso terminó de pasar al socket: lo apartado mientras tanto
+ * pasa a la salida normal.
+ */
+static int carga_completa(sesion_t *s) {
+    s->canal_carga = NULL;
+    size_t n = buffer_pendiente(&s->diferida);
+    if (n == 0) return 0;
+    int r = enviar_bytes(s, s->diferida.datos + s->diferida.inicio, n);
+    s->diferida.inicio = s->diferida.fin = 0;
+    return r;
+}
+
+/*
+ * Envía una trama completa (cabecera + carga). Las tramas pequeñas se arman en un
+ * solo buffer para enviarlas con una sola llamada.
+ */
+static int enviar_trama(sesion_t *s, uint8_t tipo, uint16_t canal, uint32_t id, int32_t estado,
+                        const void *carga, size_t longitud) {
+    uint8_t trama[PROTO_CABECERA + BUFFER_SIZE];
+    trama_codificar(trama, tipo, canal, id, (uint32_t) longitud, estado);
+    if (longitud <= BUFFER_SIZE) {
+        if (longitud > 0) memcpy(trama + PROTO_CABECERA, carga, longitud);
+        return enviar_a_cliente(s, trama, PROTO_CABECERA + longitud);
+    }
+    if (enviar_a_cliente(s, trama, PROTO_CABECERA) == -1) return -1;
+    return enviar_a_cliente(s, carga, longitud);
+}
+
+static int enviar_texto(canal_t *c, uint8_t tipo, const char *texto) {
+    return enviar_trama(c->sesion, tipo, c->num, c->id_peticion, 0, texto, strlen(texto));
+}
+
+/*
+ * Salida comprimida (PROTO_CAP_ZLIB).
+ * Las respuestas cortas van sin comprimir: en unos cientos de bytes lo que se ahorra
+ * no compensa. Cuando una respuesta pasa de COMPRESION_UMBRAL bytes, el resto viaja
+ * en un flujo deflate propio de la respuesta, y cada porción (una lectura del pipe, del
+ * shell o del archivo) se cierra con Z_SYNC_FLUSH para que el cliente la muestre al
+ * llegar. Si tras COMPRESION_MUESTRA bytes el flujo no ahorra al menos un 10% (datos ya
+ * comprimidos, binarios), se cierra y el resto de la respuesta sigue sin comprimir.
+ * Con la compresión activa no se usan splice() ni sendfile(): la salida tiene que
+ * pasar por el compresor.
+ */
+#define COMPRESION_UMBRAL 1024            // Bytes de una respuesta que van siempre sin comprimir
+#define COMPRESION_MUESTRA (64 * 1024)    // Bytes tras los que se evalúa si el flujo compensa
+#define COMPRESION_NIVEL 1                // Nivel de deflate: un solo hilo comprime para todas las sesiones
+#define COMPRESION_LECTURA (64 * 1024)    // Bytes leídos por porción cuando la salida se comprime
+
+static int compresion_ofrecida = 1;       // --sin-compresion la desactiva
+static char entrada_compresion[COMPRESION_LECTURA]; // Lecturas de la salida que va al compresor
+
+/*
+ * Pasa 'n' bytes por el compresor del canal y envía lo que produzca en tramas
+ * TRAMA_DATOS_Z. 'modo' es Z_SYNC_FLUSH para cada porción y Z_FINISH al cerrar el flujo.
+ */
+static int comprimir(canal_t *c, const void *datos, size_t n, int modo) {
+    static unsigned char salida[COMPRESION_LECTURA];
+    z_stream *z = c->z;
+    int r;
+    z->next_in = (Bytef *) datos;
+    z->avail_in = (uInt) n;
+    do {
+        z->next_out = salida;
+        z->avail_out = sizeof(salida);
+        r = deflate(z, modo);
+        if (r == Z_STREAM_ERROR) {
+            registrar(NIVEL_ERROR, c->sesion->id, "Error en deflate, cerrando sesión");
+            cerrar_sesion(c->sesion);
+            return -1;
+        }
+        size_t producidos = sizeof(salida) - z->avail_out;
+        if (producidos == 0) continue;
+        if (enviar_trama(c->sesion, TRAMA_DATOS_Z, c->num, c->id_peticion, 0, salida, producidos) == -1) return -1;
+        c->ventana -= (int64_t) producidos;
+        metricas.bytes_comprimidos += producidos;
+    } while (z->avail_out == 0 || (modo == Z_FINISH && r != Z_STREAM_END));
+    metricas.bytes_sin_comprimir += n;
+    return 0;
+}
+
+/*
+ * Cierra el flujo de la respuesta en curso, si hay uno, y deja el canal listo para
+ * la siguiente respuesta.
+ */
+static int terminar_compresion(canal_t *c) {
+    estado_compresion_t estado = c->compresion;
+    c->compresion = COMPRESION_NO_INICIADA;
+    if (estado != COMPRESION_ACTIVA) return 0;
+    int r = comprimir(c, NULL, 0, Z_FINISH);
+    deflateReset(c->z);
+    return r;
+}
+
+static void cache_grabar(canal_t *c, const void *datos, size_t n);
+static void cache_completar(canal_t *c, int32_t estado);
+static void cache_relanzar_espera(canal_t *c);
+
+/*
+ * 1 si la salida del canal tiene que pasar por enviar_datos (para comprimirla o para
+ * guardarla en la caché), y no puede ir del pipe o del archivo al socket. Una
+ * respuesta cuya compresión se descartó (o que no se comprime, como las descargas)
+ * vuelve a admitir splice() y sendfile().
+ */
+static int salida_por_copia(const canal_t *c) {
+    return (c->sesion->compresion && c->compresion != COMPRESION_DESCARTADA) || c->grabando;
+}
+
+/*
+ * Envía una porción de la salida del comando del canal, comprimida o no (ver arriba).
+ * Descuenta de la ventana los bytes tal como viajan.
+ */
+static int enviar_datos(canal_t *c, const void *datos, size_t n) {
+    sesion_t *s = c->sesion;
+    if (n == 0) return 0;
+    if (c->grabando) cache_grabar(c, datos, n);
+    c->bytes_respuesta += n;
+    if (c->compresion == COMPRESION_NO_INICIADA && s->compresion && c->bytes_respuesta > COMPRESION_UMBRAL) {
+        if (c->z == NULL && (c->z = calloc(1, sizeof(z_stream))) != NULL &&
+            deflateInit2(c->z, COMPRESION_NIVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(c->z);
+            c->z = NULL;
+        }
+        // Sin memoria para el compresor la respuesta sigue sin comprimir
+        c->compresion = c->z != NULL ? COMPRESION_ACTIVA : COMPRESION_DESCARTADA;
+        if (c->z != NULL) metricas.respuestas_comprimidas++;
+    }
+    if (c->compresion != COMPRESION_ACTIVA) {
+        c->ventana -= (int64_t) n;
+        return enviar_trama(s, TRAMA_DATOS, c->num, c->id_peticion, 0, datos, n);
+    }
+    if (comprimir(c, datos, n, Z_SYNC_FLUSH) == -1) return -1;
+    if (c->z->total_in >= COMPRESION_MUESTRA && c->z->total_out * 10 > c->z->total_in * 9) {
+        if (terminar_compresion(c) == -1) return -1;
+        c->compresion = COMPRESION_DESCARTADA;
+    }
+    return 0;
+}
+
+/*
+ * Responde a la petición actual del canal con un mensaje y un estado de error, para
+ * los casos en que el comando no llega a ejecutarse.
+ */
+static int responder_error(canal_t *c, const char *mensaje) {
+    if (terminar_compresion(c) == -1) return -1;
+    if (enviar_texto(c, TRAMA_DATOS, mensaje) == -1) return -1;
+    metricas_fin_comando(c, PROTO_ESTADO_ERROR);
+    int r = enviar_trama(c->sesion, TRAMA_FIN, c->num, c->id_peticion, PROTO_ESTADO_ERROR, NULL, 0);
+    if (c->grabacion != NULL) cache_completar(c, PROTO_ESTADO_ERROR);
+    return r;
+}
+
+/*
+ * Recolecta (sin bloquear) el hijo de una sesión ya cerrada. Si aún no termina, se
+ * anota para volver a intentarlo en las siguientes vueltas del bucle.
+ */
+static void recolectar_hijo(pid_t pid) {
+    pid_t r;
+    do { r = waitpid(pid, NULL, WNOHANG); } while (r == -1 && errno == EINTR);
+    if (r != 0) return;
+    if (num_hijos_pendientes == cap_hijos_pendientes) {
+        size_t nueva = cap_hijos_pendientes ? cap_hijos_pendientes * 2 : 16;
+        pid_t *p = realloc(hijos_pendientes, nueva * sizeof(pid_t));
+        if (p == NULL) {
+            // Sin memoria para anotarlo: se espera de forma bloqueante como último recurso
+            waitpid(pid, NULL, 0);
+            return;
+        }
+        hijos_pendientes = p;
+        cap_hijos_pendientes = nueva;
+    }
+    hijos_pendientes[num_hijos_pendientes++] = pid;
+}
+
+static void recolectar_pendientes(void) {
+    size_t i = 0;
+    while (i < num_hijos_pendientes) {
+        pid_t r = waitpid(hijos_pendientes[i], NULL, WNOHANG);
+        if (r == 0) { i++; continue; }
+        hijos_pendientes[i] = hijos_pendientes[--num_hijos_pendientes];
+    }
+}
+
+/*
+ * Convierte el estado de waitpid en el código de salida que se envía al cliente,
+ * con la misma convención que el shell (128 + señal si el hijo murió por una señal).
+ */
+static int32_t codigo_salida(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return PROTO_ESTADO_ERROR;
+}
+
+/*
+ * Texto de los errores habituales al abrir un archivo o ejecutar un comando en el
+ * hijo, el mismo que da strerror() (que no se puede llamar tras vfork()).
+ */
+static const char *texto_error_hijo(int error) {
+    switch (error) {
+        case ENOENT:       return "No such file or directory";
+        case EACCES:       return "Permission denied";
+        case EPERM:        return "Operation not permitted";
+        case ENOTDIR:      return "Not a directory";
+        case EISDIR:       return "Is a directory";
+        case ELOOP:        return "Too many levels of symbolic links";
+        case ENAMETOOLONG: return "File name too long";
+        case ENOEXEC:      return "Exec format error";
+        case ETXTBSY:      return "Text file busy";
+        case E2BIG:        return "Argument list too long";
+        case ENOMEM:       return "Cannot allocate memory";
+        case EROFS:        return "Read-only file system";
+        case ENOSPC:       return "No space left on device";
+        case EMFILE:       return "Too many open files";
+        default:           return "Input/output error";
+    }
+}
+
+/*
+ * Escribe en 'fd' las cadenas de 'partes' (terminada en NULL) con un solo write(),
+ * armadas en la pila y sin stdio, para poder usarla en el hijo de vfork(). Lo que no
+ * quepa en el buffer se pierde.
+ */
+static void escribir_en_hijo(int fd, const char *const partes[]) {
+    char msg[BUFFER_SIZE];
+    size_t n = 0;
+    for (int i = 0; partes[i] != NULL; i++) {
+        for (const char *p = partes[i]; *p != '\0' && n < sizeof(msg); p++) msg[n++] = *p;
+    }
+    if (write(fd, msg, n) < 0) { /* Nada más que hacer */ }
+}
+
+/*
+ * Código que corre en el proceso hijo entre fork()/vfork() y execvp(): aplica
+ * --limite-cpu y --limite-memoria, se cambia al directorio de la sesión (si
+ * fd_dir != -1), conecta la entrada a fd_entrada (a /dev/null si es -1), la salida a
+ * fd_salida y los errores a fd_errores, y ejecuta el comando. Como con vfork() el hijo
+ * comparte la memoria del padre, sólo usa llamadas al sistema (sigaction y no signal,
+ * nada de stdio ni strerror) y memoria de la pila. Nunca regresa.
+ */
+static void ejecutar_en_hijo(int fd_entrada, int fd_salida, int fd_errores, int fd_dir,
+                             char *comando_base, char *arg_list[]) {
+    sigset_t ninguna;
+    sigemptyset(&ninguna);
+    sigprocmask(SIG_SETMASK, &ninguna, NULL); // Los ejecutores bloquean SIGCHLD
+    struct sigaction por_defecto = { .sa_handler = SIG_DFL };
+    sigaction(SIGPIPE, &por_defecto, NULL); // El servidor la ignora; el comando debe recibirla normalmente
+    if (limite_cpu > 0) {
+        struct rlimit rl = { (rlim_t) limite_cpu, (rlim_t) limite_cpu + 1 }; // SIGXCPU y, un segundo después, SIGKILL
+        setrlimit(RLIMIT_CPU, &rl);
+    }
+    if (limite_memoria > 0) {
+        struct rlimit rl = { (rlim_t) limite_memoria, (rlim_t) limite_memoria };
+        setrlimit(RLIMIT_AS, &rl);
+    }
+    if (fd_dir != -1 && fchdir(fd_dir) == -1) _exit(EXIT_FAILURE);
+    if (fd_entrada == -1) fd_entrada = fd_dev_null;
+    if (fd_entrada != -1 && dup2(fd_entrada, STDIN_FILENO) == -1) _exit(EXIT_FAILURE);
+    if (dup2(fd_salida, STDOUT_FILENO) == -1 || dup2(fd_errores, STDERR_FILENO) == -1) _exit(EXIT_FAILURE);
+    if (fd_salida != STDOUT_FILENO && fd_salida != STDERR_FILENO) close(fd_salida);
+    execvp(comando_base, arg_list);
+    const char *partes[] = { "Error al ejecutar comando '", comando_base, "': ", texto_error_hijo(errno), "\n", NULL };
+    escribir_en_hijo(STDERR_FILENO, partes);
+    _exit(EXIT_FAILURE); // _exit: no vaciar en el pipe los logs que el padre tenía en el buffer de stdout
+}
+
+/*
+ * Abre en el hijo el archivo de una redirección, relativo al directorio de la sesión.
+ * Si no se puede, lo informa en fd_errores y el hijo termina.
+ */
+static int abrir_redireccion(int fd_dir, const char *archivo, int flags, int fd_errores) {
+    int fd = openat(fd_dir != -1 ? fd_dir : AT_FDCWD, archivo, flags | O_CLOEXEC, 0666);
+    if (fd != -1) return fd;
+    const char *partes[] = { archivo, ": ", texto_error_hijo(errno), "\n", NULL };
+    escribir_en_hijo(fd_errores, partes);
+    _exit(EXIT_FAILURE);
+}
+
+/*
+ * Hijo de una etapa de una tubería: se une al grupo de procesos 'grupo' (0: crea el
+ * suyo), aplica las redirecciones de la etapa y la ejecuta. Nunca regresa.
+ */
+static void ejecutar_etapa(const etapa_t *et, int fd_entrada, int fd_salida, int fd_errores,
+                           int fd_dir, pid_t grupo) {
+    setpgid(0, grupo);
+    if (et->entrada != NULL) fd_entrada = abrir_redireccion(fd_dir, et->entrada, O_RDONLY, fd_errores);
+    if (et->redirecciones & REDIR_ERRORES_HEREDADA) fd_errores = fd_salida; // Antes de redirigir la salida
+    if (et->salida != NULL) {
+        int flags = O_WRONLY | O_CREAT | ((et->redirecciones & REDIR_ANEXAR) ? O_APPEND : O_TRUNC);
+        fd_salida = abrir_redireccion(fd_dir, et->salida, flags, fd_errores);
+    }
+    if (et->redirecciones & REDIR_ERRORES_A_SALIDA) fd_errores = fd_salida;
+    else if (et->errores != NULL) {
+        int flags = O_WRONLY | O_CREAT | ((et->redirecciones & REDIR_ERRORES_ANEXAR) ? O_APPEND : O_TRUNC);
+        fd_errores = abrir_redireccion(fd_dir, et->errores, flags, fd_errores);
+    }
+    ejecutar_en_hijo(fd_entrada, fd_salida, fd_errores, fd_dir, et->argv[0], et->argv);
+}
+
+/*
+ * Crea el proceso de una etapa con fork() o vfork(). Va aparte de lanzar_tuberia, y sin
+ * expandir en ella, para que el hijo de vfork() no pise variables locales que el padre
+ * usa al volver: recibe todo por valor y sólo devuelve el PID.
+ */
+static __attribute__((noinline)) pid_t crear_etapa(const etapa_t *et, int fd_entrada, int fd_salida,
+                                                   int fd_errores, int fd_dir, pid_t grupo, int con_vfork) {
+    pid_t pid = con_vfork ? vfork() : fork();
+    if (pid == 0) ejecutar_etapa(et, fd_entrada, fd_salida, fd_errores, fd_dir, grupo);
+    return pid;
+}
+
+/*
+ * Lanza las etapas de 'cmd' unidas por pipes, sin pasar por un shell: la salida de
+ * cada etapa es la entrada de la siguiente y la de la última va a fd_salida, adonde
+ * van también los errores de todas (salvo redirección). Las etapas forman un grupo de
+ * procesos encabezado por la última, cuyo PID se devuelve: su código de salida es el
+ * de la tubería, como en el shell, y kill(-pid) termina la tubería entera. Los
+ * procesos lanzados quedan en 'pids' (pids[0] es la última etapa), también si falla
+ * a mitad, para poder recolectarlos. Devuelve -1 si no se pudo lanzar.
+ */
+static pid_t lanzar_tuberia(const comando_t *cmd, int fd_salida, int fd_dir, int con_vfork,
+                            pid_t pids[MAX_ETAPAS], int *lanzados) {
+    int tubos[MAX_ETAPAS - 1][2];
+    int n = cmd->num_etapas, creados = 0;
+    pid_t lider = -1;
+
+    *lanzados = 0;
+    while (creados < n - 1 && pipe2(tubos[creados], O_CLOEXEC) == 0) creados++;
+    // La última etapa primero: encabeza el grupo al que se unen las demás
+    for (int i = n - 1; i >= 0 && creados == n - 1; i--) {
+        int entrada = i > 0 ? tubos[i - 1][0] : -1;
+        int salida = i < n - 1 ? tubos[i][1] : fd_salida;
+        pid_t pid = crear_etapa(&cmd->etapas[i], entrada, salida, fd_salida, fd_dir, lider == -1 ? 0 : lider, con_vfork);
+        if (pid == -1) break;
+        setpgid(pid, lider == -1 ? pid : lider); // También desde el padre: el grupo existe al volver
+        if (lider == -1) lider = pid;
+        pids[(*lanzados)++] = pid;
+    }
+    for (int i = 0; i < creados; i++) {
+        close(tubos[i][0]);
+        close(tubos[i][1]);
+    }
+    if (*lanzados < n) {
+        if (lider != -1) kill(-lider, SIGKILL);
+        return -1;
+    }
+    return lider;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * Ejecutores: procesos auxiliares creados al arrancar, cuando el servidor aún es
+ * pequeño. Cada uno recibe peticiones por un socket Unix (SOCK_SEQPACKET): las
+ * etapas del comando con sus argumentos y redirecciones y, adjuntos con SCM_RIGHTS,
+ * el extremo de escritura del pipe de salida y, si la sesión cambió de directorio,
+ * el directorio de trabajo. El ejecutor lanza el comando con vfork() + execvp() y
+ * avisa del código de salida cuando termina, así el servidor no paga un fork() de
+ * todo su espacio de memoria por cada comando.
+ * ---------------------------------------------------------------------------
+ */
+typedef enum {
+    EJEC_LANZAR   = 1, // Servidor -> ejecutor: lanzar un comando (argumentos + fd del pipe)
+    EJEC_CANCELAR = 2, // Servidor -> ejecutor: terminar el comando (la sesión se cerró)
+    EJEC_FIN      = 3, // Ejecutor -> servidor: el comando terminó con 'estado'
+    EJEC_MATAR    = 4  // Servidor -> ejecutor: matar el comando, que superó un límite (se espera su EJEC_FIN)
+} tipo_msg_ejecutor_t;
+
+typedef struct {
+    uint32_t tipo;
+    uint32_t ranura;     // Ranura del servidor que espera el resultado
+    uint32_t generacion; // Distingue usos sucesivos de la misma ranura
+    int32_t  estado;     // En EJEC_FIN: código de salida del comando
+    uint32_t num_etapas; // En EJEC_LANZAR: etapas que siguen (ver armar_lanzamiento)
+} msg_ejecutor_t;
+
+typedef struct {
+    uint32_t argc;          // Argumentos que siguen, cada uno terminado en '\0'
+    uint32_t redirecciones; // Bits REDIR_*; tras los argumentos, los archivos de entrada, salida y errores presentes
+} msg_etapa_t;
+
+#define LANZAMIENTO_MAX (sizeof(msg_ejecutor_t) + MAX_ETAPAS * sizeof(msg_etapa_t) + 2 * BUFFER_SIZE)
+
+typedef struct {
+    int fd;                 // Socket hacia el ejecutor
+    pid_t pid;
+    int activo;             // 0 si el ejecutor terminó
+    unsigned long en_curso; // Comandos lanzados que aún no terminan
+    fuente_t f;             // Registro en epoll del socket
+} ejecutor_t;
+
+/*
+ * Una ranura por cada comando en curso en un ejecutor. Si la sesión se cierra antes
+ * de que llegue el código de salida, la ranura queda sin canal hasta que llegue.
+ */
+typedef struct {
+    canal_t *canal;
+    uint32_t generacion;
+    int ejecutor;
+    int en_uso;
+} ranura_t;
+
+static ejecutor_t ejecutores[MAX_EJECUTORES];
+static int num_ejecutores = 0;
+static int siguiente_ejecutor = 0;
+
+static ranura_t *ranuras = NULL;
+static uint32_t num_ranuras = 0;
+static uint32_t cap_ranuras = 0;
+static uint32_t *ranuras_libres = NULL;
+static uint32_t num_ranuras_libres = 0;
+
+/*
+ * Envía un mensaje por un socket Unix, con 'num_fds' descriptores adjuntos.
+ */
+static ssize_t enviar_con_fd(int fd, const void *datos, size_t n, const int *fds, int num_fds, int flags) {
+    struct iovec iov = { (void *) datos, n };
+    union { char buf[CMSG_SPACE(sizeof(int) * MAX_FDS_ADJUNTOS)]; struct cmsghdr alinear; } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (num_fds > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * num_fds);
+    }
+    ssize_t r;
+    do { r = sendmsg(fd, &msg, flags | MSG_NOSIGNAL); } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+/*
+ * Recibe un mensaje y deja en fds[] los descriptores adjuntos (-1 en los que no lleguen).
+ */
+static ssize_t recibir_con_fd(int fd, void *datos, size_t n, int fds[MAX_FDS_ADJUNTOS]) {
+    struct iovec iov = { datos, n };
+    union { char buf[CMSG_SPACE(sizeof(int) * MAX_FDS_ADJUNTOS)]; struct cmsghdr alinear; } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    for (int i = 0; i < MAX_FDS_ADJUNTOS; i++) fds[i] = -1;
+    ssize_t r = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (r < 0) return r;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            size_t num = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (num > MAX_FDS_ADJUNTOS) num = MAX_FDS_ADJUNTOS;
+            memcpy(fds, CMSG_DATA(cm), num * sizeof(int));
+        }
+    }
+    return r;
+}
+
+typedef struct {
+    pid_t pid;
+    uint32_t ranura;
+    uint32_t generacion;
+} hijo_ejecutor_t;
+
+static void ejecutor_responder(int fd, uint32_t ranura, uint32_t generacion, int32_t estado) {
+    msg_ejecutor_t m = { EJEC_FIN, ranura, generacion, estado, 0 };
+    enviar_con_fd(fd, &m, sizeof(m), NULL, 0, 0);
+}
+
+/*
+ * Lee las etapas de una petición EJEC_LANZAR (de 'p' a 'fin', con un '\0' tras el
+ * final) dejando en 'cmd' punteros a sus textos. Devuelve -1 si la petición es inválida.
+ */
+static int leer_lanzamiento(char *p, const char *fin, uint32_t num_etapas, comando_t *cmd) {
+    size_t n = 0;
+    if (num_etapas == 0 || num_etapas > MAX_ETAPAS) return -1;
+    for (uint32_t i = 0; i < num_etapas; i++) {
+        etapa_t *et = &cmd->etapas[i];
+        msg_etapa_t me;
+        if ((size_t) (fin - p) < sizeof(me)) return -1;
+        memcpy(&me, p, sizeof(me));
+        p += sizeof(me);
+        if (me.argc == 0 || n + me.argc >= MAX_TOKENS + MAX_ETAPAS) return -1;
+        et->argv = cmd->argumentos + n;
+        et->argc = (int) me.argc;
+        et->redirecciones = me.redirecciones;
+        et->entrada = et->salida = et->errores = NULL;
+        char **textos[] = { &et->entrada, &et->salida, &et->errores };
+        unsigned bits[] = { REDIR_ENTRADA, REDIR_SALIDA, REDIR_ERRORES };
+        for (uint32_t j = 0; j < me.argc + 3; j++) {
+            if (j >= me.argc && !(me.redirecciones & bits[j - me.argc])) continue;
+            if (p >= fin) return -1;
+            if (j < me.argc) cmd->argumentos[n++] = p;
+            else *textos[j - me.argc] = p;
+            p += strlen(p) + 1;
+        }
+        cmd->argumentos[n++] = NULL;
+    }
+    cmd->num_etapas = (int) num_etapas;
+    return 0;
+}
+
+/*
+ * Bucle principal de un proceso ejecutor. Atiende peticiones del servidor y, con
+ * signalfd, la terminación de sus hijos (también de las etapas de las tuberías, que
+ * no se siguen: el resultado es el de la última). Termina cuando el servidor cierra
+ * el socket.
+ */
+static void bucle_ejecutor(int fd) {
+    char buf[LANZAMIENTO_MAX + 1];
+    comando_t cmd;
+    pid_t pids[MAX_ETAPAS];
+    int lanzados;
+    hijo_ejecutor_t *hijos = NULL;
+    size_t num_hijos = 0, cap_hijos = 0;
+    sigset_t sigchld;
+
+    // El ejecutor se crea con los manejadores del servidor ya instalados: SIGINT y
+    // SIGTERM deben terminarlo, no marcar un servidor_activo que aquí nadie mira
+    struct sigaction por_defecto = { .sa_handler = SIG_DFL };
+    sigaction(SIGINT, &por_defecto, NULL);
+    sigaction(SIGTERM, &por_defecto, NULL);
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, NULL);
+    int fd_senal = signalfd(-1, &sigchld, SFD_CLOEXEC);
+    if (fd_senal == -1) {
+        perror("[EJECUTOR] Error en signalfd");
+        _exit(EXIT_FAILURE);
+    }
+    struct pollfd pfd[2] = { { fd, POLLIN, 0 }, { fd_senal, POLLIN, 0 } };
+
+    while (1) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            _exit(EXIT_FAILURE);
+        }
+        if (pfd[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(fd_senal, &info, sizeof(info)) < 0) { /* Se recolecta igual abajo */ }
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                for (size_t i = 0; i < num_hijos; i++) {
+                    if (hijos[i].pid != pid) continue;
+                    ejecutor_responder(fd, hijos[i].ranura, hijos[i].generacion, codigo_salida(status));
+                    hijos[i] = hijos[--num_hijos];
+                    break;
+                }
+            }
+        }
+        if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+        int fds[MAX_FDS_ADJUNTOS];
+        ssize_t n = recibir_con_fd(fd, buf, sizeof(buf) - 1, fds);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) _exit(0); // El servidor terminó
+        int fd_pipe = fds[0], fd_dir = fds[1];
+        msg_ejecutor_t m;
+        if ((size_t) n < sizeof(m)) m.tipo = 0;
+        else memcpy(&m, buf, sizeof(m));
+        if (m.tipo != EJEC_LANZAR && fd_dir != -1) close(fd_dir);
+
+        if (m.tipo == EJEC_CANCELAR || m.tipo == EJEC_MATAR) {
+            for (size_t i = 0; i < num_hijos; i++) {
+                if (hijos[i].ranura == m.ranura && hijos[i].generacion == m.generacion) {
+                    kill(-hijos[i].pid, m.tipo == EJEC_MATAR ? SIGKILL : SIGTERM); // Toda la tubería
+                    break;
+                }
+            }
+            if (fd_pipe != -1) close(fd_pipe);
+            continue;
+        }
+        if (m.tipo != EJEC_LANZAR || fd_pipe == -1) {
+            if (fd_pipe != -1) close(fd_pipe);
+            if (m.tipo == EJEC_LANZAR && fd_dir != -1) close(fd_dir);
+            continue;
+        }
+
+        // Etapas a continuación de la cabecera
+        buf[n] = '\0';
+        int valida = leer_lanzamiento(buf + sizeof(m), buf + n, m.num_etapas, &cmd) == 0;
+
+        if (num_hijos == cap_hijos) {
+            size_t nueva = cap_hijos ? cap_hijos * 2 : 16;
+            hijo_ejecutor_t *h = realloc(hijos, nueva * sizeof(*h));
+            if (h == NULL) {
+                close(fd_pipe);
+                if (fd_dir != -1) close(fd_dir);
+                ejecutor_responder(fd, m.ranura, m.generacion, PROTO_ESTADO_ERROR);
+                continue;
+            }
+            hijos = h;
+            cap_hijos = nueva;
+        }
+        pid_t pid = valida ? lanzar_tuberia(&cmd, fd_pipe, fd_dir, 1, pids, &lanzados) : -1;
+        close(fd_pipe);
+        if (fd_dir != -1) close(fd_dir);
+        if (pid < 0) {
+            ejecutor_responder(fd, m.ranura, m.generacion, PROTO_ESTADO_ERROR);
+            continue;
+        }
+        hijos[num_hijos].pid = pid;
+        hijos[num_hijos].ranura = m.ranura;
+        hijos[num_hijos].generacion = m.generacion;
+        num_hijos++;
+    }
+}
+
+/*
+ * Crea los procesos ejecutores. Se llama al arrancar, antes de abrir el socket de
+ * escucha, para que cada ejecutor sea una copia pequeña del servidor. Los manejadores
+ * de SIGINT y SIGTERM ya están instalados; bucle_ejecutor los devuelve a SIG_DFL.
+ */
+static int crear_ejecutores(int n) {
+    for (int i = 0; i < n && i < MAX_EJECUTORES; i++) {
+        int par[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, par) == -1) {
+            perror("[SERVIDOR] Error en socketpair (ejecutor)");
+            return -1;
+        }
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("[SERVIDOR] Error al crear ejecutor (fork)");
+            close(par[0]); close(par[1]);
+            return -1;
+        }
+        if (pid == 0) {
+            close(par[0]);
+            for (int j = 0; j < num_ejecutores; j++) close(ejecutores[j].fd);
+            bucle_ejecutor(par[1]);
+        }
+        close(par[1]);
+        ejecutores[i].fd = par[0];
+        ejecutores[i].pid = pid;
+        ejecutores[i].activo = 1;
+        ejecutores[i].en_curso = 0;
+        ejecutores[i].f.tipo = FUENTE_EJECUTOR;
+        ejecutores[i].f.sesion = NULL;
+        ejecutores[i].f.canal = NULL;
+        ejecutores[i].f.indice = i;
+        num_ejecutores++;
+    }
+    return 0;
+}
+
+static int registrar_ejecutores(void) {
+    for (int i = 0; i < num_ejecutores; i++) {
+        fijar_no_bloqueante(ejecutores[i].fd);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &ejecutores[i].f };
+        if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, ejecutores[i].fd, &ev) == -1) {
+            registrar_errno(0, "Error en epoll_ctl (ejecutor)");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int reservar_ranura(void) {
+    if (num_ranuras_libres > 0) return (int) ranuras_libres[--num_ranuras_libres];
+    if (num_ranuras == cap_ranuras) {
+        uint32_t nueva = cap_ranuras ? cap_ranuras * 2 : 64;
+        ranura_t *r = realloc(ranuras, nueva * sizeof(ranura_t));
+        if (r == NULL) return -1;
+        ranuras = r;
+        uint32_t *l = realloc(ranuras_libres, nueva * sizeof(uint32_t));
+        if (l == NULL) return -1;
+        ranuras_libres = l;
+        cap_ranuras = nueva;
+    }
+    ranuras[num_ranuras].generacion = 0;
+    ranuras[num_ranuras].en_uso = 0;
+    return (int) num_ranuras++;
+}
+
+static void liberar_ranura(uint32_t r) {
+    ranuras[r].en_uso = 0;
+    ranuras[r].canal = NULL;
+    ranuras_libres[num_ranuras_libres++] = r;
+}
+
+/*
+ * Arma en 'buf' una petición EJEC_LANZAR: tras la cabecera, por cada etapa un
+ * msg_etapa_t seguido de sus argumentos y de los archivos de sus redirecciones, cada
+ * uno terminado en '\0'. Devuelve su longitud, o 0 si el comando no cabe.
+ */
+static size_t armar_lanzamiento(char *buf, size_t cap, uint32_t ranura, uint32_t generacion,
+                                const comando_t *cmd) {
+    msg_ejecutor_t m = { EJEC_LANZAR, ranura, generacion, 0, (uint32_t) cmd->num_etapas };
+    size_t n = sizeof(m);
+    for (int i = 0; i < cmd->num_etapas; i++) {
+        const etapa_t *et = &cmd->etapas[i];
+        msg_etapa_t me = { (uint32_t) et->argc, et->redirecciones };
+        const char *archivos[] = { et->entrada, et->salida, et->errores };
+        if (n + sizeof(me) > cap) return 0;
+        memcpy(buf + n, &me, sizeof(me));
+        n += sizeof(me);
+        for (int j = 0; j < et->argc + 3; j++) {
+            const char *texto = j < et->argc ? et->argv[j] : archivos[j - et->argc];
+            if (texto == NULL) continue;
+            size_t len = strlen(texto) + 1;
+            if (n + len > cap) return 0;
+            memcpy(buf + n, texto, len);
+            n += len;
+        }
+    }
+    memcpy(buf, &m, sizeof(m));
+    return n;
+}
+
+/*
+ * Pide a un ejecutor que lance el comando con la salida en fd_escritura. Devuelve 0
+ * si la petición quedó enviada y -1 si no hay ejecutor disponible (se usa fork()).
+ */
+static int lanzar_en_ejecutor(canal_t *c, int fd_escritura, const comando_t *cmd) {
+    sesion_t *s = c->sesion;
+    char buf[LANZAMIENTO_MAX];
+    int e = -1;
+
+    for (int i = 0; i < num_ejecutores; i++) {
+        int candidato = (siguiente_ejecutor + i) % num_ejecutores;
+        if (ejecutores[candidato].activo) { e = candidato; break; }
+    }
+    if (e == -1) return -1;
+    siguiente_ejecutor = (e + 1) % num_ejecutores;
+
+    int r = reservar_ranura();
+    if (r == -1) return -1;
+    size_t n = armar_lanzamiento(buf, sizeof(buf), (uint32_t) r, ++ranuras[r].generacion, cmd);
+    int fds[MAX_FDS_ADJUNTOS] = { fd_escritura, s->fd_dir };
+    if (n == 0 || enviar_con_fd(ejecutores[e].fd, buf, n, fds, s->fd_dir != -1 ? 2 : 1, MSG_DONTWAIT) < 0) {
+        liberar_ranura(r);
+        return -1;
+    }
+    ranuras[r].canal = c;
+    ranuras[r].ejecutor = e;
+    ranuras[r].en_uso = 1;
+    ejecutores[e].en_curso++;
+    c->por_ejecutor = 1;
+    c->ranura = r;
+    return 0;
+}
+
+/*
+ * Pide al ejecutor que termine el comando de un canal cuya sesión se cierra. La
+ * ranura sigue ocupada hasta que llegue el código de salida.
+ */
+static void cancelar_en_ejecutor(canal_t *c) {
+    if (c->ranura == -1) return;
+    ranura_t *r = &ranuras[c->ranura];
+    msg_ejecutor_t m = { EJEC_CANCELAR, (uint32_t) c->ranura, r->generacion, 0, 0 };
+    enviar_con_fd(ejecutores[r->ejecutor].fd, &m, sizeof(m), NULL, 0, MSG_DONTWAIT);
+    r->canal = NULL;
+    c->ranura = -1;
+}
+
+/*
+ * Pide al ejecutor que mate el comando del canal (superó un límite). A diferencia de
+ * cancelar_en_ejecutor, la ranura sigue ligada al canal y el código de salida completa
+ * la respuesta.
+ */
+static void matar_en_ejecutor(canal_t *c) {
+    if (c->ranura == -1) return; // Ya terminó
+    ranura_t *r = &ranuras[c->ranura];
+    msg_ejecutor_t m = { EJEC_MATAR, (uint32_t) c->ranura, r->generacion, 0, 0 };
+    enviar_con_fd(ejecutores[r->ejecutor].fd, &m, sizeof(m), NULL, 0, MSG_DONTWAIT);
+}
+
+/*
+ * Crea el pipe de salida y lanza el comando (con todas sus etapas, ver
+ * lanzar_tuberia), en un ejecutor si los hay o si no con fork() en el propio
+ * servidor. El extremo de lectura se registra en epoll y la salida se reenvía al
+ * cliente a medida que llega (ver leer_salida_hijo), sin bloquear al resto de las
+ * sesiones.
+ * Devuelve 0 si el comando quedó en ejecución y -1 si no se pudo lanzar.
+ */
+static int iniciar_comando(canal_t *c, const comando_t *cmd) {
+    int pipe_fd[2];
+    pid_t pid = -1;
+    pid_t pids[MAX_ETAPAS];
+    int lanzados;
+
+    if (pipe2(pipe_fd, O_CLOEXEC) == -1) {
+        registrar_errno(0, "Error al crear el pipe");
+        responder_error(c, "Error interno del servidor (pipe)\n");
+        return -1;
+    }
+
+    c->tipo_comando = TIPO_PROCESO;
+    c->por_ejecutor = 0;
+    c->ranura = -1;
+    if (num_ejecutores == 0 || lanzar_en_ejecutor(c, pipe_fd[1], cmd) == -1) {
+        pid = lanzar_tuberia(cmd, pipe_fd[1], c->sesion->fd_dir, 0, pids, &lanzados);
+        // Las etapas anteriores a la última se recolectan aparte: no dan el código de salida
+        for (int i = pid == -1 ? 0 : 1; i < lanzados; i++) recolectar_hijo(pids[i]);
+
+        if (pid == -1) {
+            registrar_errno(0, "Error al crear proceso hijo (fork)");
+            close(pipe_fd[0]); close(pipe_fd[1]);
+            responder_error(c, "Error interno del servidor (fork)\n");
+            return -1;
+        }
+    }
+
+    // Proceso Padre
+    close(pipe_fd[1]);
+    fijar_no_bloqueante(pipe_fd[0]);
+    // Un pipe más grande deja pasar más salida por cada trama (si el sistema lo permite)
+    fcntl(pipe_fd[0], F_SETPIPE_SZ, TAMANO_PIPE);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &c->f_pipe };
+    if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, pipe_fd[0], &ev) == -1) {
+        registrar_errno(0, "Error en epoll_ctl (pipe)");
+        close(pipe_fd[0]);
+        if (c->por_ejecutor) {
+            cancelar_en_ejecutor(c);
+            c->por_ejecutor = 0;
+        } else {
+            kill(-pid, SIGKILL);
+            recolectar_hijo(pid);
+        }
+        responder_error(c, "Error interno del servidor (epoll)\n");
+        return -1;
+    }
+    c->fd_pipe = pipe_fd[0];
+    c->pid_hijo = pid;
+    c->pipe_pausado = 0;
+    c->bytes_respuesta = 0;
+    c->estado = CANAL_EJECUTANDO;
+    c->t_lanzado = ahora_ns();
+    programar_limite_comando(c);
+    return 0;
+}
+
+static void procesar_entrada(sesion_t *s);
+static void procesar_tramas(sesion_t *s);
+static void procesar_cola(canal_t *c);
+static void terminar_shell(canal_t *c, int recolectado);
+
+/*
+ * Termina el comando en curso del canal: envía la trama de fin con el código de
+ * salida y deja el canal listo para el siguiente comando (que puede estar ya en su cola).
+ * La trama de fin de una transferencia lleva además su resumen.
+ */
+static void finalizar_comando(canal_t *c, int32_t estado_salida) {
+    sesion_t *s = c->sesion;
+    uint8_t resumen[PROTO_RESUMEN_TRANSFERENCIA];
+    size_t largo_resumen = 0;
+    c->pid_hijo = -1;
+    c->estado = CANAL_ESPERANDO_COMANDO;
+    cancelar_temporizador(&c->limite);
+    uint64_t duracion = metricas_fin_comando(c, estado_salida);
+    s->t_actividad = ahora_ns();
+    if (terminar_compresion(c) == -1) return;
+    if (c->corte != CORTE_NINGUNO) {
+        char aviso[128];
+        if (c->corte == CORTE_TIEMPO) {
+            snprintf(aviso, sizeof(aviso), "Error: el comando superó el tiempo máximo (%d s) y se terminó.\n",
+                     limite_tiempo_comando);
+        } else {
+            snprintf(aviso, sizeof(aviso), "Error: el comando superó la salida máxima (%llu bytes) y se terminó.\n",
+                     (unsigned long long) limite_salida);
+        }
+        c->corte = CORTE_NINGUNO;
+        if (enviar_texto(c, TRAMA_DATOS, aviso) == -1) return;
+    }
+    if (c->tipo_comando == TIPO_TRANSFERENCIA) {
+        resumen_transferencia_t r = { c->transferencia_tamano, c->transferencia_bytes,
+                                      (uint32_t) c->transferencia_crc };
+        resumen_codificar(resumen, &r);
+        largo_resumen = sizeof(resumen);
+    }
+    if (enviar_trama(s, TRAMA_FIN, c->num, c->id_peticion, estado_salida, resumen, largo_resumen) == -1) return;
+    if (c->num == 0) {
+        registrar(NIVEL_INFO, s->id, "Respuesta enviada (%zd bytes, %.3f ms)", c->bytes_respuesta, duracion / 1e6);
+    } else {
+        registrar(NIVEL_INFO, s->id, "Respuesta enviada en el canal %u (%zd bytes, %.3f ms)", c->num,
+                  c->bytes_respuesta, duracion / 1e6);
+    }
+    if (!s->modo_shell && c->pid_shell > 0 && !c->shell_ocupado) terminar_shell(c, 0); // Modo shell desactivado desde otro canal
+    if (c->grabacion != NULL) cache_completar(c, estado_salida); // Tras la trama de fin: atiende a los que esperan
+    procesar_cola(c);
+}
+
+/*
+ * Intenta obtener el código de salida del hijo sin bloquear. Devuelve 1 si el hijo
+ * terminó y la respuesta quedó completa.
+ */
+static int esperar_hijo(canal_t *c) {
+    int status;
+    pid_t r;
+    do { r = waitpid(c->pid_hijo, &status, WNOHANG); } while (r == -1 && errno == EINTR);
+    if (r == 0) return 0;
+    if (c->fd_hijo != -1) {
+        epoll_ctl(fd_epoll, EPOLL_CTL_DEL, c->fd_hijo, NULL);
+        close(c->fd_hijo);
+        c->fd_hijo = -1;
+    } else if (c->sondeo_hijo) {
+        c->sondeo_hijo = 0;
+        sesiones_sin_pidfd--;
+    }
+    finalizar_comando(c, r == -1 ? PROTO_ESTADO_ERROR : codigo_salida(status));
+    return 1;
+}
+
+/*
+ * Espera a que termine c->pid_hijo sin bloquear el bucle. Lo habitual es que ya haya
+ * terminado; si no, se vigila su pidfd en epoll para enviar el código de salida en
+ * cuanto termine (o, si el kernel no ofrece pidfd, se sondea periódicamente).
+ */
+static void vigilar_hijo(canal_t *c) {
+    if (esperar_hijo(c)) return;
+#ifdef SYS_pidfd_open
+    int fd = (int) syscall(SYS_pidfd_open, c->pid_hijo, 0);
+    if (fd != -1) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &c->f_hijo };
+        if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd, &ev) == 0) {
+            c->fd_hijo = fd;
+            esperar_hijo(c); // Pudo terminar antes de registrar el pidfd
+            return;
+        }
+        close(fd);
+    }
+#endif
+    c->sondeo_hijo = 1;
+    sesiones_sin_pidfd++;
+}
+
+/*
+ * El hijo cerró su salida: la respuesta se completa cuando termine.
+ */
+static void salida_hijo_cerrada(canal_t *c) {
+    c->t_salida_cerrada = ahora_ns();
+    epoll_ctl(fd_epoll, EPOLL_CTL_DEL, c->fd_pipe, NULL);
+    close(c->fd_pipe);
+    c->fd_pipe = -1;
+    if (c->por_ejecutor) {
+        // El código de salida llega del ejecutor; si ya llegó, la respuesta está completa
+        if (c->ranura == -1) {
+            c->por_ejecutor = 0;
+            finalizar_comando(c, c->estado_salida_hijo);
+        }
+        return;
+    }
+    vigilar_hijo(c);
+}
+
+/*
+ * Llegó del ejecutor el código de salida del comando de una ranura. La respuesta se
+ * completa cuando además se haya cerrado la salida del comando.
+ */
+static void completar_ranura(uint32_t r, uint32_t generacion, int32_t estado) {
+    if (r >= num_ranuras || !ranuras[r].en_uso || ranuras[r].generacion != generacion) return;
+    canal_t *c = ranuras[r].canal;
+    ejecutores[ranuras[r].ejecutor].en_curso--;
+    liberar_ranura(r);
+    if (c == NULL) return; // La sesión ya se cerró
+    c->ranura = -1;
+    c->estado_salida_hijo = estado;
+    if (c->fd_pipe == -1) {
+        c->por_ejecutor = 0;
+        finalizar_comando(c, estado);
+    }
+}
+
+/*
+ * Un ejecutor terminó: sus comandos en curso se dan por fallidos y los siguientes
+ * se lanzan con otro ejecutor o con fork().
+ */
+static void ejecutor_caido(int e) {
+    registrar(NIVEL_AVISO, 0, "El ejecutor %d (pid %d) terminó; %lu comandos en curso se darán por fallidos",
+              e, (int) ejecutores[e].pid, ejecutores[e].en_curso);
+    ejecutores[e].activo = 0;
+    epoll_ctl(fd_epoll, EPOLL_CTL_DEL, ejecutores[e].fd, NULL);
+    close(ejecutores[e].fd);
+    ejecutores[e].fd = -1;
+    recolectar_hijo(ejecutores[e].pid);
+    for (uint32_t r = 0; r < num_ranuras; r++) {
+        if (ranuras[r].en_uso && ranuras[r].ejecutor == e) {
+            completar_ranura(r, ranuras[r].generacion, PROTO_ESTADO_ERROR);
+        }
+    }
+}
+
+/*
+ * Lee los avisos de terminación que envía un ejecutor.
+ */
+static void atender_ejecutor(int e) {
+    msg_ejecutor_t m;
+    while (ejecutores[e].activo) {
+        ssize_t n = recv(ejecutores[e].fd, &m, sizeof(m), MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) {
+            ejecutor_caido(e);
+            return;
+        }
+        if ((size_t) n == sizeof(m) && m.tipo == EJEC_FIN) completar_ranura(m.ranura, m.generacion, m.estado);
+    }
+}
+
+/*
+ * Límites de recursos.
+ * Con --tiempo-comando, el comando que sigue en curso a los N segundos de lanzarse se
+ * termina con SIGKILL a todo su grupo de procesos (en modo shell, al shell del canal
+ * con lo que haya lanzado); con --salida-maxima, lo mismo en cuanto su salida pasa de
+ * N bytes. El 'cat' interno y las respuestas de la caché, que no lanzan un proceso,
+ * simplemente dejan de enviarse. La respuesta termina con un mensaje que explica el
+ * corte. --limite-cpu y --limite-memoria se aplican con setrlimit() en cada proceso
+ * lanzado (ver ejecutar_en_hijo). Con --inactividad se cierra la sesión que pasa N
+ * segundos sin recibir nada del cliente ni tener comandos en curso. Un cliente que no
+ * lee no necesita límite propio: el pipe de su comando deja de leerse y el comando
+ * queda frenado por el propio pipe (ver leer_salida_hijo).
+ */
+
+/*
+ * Bytes que el comando del canal aún puede enviar sin pasar de --salida-maxima. Las
+ * descargas no tienen límite: sus datos son el archivo, no la salida de un comando.
+ */
+static uint64_t salida_permitida(const canal_t *c) {
+    if (limite_salida == 0 || c->tipo_comando == TIPO_TRANSFERENCIA) return UINT64_MAX;
+    return (uint64_t) c->bytes_respuesta < limite_salida ? limite_salida - (uint64_t) c->bytes_respuesta : 0;
+}
+
+static void avanzar_cat(canal_t *c);
+static void cache_soltar(struct entrada_cache *e);
+static int uring_enviar_trama(canal_t *c, const uint8_t *cabecera, size_t n);
+
+/*
+ * Termina el comando en curso del canal por superar un límite. Como en cualquier otro
+ * comando, la respuesta se completa con su código de salida (ver finalizar_comando).
+ */
+static void cortar_comando(canal_t *c, corte_t motivo) {
+    sesion_t *s = c->sesion;
+    if (c->estado != CANAL_EJECUTANDO || c->corte != CORTE_NINGUNO) return;
+    c->corte = motivo;
+    cancelar_temporizador(&c->limite);
+    if (motivo == CORTE_TIEMPO) {
+        metricas.cortes_tiempo++;
+        registrar(NIVEL_AVISO, s->id, "El comando del canal %u superó el tiempo máximo (%d s), se termina",
+                  c->num, limite_tiempo_comando);
+    } else {
+        metricas.cortes_salida++;
+        registrar(NIVEL_AVISO, s->id, "El comando del canal %u superó la salida máxima (%llu bytes), se termina",
+                  c->num, (unsigned long long) limite_salida);
+    }
+    if (c->tipo_comando == TIPO_SHELL && c->pid_shell > 0) {
+        // El siguiente comando del canal arranca otro shell
+        kill(-c->pid_shell, SIGKILL);
+        terminar_shell(c, 0);
+        finalizar_comando(c, 128 + SIGKILL);
+        return;
+    }
+    if (c->respuesta_cache != NULL) {
+        cache_soltar(c->respuesta_cache);
+        c->respuesta_cache = NULL;
+        finalizar_comando(c, 128 + SIGKILL);
+        return;
+    }
+    if (c->cat_fds != NULL) {
+        // 'cat' interno: termina ya o, si una trama va por sendfile(), al completarla
+        if (s->canal_carga != c) avanzar_cat(c);
+        return;
+    }
+    if (c->por_ejecutor) matar_en_ejecutor(c);
+    else if (c->pid_hijo > 0) kill(-c->pid_hijo, SIGKILL);
+    // El resto de la salida se descarta; una trama a medias se completa antes (ver reanudar_canal)
+    if (c->fd_pipe != -1 && s->canal_carga != c) salida_hijo_cerrada(c);
+}
+
+/*
+ * Venció el temporizador de inactividad de la sesión. Si entretanto hubo actividad o
+ * tiene comandos en curso se vuelve a programar; si no, se despide al cliente y se
+ * cierra. Si el cliente tampoco lee lo que ya tiene pendiente, se cierra sin más.
+ */
+static void sesion_inactiva(sesion_t *s, uint64_t ahora) {
+    uint64_t plazo = (uint64_t) limite_inactividad * 1000000000ULL;
+    if (s->fd == -1 || s->estado != SESION_ACTIVA) return;
+    for (int i = 0; i < MAX_CANALES; i++) {
+        if (s->canales[i] != NULL && s->canales[i]->estado == CANAL_EJECUTANDO) {
+            s->t_actividad = ahora;
+            break;
+        }
+    }
+    if (s->t_actividad + plazo > ahora) {
+        programar_temporizador(&s->inactividad, s->t_actividad + plazo);
+        return;
+    }
+    metricas.sesiones_inactivas++;
+    registrar(NIVEL_INFO, s->id, "Sesión inactiva durante %d s, se cierra", limite_inactividad);
+    if (salida_pendiente(s) > 0 || s->canal_carga != NULL) {
+        cerrar_sesion(s);
+        return;
+    }
+    char despedida_msg[96];
+    snprintf(despedida_msg, sizeof(despedida_msg), "Sesión cerrada por inactividad (%d s). ¡Hasta luego!\n",
+             limite_inactividad);
+    s->estado = SESION_CERRANDO;
+    if (enviar_trama(s, TRAMA_ADIOS, 0, 0, 0, despedida_msg, strlen(despedida_msg)) == -1) return;
+    if (buffer_pendiente(&s->salida) == 0) cerrar_sesion(s);
+    else actualizar_eventos_cliente(s);
+}
+
+/*
+ * Atiende los temporizadores vencidos. Cada uno se quita de la lista antes de
+ * atenderlo, así que cerrar una sesión puede cancelar otros de la misma lista.
+ */
+static void atender_temporizadores(void) {
+    uint64_t ahora = ahora_ns();
+    recorrer_rueda(ahora);
+    while (rueda.vencidos != NULL) {
+        temporizador_t *t = rueda.vencidos;
+        cancelar_temporizador(t);
+        if (t->tipo == TEMPORIZADOR_COMANDO) cortar_comando(t->canal, CORTE_TIEMPO);
+        else sesion_inactiva(t->sesion, ahora);
+    }
+}
+
+/*
+ * Deja de vigilar (o vuelve a vigilar) el pipe del hijo mientras el socket no
+ * admite más datos o la ventana del canal está agotada.
+ */
+static void pausar_pipe(canal_t *c) {
+    if (c->pipe_pausado) return;
+    struct epoll_event ev = { .events = 0, .data.ptr = &c->f_pipe };
+    epoll_ctl(fd_epoll, EPOLL_CTL_MOD, c->fd_pipe, &ev);
+    c->pipe_pausado = 1;
+}
+
+static void reanudar_pipe(canal_t *c) {
+    if (!c->pipe_pausado) return;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &c->f_pipe };
+    epoll_ctl(fd_epoll, EPOLL_CTL_MOD, c->fd_pipe, &ev);
+    c->pipe_pausado = 0;
+}
+
+/*
+ * Copia del pipe al socket (pasando por un buffer) lo que falta de la trama en
+ * curso. Se usa cuando splice() no es posible a mitad de una trama.
+ */
+static int copiar_restante(canal_t *c) {
+    sesion_t *s = c->sesion;
+    char buffer_pipe[BUFFER_SIZE];
+    while (s->splice_restante > 0) {
+        size_t n = s->splice_restante < sizeof(buffer_pipe) ? s->splice_restante : sizeof(buffer_pipe);
+        ssize_t r = read(c->fd_pipe, buffer_pipe, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            // Los bytes estaban anunciados por FIONREAD; sin ellos la trama queda truncada
+            registrar_errno(0, "Error al leer del pipe");
+            cerrar_sesion(s);
+            return -1;
+        }
+        s->splice_restante -= r;
+        c->bytes_respuesta += r;
+        if (enviar_bytes(s, buffer_pipe, r) == -1) return -1;
+    }
+    return carga_completa(s);
+}
+
+/*
+ * Mueve del pipe al socket, dentro del kernel, la carga de la trama de datos en
+ * curso. Devuelve 1 si la trama quedó completa, 0 si el socket está lleno y hay que
+ * esperar EPOLLOUT, y -1 si la sesión se cerró.
+ */
+static int mover_splice(canal_t *c) {
+    sesion_t *s = c->sesion;
+    while (s->splice_restante > 0) {
+        ssize_t r = splice(c->fd_pipe, NULL, s->fd, NULL, s->splice_restante,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (r > 0) {
+            s->splice_restante -= r;
+            c->bytes_respuesta += r;
+            continue;
+        }
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pausar_pipe(c);
+            actualizar_eventos_cliente(s);
+            return 0;
+        }
+        if (r < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // El kernel no admite splice para este par de descriptores: copiar como antes
+            registrar(NIVEL_AVISO, 0, "splice() no disponible (%s), se usará copia", strerror(errno));
+            splice_disponible = 0;
+            return copiar_restante(c) == -1 ? -1 : 1;
+        }
+        if (r == 0) errno = EPIPE; // El pipe no puede quedar vacío: FIONREAD anunció los bytes
+        registrar_errno(0, "Error en splice hacia el cliente");
+        cerrar_sesion(s);
+        return -1;
+    }
+    return carga_completa(s) == -1 ? -1 : 1;
+}
+
+/*
+ * Reenvía la salida del hijo en tramas de datos. Cuando no hay nada pendiente en
+ * el buffer de salida, la carga pasa del pipe al socket con splice(), sin copiarse
+ * a memoria del servidor: FIONREAD da los bytes disponibles, se envía la cabecera
+ * con esa longitud y se mueve exactamente esa cantidad. En otro caso (o si splice
+ * no está disponible) la salida se copia por un buffer como antes.
+ * Si el cliente no consume tan rápido como el hijo produce, se deja de leer el pipe
+ * hasta que el socket drene lo pendiente, de modo que el hijo queda frenado por el
+ * propio pipe. Lo mismo ocurre cuando el canal agota la ventana que le concedió el
+ * cliente, sin afectar a los demás canales.
+ */
+static void leer_salida_hijo(canal_t *c) {
+    sesion_t *s = c->sesion;
+    uint8_t buffer_pipe[PROTO_CABECERA + BUFFER_SIZE]; // Se lee detrás del espacio de la cabecera
+    ssize_t bytes_leidos_pipe;
+
+    // Mientras una trama va directa al socket el pipe espera: la del propio canal
+    // termina con EPOLLOUT, y la de otro canal al completarse lo reanuda
+    if (s->canal_carga != NULL) {
+        pausar_pipe(c);
+        return;
+    }
+
+    while (salida_pendiente(s) < SALIDA_MAX_PENDIENTE && c->ventana > 0) {
+        uint64_t permitido = salida_permitida(c);
+        if (permitido == 0) {
+            // En --salida-maxima: si el comando escribe un byte más, lo supera
+            char resto;
+            bytes_leidos_pipe = read(c->fd_pipe, &resto, 1);
+            if (bytes_leidos_pipe < 0 && errno == EINTR) continue;
+            if (bytes_leidos_pipe < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            if (bytes_leidos_pipe > 0) cortar_comando(c, CORTE_SALIDA);
+            else salida_hijo_cerrada(c);
+            return;
+        }
+        int disponibles = 0;
+        if (splice_disponible && !salida_por_copia(c) && buffer_pendiente(&s->salida) == 0 &&
+            ioctl(c->fd_pipe, FIONREAD, &disponibles) == 0 && disponibles > 0) {
+            uint8_t cabecera[PROTO_CABECERA];
+            size_t n = (size_t) disponibles < PROTO_MAX_CARGA ? (size_t) disponibles : PROTO_MAX_CARGA;
+            if ((int64_t) n > c->ventana) n = (size_t) c->ventana;
+            if (n > permitido) n = (size_t) permitido;
+            trama_codificar(cabecera, TRAMA_DATOS, c->num, c->id_peticion, (uint32_t) n, 0);
+            if (uring_envio_activo && uring_enviar_trama(c, cabecera, n) == 0) {
+                if (c->t_primer_byte == 0) c->t_primer_byte = ahora_ns();
+                c->ventana -= n;
+                return;
+            }
+            ssize_t r;
+            do { r = send(s->fd, cabecera, sizeof(cabecera), MSG_NOSIGNAL | MSG_MORE); } while (r < 0 && errno == EINTR);
+            if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                registrar_errno(0, "Error al enviar datos al cliente");
+                cerrar_sesion(s);
+                return;
+            }
+            if (r < 0) r = 0;
+            if (c->t_primer_byte == 0) c->t_primer_byte = ahora_ns();
+            c->ventana -= n;
+            if ((size_t) r < sizeof(cabecera)) {
+                // Cabecera incompleta: el resto sale por el buffer y la carga después
+                if (enviar_bytes(s, cabecera + r, sizeof(cabecera) - r) == -1) return;
+                s->splice_restante = n;
+                s->canal_carga = c;
+                pausar_pipe(c);
+                actualizar_eventos_cliente(s);
+                return;
+            }
+            s->splice_restante = n;
+            s->canal_carga = c;
+            if (mover_splice(c) <= 0) return;
+            continue;
+        }
+        size_t n = c->ventana < BUFFER_SIZE ? (size_t) c->ventana : BUFFER_SIZE;
+        void *destino = buffer_pipe + PROTO_CABECERA;
+        int por_copia = salida_por_copia(c);
+        if (por_copia) {
+            // Porciones más grandes: cada una es un bloque del flujo comprimido o de la grabación
+            destino = entrada_compresion;
+            n = sizeof(entrada_compresion);
+            if (!s->compresion && (int64_t) n > c->ventana) n = (size_t) c->ventana;
+        }
+        if (n > permitido) n = (size_t) permitido;
+        bytes_leidos_pipe = read(c->fd_pipe, destino, n);
+        if (bytes_leidos_pipe > 0) {
+            if (c->t_primer_byte == 0) c->t_primer_byte = ahora_ns();
+            if (por_copia) {
+                if (enviar_datos(c, destino, bytes_leidos_pipe) == -1) return;
+                continue;
+            }
+            trama_codificar(buffer_pipe, TRAMA_DATOS, c->num, c->id_peticion, (uint32_t) bytes_leidos_pipe, 0);
+            if (enviar_a_cliente(s, buffer_pipe, PROTO_CABECERA + bytes_leidos_pipe) == -1) return;
+            c->bytes_respuesta += bytes_leidos_pipe;
+            c->ventana -= bytes_leidos_pipe;
+            continue;
+        }
+        if (bytes_leidos_pipe < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            registrar_errno(0, "Error al leer del pipe");
+        }
+        salida_hijo_cerrada(c); // EOF o error: el hijo cerró su salida
+        return;
+    }
+    // Demasiada salida pendiente o ventana agotada: pausar el pipe hasta poder seguir
+    pausar_pipe(c);
+    cache_relanzar_espera(c);
+}
+
+static void reanudar_shell(canal_t *c);
+static void avanzar_cache(canal_t *c);
+
+/*
+ * Retoma lo que el canal dejó de leer (pipe, shell o 'cat' interno) si ya hay
+ * ventana y espacio en la salida.
+ */
+static void reanudar_canal(canal_t *c) {
+    sesion_t *s = c->sesion;
+    if (c->corte != CORTE_NINGUNO && s->canal_carga == NULL) {
+        // Cortado con una trama a medias, que ya salió: el resto de la salida se descarta
+        if (c->fd_pipe != -1) {
+            salida_hijo_cerrada(c);
+            return;
+        }
+        if (c->cat_fds != NULL) {
+            avanzar_cat(c);
+            return;
+        }
+    }
+    if (c->ventana <= 0 || s->canal_carga != NULL || salida_pendiente(s) >= SALIDA_MAX_PENDIENTE / 2) return;
+    if (c->pipe_pausado) reanudar_pipe(c);
+    if (c->shell_pausado) reanudar_shell(c);
+    if (c->cat_fds != NULL) avanzar_cat(c);
+    if (c->respuesta_cache != NULL) avanzar_cache(c);
+}
+
+static int mover_sendfile(canal_t *c);
+
+/*
+ * Envía la salida pendiente cuando el socket vuelve a admitir datos.
+ */
+static void vaciar_salida(sesion_t *s) {
+    while (buffer_pendiente(&s->salida) > 0) {
+        ssize_t r = send(s->fd, s->salida.datos + s->salida.inicio,
+                         buffer_pendiente(&s->salida), MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            registrar_errno(0, "Error al enviar datos al cliente");
+            cerrar_sesion(s);
+            return;
+        }
+        buffer_consumir(&s->salida, r);
+    }
+    if (s->estado == SESION_CERRANDO && buffer_pendiente(&s->salida) == 0 && s->canal_carga == NULL) {
+        cerrar_sesion(s);
+        return;
+    }
+    if (s->canal_carga != NULL && s->trama_uring == 0 && buffer_pendiente(&s->salida) == 0) {
+        // Completar la carga de la trama cuya cabecera acaba de salir
+        canal_t *c = s->canal_carga;
+        if ((s->splice_restante > 0 ? mover_splice(c) : mover_sendfile(c)) <= 0) return;
+        if (s->estado == SESION_CERRANDO) {
+            vaciar_salida(s);
+            return;
+        }
+    }
+    for (int i = 0; i < MAX_CANALES && s->fd != -1; i++) {
+        if (s->canales[i] != NULL) reanudar_canal(s->canales[i]);
+    }
+    if (s->fd != -1) actualizar_eventos_cliente(s);
+}
+
+/*
+ * Comandos internos.
+ * pwd, echo, ls, cat y stat se atienden dentro del servidor, sin crear un proceso,
+ * y producen exactamente la misma salida que las herramientas de coreutils con las
+ * que se ejecutarían. Cuando un caso no está cubierto (una opción no soportada, un
+ * archivo que no existe, un nombre que habría que entrecomillar...) la función
+ * devuelve INTERNO_NO_APLICA antes de haber escrito nada y el comando se lanza
+ * normalmente, de modo que el mensaje de error o el formato siguen siendo los de
+ * la herramienta real. 'cd' no tiene equivalente externo y siempre es interno:
+ * cambia el directorio de la sesión, que heredan los comandos siguientes.
+ */
+#define INTERNO_NO_APLICA (-2)  // El comando debe ejecutarse como un proceso
+#define INTERNO_EN_CURSO  (-3)  // La respuesta se completa más tarde (cat de archivos grandes)
+#define CAT_MAX_LECTURA (64 * 1024) // Archivos menores se leen con read(); los demás van con sendfile()
+
+// 1 si los comandos internos producen la misma salida que las herramientas reales
+static int internos_activos = 1;
+
+/*
+ * Acumula la salida de un comando interno y la envía en tramas de hasta BUFFER_SIZE bytes.
+ */
+typedef struct {
+    canal_t *c;
+    size_t n;
+    char datos[BUFFER_SIZE];
+} escritor_t;
+
+static int escritor_vaciar(escritor_t *e) {
+    canal_t *c = e->c;
+    if (e->n == 0) return 0;
+    if (c->sesion->fd == -1) return -1;
+    // La salida de los internos es breve: puede exceder algo la ventana
+    if (enviar_datos(c, e->datos, e->n) == -1) return -1;
+    e->n = 0;
+    return 0;
+}
+
+static int escribir(escritor_t *e, const void *datos, size_t n) {
+    const char *p = datos;
+    while (n > 0) {
+        if (e->n == sizeof(e->datos) && escritor_vaciar(e) == -1) return -1;
+        size_t k = sizeof(e->datos) - e->n;
+        if (k > n) k = n;
+        memcpy(e->datos + e->n, p, k);
+        e->n += k;
+        p += k;
+        n -= k;
+    }
+    return 0;
+}
+
+static int escribir_texto(escritor_t *e, const char *texto) {
+    return escribir(e, texto, strlen(texto));
+}
+
+static int escribir_formato(escritor_t *e, const char *formato, ...) {
+    char *texto;
+    va_list ap;
+    va_start(ap, formato);
+    int n = vasprintf(&texto, formato, ap);
+    va_end(ap);
+    if (n < 0) return -1;
+    int r = escribir(e, texto, (size_t) n);
+    free(texto);
+    return r;
+}
+
+/*
+ * Directorio contra el que se resuelven las rutas relativas de la sesión.
+ */
+static int dir_base(const sesion_t *s) {
+    return s->fd_dir != -1 ? s->fd_dir : AT_FDCWD;
+}
+
+/*
+ * Ruta absoluta del directorio de la sesión en 'ruta'. Devuelve -1 si no se puede
+ * obtener (por ejemplo, si el directorio fue borrado).
+ */
+static int ruta_directorio(const sesion_t *s, char *ruta, size_t tam) {
+    if (s->fd_dir == -1) return getcwd(ruta, tam) != NULL ? 0 : -1;
+    char enlace[64];
+    snprintf(enlace, sizeof(enlace), "/proc/self/fd/%d", s->fd_dir);
+    ssize_t n = readlink(enlace, ruta, tam - 1);
+    if (n <= 0 || ruta[0] != '/') return -1;
+    ruta[n] = '\0';
+    const char *borrado = " (deleted)";
+    size_t lb = strlen(borrado);
+    if ((size_t) n >= lb && strcmp(ruta + n - lb, borrado) == 0) return -1;
+    return 0;
+}
+
+static int interno_pwd(sesion_t *s, escritor_t *e, int argc, char *argv[]) {
+    (void) argv;
+    char ruta[PATH_MAX];
+    if (argc > 1) return INTERNO_NO_APLICA; // Opciones: las atiende /bin/pwd
+    if (ruta_directorio(s, ruta, sizeof(ruta)) == -1) return INTERNO_NO_APLICA;
+    escribir_texto(e, ruta);
+    escribir(e, "\n", 1);
+    return 0;
+}
+
+static int interno_echo(sesion_t *s, escritor_t *e, int argc, char *argv[]) {
+    (void) s;
+    int salto = 1, escapes = 0, i = 1;
+    if (argc == 2 && (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "--version") == 0)) {
+        return INTERNO_NO_APLICA;
+    }
+    // Igual que coreutils: sólo son opciones los argumentos iniciales formados por n, e y E
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1)) break;
+        for (const char *c = argv[i] + 1; *c; c++) {
+            if (*c == 'n') salto = 0;
+            else escapes = (*c == 'e');
+        }
+    }
+    if (escapes) return INTERNO_NO_APLICA; // Secuencias de escape: /bin/echo
+    for (int primero = i; i < argc; i++) {
+        if (i > primero) escribir(e, " ", 1);
+        escribir_texto(e, argv[i]);
+    }
+    if (salto) escribir(e, "\n", 1);
+    return 0;
+}
+
+/*
+ * cd [dir | -]: sin argumento va a $HOME; con '-' vuelve al directorio anterior y
+ * lo muestra. Los mensajes de error son los de bash.
+ */
+static int interno_cd(sesion_t *s, escritor_t *e, int argc, char *argv[]) {
+    const char *destino = argc > 1 ? argv[1] : getenv("HOME");
+    int fd_nuevo;
+
+    if (argc > 2) {
+        escribir_texto(e, "cd: too many arguments\n");
+        return 1;
+    }
+    if (destino == NULL) {
+        escribir_texto(e, "cd: HOME not set\n");
+        return 1;
+    }
+    if (strcmp(destino, "-") == 0) {
+        if (s->fd_dir_anterior == -1) {
+            escribir_texto(e, "cd: OLDPWD not set\n");
+            return 1;
+        }
+        fd_nuevo = dup(s->fd_dir_anterior);
+    } else if (faccessat(dir_base(s), destino, X_OK, 0) == -1) {
+        fd_nuevo = -1;
+    } else {
+        // O_PATH: basta con permiso de búsqueda, igual que chdir()
+        fd_nuevo = openat(dir_base(s), destino, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fd_nuevo == -1) {
+        escribir_formato(e, "cd: %s: %s\n", destino, strerror(errno));
+        return 1;
+    }
+
+    int fd_actual = s->fd_dir != -1 ? s->fd_dir : open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (s->fd_dir_anterior != -1) close(s->fd_dir_anterior);
+    s->fd_dir_anterior = fd_actual;
+    s->fd_dir = fd_nuevo;
+
+    if (strcmp(destino, "-") == 0) {
+        char ruta[PATH_MAX];
+        if (ruta_directorio(s, ruta, sizeof(ruta)) == 0) escribir_formato(e, "%s\n", ruta);
+    }
+    return 0;
+}
+
+/*
+ * Lista de nombres para ls.
+ */
+typedef struct {
+    char **nombres;
+    size_t num;
+    size_t cap;
+} lista_nombres_t;
+
+static int lista_agregar(lista_nombres_t *l, const char *nombre) {
+    if (l->num == l->cap) {
+        size_t nueva = l->cap ? l->cap * 2 : 32;
+        char **p = realloc(l->nombres, nueva * sizeof(char *));
+        if (p == NULL) return -1;
+        l->nombres = p;
+        l->cap = nueva;
+    }
+    if ((l->nombres[l->num] = strdup(nombre)) == NULL) return -1;
+    l->num++;
+    return 0;
+}
+
+static void lista_liberar(lista_nombres_t *l) {
+    for (size_t i = 0; i < l->num; i++) free(l->nombres[i]);
+    free(l->nombres);
+    memset(l, 0, sizeof(*l));
+}
+
+// Mismo orden que ls: strcoll() según LC_COLLATE
+static int comparar_nombres(const void *a, const void *b) {
+    const char *x = *(char * const *) a, *y = *(char * const *) b;
+    int r = strcoll(x, y);
+    return r != 0 ? r : strcmp(x, y);
+}
+
+static void lista_ordenar(lista_nombres_t *l) {
+    if (l->num > 1) qsort(l->nombres, l->num, sizeof(char *), comparar_nombres);
+}
+
+typedef enum { LS_VISIBLES, LS_CASI_TODOS, LS_TODOS } filtro_ls_t;
+
+/*
+ * Lee el directorio 'nombre' completo en 'l' (ordenado). Devuelve -1 si no se puede.
+ */
+static int leer_directorio(int base, const char *nombre, filtro_ls_t filtro, lista_nombres_t *l) {
+    int fd = openat(base, nombre, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    DIR *d = fdopendir(fd);
+    if (d == NULL) {
+        close(fd);
+        return -1;
+    }
+    struct dirent *ent;
+    int r = 0;
+    errno = 0;
+    while ((ent = readdir(d)) != NULL) {
+        const char *n = ent->d_name;
+        if (n[0] == '.') {
+            if (filtro == LS_VISIBLES) continue;
+            if (filtro == LS_CASI_TODOS && (n[1] == '\0' || (n[1] == '.' && n[2] == '\0'))) continue;
+        }
+        if (lista_agregar(l, n) == -1) { r = -1; break; }
+        errno = 0;
+    }
+    if (ent == NULL && errno != 0) r = -1;
+    closedir(d);
+    lista_ordenar(l);
+    return r;
+}
+
+/*
+ * ls [-1aA] [--] [archivo...], con el formato de una columna que usa ls cuando su
+ * salida no es una terminal. Los directorios se leen completos antes de escribir
+ * nada, para poder ceder el comando a /bin/ls si alguno falla.
+ */
+static int interno_ls(sesion_t *s, escritor_t *e, int argc, char *argv[]) {
+    filtro_ls_t filtro = LS_VISIBLES;
+    lista_nombres_t archivos = { 0 }, dirs = { 0 };
+    lista_nombres_t *contenidos = NULL;
+    int operandos = 0, fin_opciones = 0, r = 0;
+    int base = dir_base(s);
+
+    if (getenv("QUOTING_STYLE") != NULL) return INTERNO_NO_APLICA;
+    // getopt de glibc permuta: las opciones pueden ir después de los operandos
+    for (int i = 1; i < argc; i++) {
+        if (fin_opciones || argv[i][0] != '-' || argv[i][1] == '\0') { operandos++; continue; }
+        if (strcmp(argv[i], "--") == 0) { fin_opciones = 1; continue; }
+        if (argv[i][1] == '-') return INTERNO_NO_APLICA;
+        for (const char *c = argv[i] + 1; *c; c++) {
+            if (*c == 'a') filtro = LS_TODOS;
+            else if (*c == 'A') filtro = LS_CASI_TODOS;
+            else if (*c != '1') return INTERNO_NO_APLICA;
+        }
+    }
+
+    fin_opciones = 0;
+    for (int i = 1; i < argc && r == 0; i++) {
+        const char *nombre = argv[i];
+        if (!fin_opciones && nombre[0] == '-' && nombre[1] != '\0') {
+            if (strcmp(nombre, "--") == 0) fin_opciones = 1;
+            continue;
+        }
+        struct stat st;
+        // En los operandos se siguen los enlaces a directorios (los rotos se listan como archivo)
+        if (fstatat(base, nombre, &st, 0) == -1 && fstatat(base, nombre, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            r = -1;
+        } else {
+            r = lista_agregar(S_ISDIR(st.st_mode) ? &dirs : &archivos, nombre);
+        }
+    }
+    if (r == 0 && operandos == 0) r = lista_agregar(&dirs, ".");
+    if (r == 0) {
+        lista_ordenar(&archivos);
+        lista_ordenar(&dirs);
+        contenidos = calloc(dirs.num ? dirs.num : 1, sizeof(lista_nombres_t));
+        if (contenidos == NULL) r = -1;
+        for (size_t i = 0; r == 0 && i < dirs.num; i++) {
+            r = leer_directorio(base, dirs.nombres[i], filtro, &contenidos[i]);
+        }
+    }
+
+    if (r == 0) {
+        int encabezados = operandos > 1 || archivos.num > 0;
+        for (size_t i = 0; i < archivos.num; i++) {
+            escribir_texto(e, archivos.nombres[i]);
+            escribir(e, "\n", 1);
+        }
+        for (size_t i = 0; i < dirs.num; i++) {
+            if (archivos.num > 0 || i > 0) escribir(e, "\n", 1);
+            if (encabezados) escribir_formato(e, "%s:\n", dirs.nombres[i]);
+            for (size_t j = 0; j < contenidos[i].num; j++) {
+                escribir_texto(e, contenidos[i].nombres[j]);
+                escribir(e, "\n", 1);
+            }
+        }
+    }
+
+    for (size_t i = 0; contenidos != NULL && i < dirs.num; i++) lista_liberar(&contenidos[i]);
+    free(contenidos);
+    lista_liberar(&archivos);
+    lista_liberar(&dirs);
+    return r == 0 ? 0 : INTERNO_NO_APLICA;
+}
+
+/*
+ * Libera los archivos del 'cat' en curso.
+ */
+static void terminar_cat(canal_t *c) {
+    for (int i = c->cat_actual; i < c->cat_num; i++) close(c->cat_fds[i]);
+    free(c->cat_fds);
+    c->cat_fds = NULL;
+    c->cat_num = c->cat_actual = 0;
+    if (c->cat_solo_suma) {
+        c->cat_solo_suma = 0;
+        sumas_pendientes--;
+    }
+    if (c->sesion->canal_carga == c) {
+        c->sesion->envio_restante = 0;
+        c->sesion->canal_carga = NULL;
+    }
+}
+
+/*
+ * 1 si el archivo está en un sistema de archivos virtual (proc, sysfs), cuyo
+ * tamaño no indica cuánto se puede leer.
+ */
+static int archivo_virtual(int fd) {
+    struct statfs sf;
+    if (fstatfs(fd, &sf) == -1) return 1;
+    return sf.f_type == PROC_SUPER_MAGIC || sf.f_type == SYSFS_MAGIC;
+}
+
+/*
+ * Cuenta 'n' bytes enviados por una descarga (TRAMA_DESCARGA) y los suma a su CRC.
+ */
+static void contar_descarga(canal_t *c, const void *datos, size_t n) {
+    c->transferencia_crc = crc32(c->transferencia_crc, datos, (uInt) n);
+    c->transferencia_bytes += n;
+    metricas.bytes_descargados += n;
+}
+
+/*
+ * Lo mismo para los bytes que salieron con sendfile(): se releen del archivo, que
+ * los tiene en el caché de páginas. Es una copia a memoria del servidor, en lugar de
+ * las dos que harían read() y send().
+ */
+static void contar_descarga_archivo(canal_t *c, int fd, off_t offset, size_t n) {
+    while (n > 0) {
+        size_t k = n < sizeof(entrada_compresion) ? n : sizeof(entrada_compresion);
+        ssize_t r = pread(fd, entrada_compresion, k, offset);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            c->cat_estado = EIO; // El archivo se acortó: lo enviado no se puede sumar
+            return;
+        }
+        contar_descarga(c, entrada_compresion, r);
+        offset += r;
+        n -= r;
+    }
+}
+
+/*
+ * Pasa con sendfile() lo que falta de la trama en curso. Si el archivo se acortó
+ * mientras tanto, la trama se completa con ceros (su longitud ya se envió).
+ * Devuelve 1 si la trama quedó completa, 0 si el socket se llenó y -1 si la
+ * sesión se cerró.
+ */
+static int mover_sendfile(canal_t *c) {
+    sesion_t *s = c->sesion;
+    int fd = c->cat_fds[c->cat_actual];
+    while (s->envio_restante > 0) {
+        off_t desde = c->cat_offset;
+        ssize_t r = sendfile(s->fd, fd, &c->cat_offset, s->envio_restante);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                actualizar_eventos_cliente(s);
+                return 0;
+            }
+            registrar_errno(0, "Error en sendfile");
+            cerrar_sesion(s);
+            return -1;
+        }
+        if (r == 0) {
+            static const char ceros[BUFFER_SIZE];
+            registrar(NIVEL_AVISO, s->id, "El archivo se acortó durante 'cat'; la trama se completa con ceros");
+            while (s->envio_restante > 0) {
+                size_t k = s->envio_restante < sizeof(ceros) ? s->envio_restante : sizeof(ceros);
+                if (enviar_bytes(s, ceros, k) == -1) return -1;
+                s->envio_restante -= k;
+                c->bytes_respuesta += k;
+            }
+            if (c->tipo_comando == TIPO_TRANSFERENCIA) c->cat_estado = EIO;
+            break;
+        }
+        s->envio_restante -= r;
+        c->bytes_respuesta += r;
+        if (c->tipo_comando == TIPO_TRANSFERENCIA) contar_descarga_archivo(c, fd, desde, r);
+    }
+    return carga_completa(s) == -1 ? -1 : 1;
+}
+
+/*
+ * Avanza un PROTO_SOLO_SUMA: suma una lectura del rango y deja el resto para las
+ * siguientes vueltas del bucle (ver avanzar_sumas), así las demás sesiones no esperan
+ * mientras se leen hasta TRANSFERENCIA_MAX_SUMA bytes.
+ */
+static void avanzar_suma(canal_t *c) {
+    size_t k = sizeof(entrada_compresion);
+    if ((off_t) k > c->cat_fin - c->cat_offset) k = (size_t) (c->cat_fin - c->cat_offset);
+    ssize_t r = k > 0 ? pread(c->cat_fds[0], entrada_compresion, k, c->cat_offset) : 0;
+    if (r < 0 && errno == EINTR) return; // Se reintenta en la siguiente vuelta
+    if (r > 0) {
+        c->transferencia_crc = crc32(c->transferencia_crc, (const Bytef *) entrada_compresion, (uInt) r);
+        c->transferencia_bytes += r;
+        c->cat_offset += r;
+        if (c->cat_offset < c->cat_fin) return;
+    } else if (r < 0) {
+        c->cat_estado = errno;
+    }
+    int32_t estado = c->cat_estado;
+    terminar_cat(c);
+    finalizar_comando(c, estado);
+}
+
+/*
+ * Avanza un paso cada PROTO_SOLO_SUMA en curso. Se llama en cada vuelta del bucle
+ * mientras haya alguno, y entonces epoll no espera.
+ */
+static void avanzar_sumas(void) {
+    sesion_t *sig;
+    for (sesion_t *s = sesiones; s != NULL; s = sig) {
+        sig = s->sig;
+        for (int i = 0; i < MAX_CANALES && s->fd != -1; i++) {
+            if (s->canales[i] != NULL && s->canales[i]->cat_solo_suma) avanzar_suma(s->canales[i]);
+        }
+    }
+}
+
+/*
+ * Avanza el 'cat' en curso hasta terminarlo, hasta que el socket se llene o hasta
+ * agotar la ventana del canal; en esos casos reanudar_canal lo retoma. Los archivos
+ * pequeños y los virtuales se leen y se envían en tramas normales; los grandes pasan
+ * del archivo al socket con sendfile(), en tramas de hasta PROTO_MAX_CARGA bytes,
+ * sin copiarse al espacio del servidor.
+ */
+static void avanzar_cat(canal_t *c) {
+    sesion_t *s = c->sesion;
+    if (c->cat_solo_suma) {
+        avanzar_suma(c);
+        return;
+    }
+    while (c->cat_actual < c->cat_num) {
+        int fd = c->cat_fds[c->cat_actual];
+        struct stat st;
+
+        if (s->canal_carga == c) {
+            if (buffer_pendiente(&s->salida) > 0) {
+                actualizar_eventos_cliente(s); // Se retoma cuando el socket se vacíe
+                return;
+            }
+            if (mover_sendfile(c) <= 0) return;
+            continue;
+        }
+        if (c->corte != CORTE_NINGUNO) break; // Cortado por --tiempo-comando (ver cortar_comando)
+        if (s->canal_carga != NULL || salida_pendiente(s) >= SALIDA_MAX_PENDIENTE || c->ventana <= 0) {
+            actualizar_eventos_cliente(s);
+            if (s->canal_carga == NULL) cache_relanzar_espera(c);
+            return;
+        }
+        uint64_t permitido = salida_permitida(c);
+        if (permitido == 0) {
+            // En --salida-maxima: si queda un byte más por enviar, el comando la supera
+            char resto;
+            ssize_t r;
+            do { r = pread(fd, &resto, 1, c->cat_offset); } while (r < 0 && errno == EINTR);
+            if (r > 0) {
+                cortar_comando(c, CORTE_SALIDA);
+                return;
+            }
+            close(fd);
+            c->cat_actual++;
+            c->cat_offset = 0;
+            continue;
+        }
+        if (fstat(fd, &st) == -1) st.st_size = 0;
+        if (c->cat_fin >= 0 && c->cat_fin < st.st_size) st.st_size = c->cat_fin;
+        if (st.st_size - c->cat_offset >= CAT_MAX_LECTURA && !salida_por_copia(c) && !archivo_virtual(fd)) {
+            // La cabecera sale ahora; la carga, con sendfile() en cuanto el buffer esté vacío
+            uint8_t cabecera[PROTO_CABECERA];
+            off_t n = st.st_size - c->cat_offset;
+            if (n > PROTO_MAX_CARGA) n = PROTO_MAX_CARGA;
+            if (n > c->ventana) n = (off_t) c->ventana;
+            if ((uint64_t) n > permitido) n = (off_t) permitido;
+            trama_codificar(cabecera, TRAMA_DATOS, c->num, c->id_peticion, (uint32_t) n, 0);
+            if (enviar_a_cliente(s, cabecera, sizeof(cabecera)) == -1) return;
+            s->envio_restante = (size_t) n;
+            s->canal_carga = c;
+            c->ventana -= n;
+            continue;
+        }
+        // Lectura hasta el final del archivo (su tamaño puede no ser fiable) o del rango
+        char buf[BUFFER_SIZE];
+        int transferencia = c->tipo_comando == TIPO_TRANSFERENCIA;
+        char *lectura = s->compresion || transferencia ? entrada_compresion : buf;
+        size_t tam_lectura = s->compresion || transferencia ? sizeof(entrada_compresion) : sizeof(buf);
+        ssize_t n = 0;
+        while (c->ventana > 0 && salida_pendiente(s) < SALIDA_MAX_PENDIENTE) {
+            size_t k = tam_lectura;
+            if (c->cat_fin >= 0 && (off_t) k > c->cat_fin - c->cat_offset) k = (size_t) (c->cat_fin - c->cat_offset);
+            if (k > salida_permitida(c)) k = (size_t) salida_permitida(c);
+            if (k == 0) break;
+            n = pread(fd, lectura, k, c->cat_offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            if (transferencia) contar_descarga(c, lectura, n);
+            if (enviar_datos(c, lectura, n) == -1) return;
+            c->cat_offset += n;
+        }
+        if (c->ventana <= 0 || salida_pendiente(s) >= SALIDA_MAX_PENDIENTE || salida_permitida(c) == 0) continue;
+        if (n < 0 && errno != EAGAIN) {
+            int error = errno;
+            registrar_errno(0, "Error al leer archivo en 'cat'");
+            c->cat_estado = transferencia ? error : 1;
+        }
+        close(fd);
+        c->cat_actual++;
+        c->cat_offset = 0;
+    }
+    int32_t estado = c->corte != CORTE_NINGUNO ? 128 + SIGKILL : c->cat_estado;
+    terminar_cat(c);
+    finalizar_comando(c, estado);
+}
+
+/*
+ * cat archivo...: sólo archivos regulares y sin opciones. Todos se abren antes de
+ * empezar, así un archivo inexistente o sin permiso cede el comando a /bin/cat.
+ */
+static int interno_cat(sesion_t *s, escritor_t *e, int argc, char *argv[]) {
+    canal_t *c = e->c;
+    if (argc == 1) return 0; // Lee la entrada estándar, que es /dev/null
+    int *fds = malloc((argc - 1) * sizeof(int));
+    if (fds == NULL) return INTERNO_NO_APLICA;
+    int n = 0;
+    for (int i = 1; i < argc; i++) {
+        struct stat st;
+        int fd = argv[i][0] == '-' ? -1 :
+                 openat(dir_base(s), argv[i], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd != -1 && (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd == -1) {
+            while (n > 0) close(fds[--n]);
+            free(fds);
+            return INTERNO_NO_APLICA;
+        }
+        fds[n++] = fd;
+    }
+    c->cat_fds = fds;
+    c->cat_num = n;
+    c->cat_actual = 0;
+    c->cat_offset = 0;
+    c->cat_fin = -1;
+    c->cat_estado = 0;
+    c->estado = CANAL_EJECUTANDO;
+    programar_limite_comando(c);
+    avanzar_cat(c);
+    return INTERNO_EN_CURSO;
+}
+
+/*
+ * Permisos al estilo de ls -l (%A de stat).
+ */
+static void cadena_modo(mode_t m, char *c) {
+    c[0] = S_ISREG(m) ? '-' : S_ISDIR(m) ? 'd' : S_ISLNK(m) ? 'l' : S_ISCHR(m) ? 'c' :
+           S_ISBLK(m) ? 'b' : S_ISFIFO(m) ? 'p' : S_ISSOCK(m) ? 's' : '?';
+    c[1] = m & S_IRUSR ? 'r' : '-';
+    c[2] = m & S_IWUSR ? 'w' : '-';
+    c[3] = m & S_ISUID ? (m & S_IXUSR ? 's' : 'S') : (m & S_IXUSR ? 'x' : '-');
+    c[4] = m & S_IRGRP ? 'r' : '-';
+    c[5] = m & S_IWGRP ? 'w' : '-';
+    c[6] = m & S_ISGID ? (m & S_IXGRP ? 's' : 'S') : (m & S_IXGRP ? 'x' : '-');
+    c[7] = m & S_IROTH ? 'r' : '-';
+    c[8] = m & S_IWOTH ? 'w' : '-';
+    c[9] = m & S_ISVTX ? (m & S_IXOTH ? 't' : 'T') : (m & S_IXOTH ? 'x' : '-');
+    c[10] = '\0';
+}
+
+static const char *tipo_archivo(const struct statx *sx) {
+    mode_t m = sx->stx_mode;
+    if (S_ISREG(m)) return sx->stx_size == 0 ? "regular empty file" : "regular file";
+    if (S_ISDIR(m)) return "directory";
+    if (S_ISLNK(m)) return "symbolic link";
+    if (S_ISFIFO(m)) return "fifo";
+    if (S_ISSOCK(m)) return "socket";
+    if (S_ISCHR(m)) return "character special file";
+    if (S_ISBLK(m)) return "block special file";
+    return "weird file";
+}
+
+static void escribir_fecha(escritor_t *e, const char *titulo, const struct statx_timestamp *t) {
+    char fecha[64], zona[16];
+    struct tm tm;
+    time_t seg = (time_t) t->tv_sec;
+    localtime_r(&seg, &tm);
+    strftime(fecha, sizeof(fecha), "%Y-%m-%d %H:%M:%S", &tm);
+    strftime(zona, sizeof(zona), "%z", &tm);
+    escribir_formato(e, "%s: %s.%09u %s\n", titulo, fecha, t->tv_nsec, zona);
+}
+
+// Nombres que stat muestra tal cual (sin caracteres de control)
+static int nombre_imprimible(const char *n) {
+    for (; *n; n++) if ((unsigned char) *n < 0x20 || *n == 0x7f) return 0;
+    return 1;
+}
+
+/*
+ * stat archivo...: el formato por defecto de stat de coreutils. Todos los archivos
+ * se consultan antes de escribir, para ceder el comando a /bin/stat ante cualquier error.
+ */
+static int interno_stat(sesion_t *s, escritor_t *e, int argc, char *argv[]) {
+    if (argc < 2) return INTERNO_NO_APLICA;
+    struct statx *sx = malloc((argc - 1) * sizeof(struct statx));
+    char **destinos = calloc(argc - 1, sizeof(char *));
+    int r = (sx != NULL && destinos != NULL) ? 0 : -1;
+
+    for (int i = 1; r == 0 && i < argc; i++) {
+        struct statx *x = &sx[i - 1];
+        if (argv[i][0] == '-' || !nombre_imprimible(argv[i]) ||
+            statx(dir_base(s), argv[i], AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                  STATX_BASIC_STATS | STATX_BTIME, x) == -1) {
+            r = -1;
+            break;
+        }
+        if (S_ISLNK(x->stx_mode)) {
+            char destino[PATH_MAX];
+            ssize_t n = readlinkat(dir_base(s), argv[i], destino, sizeof(destino) - 1);
+            if (n < 0) { r = -1; break; }
+            destino[n] = '\0';
+            if (!nombre_imprimible(destino) || (destinos[i - 1] = strdup(destino)) == NULL) r = -1;
+        }
+    }
+
+    for (int i = 1; r == 0 && i < argc; i++) {
+        const struct statx *x = &sx[i - 1];
+        char modo[11], usuario[256], grupo[256], buf[4096];
+        struct passwd pw, *ppw = NULL;
+        struct group gr, *pgr = NULL;
+
+        getpwuid_r(x->stx_uid, &pw, buf, sizeof(buf), &ppw);
+        snprintf(usuario, sizeof(usuario), "%s", ppw ? ppw->pw_name : "UNKNOWN");
+        getgrgid_r(x->stx_gid, &gr, buf, sizeof(buf), &pgr);
+        snprintf(grupo, sizeof(grupo), "%s", pgr ? pgr->gr_name : "UNKNOWN");
+        cadena_modo(x->stx_mode, modo);
+
+        if (destinos[i - 1] != NULL) escribir_formato(e, "  File: %s -> %s\n", argv[i], destinos[i - 1]);
+        else escribir_formato(e, "  File: %s\n", argv[i]);
+        escribir_formato(e, "  Size: %-10llu\tBlocks: %-10llu IO Block: %-6u %s\n",
+                         (unsigned long long) x->stx_size, (unsigned long long) x->stx_blocks,
+                         x->stx_blksize, tipo_archivo(x));
+        if (S_ISCHR(x->stx_mode) || S_ISBLK(x->stx_mode)) {
+            escribir_formato(e, "Device: %u,%u\tInode: %-11llu Links: %-5u Device type: %u,%u\n",
+                             x->stx_dev_major, x->stx_dev_minor, (unsigned long long) x->stx_ino,
+                             x->stx_nlink, x->stx_rdev_major, x->stx_rdev_minor);
+        } else {
+            escribir_formato(e, "Device: %u,%u\tInode: %-11llu Links: %u\n",
+                             x->stx_dev_major, x->stx_dev_minor, (unsigned long long) x->stx_ino,
+                             x->stx_nlink);
+        }
+        escribir_formato(e, "Access: (%04o/%10.10s)  Uid: (%5u/%8s)   Gid: (%5u/%8s)\n",
+                         x->stx_mode & 07777, modo, x->stx_uid, usuario, x->stx_gid, grupo);
+        escribir_fecha(e, "Access", &x->stx_atime);
+        escribir_fecha(e, "Modify", &x->stx_mtime);
+        escribir_fecha(e, "Change", &x->stx_ctime);
+        if (x->stx_mask & STATX_BTIME) escribir_fecha(e, " Birth", &x->stx_btime);
+        else escribir_texto(e, " Birth: -\n");
+    }
+
+    for (int i = 0; destinos != NULL && i < argc - 1; i++) free(destinos[i]);
+    free(destinos);
+    free(sx);
+    return r == 0 ? 0 : INTERNO_NO_APLICA;
+}
+
+typedef struct {
+    const char *nombre;
+    int (*funcion)(sesion_t *s, escritor_t *e, int argc, char *argv[]);
+    int siempre;    // 1 si no tiene equivalente externo (no depende de internos_activos)
+} comando_interno_t;
+
+static const comando_interno_t comandos_internos[] = {
+    { "cd",   interno_cd,   1 },
+    { "pwd",  interno_pwd,  0 },
+    { "echo", interno_echo, 0 },
+    { "ls",   interno_ls,   0 },
+    { "cat",  interno_cat,  0 },
+    { "stat", interno_stat, 0 },
+};
+
+/*
+ * Atiende el comando dentro del servidor si es interno. Devuelve INTERNO_NO_APLICA
+ * si hay que lanzarlo como proceso; en otro caso la respuesta ya se envió (o se
+ * completa más tarde).
+ */
+static int ejecutar_interno(canal_t *c, int argc, char *argv[]) {
+    const comando_interno_t *interno = NULL;
+    for (size_t i = 0; i < sizeof(comandos_internos) / sizeof(comandos_internos[0]); i++) {
+        if (strcmp(argv[0], comandos_internos[i].nombre) == 0) {
+            interno = &comandos_internos[i];
+            break;
+        }
+    }
+    if (interno == NULL || (!interno->siempre && !internos_activos)) return INTERNO_NO_APLICA;
+    c->tipo_comando = TIPO_INTERNO;
+
+    escritor_t e;
+    e.c = c;
+    e.n = 0;
+    c->bytes_respuesta = 0;
+    int estado = interno->funcion(c->sesion, &e, argc, argv);
+    if (estado == INTERNO_NO_APLICA || estado == INTERNO_EN_CURSO) return estado;
+    if (escritor_vaciar(&e) == -1 || c->sesion->fd == -1) return 0;
+    finalizar_comando(c, estado);
+    return 0;
+}
+
+/*
+ * Los comandos internos imitan la salida en inglés de coreutils; con un idioma de
+ * mensajes distinto las herramientas reales traducirían sus textos.
+ */
+static int locale_compatible(void) {
+    const char *v = getenv("LC_ALL");
+    if (v == NULL || *v == '\0') v = getenv("LC_MESSAGES");
+    if (v == NULL || *v == '\0') v = getenv("LANG");
+    if (v == NULL || *v == '\0' || strcmp(v, "C") == 0 || strcmp(v, "POSIX") == 0 ||
+        strncmp(v, "C.", 2) == 0) {
+        return 1; // Con el locale C, LANGUAGE no se consulta
+    }
+    const char *idioma = getenv("LANGUAGE");
+    if (idioma != NULL && *idioma != '\0' && strncmp(idioma, "en", 2) != 0) return 0;
+    return strncmp(v, "en", 2) == 0;
+}
+
+/*
+ * Modo shell.
+ * Con '__shell' la sesión deja de lanzar un proceso por comando: el primer comando
+ * de cada canal arranca un /bin/sh propio del canal, conectado por un par de pipes,
+ * y cada comando se escribe en su entrada. Así las variables, el directorio, las funciones
+ * y los alias se conservan entre comandos, y se admiten tuberías y redirecciones.
+ * Cada comando va seguido de un 'printf' con una marca aleatoria nueva y el código
+ * de salida; la salida se reenvía hasta encontrar la marca, que no se envía.
+ */
+#define SHELL_LECTURA (64 * 1024)   // Bytes leídos de la salida del shell por llamada
+
+/*
+ * Arranca el shell del canal en un grupo de procesos propio, para poder
+ * terminar también los procesos que deje en segundo plano.
+ */
+static int iniciar_shell(canal_t *c) {
+    int entrada[2], salida[2];
+    if (pipe2(entrada, O_CLOEXEC) == -1) return -1;
+    if (pipe2(salida, O_CLOEXEC) == -1) {
+        close(entrada[0]); close(entrada[1]);
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(entrada[0]); close(entrada[1]);
+        close(salida[0]); close(salida[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        char *arg_list[] = { "sh", NULL };
+        setsid();
+        ejecutar_en_hijo(entrada[0], salida[1], salida[1], c->sesion->fd_dir, "/bin/sh", arg_list);
+    }
+    close(entrada[0]);
+    close(salida[1]);
+    fijar_no_bloqueante(entrada[1]);
+    fijar_no_bloqueante(salida[0]);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &c->f_shell };
+    if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, salida[0], &ev) == -1) {
+        registrar_errno(0, "Error en epoll_ctl (shell)");
+        close(entrada[1]);
+        close(salida[0]);
+        kill(pid, SIGKILL);
+        recolectar_hijo(pid);
+        return -1;
+    }
+    c->pid_shell = pid;
+    c->fd_shell_entrada = entrada[1];
+    c->fd_shell_salida = salida[0];
+    c->shell_pausado = 0;
+    c->shell_ocupado = 0;
+    c->shell_cola_len = 0;
+    registrar(NIVEL_INFO, c->sesion->id, "Shell del canal %u iniciado (PID %d)", c->num, (int) pid);
+    return 0;
+}
+
+/*
+ * Termina el shell del canal junto con los procesos que haya lanzado. Si el
+ * shell ya terminó (y se recolecta aparte) sólo se avisa a lo que quede de su grupo.
+ */
+static void terminar_shell(canal_t *c, int recolectado) {
+    if (c->pid_shell <= 0) return;
+    epoll_ctl(fd_epoll, EPOLL_CTL_DEL, c->fd_shell_salida, NULL);
+    close(c->fd_shell_salida);
+    close(c->fd_shell_entrada);
+    c->fd_shell_salida = c->fd_shell_entrada = -1;
+    kill(-c->pid_shell, SIGTERM);
+    if (!recolectado) {
+        kill(c->pid_shell, SIGKILL);
+        recolectar_hijo(c->pid_shell);
+    }
+    c->pid_shell = -1;
+    c->shell_ocupado = 0;
+    c->shell_cola_len = 0;
+}
+
+static void pausar_shell(canal_t *c) {
+    if (c->shell_pausado) return;
+    struct epoll_event ev = { .events = 0, .data.ptr = &c->f_shell };
+    epoll_ctl(fd_epoll, EPOLL_CTL_MOD, c->fd_shell_salida, &ev);
+    c->shell_pausado = 1;
+}
+
+static void reanudar_shell(canal_t *c) {
+    if (!c->shell_pausado) return;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &c->f_shell };
+    epoll_ctl(fd_epoll, EPOLL_CTL_MOD, c->fd_shell_salida, &ev);
+    c->shell_pausado = 0;
+}
+
+/*
+ * Marca aleatoria (hexadecimal) que señala el final de la salida de un comando.
+ */
+static void generar_marca(char *marca) {
+    static const char hex[] = "0123456789abcdef";
+    static unsigned long contador = 0;
+    unsigned char aleatorio[SHELL_MARCA / 2];
+    if (getrandom(aleatorio, sizeof(aleatorio), GRND_NONBLOCK) != (ssize_t) sizeof(aleatorio)) {
+        // Sin entropía disponible: una marca distinta por comando sigue bastando
+        unsigned long v = (unsigned long) time(NULL) ^ ((unsigned long) getpid() << 16) ^ ++contador;
+        for (size_t i = 0; i < sizeof(aleatorio); i++) {
+            v = v * 6364136223846793005UL + 1442695040888963407UL;
+            aleatorio[i] = (unsigned char) (v >> 56);
+        }
+    }
+    for (size_t i = 0; i < sizeof(aleatorio); i++) {
+        marca[2 * i] = hex[aleatorio[i] >> 4];
+        marca[2 * i + 1] = hex[aleatorio[i] & 0xf];
+    }
+    marca[SHELL_MARCA] = '\0';
+}
+
+/*
+ * Escribe el comando en la entrada del shell. 'command eval' evita que un error de
+ * sintaxis termine el shell; la entrada del comando es /dev/null, no la del shell.
+ */
+static void comando_en_shell(canal_t *c, const char *comando) {
+    c->tipo_comando = TIPO_SHELL;
+    if (c->pid_shell <= 0 && iniciar_shell(c) == -1) {
+        registrar_errno(0, "Error al iniciar el shell del canal");
+        responder_error(c, "Error interno del servidor (shell)\n");
+        return;
+    }
+    registrar(NIVEL_INFO, c->sesion->id, "Ejecutando en el shell del canal %u: %s", c->num, comando);
+    generar_marca(c->shell_marca);
+
+    // El comando va entre comillas simples: cada ' se escribe como '\''
+    size_t largo = strlen(comando);
+    char *guion = malloc(4 * largo + SHELL_MARCA + 96);
+    if (guion == NULL) {
+        responder_error(c, "Error interno del servidor (memoria)\n");
+        return;
+    }
+    char *p = guion + sprintf(guion, "command eval '");
+    for (const char *q = comando; *q; q++) {
+        if (*q == '\'') { memcpy(p, "'\\''", 4); p += 4; }
+        else *p++ = *q;
+    }
+    p += sprintf(p, "' </dev/null; command printf '%%s:%%d\\n' %s \"$?\"\n", c->shell_marca);
+
+    size_t n = (size_t) (p - guion), escritos = 0;
+    while (escritos < n) {
+        ssize_t r = write(c->fd_shell_entrada, guion + escritos, n - escritos);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        escritos += r;
+    }
+    free(guion);
+    if (escritos < n) {
+        // El shell no lee su entrada (terminó o está ocupado): se reemplaza en el siguiente comando
+        registrar_errno(0, "Error al escribir en el shell del canal");
+        terminar_shell(c, 0);
+        responder_error(c, "Error: el shell de la sesión no responde.\n");
+        return;
+    }
+    c->shell_ocupado = 1;
+    c->shell_cola_len = 0;
+    c->bytes_respuesta = 0;
+    c->estado = CANAL_EJECUTANDO;
+    c->t_lanzado = ahora_ns();
+    programar_limite_comando(c);
+}
+
+/*
+ * Envía salida del shell como respuesta del comando en curso. Devuelve -1 si la
+ * sesión se cerró o si el comando pasó de --salida-maxima y se terminó.
+ */
+static int enviar_salida_shell(canal_t *c, const char *datos, size_t n) {
+    if (n == 0) return 0;
+    if (c->t_primer_byte == 0) c->t_primer_byte = ahora_ns();
+    uint64_t permitido = salida_permitida(c);
+    if (n > permitido) {
+        if (enviar_datos(c, datos, (size_t) permitido) == -1) return -1;
+        cortar_comando(c, CORTE_SALIDA);
+        return -1;
+    }
+    return enviar_datos(c, datos, n);
+}
+
+/*
+ * El shell cerró su salida (terminó, por ejemplo con 'exit'). Si había un comando en
+ * curso se responde con el código de salida del shell; el siguiente comando arranca
+ * uno nuevo.
+ */
+static void shell_terminado(canal_t *c) {
+    int ocupado = c->shell_ocupado;
+    if (ocupado && enviar_salida_shell(c, c->shell_cola, c->shell_cola_len) == -1) return;
+    registrar(NIVEL_INFO, c->sesion->id, "El shell del canal %u terminó", c->num);
+    pid_t pid = c->pid_shell;
+    terminar_shell(c, 1);
+    if (!ocupado) {
+        recolectar_hijo(pid);
+        return;
+    }
+    // El shell cierra su salida al terminar, un instante antes de poder recolectarlo:
+    // se espera como al hijo de cualquier otro comando
+    c->pid_hijo = pid;
+    vigilar_hijo(c);
+}
+
+/*
+ * Reenvía la salida del shell hasta encontrar la marca del comando en curso. Los
+ * últimos bytes leídos se retienen en 'shell_cola' mientras puedan ser el comienzo
+ * de la marca, que puede llegar partida entre dos lecturas.
+ * La ventana del canal se comprueba antes de cada lectura, así que puede excederse
+ * como mucho en una lectura.
+ */
+static void leer_salida_shell(canal_t *c) {
+    sesion_t *s = c->sesion;
+    char buf[sizeof(c->shell_cola) + SHELL_LECTURA];
+
+    while (s->canal_carga == NULL && salida_pendiente(s) < SALIDA_MAX_PENDIENTE && c->ventana > 0) {
+        size_t total = c->shell_cola_len;
+        memcpy(buf, c->shell_cola, total);
+        ssize_t n = read(c->fd_shell_salida, buf + total, SHELL_LECTURA);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            registrar_errno(0, "Error al leer del shell");
+        }
+        if (n <= 0) {
+            shell_terminado(c);
+            return;
+        }
+        total += n;
+        c->shell_cola_len = 0;
+        if (!c->shell_ocupado) {
+            // Salida de procesos en segundo plano entre comandos: no hay a quién enviarla
+            registrar(NIVEL_INFO, c->sesion->id, "Salida del shell sin comando en curso (%zd bytes descartados)", n);
+            continue;
+        }
+
+        char *marca = memmem(buf, total, c->shell_marca, SHELL_MARCA);
+        size_t retener = SHELL_MARCA - 1;
+        size_t enviar = marca != NULL ? (size_t) (marca - buf) : (total > retener ? total - retener : 0);
+        if (enviar_salida_shell(c, buf, enviar) == -1) return;
+
+        char *fin = marca != NULL ? memchr(marca, '\n', total - enviar) : NULL;
+        if (fin == NULL) {
+            // Marca ausente o incompleta: retener el final para la próxima lectura
+            if (total - enviar > sizeof(c->shell_cola)) {
+                registrar(NIVEL_AVISO, c->sesion->id, "Marca de fin de comando inválida");
+                terminar_shell(c, 0);
+                finalizar_comando(c, PROTO_ESTADO_ERROR);
+                return;
+            }
+            memcpy(c->shell_cola, buf + enviar, total - enviar);
+            c->shell_cola_len = total - enviar;
+            continue;
+        }
+        int32_t estado = PROTO_ESTADO_ERROR;
+        if (marca[SHELL_MARCA] == ':') estado = (int32_t) strtol(marca + SHELL_MARCA + 1, NULL, 10);
+        c->shell_ocupado = 0;
+        finalizar_comando(c, estado);
+        return;
+    }
+    // Demasiada salida pendiente o ventana agotada: dejar de leer hasta poder seguir
+    pausar_shell(c);
+}
+
+/*
+ * __shell [on|off]: activa o desactiva el modo shell de la sesión.
+ */
+static void conmutar_modo_shell(canal_t *c, const char *argumento) {
+    c->bytes_respuesta = 0;
+    if (*argumento == '\0' || strcmp(argumento, "on") == 0) {
+        c->sesion->modo_shell = 1;
+        enviar_texto(c, TRAMA_DATOS, "Modo shell activado: los comandos se ejecutan en un shell persistente.\n");
+    } else if (strcmp(argumento, "off") == 0) {
+        // Los shells de los canales ocupados terminan al completar su comando
+        sesion_t *s = c->sesion;
+        s->modo_shell = 0;
+        for (int i = 0; i < MAX_CANALES; i++) {
+            if (s->canales[i] != NULL && !s->canales[i]->shell_ocupado) terminar_shell(s->canales[i], 0);
+        }
+        enviar_texto(c, TRAMA_DATOS, "Modo shell desactivado.\n");
+    } else {
+        responder_error(c, "Uso: __shell [on|off]\n");
+        return;
+    }
+    if (c->sesion->fd != -1) finalizar_comando(c, 0);
+}
+
+/*
+ * __stats: responde con el resumen de las métricas del servidor (ver escribir_estadisticas).
+ */
+static void mostrar_estadisticas(canal_t *c, const char *argumento) {
+    char *texto = NULL;
+    size_t largo = 0;
+    if (*argumento != '\0') {
+        responder_error(c, "Uso: __stats\n");
+        return;
+    }
+    FILE *f = open_memstream(&texto, &largo);
+    if (f == NULL) {
+        responder_error(c, "Error interno del servidor (memoria)\n");
+        return;
+    }
+    escribir_estadisticas(f);
+    fclose(f);
+    c->bytes_respuesta = 0;
+    int r = enviar_datos(c, texto, largo);
+    free(texto);
+    if (r == 0) finalizar_comando(c, 0);
+}
+
+/*
+ * Ejecuta un comando ya analizado: dentro del servidor si es interno y si no como
+ * proceso (o tubería de procesos). La respuesta se completa en finalizar_comando.
+ */
+static void ejecutar_comando(canal_t *c, const comando_t *cmd) {
+    int r = INTERNO_NO_APLICA;
+    if (comando_simple(cmd)) r = ejecutar_interno(c, cmd->etapas[0].argc, cmd->etapas[0].argv);
+    if (r == INTERNO_NO_APLICA) r = iniciar_comando(c, cmd);
+    if (r == -1) registrar(NIVEL_INFO, c->sesion->id, "Respuesta enviada (0 bytes)");
+}
+
+/*
+ * Caché de respuestas (--cache ARCHIVO).
+ * Los comandos de sólo lectura que se consultan una y otra vez desde muchas sesiones
+ * (uptime, df -h, cat /proc/meminfo...) se responden desde memoria mientras su
+ * respuesta no caduque, sin lanzar un proceso. Cada línea del archivo es
+ * 'TTL palabra...': un comando es cacheable si empieza por las palabras de alguna
+ * línea (vale la primera que coincida) y su respuesta se guarda TTL segundos. La
+ * clave son los argumentos ya analizados (sin comillas) junto con el directorio de
+ * trabajo de la sesión: 'ls' en dos directorios son dos entradas. Las tuberías y
+ * los comandos con redirecciones no pasan por la caché.
+ * - Sólo se guardan las respuestas con código de salida 0 y de hasta
+ *   CACHE_MAX_RESPUESTA bytes. La memoria total se limita con --cache-memoria,
+ *   expulsando las entradas usadas hace más tiempo (LRU).
+ * - Si llega un comando cuya respuesta se está generando, no se lanza otro proceso:
+ *   el canal espera y recibe la misma salida con el mismo código de salida. Si esa
+ *   respuesta no llega a grabarse (demasiado larga, error del servidor, sesión
+ *   cerrada) o se detiene por el control de flujo, cada canal en espera ejecuta su
+ *   propio comando.
+ * - La salida que se graba pasa por enviar_datos, como la comprimida: sin splice()
+ *   ni sendfile(). Desde la caché se envía respetando la ventana del canal.
+ * - Con --workers cada worker tiene su propia caché.
+ */
+#define CACHE_CUBETAS 1024                  // Cubetas de la tabla de entradas (potencia de 2)
+#define CACHE_MAX_RESPUESTA (256 * 1024)    // Respuestas más largas no se guardan
+#define CACHE_MEMORIA_POR_DEFECTO 16        // MB de --cache-memoria
+#define CACHE_MAX_REGLAS 256                // Líneas del archivo de --cache
+
+typedef struct {
+    char *palabras[MAX_TOKENS];
+    int num;
+    uint64_t ttl_ns;
+} regla_cache_t;
+
+typedef struct entrada_cache {
+    char *clave;                // Directorio (dispositivo e inodo) y argumentos, cada uno terminado en '\0'
+    size_t largo_clave;
+    uint64_t hash;
+    int argc;
+    const char *argumentos;     // Los argumentos dentro de 'clave' (para los canales en espera)
+    buffer_t salida;
+    int32_t estado;             // Código de salida de la respuesta grabada
+    uint64_t ttl_ns;
+    uint64_t expira;
+    size_t memoria;             // Bytes contados en metricas.cache_bytes
+    int en_curso;               // 1 mientras el canal que la graba ejecuta el comando
+    int excedida;               // 1 si la salida no cupo: no se guardará
+    int huerfana;               // 1 si ya no está en la tabla: se libera al quedar sin usuarios
+    int usuarios;               // Canales que envían su salida (no se expulsa mientras tanto)
+    canal_t *grabador;          // Canal que la graba mientras está en curso
+    canal_t *espera;            // Canales que esperan a que termine de grabarse
+    struct entrada_cache *sig_cubeta;
+    struct entrada_cache *mas_reciente;     // Lista LRU
+    struct entrada_cache *menos_reciente;
+} entrada_cache_t;
+
+static regla_cache_t reglas_cache[CACHE_MAX_REGLAS];
+static int num_reglas_cache = 0;            // 0: caché desactivada
+static size_t cache_memoria_max = (size_t) CACHE_MEMORIA_POR_DEFECTO * 1024 * 1024;
+static entrada_cache_t *cubetas_cache[CACHE_CUBETAS];
+static entrada_cache_t *cache_lru_primera = NULL;  // La usada más recientemente
+static entrada_cache_t *cache_lru_ultima = NULL;
+
+/*
+ * Lee las reglas del archivo de --cache. Las líneas vacías y las que empiezan por
+ * '#' se ignoran.
+ */
+static int cargar_reglas_cache(const char *archivo) {
+    FILE *f = fopen(archivo, "r");
+    char linea[BUFFER_SIZE];
+    int num_linea = 0;
+    if (f == NULL) {
+        perror("[SERVIDOR] Error al abrir el archivo de la caché");
+        return -1;
+    }
+    while (fgets(linea, sizeof(linea), f) != NULL) {
+        comando_t cmd;
+        char *texto, *fin = "";
+        num_linea++;
+        linea[strcspn(linea, "\r\n")] = '\0';
+        trim(linea);
+        if (linea[0] == '\0' || linea[0] == '#') continue;
+        // Las palabras de la regla apuntan a su propia copia de la línea, que se conserva
+        if ((texto = strdup(linea)) == NULL) {
+            perror("[SERVIDOR] Error al reservar memoria para la caché");
+            fclose(f);
+            return -1;
+        }
+        int valida = analizar_comando(texto, &cmd) == NULL && comando_simple(&cmd) && cmd.etapas[0].argc >= 2;
+        double ttl = valida ? strtod(cmd.etapas[0].argv[0], &fin) : 0;
+        if (!valida || *fin != '\0' || !(ttl > 0) || num_reglas_cache == CACHE_MAX_REGLAS) {
+            fprintf(stderr, "%s:%d: regla inválida (se esperaba 'TTL comando [argumentos...]')\n", archivo, num_linea);
+            free(texto);
+            fclose(f);
+            return -1;
+        }
+        regla_cache_t *r = &reglas_cache[num_reglas_cache++];
+        r->ttl_ns = (uint64_t) (ttl * 1e9);
+        for (int i = 1; i < cmd.etapas[0].argc; i++) r->palabras[i - 1] = cmd.etapas[0].argv[i];
+        r->num = cmd.etapas[0].argc - 1;
+    }
+    fclose(f);
+    return 0;
+}
+
+static const regla_cache_t *regla_para(int argc, char *argv[]) {
+    for (int i = 0; i < num_reglas_cache; i++) {
+        const regla_cache_t *r = &reglas_cache[i];
+        int j = 0;
+        while (j < r->num && j < argc && strcmp(r->palabras[j], argv[j]) == 0) j++;
+        if (j == r->num) return r;
+    }
+    return NULL;
+}
+
+static uint64_t hash_clave(const char *clave, size_t n) {
+    uint64_t h = 14695981039346656037ULL;    // FNV-1a
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char) clave[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void lru_quitar(entrada_cache_t *e) {
+    if (e->mas_reciente) e->mas_reciente->menos_reciente = e->menos_reciente;
+    else cache_lru_primera = e->menos_reciente;
+    if (e->menos_reciente) e->menos_reciente->mas_reciente = e->mas_reciente;
+    else cache_lru_ultima = e->mas_reciente;
+    e->mas_reciente = e->menos_reciente = NULL;
+}
+
+static void lru_insertar(entrada_cache_t *e) {
+    e->menos_reciente = cache_lru_primera;
+    if (cache_lru_primera) cache_lru_primera->mas_reciente = e;
+    cache_lru_primera = e;
+    if (cache_lru_ultima == NULL) cache_lru_ultima = e;
+}
+
+static void lru_al_frente(entrada_cache_t *e) {
+    lru_quitar(e);
+    lru_insertar(e);
+}
+
+/*
+ * Vuelve a contar la memoria de la entrada tras cambiar su salida.
+ */
+static void cache_contar_memoria(entrada_cache_t *e) {
+    size_t memoria = sizeof(*e) + e->largo_clave + e->salida.capacidad;
+    if (!e->huerfana) metricas.cache_bytes = metricas.cache_bytes - e->memoria + memoria;
+    e->memoria = memoria;
+}
+
+static void cache_liberar(entrada_cache_t *e) {
+    free(e->clave);
+    buffer_liberar(&e->salida);
+    free(e);
+}
+
+/*
+ * Saca la entrada de la tabla. Si algún canal aún envía su salida, la entrada queda
+ * huérfana y la libera el último (ver cache_soltar).
+ */
+static void cache_quitar(entrada_cache_t *e) {
+    entrada_cache_t **p = &cubetas_cache[e->hash & (CACHE_CUBETAS - 1)];
+    while (*p != e) p = &(*p)->sig_cubeta;
+    *p = e->sig_cubeta;
+    lru_quitar(e);
+    metricas.cache_entradas--;
+    metricas.cache_bytes -= e->memoria;
+    e->huerfana = 1;
+    if (e->usuarios == 0) cache_liberar(e);
+}
+
+static void cache_soltar(entrada_cache_t *e) {
+    e->usuarios--;
+    if (e->huerfana && e->usuarios == 0) cache_liberar(e);
+}
+
+/*
+ * Expulsa las entradas usadas hace más tiempo hasta volver bajo el límite de memoria.
+ * Las que se están grabando o enviando se respetan.
+ */
+static void cache_recortar(void) {
+    entrada_cache_t *e = cache_lru_ultima;
+    while (e != NULL && metricas.cache_bytes > cache_memoria_max) {
+        entrada_cache_t *anterior = e->mas_reciente;
+        if (!e->en_curso && e->usuarios == 0) {
+            cache_quitar(e);
+            metricas.cache_expulsiones++;
+        }
+        e = anterior;
+    }
+}
+
+/*
+ * La respuesta en grabación no se guardará: se libera lo copiado y el resto de la
+ * salida vuelve a ir directa al socket.
+ */
+static void cache_exceder(canal_t *c) {
+    entrada_cache_t *e = c->grabacion;
+    e->excedida = 1;
+    c->grabando = 0;
+    buffer_liberar(&e->salida);
+    cache_contar_memoria(e);
+}
+
+static void cache_grabar(canal_t *c, const void *datos, size_t n) {
+    entrada_cache_t *e = c->grabacion;
+    if (buffer_pendiente(&e->salida) + n > CACHE_MAX_RESPUESTA || buffer_agregar(&e->salida, datos, n) == -1) {
+        cache_exceder(c);
+        return;
+    }
+    cache_contar_memoria(e);
+    cache_recortar();
+    if (metricas.cache_bytes > cache_memoria_max) cache_exceder(c);
+}
+
+/*
+ * Envía la salida de la entrada desde donde quedó, hasta terminarla, hasta que el
+ * socket se llene o hasta agotar la ventana del canal (como avanzar_cat).
+ */
+static void avanzar_cache(canal_t *c) {
+    sesion_t *s = c->sesion;
+    entrada_cache_t *e = c->respuesta_cache;
+    while (c->cache_enviado < buffer_pendiente(&e->salida)) {
+        if (s->canal_carga != NULL || salida_pendiente(s) >= SALIDA_MAX_PENDIENTE || c->ventana <= 0) {
+            actualizar_eventos_cliente(s);
+            return;
+        }
+        size_t n = buffer_pendiente(&e->salida) - c->cache_enviado;
+        if (salida_permitida(c) == 0) {
+            cortar_comando(c, CORTE_SALIDA);
+            return;
+        }
+        if (n > COMPRESION_LECTURA) n = COMPRESION_LECTURA;
+        if ((int64_t) n > c->ventana) n = (size_t) c->ventana;
+        if (n > salida_permitida(c)) n = (size_t) salida_permitida(c);
+        if (enviar_datos(c, e->salida.datos + e->salida.inicio + c->cache_enviado, n) == -1) return;
+        c->cache_enviado += n;
+    }
+    int32_t estado = e->estado;
+    c->respuesta_cache = NULL;
+    cache_soltar(e);
+    finalizar_comando(c, estado);
+}
+
+static void responder_desde_cache(canal_t *c, entrada_cache_t *e) {
+    e->usuarios++;
+    c->respuesta_cache = e;
+    c->cache_enviado = 0;
+    programar_limite_comando(c);
+    avanzar_cache(c);
+}
+
+/*
+ * Un canal que esperaba una respuesta que no llegó a grabarse ejecuta su comando.
+ */
+static void ejecutar_sin_cache(canal_t *c, const entrada_cache_t *e) {
+    char texto[BUFFER_SIZE];
+    char *argv[MAX_TOKENS];
+    comando_t cmd;
+    size_t largo = e->largo_clave - (size_t) (e->argumentos - e->clave);
+    memcpy(texto, e->argumentos, largo);
+    char *p = texto;
+    for (int i = 0; i < e->argc; i++) {
+        argv[i] = p;
+        p += strlen(p) + 1;
+    }
+    argv[e->argc] = NULL;
+    c->estado = CANAL_ESPERANDO_COMANDO;
+    c->tipo_comando = TIPO_OTRO;
+    comando_de_argumentos(&cmd, e->argc, argv);
+    ejecutar_comando(c, &cmd);
+    if (c->sesion->fd != -1 && c->estado == CANAL_ESPERANDO_COMANDO) procesar_cola(c);
+}
+
+/*
+ * Atiende la lista de canales que esperaban la entrada: reciben su salida o, si no
+ * se va a compartir, ejecutan su comando.
+ */
+static void atender_espera(entrada_cache_t *e, canal_t *espera, int compartir) {
+    while (espera != NULL) {
+        canal_t *w = espera;
+        espera = w->sig_espera;
+        w->sig_espera = NULL;
+        w->espera_cache = NULL;
+        if (w->sesion->fd == -1) continue; // Se cerró mientras se atendía a otro canal en espera
+        if (compartir) responder_desde_cache(w, e);
+        else ejecutar_sin_cache(w, e);
+    }
+}
+
+/*
+ * Terminó el comando que grababa la entrada del canal. La respuesta se guarda si
+ * salió bien y completa; los canales en espera la reciben o, si no llegó a grabarse,
+ * ejecutan su propio comando.
+ */
+static void cache_completar(canal_t *c, int32_t estado) {
+    entrada_cache_t *e = c->grabacion;
+    canal_t *espera = e->espera;
+    int compartir = !e->excedida && !e->huerfana && estado != PROTO_ESTADO_ERROR;
+    c->grabacion = NULL;
+    c->grabando = 0;
+    e->en_curso = 0;
+    e->grabador = NULL;
+    e->espera = NULL;
+    e->estado = estado;
+    e->usuarios++; // No se expulsa mientras se atiende a los canales en espera
+    if (compartir && estado == 0) {
+        // El buffer creció por duplicación: se ajusta a lo grabado
+        char *datos = buffer_pendiente(&e->salida) > 0 ? realloc(e->salida.datos, e->salida.fin) : NULL;
+        if (datos != NULL) {
+            e->salida.datos = datos;
+            e->salida.capacidad = e->salida.fin;
+        }
+        cache_contar_memoria(e);
+        e->expira = ahora_ns() + e->ttl_ns;
+    } else if (!e->huerfana) {
+        cache_quitar(e);
+    }
+    atender_espera(e, espera, compartir);
+    cache_soltar(e);
+    cache_recortar();
+}
+
+/*
+ * La respuesta que graba el canal se detuvo por el control de flujo. Los canales en
+ * espera ejecutan su propio comando en lugar de depender de un cliente lento, o del
+ * propio cliente, que puede estar esperando sus respuestas antes de conceder más
+ * ventana al canal que graba.
+ */
+static void cache_relanzar_espera(canal_t *c) {
+    entrada_cache_t *e = c->grabacion;
+    if (e == NULL || e->espera == NULL) return;
+    canal_t *espera = e->espera;
+    e->espera = NULL;
+    e->usuarios++; // Un canal relanzado puede cerrar la sesión del que graba
+    atender_espera(e, espera, 0);
+    cache_soltar(e);
+}
+
+/*
+ * El canal deja de esperar la entrada (su sesión se cierra).
+ */
+static void cache_dejar_de_esperar(canal_t *c) {
+    canal_t **p = &c->espera_cache->espera;
+    while (*p != NULL && *p != c) p = &(*p)->sig_espera;
+    if (*p == c) *p = c->sig_espera;
+    c->espera_cache = NULL;
+    c->sig_espera = NULL;
+}
+
+/*
+ * Busca en la caché el comando del canal. Devuelve 1 si la respuesta sale de la
+ * caché (o de la misma petición en curso) y 0 si hay que ejecutarlo; si es
+ * cacheable, el canal queda grabando su respuesta.
+ */
+static int consultar_cache(canal_t *c, int argc, char *argv[]) {
+    sesion_t *s = c->sesion;
+    char clave[2 * sizeof(uint64_t) + BUFFER_SIZE];
+    struct stat st;
+    if (num_reglas_cache == 0 || strcmp(argv[0], "cd") == 0) return 0;
+    const regla_cache_t *regla = regla_para(argc, argv);
+    if (regla == NULL || fstatat(dir_base(s), "", &st, AT_EMPTY_PATH) == -1) return 0;
+
+    uint64_t dispositivo = st.st_dev, inodo = st.st_ino;
+    size_t largo = 0;
+    memcpy(clave, &dispositivo, sizeof(dispositivo));
+    memcpy(clave + sizeof(dispositivo), &inodo, sizeof(inodo));
+    largo = 2 * sizeof(uint64_t);
+    for (int i = 0; i < argc; i++) {
+        size_t n = strlen(argv[i]) + 1;
+        memcpy(clave + largo, argv[i], n); // Los argumentos salen del texto del comando, que cabe en BUFFER_SIZE
+        largo += n;
+    }
+    uint64_t hash = hash_clave(clave, largo);
+    entrada_cache_t *e = cubetas_cache[hash & (CACHE_CUBETAS - 1)];
+    while (e != NULL && (e->hash != hash || e->largo_clave != largo || memcmp(e->clave, clave, largo) != 0)) {
+        e = e->sig_cubeta;
+    }
+    if (e != NULL && !e->en_curso && ahora_ns() >= e->expira) {
+        cache_quitar(e); // Caducada
+        e = NULL;
+    }
+    if (e != NULL && e->en_curso && (e->grabador->ventana <= 0 ||
+                                     salida_pendiente(e->grabador->sesion) >= SALIDA_MAX_PENDIENTE)) {
+        // La respuesta en curso está detenida por el control de flujo (ver cache_relanzar_espera)
+        metricas.cache_fallos++;
+        return 0;
+    }
+
+    if (e == NULL) {
+        e = calloc(1, sizeof(entrada_cache_t));
+        if (e == NULL || (e->clave = malloc(largo)) == NULL) {
+            free(e);
+            return 0;
+        }
+        memcpy(e->clave, clave, largo);
+        e->largo_clave = largo;
+        e->hash = hash;
+        e->argc = argc;
+        e->argumentos = e->clave + 2 * sizeof(uint64_t);
+        e->ttl_ns = regla->ttl_ns;
+        e->en_curso = 1;
+        e->grabador = c;
+        e->sig_cubeta = cubetas_cache[hash & (CACHE_CUBETAS - 1)];
+        cubetas_cache[hash & (CACHE_CUBETAS - 1)] = e;
+        lru_insertar(e);
+        metricas.cache_entradas++;
+        cache_contar_memoria(e);
+        metricas.cache_fallos++;
+        c->grabacion = e;
+        c->grabando = 1;
+        cache_recortar();
+        return 0;
+    }
+
+    lru_al_frente(e);
+    c->tipo_comando = TIPO_CACHE;
+    c->estado = CANAL_EJECUTANDO;
+    c->bytes_respuesta = 0;
+    if (e->en_curso) {
+        registrar(NIVEL_INFO, s->id, "La misma petición está en curso: se espera su respuesta");
+        metricas.cache_compartidas++;
+        c->espera_cache = e;
+        c->sig_espera = e->espera;
+        e->espera = c;
+        return 1;
+    }
+    registrar(NIVEL_INFO, s->id, "Respuesta desde la caché (%zu bytes)", buffer_pendiente(&e->salida));
+    metricas.cache_aciertos++;
+    responder_desde_cache(c, e);
+    return 1;
+}
+
+/*
+ * Transferencias de archivos (PROTO_CAP_TRANSFERENCIA, ver protocolo.h).
+ * Una descarga reutiliza el 'cat' interno, limitado al rango pedido: los trozos
+ * largos pasan del archivo al socket con sendfile() y los cortos con pread(), nunca
+ * comprimidos, y el CRC-32 de lo enviado se calcula por el camino. Una subida escribe
+ * los datos de cada trama del cliente en su lugar del archivo directamente desde el
+ * buffer de entrada, sin copiarlos antes; el archivo toma su tamaño final con el
+ * primer trozo y el espacio de cada trozo se reserva con fallocate() al empezarlo,
+ * así un disco lleno se detecta antes de recibir los datos.
+ */
+#define TRANSFERENCIA_MAX_SUMA (16 * 1024 * 1024) // Bytes que puede sumar un PROTO_SOLO_SUMA
+#define RECEPCION_SUBIDA (256 * 1024)              // Bytes por recv() mientras la sesión recibe subidas
+
+/*
+ * Responde a una transferencia que llega a un canal ocupado, sin tocar la petición
+ * en curso del canal.
+ */
+static void rechazar_transferencia(canal_t *c, uint32_t id, int32_t error) {
+    uint8_t resumen[PROTO_RESUMEN_TRANSFERENCIA] = { 0 };
+    enviar_trama(c->sesion, TRAMA_FIN, c->num, id, error, resumen, sizeof(resumen));
+}
+
+static void iniciar_descarga(canal_t *c, const peticion_transferencia_t *p, const char *ruta, int32_t opciones) {
+    struct stat st;
+    int32_t error = 0;
+    int fd = openat(dir_base(c->sesion), ruta, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1) error = errno;
+    else if (!S_ISREG(st.st_mode)) error = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+    if (error != 0) {
+        if (fd != -1) close(fd);
+        finalizar_comando(c, error);
+        return;
+    }
+    // Un trozo que pasa del final del archivo se acorta
+    off_t desde = p->desplazamiento < (uint64_t) st.st_size ? (off_t) p->desplazamiento : st.st_size;
+    off_t hasta = p->longitud < (uint64_t) (st.st_size - desde) ? desde + (off_t) p->longitud : st.st_size;
+    c->transferencia_tamano = (uint64_t) st.st_size;
+    if ((opciones & PROTO_SOLO_SUMA) && hasta - desde > TRANSFERENCIA_MAX_SUMA) {
+        close(fd);
+        finalizar_comando(c, EFBIG);
+        return;
+    }
+    c->cat_fds = malloc(sizeof(int));
+    if (c->cat_fds == NULL) {
+        close(fd);
+        finalizar_comando(c, ENOMEM);
+        return;
+    }
+    c->cat_fds[0] = fd;
+    c->cat_num = 1;
+    c->cat_actual = 0;
+    c->cat_offset = desde;
+    c->cat_fin = hasta;
+    c->cat_estado = 0;
+    if (opciones & PROTO_SOLO_SUMA) {
+        // El rango se suma sin enviarlo, por pasos (ver avanzar_suma)
+        c->cat_solo_suma = 1;
+        sumas_pendientes++;
+    }
+    c->compresion = COMPRESION_DESCARTADA; // Los datos viajan tal cual, con sendfile() si el trozo es largo
+    c->estado = CANAL_EJECUTANDO;
+    avanzar_cat(c);
+}
+
+static void terminar_subida(canal_t *c) {
+    int32_t error = c->subida_error;
+    if (close(c->fd_subida) == -1 && error == 0) error = errno;
+    c->fd_subida = -1;
+    c->sesion->subidas_activas--;
+    registrar(NIVEL_INFO, c->sesion->id, "Subida recibida (%llu bytes)", (unsigned long long) c->transferencia_bytes);
+    finalizar_comando(c, error);
+}
+
+static void iniciar_subida(canal_t *c, const peticion_transferencia_t *p, const char *ruta) {
+    struct stat st;
+    int32_t error = 0;
+    int fd = -1;
+    c->transferencia_tamano = p->tamano;
+    if (p->tamano > INT64_MAX || p->desplazamiento > p->tamano || p->longitud > p->tamano - p->desplazamiento) {
+        error = EINVAL;
+    } else {
+        // Sin O_TRUNC: al reanudar, los trozos ya subidos se conservan
+        fd = openat(dir_base(c->sesion), ruta, O_WRONLY | O_CREAT | O_NONBLOCK | O_CLOEXEC, 0666);
+        if (fd == -1 || fstat(fd, &st) == -1) error = errno;
+        else if (!S_ISREG(st.st_mode)) error = EINVAL;
+        else if (st.st_size != (off_t) p->tamano && ftruncate(fd, (off_t) p->tamano) == -1) error = errno;
+        else if (p->longitud > 0 && fallocate(fd, 0, (off_t) p->desplazamiento, (off_t) p->longitud) == -1 &&
+                 errno != EOPNOTSUPP && errno != ENOSYS) error = errno;
+    }
+    if (error != 0) {
+        // Los datos que el cliente ya envió se descartan al llegar (ver procesar_tramas)
+        if (fd != -1) close(fd);
+        finalizar_comando(c, error);
+        return;
+    }
+    c->fd_subida = fd;
+    c->subida_offset = (off_t) p->desplazamiento;
+    c->subida_restante = p->longitud;
+    c->subida_error = 0;
+    c->estado = CANAL_EJECUTANDO;
+    c->sesion->subidas_activas++;
+    if (c->subida_restante == 0) terminar_subida(c);
+}
+
+/*
+ * Escribe en su lugar del archivo los datos de una trama de la subida en curso, tal
+ * como están en el buffer de entrada. Tras un error de escritura el resto de la
+ * subida se descarta y la trama de fin informa el error.
+ */
+static void recibir_subida(canal_t *c, const char *datos, size_t n) {
+    if (n > c->subida_restante) n = (size_t) c->subida_restante; // Lo que sobre se ignora
+    c->subida_restante -= n;
+    while (n > 0 && c->subida_error == 0) {
+        ssize_t r = pwrite(c->fd_subida, datos, n, c->subida_offset);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            c->subida_error = r < 0 ? errno : EIO;
+            registrar(NIVEL_ERROR, c->sesion->id, "Error al escribir la subida: %s", strerror(c->subida_error));
+            break;
+        }
+        c->transferencia_crc = crc32(c->transferencia_crc, (const Bytef *) datos, (uInt) r);
+        c->transferencia_bytes += r;
+        metricas.bytes_subidos += r;
+        c->subida_offset += r;
+        datos += r;
+        n -= r;
+    }
+    if (c->subida_restante == 0) terminar_subida(c);
+}
+
+/*
+ * Atiende una TRAMA_DESCARGA o TRAMA_SUBIDA recibida en el instante 'llegada'. No
+ * pasan por la cola: en un canal ocupado se rechazan con EBUSY.
+ */
+static void atender_transferencia(canal_t *c, const cabecera_trama_t *t, const uint8_t *carga, uint64_t llegada) {
+    sesion_t *s = c->sesion;
+    peticion_transferencia_t p;
+    char ruta[PATH_MAX];
+    size_t largo_ruta = t->longitud > PROTO_PETICION_TRANSFERENCIA ? t->longitud - PROTO_PETICION_TRANSFERENCIA : 0;
+
+    if (c->estado != CANAL_ESPERANDO_COMANDO || buffer_pendiente(&c->cola) > 0) {
+        registrar(NIVEL_INFO, s->id, "Transferencia rechazada: el canal %u está ocupado", c->num);
+        rechazar_transferencia(c, t->id, EBUSY);
+        return;
+    }
+    c->id_peticion = t->id;
+    c->tipo_comando = TIPO_TRANSFERENCIA;
+    c->t_llegada = llegada;
+    c->t_inicio = ahora_ns();
+    c->t_lanzado = c->t_primer_byte = c->t_salida_cerrada = 0;
+    c->bytes_respuesta = 0;
+    c->subida = t->tipo == TRAMA_SUBIDA;
+    c->transferencia_tamano = c->transferencia_bytes = 0;
+    c->transferencia_crc = crc32(0, NULL, 0);
+    if (largo_ruta == 0 || largo_ruta >= sizeof(ruta) ||
+        memchr(carga + PROTO_PETICION_TRANSFERENCIA, '\0', largo_ruta) != NULL) {
+        registrar(NIVEL_INFO, s->id, "Petición de transferencia inválida");
+        finalizar_comando(c, EINVAL);
+        return;
+    }
+    peticion_decodificar(carga, &p);
+    memcpy(ruta, carga + PROTO_PETICION_TRANSFERENCIA, largo_ruta);
+    ruta[largo_ruta] = '\0';
+    registrar(NIVEL_INFO, s->id, "%s de '%s' en el canal %u (%llu bytes desde %llu)",
+              c->subida ? "Subida" : (t->estado & PROTO_SOLO_SUMA) ? "Suma" : "Descarga", ruta, c->num,
+              (unsigned long long) p.longitud, (unsigned long long) p.desplazamiento);
+    if (c->subida) iniciar_subida(c, &p, ruta);
+    else iniciar_descarga(c, &p, ruta, t->estado);
+}
+
+/*
+ * Atiende un comando recibido del cliente.
+ */
+static void procesar_comando(canal_t *c, char *buf_comando_raw) {
+    sesion_t *s = c->sesion;
+    char buf_comando_trimmed[BUFFER_SIZE];
+    comando_t cmd;
+
+    // Limpiar saltos de línea
+    memset(buf_comando_trimmed, '\0', sizeof(buf_comando_trimmed));
+    strncpy(buf_comando_trimmed, buf_comando_raw, sizeof(buf_comando_trimmed) -1);
+    buf_comando_trimmed[strcspn(buf_comando_trimmed, "\r\n")] = 0;
+    trim(buf_comando_trimmed);
+
+    if (c->num == 0) registrar(NIVEL_INFO, s->id, "Comando recibido: '%s'", buf_comando_trimmed);
+    else registrar(NIVEL_INFO, s->id, "Comando recibido en el canal %u: '%s'", c->num, buf_comando_trimmed);
+
+    // Verificar comandos de salida (cierran la sesión entera, con todos sus canales)
+    if (strcmp(buf_comando_trimmed, "salir") == 0 || strcmp(buf_comando_trimmed, "exit") == 0) {
+        const char* despedida_msg = "Desconectando. ¡Hasta luego!\n";
+        s->estado = SESION_CERRANDO;
+        c->t_llegada = 0; // Sin trama de fin: no cuenta como comando
+        if (enviar_texto(c, TRAMA_ADIOS, despedida_msg) == -1) return;
+        if (buffer_pendiente(&s->salida) == 0 && s->canal_carga == NULL) cerrar_sesion(s);
+        else actualizar_eventos_cliente(s);
+        return;
+    }
+
+    // Verificar comando vacío
+    if (strlen(buf_comando_trimmed) == 0) {
+        const char* error_vacio_msg = "Error: Comando vacío recibido.\n";
+        if (responder_error(c, error_vacio_msg) == -1) return;
+        registrar(NIVEL_INFO, s->id, "Respuesta enviada (%zu bytes)", strlen(error_vacio_msg));
+        return;
+    }
+
+    // Modo shell: '__shell [on|off]' lo cambia; activo, todo comando va al shell del canal
+    if (strncmp(buf_comando_trimmed, "__shell", 7) == 0 &&
+        (buf_comando_trimmed[7] == '\0' || isspace((unsigned char) buf_comando_trimmed[7]))) {
+        char *argumento = buf_comando_trimmed + 7;
+        trim(argumento);
+        conmutar_modo_shell(c, argumento);
+        return;
+    }
+    if (strncmp(buf_comando_trimmed, "__stats", 7) == 0 &&
+        (buf_comando_trimmed[7] == '\0' || isspace((unsigned char) buf_comando_trimmed[7]))) {
+        char *argumento = buf_comando_trimmed + 7;
+        trim(argumento);
+        mostrar_estadisticas(c, argumento);
+        return;
+    }
+    if (s->modo_shell) {
+        comando_en_shell(c, buf_comando_trimmed);
+        return;
+    }
+
+    // Ejecutar comando; la respuesta se completa en finalizar_comando
+    registrar(NIVEL_INFO, s->id, "Ejecutando comando: %s", buf_comando_trimmed);
+
+    const char *error = analizar_comando(buf_comando_trimmed, &cmd);
+    if (error != NULL) {
+        if (responder_error(c, error) == -1) return;
+        registrar(NIVEL_INFO, s->id, "Respuesta enviada (%zu bytes)", strlen(error));
+        return;
+    }
+    if (!comando_simple(&cmd) || !consultar_cache(c, cmd.etapas[0].argc, cmd.etapas[0].argv)) ejecutar_comando(c, &cmd);
+}
+
+/*
+ * Atiende el comando 'id' con el texto recibido en la trama en el instante 'llegada'.
+ */
+static void atender_comando(canal_t *c, uint32_t id, const char *texto, uint32_t longitud, uint64_t llegada) {
+    char buf_comando_raw[BUFFER_SIZE];
+    c->id_peticion = id;
+    c->tipo_comando = TIPO_OTRO;
+    c->t_llegada = llegada;
+    c->t_inicio = ahora_ns();
+    c->t_lanzado = c->t_primer_byte = c->t_salida_cerrada = 0;
+    if (longitud >= sizeof(buf_comando_raw)) {
+        registrar(NIVEL_INFO, c->sesion->id, "Comando demasiado largo (%u bytes)", longitud);
+        responder_error(c, "Error: Comando demasiado largo.\n");
+        return;
+    }
+    memcpy(buf_comando_raw, texto, longitud);
+    buf_comando_raw[longitud] = '\0';
+    procesar_comando(c, buf_comando_raw);
+}
+
+/*
+ * Canal 'num' de la sesión, que se crea la primera vez que el cliente lo usa.
+ */
+static canal_t *obtener_canal(sesion_t *s, uint16_t num) {
+    if (s->canales[num] != NULL) return s->canales[num];
+    canal_t *c = calloc(1, sizeof(canal_t));
+    if (c == NULL) return NULL;
+    c->sesion = s;
+    c->num = num;
+    c->estado = CANAL_ESPERANDO_COMANDO;
+    c->fd_pipe = -1;
+    c->fd_hijo = -1;
+    c->pid_hijo = -1;
+    c->ranura = -1;
+    c->pid_shell = -1;
+    c->fd_shell_entrada = -1;
+    c->fd_shell_salida = -1;
+    c->fd_subida = -1;
+    c->cat_fin = -1;
+    c->ventana = PROTO_VENTANA_INICIAL;
+    c->f_pipe.tipo = FUENTE_PIPE;
+    c->f_hijo.tipo = FUENTE_HIJO;
+    c->f_shell.tipo = FUENTE_SHELL;
+    c->f_pipe.sesion = c->f_hijo.sesion = c->f_shell.sesion = s;
+    c->f_pipe.canal = c->f_hijo.canal = c->f_shell.canal = c;
+    c->limite.tipo = TEMPORIZADOR_COMANDO;
+    c->limite.sesion = s;
+    c->limite.canal = c;
+    c->limite.ranura = -1;
+    s->canales[num] = c;
+    return c;
+}
+
+/*
+ * Registro de la cola de comandos de un canal; le sigue el texto del comando.
+ */
+typedef struct {
+    uint32_t id;
+    uint32_t longitud;
+    uint64_t llegada;       // Instante en que se recibió la trama (para las métricas)
+} registro_cola_t;
+
+/*
+ * Guarda un comando para un canal ocupado.
+ */
+static int encolar_comando(canal_t *c, uint32_t id, const void *texto, uint32_t longitud, uint64_t llegada) {
+    registro_cola_t registro = { id, longitud, llegada };
+    if (buffer_agregar(&c->cola, &registro, sizeof(registro)) == -1) return -1;
+    if (buffer_agregar(&c->cola, texto, longitud) == -1) return -1;
+    c->sesion->bytes_en_cola += sizeof(registro) + longitud;
+    return 0;
+}
+
+/*
+ * Atiende, en orden, los comandos que esperan en la cola del canal mientras el canal
+ * quede libre. Como en procesar_entrada, los comandos que terminan dentro de la
+ * llamada no anidan otra.
+ */
+static void procesar_cola(canal_t *c) {
+    sesion_t *s = c->sesion;
+    if (c->procesando_cola) return;
+    c->procesando_cola = 1;
+    while (s->fd != -1 && s->estado == SESION_ACTIVA && c->estado == CANAL_ESPERANDO_COMANDO &&
+           buffer_pendiente(&c->cola) > 0) {
+        registro_cola_t registro;
+        memcpy(&registro, c->cola.datos + c->cola.inicio, sizeof(registro));
+        atender_comando(c, registro.id, c->cola.datos + c->cola.inicio + sizeof(registro), registro.longitud,
+                        registro.llegada);
+        buffer_consumir(&c->cola, sizeof(registro) + registro.longitud);
+        s->bytes_en_cola -= sizeof(registro) + registro.longitud;
+    }
+    c->procesando_cola = 0;
+    if (s->fd == -1) return;
+    // La cola pudo bajar del límite: volver a leer al cliente, empezando por lo ya recibido
+    actualizar_eventos_cliente(s);
+    procesar_entrada(s);
+}
+
+/*
+ * Procesa las tramas completas que haya en el buffer de entrada, en orden. Si una
+ * trama no está completa se espera a recibir el resto. Los comandos para un canal
+ * libre se atienden en el acto; los de un canal ocupado esperan en su cola, de modo
+ * que cada canal responde en el orden en que recibió sus comandos. Los créditos de
+ * ventana se aplican siempre al llegar.
+ */
+static void procesar_entrada(sesion_t *s) {
+    // Un comando interno termina dentro de procesar_comando: el bucle de abajo sigue
+    // con la trama siguiente, sin anidar otra llamada
+    if (s->procesando_entrada) return;
+    s->procesando_entrada = 1;
+    procesar_tramas(s);
+    s->procesando_entrada = 0;
+}
+
+static void procesar_tramas(sesion_t *s) {
+    while (s->fd != -1 && s->estado == SESION_ACTIVA) {
+        cabecera_trama_t t;
+        const uint8_t *inicio = (const uint8_t *) s->entrada.datos + s->entrada.inicio;
+        size_t disponible = buffer_pendiente(&s->entrada);
+
+        if (disponible < PROTO_CABECERA) return;
+        if (trama_decodificar(inicio, &t) == -1) {
+            registrar(NIVEL_AVISO, s->id, "Trama inválida (versión %u), cerrando sesión", inicio[0]);
+            cerrar_sesion(s);
+            return;
+        }
+        if (disponible < PROTO_CABECERA + (size_t) t.longitud) return;
+
+        if (t.tipo == TRAMA_OPCIONES) {
+            buffer_consumir(&s->entrada, PROTO_CABECERA + t.longitud);
+            s->compresion = compresion_ofrecida && (t.estado & PROTO_CAP_ZLIB);
+            if (s->compresion) registrar(NIVEL_INFO, s->id, "Salida comprimida activada (deflate)");
+            continue;
+        }
+        if (t.tipo != TRAMA_COMANDO && t.tipo != TRAMA_VENTANA && t.tipo != TRAMA_DATOS &&
+            t.tipo != TRAMA_DESCARGA && t.tipo != TRAMA_SUBIDA) {
+            registrar(NIVEL_AVISO, s->id, "Trama inesperada (tipo %u), cerrando sesión", t.tipo);
+            cerrar_sesion(s);
+            return;
+        }
+        if (t.canal >= MAX_CANALES) {
+            registrar(NIVEL_AVISO, s->id, "Canal inválido (%u), cerrando sesión", t.canal);
+            cerrar_sesion(s);
+            return;
+        }
+        canal_t *c = obtener_canal(s, t.canal);
+        if (c == NULL) {
+            registrar_errno(0, "Error al reservar memoria para el canal");
+            cerrar_sesion(s);
+            return;
+        }
+        if (t.tipo == TRAMA_VENTANA) {
+            buffer_consumir(&s->entrada, PROTO_CABECERA + t.longitud);
+            if (t.estado > 0) c->ventana += t.estado;
+            reanudar_canal(c);
+            continue;
+        }
+        if (t.tipo == TRAMA_DATOS) {
+            // Datos de la subida en curso; los de una subida rechazada se descartan
+            if (c->fd_subida != -1 && c->id_peticion == t.id) {
+                recibir_subida(c, (const char *) inicio + PROTO_CABECERA, t.longitud);
+            }
+            buffer_consumir(&s->entrada, PROTO_CABECERA + t.longitud);
+            continue;
+        }
+        if (t.tipo == TRAMA_DESCARGA || t.tipo == TRAMA_SUBIDA) {
+            atender_transferencia(c, &t, inicio + PROTO_CABECERA, s->t_recepcion);
+            buffer_consumir(&s->entrada, PROTO_CABECERA + t.longitud);
+            continue;
+        }
+        const char *texto = (const char *) inicio + PROTO_CABECERA;
+        if (c->estado == CANAL_ESPERANDO_COMANDO && buffer_pendiente(&c->cola) == 0) {
+            atender_comando(c, t.id, texto, t.longitud, s->t_recepcion);
+        } else if (encolar_comando(c, t.id, texto, t.longitud, s->t_recepcion) == -1) {
+            registrar_errno(0, "Error al reservar memoria para la cola del canal");
+            cerrar_sesion(s);
+            return;
+        }
+        buffer_consumir(&s->entrada, PROTO_CABECERA + t.longitud);
+    }
+}
+
+/*
+ * Recibe comandos y créditos de ventana del cliente. Un mismo recv() puede traer
+ * varias tramas o sólo una parte de una. Se recibe directamente en el buffer de
+ * entrada, en porciones grandes mientras llegan subidas.
+ */
+static void leer_cliente(sesion_t *s) {
+    size_t tam = s->subidas_activas > 0 ? RECEPCION_SUBIDA : BUFFER_SIZE;
+    char *destino = buffer_reservar(&s->entrada, tam);
+    ssize_t bytes_recibidos;
+
+    if (destino == NULL) {
+        registrar_errno(0, "Error al reservar memoria para la entrada");
+        cerrar_sesion(s);
+        return;
+    }
+    do {
+        bytes_recibidos = recv(s->fd, destino, tam, 0);
+    } while (bytes_recibidos < 0 && errno == EINTR);
+
+    if (bytes_recibidos < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (bytes_recibidos <= 0) {
+        if (bytes_recibidos != 0) registrar_errno(s->id, "Cliente desconectado inesperadamente");
+        cerrar_sesion(s);
+        return;
+    }
+    s->t_recepcion = s->t_actividad = ahora_ns();
+    s->entrada.fin += bytes_recibidos;
+    procesar_entrada(s);
+}
+
+/*
+ * Cierra la conexión con el cliente. Si hay comandos en curso se cierran sus pipes y
+ * se termina a los hijos, que se recolecta más adelante. La memoria de la sesión se
+ * libera al final de la iteración del bucle, ya que epoll puede haber entregado
+ * otros eventos que todavía la referencian.
+ */
+static void cerrar_canal(canal_t *c) {
+    cancelar_temporizador(&c->limite);
+    if (c->t_llegada != 0) {
+        metricas.cancelados++;
+        c->t_llegada = 0;
+    }
+    if (c->respuesta_cache != NULL) {
+        cache_soltar(c->respuesta_cache);
+        c->respuesta_cache = NULL;
+    }
+    // Los canales que esperaban esta respuesta ejecutan su propio comando
+    if (c->grabacion != NULL) cache_completar(c, PROTO_ESTADO_ERROR);
+    if (c->fd_pipe != -1) {
+        epoll_ctl(fd_epoll, EPOLL_CTL_DEL, c->fd_pipe, NULL);
+        close(c->fd_pipe);
+        c->fd_pipe = -1;
+    }
+    if (c->fd_hijo != -1) {
+        epoll_ctl(fd_epoll, EPOLL_CTL_DEL, c->fd_hijo, NULL);
+        close(c->fd_hijo);
+        c->fd_hijo = -1;
+    } else if (c->sondeo_hijo) {
+        c->sondeo_hijo = 0;
+        sesiones_sin_pidfd--;
+    }
+    if (c->por_ejecutor) {
+        cancelar_en_ejecutor(c);
+        c->por_ejecutor = 0;
+    }
+    if (c->cat_fds != NULL) terminar_cat(c);
+    if (c->fd_subida != -1) {
+        close(c->fd_subida);
+        c->fd_subida = -1;
+        c->sesion->subidas_activas--;
+    }
+    terminar_shell(c, 0);
+    if (c->pid_hijo > 0) {
+        kill(-c->pid_hijo, SIGTERM); // Toda la tubería
+        recolectar_hijo(c->pid_hijo);
+        c->pid_hijo = -1;
+    }
+}
+
+static void cerrar_sesion(sesion_t *s) {
+    if (s->fd == -1) return; // Ya cerrada
+    registrar(NIVEL_INFO, s->id, "Cerrando conexión con cliente...");
+    metricas.sesiones_activas--;
+    cancelar_temporizador(&s->inactividad);
+    // Primero los canales en espera de la caché: si otro canal de la sesión grababa
+    // esa respuesta, no deben ejecutar el comando al cerrarse el que grababa
+    for (int i = 0; i < MAX_CANALES; i++) {
+        if (s->canales[i] != NULL && s->canales[i]->espera_cache != NULL) cache_dejar_de_esperar(s->canales[i]);
+    }
+    // La carga enlazada aún no lanzada tomaría el pipe por su número, que se cierra abajo:
+    // se cancela antes
+    if (s->trama_uring > 0) uring_cancelar_trama(s);
+    for (int i = 0; i < MAX_CANALES; i++) {
+        if (s->canales[i] != NULL) cerrar_canal(s->canales[i]);
+    }
+    if (s->recv_uring) uring_lectura(s, 0);
+    epoll_ctl(fd_epoll, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    s->fd = -1;
+
+    // Mover de la lista de activas a la de cerradas
+    if (s->ant) s->ant->sig = s->sig; else sesiones = s->sig;
+    if (s->sig) s->sig->ant = s->ant;
+    s->ant = NULL;
+    s->sig = sesiones_cerradas;
+    sesiones_cerradas = s;
+}
+
+/*
+ * Las sesiones con un recv de io_uring aún armado, o una trama aún en el anillo, se
+ * conservan hasta que llegue su resultado final, que todavía las referencia.
+ */
+static void liberar_sesiones_cerradas(void) {
+    sesion_t *pendientes = NULL;
+    while (sesiones_cerradas) {
+        sesion_t *s = sesiones_cerradas;
+        sesiones_cerradas = s->sig;
+        if (s->recv_uring || s->trama_uring > 0) {
+            s->sig = pendientes;
+            pendientes = s;
+            continue;
+        }
+        for (int i = 0; i < MAX_CANALES; i++) {
+            if (s->canales[i] == NULL) continue;
+            buffer_liberar(&s->canales[i]->cola);
+            if (s->canales[i]->z != NULL) {
+                deflateEnd(s->canales[i]->z);
+                free(s->canales[i]->z);
+            }
+            free(s->canales[i]);
+        }
+        buffer_liberar(&s->entrada);
+        buffer_liberar(&s->salida);
+        buffer_liberar(&s->diferida);
+        if (s->fd_dir != -1) close(s->fd_dir);
+        if (s->fd_dir_anterior != -1) close(s->fd_dir_anterior);
+        free(s);
+    }
+    sesiones_cerradas = pendientes;
+}
+
+/*
+ * Resolución inversa de nombres.
+ * gethostbyaddr() puede tardar segundos con un DNS lento o caído, y en el bucle de
+ * eventos eso detendría a todas las sesiones. Las consultas las hace un hilo aparte
+ * con getnameinfo(); el bucle le pasa direcciones y recibe los nombres por una cola,
+ * con un eventfd registrado en epoll que avisa de cada resultado. Los resultados,
+ * también los fallidos, se guardan en una caché de tamaño fijo con caducidad, que
+ * sólo usa el hilo del bucle. La bienvenida y el log de la conexión salen al
+ * instante con la IP (o con el nombre, si ya estaba en la caché); el nombre se
+ * añade al log cuando llega.
+ */
+#define DNS_CACHE_ENTRADAS 256   // Entradas de la caché de nombres
+#define DNS_CACHE_SONDEO 8       // Posiciones consecutivas en que puede estar una dirección
+#define DNS_TTL 300              // Segundos que vale un nombre resuelto
+#define DNS_TTL_NEGATIVO 60      // Segundos que vale un "sin nombre" (o un error del DNS)
+#define DNS_MAX_PENDIENTES 64    // Consultas encargadas al hilo y aún sin respuesta
+
+typedef enum {
+    DNS_PENDIENTE,   // Consulta en curso
+    DNS_RESUELTO,
+    DNS_SIN_NOMBRE
+} estado_dns_t;
+
+typedef struct {
+    int usada;
+    struct in_addr dir;
+    estado_dns_t estado;
+    time_t expira;
+    char nombre[NI_MAXHOST];
+} entrada_dns_t;
+
+typedef struct {
+    struct in_addr dir;
+    int resuelto;
+    char nombre[NI_MAXHOST];
+} resultado_dns_t;
+
+static int dns_activo = 1;              // --sin-dns lo desactiva
+static entrada_dns_t *cache_dns = NULL;
+static int dns_en_curso = 0;            // Consultas encargadas sin respuesta procesada
+static fuente_t f_resolutor = { FUENTE_RESOLUTOR, NULL, NULL, 0 };
+static int fd_aviso_dns = -1;           // eventfd: el hilo avisa que hay resultados
+
+// Colas entre el bucle y el hilo, protegidas por mutex_dns; nunca tienen más de
+// DNS_MAX_PENDIENTES elementos porque el bucle no encarga más consultas que esas
+static pthread_mutex_t mutex_dns = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hay_consultas = PTHREAD_COND_INITIALIZER;
+static struct in_addr consultas_dns[DNS_MAX_PENDIENTES];
+static int consultas_inicio = 0, num_consultas = 0;
+static resultado_dns_t resultados_dns[DNS_MAX_PENDIENTES];
+static int resultados_inicio = 0, num_resultados = 0;
+
+static void *hilo_resolutor(void *arg) {
+    (void) arg;
+    resultado_dns_t r;
+    while (1) {
+        pthread_mutex_lock(&mutex_dns);
+        while (num_consultas == 0) pthread_cond_wait(&hay_consultas, &mutex_dns);
+        r.dir = consultas_dns[consultas_inicio];
+        consultas_inicio = (consultas_inicio + 1) % DNS_MAX_PENDIENTES;
+        num_consultas--;
+        pthread_mutex_unlock(&mutex_dns);
+
+        struct sockaddr_in sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_addr = r.dir;
+        r.resuelto = getnameinfo((struct sockaddr *) &sa, sizeof(sa), r.nombre, sizeof(r.nombre),
+                                 NULL, 0, NI_NAMEREQD) == 0;
+
+        pthread_mutex_lock(&mutex_dns);
+        resultados_dns[(resultados_inicio + num_resultados) % DNS_MAX_PENDIENTES] = r;
+        num_resultados++;
+        pthread_mutex_unlock(&mutex_dns);
+        uint64_t uno = 1;
+        while (write(fd_aviso_dns, &uno, sizeof(uno)) < 0 && errno == EINTR) { }
+    }
+    return NULL;
+}
+
+/*
+ * Crea la caché, el eventfd y el hilo. Si algo falla el servidor sigue sin nombres.
+ */
+static int iniciar_resolutor(void) {
+    pthread_t hilo;
+    cache_dns = calloc(DNS_CACHE_ENTRADAS, sizeof(entrada_dns_t));
+    if (cache_dns == NULL) return -1;
+    fd_aviso_dns = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd_aviso_dns == -1) return -1;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &f_resolutor };
+    if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_aviso_dns, &ev) == -1) return -1;
+    // El hilo no debe recibir las señales del servidor (SIGINT, SIGTERM...)
+    sigset_t todas, anteriores;
+    sigfillset(&todas);
+    pthread_sigmask(SIG_BLOCK, &todas, &anteriores);
+    int r = pthread_create(&hilo, NULL, hilo_resolutor, NULL);
+    pthread_sigmask(SIG_SETMASK, &anteriores, NULL);
+    if (r != 0) {
+        errno = r;
+        return -1;
+    }
+    pthread_detach(hilo);
+    return 0;
+}
+
+/*
+ * Entrada vigente de 'dir' en la caché (NULL si no está). En *hueco deja la posición
+ * que debe ocupar si no está: libre, caducada o la que caduca antes, pero nunca una
+ * que espera respuesta (NULL si todas las candidatas esperan).
+ */
+static entrada_dns_t *buscar_dns(struct in_addr dir, time_t ahora, entrada_dns_t **hueco) {
+    uint32_t h = (uint32_t) dir.s_addr * 2654435761u;
+    *hueco = NULL;
+    for (int i = 0; i < DNS_CACHE_SONDEO; i++) {
+        entrada_dns_t *e = &cache_dns[(h + i) % DNS_CACHE_ENTRADAS];
+        int vigente = e->usada && (e->estado == DNS_PENDIENTE || e->expira > ahora);
+        if (vigente && e->dir.s_addr == dir.s_addr) return e;
+        if (!vigente) {
+            if (*hueco == NULL || (*hueco)->usada) *hueco = e;
+        } else if (e->estado != DNS_PENDIENTE && (*hueco == NULL || ((*hueco)->usada && e->expira < (*hueco)->expira))) {
+            *hueco = e;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Nombre de 'dir' si está en la caché. Si no está, encarga la consulta y devuelve
+ * NULL con *pendiente = 1 (el nombre llegará a atender_resolutor).
+ */
+static const char *nombre_cliente(struct in_addr dir, int *pendiente) {
+    entrada_dns_t *hueco;
+    *pendiente = 0;
+    if (!dns_activo) return NULL;
+    entrada_dns_t *e = buscar_dns(dir, time(NULL), &hueco);
+    if (e != NULL) {
+        *pendiente = e->estado == DNS_PENDIENTE;
+        return e->estado == DNS_RESUELTO ? e->nombre : NULL;
+    }
+    // Sin lugar en la caché o resolutor saturado: sólo la IP
+    if (hueco == NULL || dns_en_curso >= DNS_MAX_PENDIENTES) return NULL;
+    e = hueco;
+    e->usada = 1;
+    e->dir = dir;
+    e->estado = DNS_PENDIENTE;
+    dns_en_curso++;
+    pthread_mutex_lock(&mutex_dns);
+    consultas_dns[(consultas_inicio + num_consultas) % DNS_MAX_PENDIENTES] = dir;
+    num_consultas++;
+    pthread_cond_signal(&hay_consultas);
+    pthread_mutex_unlock(&mutex_dns);
+    *pendiente = 1;
+    return NULL;
+}
+
+/*
+ * Recoge los nombres resueltos por el hilo: los guarda en la caché y los muestra en
+ * el log de las sesiones de esa dirección que aún no lo tenían.
+ */
+static void atender_resolutor(void) {
+    uint64_t avisos;
+    entrada_dns_t *hueco;
+    while (read(fd_aviso_dns, &avisos, sizeof(avisos)) > 0) { }
+    while (1) {
+        resultado_dns_t r;
+        pthread_mutex_lock(&mutex_dns);
+        if (num_resultados == 0) {
+            pthread_mutex_unlock(&mutex_dns);
+            return;
+        }
+        r = resultados_dns[resultados_inicio];
+        resultados_inicio = (resultados_inicio + 1) % DNS_MAX_PENDIENTES;
+        num_resultados--;
+        pthread_mutex_unlock(&mutex_dns);
+        dns_en_curso--;
+
+        time_t ahora = time(NULL);
+        entrada_dns_t *e = buscar_dns(r.dir, ahora, &hueco);
+        if (e == NULL) e = hueco;
+        if (e != NULL) {
+            e->usada = 1;
+            e->dir = r.dir;
+            e->estado = r.resuelto ? DNS_RESUELTO : DNS_SIN_NOMBRE;
+            e->expira = ahora + (r.resuelto ? DNS_TTL : DNS_TTL_NEGATIVO);
+            if (r.resuelto) snprintf(e->nombre, sizeof(e->nombre), "%s", r.nombre);
+        }
+        for (sesion_t *s = sesiones; s != NULL; s = s->sig) {
+            if (!s->esperando_nombre || s->dir_cliente.s_addr != r.dir.s_addr) continue;
+            s->esperando_nombre = 0;
+            if (r.resuelto) registrar(NIVEL_INFO, s->id, "Cliente %s resuelto como %s", inet_ntoa(r.dir), r.nombre);
+        }
+    }
+}
+
+/*
+ * Registra un cliente recién aceptado: crea su sesión, muestra la conexión en
+ * consola y le envía la información de la conexión junto con la bienvenida.
+ */
+static void nueva_sesion(int fd_c, struct sockaddr_in *cliente_addr) {
+    const char *nombre_host;           // Nombre del cliente (NULL si aún no se conoce)
+    char buffer_info_conexion_cliente[512]; // Buffer para formatear el mensaje de conexión para el cliente
+
+    sesion_t *s = calloc(1, sizeof(sesion_t));
+    if (s == NULL) {
+        registrar_errno(0, "Error al reservar memoria para la sesión");
+        close(fd_c);
+        return;
+    }
+    s->id = siguiente_id_sesion;
+    siguiente_id_sesion += paso_id_sesion;
+    s->fd = fd_c;
+    s->fd_dir = -1;
+    s->fd_dir_anterior = -1;
+    s->modo_shell = modo_shell_por_defecto;
+    s->estado = SESION_ACTIVA;
+    s->f_cliente.tipo = FUENTE_CLIENTE;
+    s->f_cliente.sesion = s;
+    s->lectura_uring = uring_recv_activo;
+    s->eventos_cliente = s->lectura_uring ? 0 : EPOLLIN | EPOLLRDHUP;
+    s->inactividad.tipo = TEMPORIZADOR_INACTIVIDAD;
+    s->inactividad.sesion = s;
+    s->inactividad.ranura = -1;
+
+    struct epoll_event ev = { .events = s->eventos_cliente, .data.ptr = &s->f_cliente };
+    if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_c, &ev) == -1) {
+        registrar_errno(0, "Error en epoll_ctl (cliente)");
+        close(fd_c);
+        free(s);
+        return;
+    }
+    s->sig = sesiones;
+    if (sesiones) sesiones->ant = s;
+    sesiones = s;
+    if (s->lectura_uring) uring_lectura(s, 1);
+    s->t_actividad = ahora_ns();
+    if (limite_inactividad > 0) {
+        programar_temporizador(&s->inactividad, s->t_actividad + (uint64_t) limite_inactividad * 1000000000ULL);
+    }
+    metricas.sesiones_aceptadas++;
+    metricas.sesiones_activas++;
+
+    // 6. Obtener información del cliente: el nombre sólo si ya está en la caché; si no,
+    // se resuelve en segundo plano y se añade al log al llegar (ver atender_resolutor)
+    s->dir_cliente = cliente_addr->sin_addr;
+    nombre_host = nombre_cliente(cliente_addr->sin_addr, &s->esperando_nombre);
+    // Fecha de la conexión para el saludo (localtime_r no vuelve a consultar la zona horaria)
+    time_t T = time(NULL);
+    struct tm tm_info;
+    localtime_r(&T, &tm_info);
+
+    // Registrar la conexión (la hora la pone el registro)
+    if (nombre_host == NULL) {
+        registrar(NIVEL_INFO, s->id, "Cliente conectado desde: %s", inet_ntoa(cliente_addr->sin_addr));
+    } else {
+        registrar(NIVEL_INFO, s->id, "Cliente conectado desde: %s (%s)", nombre_host,
+                  inet_ntoa(cliente_addr->sin_addr));
+    }
+
+    // 7. Enviar información de la conexión y mensaje de bienvenida en la trama de saludo
+    const char* bienvenida_msg = "Conexión SSH simulada. Escriba comandos o 'salir'/'exit' para desconectar.\n";
+    int len_escrita = snprintf(buffer_info_conexion_cliente, sizeof(buffer_info_conexion_cliente),
+             "%02d/%02d/%04d %02d:%02d:%02d - Cliente conectado desde: ",
+             tm_info.tm_mday, tm_info.tm_mon + 1, tm_info.tm_year + 1900,
+             tm_info.tm_hour, tm_info.tm_min, tm_info.tm_sec);
+    if (nombre_host == NULL) {
+        len_escrita += snprintf(buffer_info_conexion_cliente + len_escrita, sizeof(buffer_info_conexion_cliente) - len_escrita,
+                 "%s\n", inet_ntoa(cliente_addr->sin_addr));
+    } else {
+        len_escrita += snprintf(buffer_info_conexion_cliente + len_escrita, sizeof(buffer_info_conexion_cliente) - len_escrita,
+                 "%s (%s)\n", nombre_host, inet_ntoa(cliente_addr->sin_addr));
+    }
+    if (len_escrita < (int) sizeof(buffer_info_conexion_cliente)) {
+        snprintf(buffer_info_conexion_cliente + len_escrita, sizeof(buffer_info_conexion_cliente) - len_escrita,
+                 "%s", bienvenida_msg);
+    }
+    enviar_trama(s, TRAMA_HOLA, 0, 0, (compresion_ofrecida ? PROTO_CAP_ZLIB : 0) | PROTO_CAP_TRANSFERENCIA,
+                 buffer_info_conexion_cliente, strlen(buffer_info_conexion_cliente));
+}
+
+static void aceptar_cliente(int fd_c, struct sockaddr_in *cliente_addr) {
+    // Sin Nagle: la trama de fin de una respuesta corta no espera el ACK de la de
+    // datos, lo que con el ACK retardado del cliente costaba ~40 ms por comando
+    int uno = 1;
+    setsockopt(fd_c, IPPROTO_TCP, TCP_NODELAY, &uno, sizeof(uno));
+    nueva_sesion(fd_c, cliente_addr);
+}
+
+/*
+ * Acepta todas las conexiones pendientes en el socket de escucha (no bloqueante).
+ */
+static void aceptar_conexiones(void) {
+    struct sockaddr_in cliente_addr;   // Estructura para dirección del cliente
+    socklen_t longClient;              // Longitud de la estructura cliente
+    int fd_c;                          // File descriptor del cliente
+
+    while (1) {
+        longClient = sizeof(cliente_addr);
+        // 5. Accept - retorna un nuevo socket (ya no bloqueante) para comunicarse con el cliente.
+        fd_c = accept4(fd_s, (struct sockaddr *) &cliente_addr, &longClient, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd_c < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == ECONNABORTED || errno == EPROTO) continue;
+            registrar_errno(0, "Error en accept");
+            return;
+        }
+        aceptar_cliente(fd_c, &cliente_addr);
+    }
+}
+
+/*
+ * Motor io_uring (--io-uring).
+ * Con muchas sesiones cortas, buena parte del tiempo del servidor se va en llamadas
+ * al sistema: un accept() por conexión y un recv() por cada aviso de epoll. Con este
+ * motor, un solo accept multishot entrega todas las conexiones nuevas y cada sesión
+ * tiene un recv multishot que deja los datos en un anillo de buffers provisto por el
+ * servidor (sin un buffer reservado por sesión). Las peticiones se acumulan y se
+ * envían juntas con un io_uring_enter() por vuelta del bucle, y el descriptor del
+ * anillo se vigila en epoll como uno más.
+ * La salida de los comandos también va por el anillo: cada trama de datos que en
+ * epoll saldría con send() y splice() es un IORING_OP_SEND de la cabecera enlazado
+ * (IOSQE_IO_LINK) a un IORING_OP_SPLICE de la carga, del pipe al socket. La ventana
+ * del canal, la pausa del pipe y el apartado de las tramas de los demás canales son
+ * los de epoll (ver leer_salida_hijo); una cabecera o una carga que salen a medias
+ * se completan por el camino de epoll. El resto (el buffer de salida, sendfile() de
+ * 'cat', ejecutores, shell) sigue igual.
+ * Detener la lectura de un cliente (cola de comandos llena, sesión cerrándose)
+ * cancela su recv y reanudarla lo vuelve a armar, como EPOLLIN en el motor epoll.
+ * Si el kernel no admite io_uring o alguna de estas operaciones, se sigue con epoll.
+ */
+#define URING_ENTRADAS 256          // Capacidad de la cola de envío
+#define URING_NUM_BUFFERS 256       // Buffers del anillo para recv (potencia de 2)
+#define URING_GRUPO_BUFFERS 0       // Identificador del grupo de buffers
+#define URING_ACEPTAR 1             // user_data del accept multishot
+#define URING_IGNORAR 2             // user_data de las cancelaciones
+// Las demás peticiones llevan en user_data su sesión y, en los bits bajos (libres por
+// la alineación), de qué se trata: el recv no lleva marca
+#define URING_CABECERA 1            // Cabecera de una trama de datos (IORING_OP_SEND)
+#define URING_CARGA 2               // Su carga (IORING_OP_SPLICE)
+#define URING_ESPERA 3              // Espera de lugar en el socket antes de la carga (IORING_OP_POLL_ADD)
+#define URING_MARCAS 3
+
+static int uring_aceptando = 0;     // El accept multishot está armado
+static fuente_t f_uring = { FUENTE_URING, NULL, NULL, 0 };
+
+static struct {
+    int fd;
+    unsigned *sq_cabeza, *sq_cola, *sq_mascara, *sq_indices;
+    unsigned sq_entradas;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_cabeza, *cq_cola, *cq_mascara;
+    struct io_uring_cqe *cqes;
+    unsigned por_enviar;            // Peticiones preparadas aún sin io_uring_enter()
+    struct io_uring_buf_ring *anillo_buffers;
+    char *buffers;
+} uring = { .fd = -1 };
+
+static int uring_llamar_registro(unsigned op, void *arg, unsigned n) {
+    return (int) syscall(__NR_io_uring_register, uring.fd, op, arg, n);
+}
+
+/*
+ * Envía al kernel las peticiones preparadas.
+ */
+static void uring_enviar(void) {
+    while (uring.por_enviar > 0) {
+        int r = (int) syscall(__NR_io_uring_enter, uring.fd, uring.por_enviar, 0, 0, NULL, 0);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EBUSY) registrar_errno(0, "Error en io_uring_enter");
+            return; // Se reintenta en la siguiente vuelta del bucle
+        }
+        uring.por_enviar -= (unsigned) r;
     }
-    exit(0);
 }
 
 /*
- * Elimina los espacios en blanco al inicio y al final de la cadena.
+ * Prepara una petición vacía en la cola de envío, que se publica con uring_publicar.
+ * Si la cola está llena se envía lo acumulado primero.
  */
-void trim(char *str) {
-    char *start = str;
-    char *end;
-    while (isspace((unsigned char)*start)) start++;
-    if (*start == '\0') {
-        str[0] = '\0';
+static struct io_uring_sqe *uring_peticion(void) {
+    unsigned cola = *uring.sq_cola;
+    if (cola - __atomic_load_n(uring.sq_cabeza, __ATOMIC_ACQUIRE) >= uring.sq_entradas) {
+        uring_enviar();
+        if (cola - __atomic_load_n(uring.sq_cabeza, __ATOMIC_ACQUIRE) >= uring.sq_entradas) return NULL;
+    }
+    struct io_uring_sqe *sqe = &uring.sqes[cola & *uring.sq_mascara];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void uring_publicar(void) {
+    unsigned cola = *uring.sq_cola;
+    uring.sq_indices[cola & *uring.sq_mascara] = cola & *uring.sq_mascara;
+    __atomic_store_n(uring.sq_cola, cola + 1, __ATOMIC_RELEASE);
+    uring.por_enviar++;
+}
+
+static void uring_devolver_buffer(unsigned id) {
+    struct io_uring_buf_ring *a = uring.anillo_buffers;
+    unsigned short cola = a->tail;
+    struct io_uring_buf *b = &a->bufs[cola & (URING_NUM_BUFFERS - 1)];
+    b->addr = (uint64_t) (uintptr_t) (uring.buffers + (size_t) id * BUFFER_SIZE);
+    b->len = BUFFER_SIZE;
+    b->bid = (uint16_t) id;
+    __atomic_store_n(&a->tail, (unsigned short) (cola + 1), __ATOMIC_RELEASE);
+}
+
+static int uring_cancelar(uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_peticion();
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = URING_IGNORAR;
+    uring_publicar();
+    return 0;
+}
+
+/*
+ * Crea el anillo, comprueba que el kernel admite accept y recv, y registra los
+ * buffers de recepción. Devuelve -1 (y el servidor sigue con epoll) si algo falla.
+ */
+static int iniciar_uring(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    uring.fd = (int) syscall(__NR_io_uring_setup, URING_ENTRADAS, &p);
+    if (uring.fd < 0) return -1;
+
+    size_t largo_sq = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t largo_cq = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && largo_cq > largo_sq) largo_sq = largo_cq;
+    char *sq = mmap(NULL, largo_sq, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) return -1;
+    char *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, largo_cq, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) return -1;
+    }
+    uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) return -1;
+    uring.sq_cabeza = (unsigned *) (sq + p.sq_off.head);
+    uring.sq_cola = (unsigned *) (sq + p.sq_off.tail);
+    uring.sq_mascara = (unsigned *) (sq + p.sq_off.ring_mask);
+    uring.sq_indices = (unsigned *) (sq + p.sq_off.array);
+    uring.sq_entradas = p.sq_entries;
+    uring.cq_cabeza = (unsigned *) (cq + p.cq_off.head);
+    uring.cq_cola = (unsigned *) (cq + p.cq_off.tail);
+    uring.cq_mascara = (unsigned *) (cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    // Operaciones que hacen falta (el modo multishot se comprueba al usarlo)
+    size_t largo_sonda = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *sonda = calloc(1, largo_sonda);
+    if (sonda == NULL || uring_llamar_registro(IORING_REGISTER_PROBE, sonda, 256) < 0) {
+        free(sonda);
+        return -1;
+    }
+    static const int necesarias[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_ASYNC_CANCEL };
+    for (size_t i = 0; i < sizeof(necesarias) / sizeof(necesarias[0]); i++) {
+        if (necesarias[i] > sonda->last_op || !(sonda->ops[necesarias[i]].flags & IO_URING_OP_SUPPORTED)) {
+            free(sonda);
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+    }
+    // Sin send o splice (Linux 5.6 y 5.7) las tramas de datos siguen saliendo por epoll
+    uring_envio_activo = splice_disponible;
+    static const int de_envio[] = { IORING_OP_SEND, IORING_OP_SPLICE, IORING_OP_POLL_ADD };
+    for (size_t i = 0; i < sizeof(de_envio) / sizeof(de_envio[0]); i++) {
+        if (de_envio[i] > sonda->last_op || !(sonda->ops[de_envio[i]].flags & IO_URING_OP_SUPPORTED)) {
+            uring_envio_activo = 0;
+        }
+    }
+    free(sonda);
+
+    // Anillo de buffers provistos: el kernel elige uno libre para cada recepción
+    uring.anillo_buffers = mmap(NULL, URING_NUM_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uring.buffers = malloc((size_t) URING_NUM_BUFFERS * BUFFER_SIZE);
+    if (uring.anillo_buffers == MAP_FAILED || uring.buffers == NULL) return -1;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) uring.anillo_buffers;
+    reg.ring_entries = URING_NUM_BUFFERS;
+    reg.bgid = URING_GRUPO_BUFFERS;
+    if (uring_llamar_registro(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -1;
+    for (unsigned i = 0; i < URING_NUM_BUFFERS; i++) uring_devolver_buffer(i);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &f_uring };
+    if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, uring.fd, &ev) == -1) return -1;
+    uring_recv_activo = 1;
+    return 0;
+}
+
+/*
+ * Arma el accept multishot sobre el socket de escucha.
+ */
+static int uring_armar_aceptar(void) {
+    struct io_uring_sqe *sqe = uring_peticion();
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd_s;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_ACEPTAR;
+    uring_publicar();
+    uring_aceptando = 1;
+    return 0;
+}
+
+/*
+ * Arranca (leer = 1) o detiene la lectura de un cliente con recv multishot.
+ */
+static void uring_lectura(sesion_t *s, int leer) {
+    if (leer && !s->recv_uring) {
+        struct io_uring_sqe *sqe = uring_peticion();
+        if (sqe == NULL) return; // Se reintenta al volver a actualizar los eventos de la sesión
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = s->fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_GRUPO_BUFFERS;
+        sqe->user_data = (uint64_t) (uintptr_t) s;
+        uring_publicar();
+        s->recv_uring = 1;
+        s->recv_cancelado = 0;
+    } else if (!leer && s->recv_uring && !s->recv_cancelado) {
+        if (uring_cancelar((uint64_t) (uintptr_t) s) == 0) s->recv_cancelado = 1;
+    }
+}
+
+/*
+ * El kernel no admite algo del motor (recv o accept multishot llegaron en Linux 6.0 y
+ * 5.19): esa parte vuelve a epoll.
+ */
+static void uring_sin_recv(void) {
+    registrar(NIVEL_AVISO, 0, "recv multishot no disponible, se usará epoll");
+    uring_recv_activo = 0;
+    for (sesion_t *s = sesiones; s != NULL; s = s->sig) {
+        s->lectura_uring = 0;
+        uring_lectura(s, 0);
+        actualizar_eventos_cliente(s);
+    }
+}
+
+static void uring_sin_aceptar(void) {
+    registrar(NIVEL_AVISO, 0, "accept multishot no disponible, se usará epoll");
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &f_escucha };
+    if (fd_s != -1 && epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_s, &ev) == -1) {
+        registrar_errno(0, "Error en epoll_ctl (escucha)");
+    }
+}
+
+/*
+ * Resultado del recv multishot de una sesión. Sin IORING_CQE_F_MORE el recv terminó
+ * (cancelado, sin buffers libres, error) y se vuelve a armar si la sesión sigue leyendo.
+ */
+static void uring_datos_recibidos(sesion_t *s, const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) s->recv_uring = 0;
+    if (cqe->res > 0) {
+        unsigned id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        int agregado = 0;
+        if (s->fd != -1) {
+            s->t_recepcion = s->t_actividad = ahora_ns();
+            agregado = buffer_agregar(&s->entrada, uring.buffers + (size_t) id * BUFFER_SIZE, cqe->res);
+        }
+        uring_devolver_buffer(id);
+        if (s->fd == -1) return;
+        if (agregado == -1) {
+            registrar_errno(0, "Error al reservar memoria para la entrada");
+            cerrar_sesion(s);
+            return;
+        }
+        procesar_entrada(s);
+    } else if (s->fd != -1 && cqe->res != -ECANCELED && cqe->res != -ENOBUFS) {
+        if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+            uring_sin_recv();
+            return;
+        }
+        if (cqe->res != 0) {
+            errno = -cqe->res;
+            registrar_errno(s->id, "Cliente desconectado inesperadamente");
+        }
+        cerrar_sesion(s);
         return;
     }
-    if (start != str) {
-        memmove(str, start, strlen(start) + 1);
+    if (!s->recv_uring && s->fd != -1) actualizar_eventos_cliente(s);
+}
+
+/*
+ * 1 si caben 'n' peticiones más en la cola de envío (enviando antes lo acumulado si
+ * hace falta). Las enlazadas se preparan juntas: un io_uring_enter() entre ellas
+ * rompería el enlace.
+ */
+static int uring_hay_lugar(unsigned n) {
+    if (*uring.sq_cola - __atomic_load_n(uring.sq_cabeza, __ATOMIC_ACQUIRE) + n <= uring.sq_entradas) return 1;
+    uring_enviar();
+    return *uring.sq_cola - __atomic_load_n(uring.sq_cabeza, __ATOMIC_ACQUIRE) + n <= uring.sq_entradas;
+}
+
+/*
+ * Prepara el splice de lo que falta de la carga de la trama en curso (del pipe del
+ * canal al socket). El socket no bloquea y splice, a diferencia de send, no se
+ * reintenta solo cuando está lleno: en ese caso va enlazado a una espera de POLLOUT.
+ */
+static void uring_preparar_carga(sesion_t *s, canal_t *c) {
+    struct io_uring_sqe *sqe;
+    if (s->socket_lleno) {
+        sqe = uring_peticion();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->fd = s->fd;
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = (uint64_t) (uintptr_t) s | URING_ESPERA;
+        uring_publicar();
+        s->trama_uring++;
+        s->socket_lleno = 0;
     }
-    end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) end--;
-    *(end + 1) = '\0';
+    sqe = uring_peticion();
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = s->fd;
+    sqe->off = (uint64_t) -1;
+    sqe->splice_fd_in = c->fd_pipe;
+    sqe->splice_off_in = (uint64_t) -1;
+    sqe->len = (uint32_t) s->splice_restante;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    sqe->user_data = (uint64_t) (uintptr_t) s | URING_CARGA;
+    uring_publicar();
+    s->trama_uring++;
 }
 
 /*
- * Divide una cadena en tokens (argumentos para execvp).
+ * Envía por el anillo una trama de datos cuya carga, 'n' bytes, ya está en el pipe
+ * del canal (FIONREAD): la cabecera y, enlazada a ella, la carga. Mientras tanto el
+ * canal es el dueño de la carga, como con splice() en epoll. Devuelve -1 si no hay
+ * lugar en la cola de envío; la trama sale entonces por epoll.
  */
-int split(const char *buf_comando, char *arg_list[]) {
-    int count = 0;
-    char *token;
-    char *buffer_copy = strdup(buf_comando);
-    if (buffer_copy == NULL) {
-        perror("[SERVIDOR] Error en strdup para split");
-        return 0;
+static int uring_enviar_trama(canal_t *c, const uint8_t *cabecera, size_t n) {
+    sesion_t *s = c->sesion;
+    if (!uring_hay_lugar(2)) return -1;
+    memcpy(s->cabecera_uring, cabecera, PROTO_CABECERA);
+    struct io_uring_sqe *sqe = uring_peticion();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = s->fd;
+    sqe->addr = (uint64_t) (uintptr_t) s->cabecera_uring;
+    sqe->len = PROTO_CABECERA;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_MORE | MSG_WAITALL;
+    sqe->user_data = (uint64_t) (uintptr_t) s | URING_CABECERA;
+    uring_publicar();
+    s->trama_uring = 1;
+    s->cabecera_enviada = 0;
+    s->socket_lleno = 0;
+    s->splice_restante = n;
+    s->canal_carga = c;
+    uring_preparar_carga(s, c);
+    pausar_pipe(c);
+    return 0;
+}
+
+/*
+ * Al cerrar la sesión: cancela lo que queda en el anillo de su trama de datos.
+ */
+static void uring_cancelar_trama(sesion_t *s) {
+    uring_cancelar((uint64_t) (uintptr_t) s | URING_CABECERA);
+    uring_cancelar((uint64_t) (uintptr_t) s | URING_ESPERA);
+    uring_cancelar((uint64_t) (uintptr_t) s | URING_CARGA);
+    uring_enviar();
+}
+
+/*
+ * Resultado de una petición de la trama de datos de una sesión. Cuando llegan todos,
+ * lo que haya quedado a medias sigue: el resto de la cabecera por el buffer de salida
+ * y el de la carga con mover_splice, como en epoll; o, si la cabecera salió entera,
+ * con otro splice por el anillo.
+ */
+static void uring_trama_enviada(sesion_t *s, unsigned marca, int res) {
+    s->trama_uring--;
+    if (s->fd == -1) return; // Sesión cerrada: sólo se esperaba el resultado para liberarla
+    canal_t *c = s->canal_carga;
+    if (marca == URING_CABECERA && res >= 0) {
+        s->cabecera_enviada += (size_t) res;
+    } else if (marca == URING_CARGA && res > 0) {
+        s->splice_restante -= (size_t) res;
+        c->bytes_respuesta += res;
+    } else if (marca == URING_CARGA && res == -EAGAIN) {
+        s->socket_lleno = 1;
+    } else if (marca == URING_ESPERA && res > 0) {
+        // El socket admite datos: el splice enlazado sigue
+    } else if (res != -ECANCELED) {
+        // Cancelada la carga, es que la cabecera salió a medias: se completa abajo
+        if (marca == URING_CARGA && res == -EINVAL) {
+            registrar(NIVEL_AVISO, 0, "splice no disponible en io_uring, las tramas de datos saldrán por epoll");
+            uring_envio_activo = 0;
+        } else {
+            errno = res == 0 ? EPIPE : -res; // El pipe no puede quedar vacío: FIONREAD anunció los bytes
+            registrar_errno(0, "Error al enviar datos al cliente");
+            cerrar_sesion(s);
+            return;
+        }
     }
-    token = strtok(buffer_copy, " ");
-    while (token != NULL && count < MAX_TOKENS - 1) {
-        arg_list[count] = strdup(token);
-        if (arg_list[count] == NULL) {
-            perror("[SERVIDOR] Error en strdup para token en split");
-            for (int i = 0; i < count; i++) free(arg_list[i]);
-            free(buffer_copy);
-            return -1;
+    if (s->trama_uring > 0) return;
+    if (s->cabecera_enviada < PROTO_CABECERA) {
+        if (enviar_bytes(s, s->cabecera_uring + s->cabecera_enviada, PROTO_CABECERA - s->cabecera_enviada) == -1) {
+            return;
+        }
+        s->cabecera_enviada = PROTO_CABECERA;
+    } else if (s->splice_restante > 0 && uring_envio_activo && uring_hay_lugar(2)) {
+        uring_preparar_carga(s, c);
+        return;
+    }
+    if (s->splice_restante == 0 && carga_completa(s) == -1) return;
+    vaciar_salida(s); // Completa por epoll lo que falte y reanuda los canales
+}
+
+/*
+ * Atiende las peticiones completadas del anillo.
+ */
+static void atender_uring(void) {
+    unsigned cabeza = *uring.cq_cabeza;
+    while (cabeza != __atomic_load_n(uring.cq_cola, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = uring.cqes[cabeza & *uring.cq_mascara];
+        __atomic_store_n(uring.cq_cabeza, ++cabeza, __ATOMIC_RELEASE);
+        if (cqe.user_data == URING_IGNORAR) continue;
+        if (cqe.user_data == URING_ACEPTAR) {
+            if (!(cqe.flags & IORING_CQE_F_MORE)) uring_aceptando = 0;
+            if (cqe.res >= 0) {
+                struct sockaddr_in cliente_addr;
+                socklen_t largo = sizeof(cliente_addr);
+                if (fd_s == -1 || getpeername(cqe.res, (struct sockaddr *) &cliente_addr, &largo) == -1) {
+                    close(cqe.res); // Apagando, o el cliente ya se fue
+                } else {
+                    aceptar_cliente(cqe.res, &cliente_addr);
+                }
+            } else if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+                uring_sin_aceptar();
+                continue;
+            } else if (cqe.res != -ECANCELED) {
+                errno = -cqe.res;
+                registrar_errno(0, "Error en accept");
+            }
+            if (!uring_aceptando && fd_s != -1 && cqe.res != -ECANCELED) uring_armar_aceptar();
+            continue;
         }
-        count++;
-        token = strtok(NULL, " ");
+        unsigned marca = (unsigned) (cqe.user_data & URING_MARCAS);
+        sesion_t *s = (sesion_t *) (uintptr_t) (cqe.user_data & ~(uint64_t) URING_MARCAS);
+        if (marca != 0) uring_trama_enviada(s, marca, cqe.res);
+        else uring_datos_recibidos(s, &cqe);
+    }
+}
+
+/*
+ * Apagado ordenado (SIGTERM o Ctrl+C): se deja de aceptar conexiones y cada sesión
+ * recibe una trama de despedida; se cierra en cuanto se haya enviado lo pendiente (lo
+ * que termina sus comandos en curso). Las que no terminen en TIEMPO_APAGADO_MS se
+ * cierran igualmente.
+ */
+#define TIEMPO_APAGADO_MS 5000
+
+static void iniciar_apagado(void) {
+    const char *despedida_msg = "El servidor se está apagando. ¡Hasta luego!\n";
+    registrar(NIVEL_INFO, 0, "Cerrando servidor...");
+    if (uring_aceptando) uring_cancelar(URING_ACEPTAR);
+    epoll_ctl(fd_epoll, EPOLL_CTL_DEL, fd_s, NULL);
+    close(fd_s);
+    fd_s = -1;
+    sesion_t *sig;
+    for (sesion_t *s = sesiones; s != NULL; s = sig) {
+        sig = s->sig;
+        if (s->estado == SESION_CERRANDO) continue;
+        s->estado = SESION_CERRANDO;
+        if (enviar_trama(s, TRAMA_ADIOS, 0, 0, 0, despedida_msg, strlen(despedida_msg)) == -1) continue;
+        if (buffer_pendiente(&s->salida) == 0 && s->canal_carga == NULL) cerrar_sesion(s);
+        else actualizar_eventos_cliente(s);
+    }
+}
+
+/*
+ * Termina lo que queda: sesiones, ejecutores e hijos. Las métricas se escriben por
+ * última vez.
+ */
+static void terminar_servidor(void) {
+    sesion_t *sig;
+    for (sesion_t *s = sesiones; s != NULL; s = sig) {
+        sig = s->sig;
+        cerrar_sesion(s);
+    }
+    liberar_sesiones_cerradas();
+    for (int e = 0; e < num_ejecutores; e++) {
+        if (!ejecutores[e].activo) continue;
+        close(ejecutores[e].fd); // El ejecutor termina al ver cerrado su socket
+        waitpid(ejecutores[e].pid, NULL, 0);
     }
-    arg_list[count] = NULL;
-    free(buffer_copy);
-    return count;
+    for (size_t i = 0; i < num_hijos_pendientes; i++) kill(hijos_pendientes[i], SIGKILL);
+    for (size_t i = 0; i < num_hijos_pendientes; i++) waitpid(hijos_pendientes[i], NULL, 0);
+    num_hijos_pendientes = 0;
+    if (archivo_metricas != NULL) escribir_archivo_metricas();
+    close(fd_epoll);
 }
 
 /*
- * Ejecuta un comando en un proceso hijo y redirige su salida al cliente.
- * Devuelve el número total de bytes de datos del comando enviados al cliente (payload).
+ * Modo de comparación (--bench-lanzamiento): lanza N veces el comando 'true' con
+ * fork() desde el servidor y con un ejecutor, esperando cada vez a que termine, e
+ * imprime el costo medio de cada camino. Con --bench-memoria se reserva y se toca
+ * antes esa cantidad de memoria, como un servidor con mucha memoria residente (lo
+ * que encarece cada fork(); los ejecutores se crean antes, como al arrancar).
  */
-ssize_t ejecutar_y_transmitir_comando(char *comando_base, char *arg_list[], int fd_cliente) {
+static double ahora_segundos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int lanzar_y_esperar(int usar_ejecutor, uint32_t generacion, char *arg_list[]) {
+    char buf[LANZAMIENTO_MAX];
     int pipe_fd[2];
-    pid_t pid;
-    char buffer_pipe[BUFFER_SIZE];
-    ssize_t bytes_leidos_pipe;
-    ssize_t total_bytes_enviados_payload = 0;
+    pid_t pid = -1;
 
-    if (pipe(pipe_fd) == -1) {
-        perror("[SERVIDOR] Error al crear el pipe");
-        const char* err_msg = "Error interno del servidor (pipe)\n";
-        send(fd_cliente, err_msg, strlen(err_msg), 0);
-        send(fd_cliente, CMD_EOF_MARKER, strlen(CMD_EOF_MARKER), 0);
-        return 0;
+    if (pipe2(pipe_fd, O_CLOEXEC) == -1) return -1;
+    if (usar_ejecutor) {
+        comando_t cmd;
+        comando_de_argumentos(&cmd, 1, arg_list);
+        size_t n = armar_lanzamiento(buf, sizeof(buf), 0, generacion, &cmd);
+        if (enviar_con_fd(ejecutores[0].fd, buf, n, &pipe_fd[1], 1, 0) < 0) {
+            close(pipe_fd[0]); close(pipe_fd[1]);
+            return -1;
+        }
+    } else {
+        pid = fork();
+        if (pid == -1) {
+            close(pipe_fd[0]); close(pipe_fd[1]);
+            return -1;
+        }
+        if (pid == 0) {
+            close(pipe_fd[0]);
+            ejecutar_en_hijo(-1, pipe_fd[1], pipe_fd[1], -1, arg_list[0], arg_list);
+        }
+    }
+    close(pipe_fd[1]);
+    while (read(pipe_fd[0], buf, sizeof(buf)) > 0) { /* Descartar la salida */ }
+    close(pipe_fd[0]);
+    if (usar_ejecutor) {
+        msg_ejecutor_t m;
+        do {
+            if (recv(ejecutores[0].fd, &m, sizeof(m), 0) <= 0) return -1;
+        } while (m.tipo != EJEC_FIN || m.generacion != generacion);
+    } else {
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
+
+static void comparar_lanzamiento(int repeticiones, size_t memoria_mb) {
+    char *arg_list[] = { "true", NULL };
+    double t_fork, t_ejecutor;
+
+    if (num_ejecutores == 0 && crear_ejecutores(1) == -1) exit(1);
+    if (memoria_mb > 0) {
+        char *lastre = malloc(memoria_mb * 1024 * 1024);
+        if (lastre == NULL) { perror("Error al reservar memoria para la comparación"); exit(1); }
+        memset(lastre, 1, memoria_mb * 1024 * 1024); // Tocar cada página para que sea residente
     }
 
-    pid = fork();
+    printf("=== COMPARACIÓN DE LANZAMIENTO DE COMANDOS ===\n");
+    printf("Comando: true, repeticiones: %d, memoria residente adicional: %zu MiB\n\n",
+           repeticiones, memoria_mb);
 
-    if (pid == -1) {
-        perror("[SERVIDOR] Error al crear proceso hijo (fork)");
-        close(pipe_fd[0]); close(pipe_fd[1]);
-        const char* err_msg = "Error interno del servidor (fork)\n";
-        send(fd_cliente, err_msg, strlen(err_msg), 0);
-        send(fd_cliente, CMD_EOF_MARKER, strlen(CMD_EOF_MARKER), 0);
-        return 0;
+    double inicio = ahora_segundos();
+    for (int i = 0; i < repeticiones; i++) {
+        if (lanzar_y_esperar(0, 0, arg_list) == -1) { perror("Error en fork()"); exit(1); }
     }
+    t_fork = ahora_segundos() - inicio;
 
-    if (pid == 0) { // Proceso Hijo
-        close(pipe_fd[0]);
-        if (dup2(pipe_fd[1], STDOUT_FILENO) == -1) { perror("[SERVIDOR HIJO] Error dup2 stdout"); exit(EXIT_FAILURE); }
-        if (dup2(pipe_fd[1], STDERR_FILENO) == -1) { perror("[SERVIDOR HIJO] Error dup2 stderr"); exit(EXIT_FAILURE); }
-        close(pipe_fd[1]);
-        execvp(comando_base, arg_list);
-        fprintf(stderr, "Error al ejecutar comando '%s': %s\n", comando_base, strerror(errno));
-        exit(EXIT_FAILURE);
-    } else { // Proceso Padre
-        close(pipe_fd[1]);
-        while ((bytes_leidos_pipe = read(pipe_fd[0], buffer_pipe, sizeof(buffer_pipe) -1 )) > 0) {
-            ssize_t bytes_enviados_chunk = send(fd_cliente, buffer_pipe, bytes_leidos_pipe, 0);
-            if (bytes_enviados_chunk < 0) { perror("[SERVIDOR] Error al enviar datos del pipe"); break; }
-            if (bytes_enviados_chunk > 0) total_bytes_enviados_payload += bytes_enviados_chunk;
-        }
-        if (bytes_leidos_pipe < 0) perror("[SERVIDOR] Error al leer del pipe");
-        if (send(fd_cliente, CMD_EOF_MARKER, strlen(CMD_EOF_MARKER), 0) < 0) {
-            perror("[SERVIDOR] Error al enviar CMD_EOF_MARKER");
+    inicio = ahora_segundos();
+    for (int i = 0; i < repeticiones; i++) {
+        if (lanzar_y_esperar(1, (uint32_t) i + 1, arg_list) == -1) { perror("Error con el ejecutor"); exit(1); }
+    }
+    t_ejecutor = ahora_segundos() - inicio;
+
+    printf("fork() en el servidor:  total %.3f s, %.1f us por comando\n",
+           t_fork, t_fork * 1e6 / repeticiones);
+    printf("ejecutor (vfork):       total %.3f s, %.1f us por comando\n",
+           t_ejecutor, t_ejecutor * 1e6 / repeticiones);
+    printf("Relación fork/ejecutor: %.2fx\n", t_ejecutor > 0 ? t_fork / t_ejecutor : 0.0);
+}
+
+/*
+ * Workers.
+ * Con --workers N el proceso inicial sólo supervisa: crea N procesos worker, cada uno
+ * con su propio socket de escucha (SO_REUSEPORT, el kernel reparte las conexiones
+ * entre ellos), su bucle de eventos, sus ejecutores y sus métricas, y opcionalmente
+ * fijado a una CPU. Se usan procesos y no hilos porque el estado del bucle es global
+ * y así cada worker lo tiene propio. Si un worker muere se crea otro; si uno no pudo
+ * arrancar (sale con código 1, por ejemplo porque el puerto está ocupado) se apaga todo.
+ * SIGTERM o Ctrl+C se reenvían a los workers, que se cierran ordenadamente.
+ */
+#define MAX_WORKERS 256
+
+static char archivo_metricas_worker[PATH_MAX];
+
+/*
+ * Fija el proceso a la CPU 'i' (módulo las CPU que tiene permitidas).
+ */
+static void fijar_en_cpu(int i) {
+    cpu_set_t permitidas, una;
+    if (sched_getaffinity(0, sizeof(permitidas), &permitidas) == -1) return;
+    int k = i % CPU_COUNT(&permitidas);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &permitidas) || k-- > 0) continue;
+        CPU_ZERO(&una);
+        CPU_SET(cpu, &una);
+        if (sched_setaffinity(0, sizeof(una), &una) == -1) perror("[SERVIDOR] Error en sched_setaffinity");
+        else printf("[SERVIDOR] Worker %d fijado a la CPU %d\n", i, cpu);
+        return;
+    }
+}
+
+/*
+ * Crea el worker 'i'. En el worker devuelve 0 con su configuración ya aplicada; en el
+ * supervisor, el pid del worker (o -1).
+ */
+static pid_t crear_worker(int i, int fijar_cpu, const sigset_t *mascara) {
+    fflush(NULL); // Que el worker no herede (y repita) logs sin escribir
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    sigprocmask(SIG_SETMASK, mascara, NULL);
+    num_worker = i;
+    siguiente_id_sesion = (unsigned long) i + 1;
+    paso_id_sesion = (unsigned long) num_workers;
+    if (archivo_metricas != NULL) {
+        // ssh.prom -> ssh-2.prom: un archivo por worker, que el textfile collector suma
+        const char *punto = strrchr(archivo_metricas, '.');
+        const char *barra = strrchr(archivo_metricas, '/');
+        if (punto == NULL || (barra != NULL && punto < barra)) punto = archivo_metricas + strlen(archivo_metricas);
+        snprintf(archivo_metricas_worker, sizeof(archivo_metricas_worker), "%.*s-%d%s",
+                 (int) (punto - archivo_metricas), archivo_metricas, i, punto);
+        archivo_metricas = archivo_metricas_worker;
+    }
+    if (fijar_cpu) fijar_en_cpu(i);
+    return 0;
+}
+
+/*
+ * Supervisa los workers. Sólo regresa en cada worker recién creado.
+ */
+static void supervisar_workers(int fijar_cpu) {
+    pid_t pids[MAX_WORKERS];
+    time_t inicios[MAX_WORKERS];
+    sigset_t senales, anterior;
+    int vivos = 0, apagando = 0, codigo = 0;
+
+    sigemptyset(&senales);
+    sigaddset(&senales, SIGINT);
+    sigaddset(&senales, SIGTERM);
+    sigaddset(&senales, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &senales, &anterior);
+
+    for (int i = 0; i < num_workers; i++) {
+        pids[i] = crear_worker(i, fijar_cpu, &anterior);
+        if (pids[i] == 0) return;
+        if (pids[i] == -1) {
+            perror("[SERVIDOR] Error al crear worker (fork)");
+            apagando = 1;
+            codigo = 1;
+            break;
         }
-        close(pipe_fd[0]);
-        waitpid(pid, NULL, 0); // Esperar al hijo, sin loguear su estado en consola del servidor
+        inicios[i] = time(NULL);
+        vivos++;
     }
-    return total_bytes_enviados_payload;
+    printf("[SERVIDOR] %d workers atendiendo el puerto (supervisor PID %d)\n", vivos, (int) getpid());
+    for (int i = 0; apagando && i < vivos; i++) kill(pids[i], SIGTERM);
+
+    while (vivos > 0) {
+        siginfo_t info;
+        int sig = sigwaitinfo(&senales, &info);
+        if (sig == -1) continue;
+        if (sig == SIGINT || sig == SIGTERM) {
+            if (apagando) continue;
+            printf("\n[SERVIDOR] Cerrando los workers...\n");
+            apagando = 1;
+            for (int i = 0; i < num_workers; i++) if (pids[i] > 0) kill(pids[i], SIGTERM);
+            continue;
+        }
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            int i = 0;
+            while (i < num_workers && pids[i] != pid) i++;
+            if (i == num_workers) continue;
+            pids[i] = -1;
+            vivos--;
+            if (apagando) continue;
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 1) {
+                fprintf(stderr, "[SERVIDOR] El worker %d no pudo arrancar; cerrando el servidor\n", i);
+                apagando = 1;
+                codigo = 1;
+                for (int j = 0; j < num_workers; j++) if (pids[j] > 0) kill(pids[j], SIGTERM);
+                continue;
+            }
+            fprintf(stderr, "[SERVIDOR] El worker %d (PID %d) terminó inesperadamente (estado %d); se crea otro\n",
+                    i, (int) pid, (int) codigo_salida(status));
+            if (time(NULL) - inicios[i] < 1) sleep(1); // No relanzar sin pausa un worker que muere al arrancar
+            pids[i] = crear_worker(i, fijar_cpu, &anterior);
+            if (pids[i] == 0) return;
+            if (pids[i] > 0) {
+                inicios[i] = time(NULL);
+                vivos++;
+            }
+        }
+    }
+    printf("[SERVIDOR] Servidor cerrado\n");
+    exit(codigo);
+}
+
+/*
+ * Tamaño en bytes con un sufijo opcional K, M o G (potencias de 1024), como "512M".
+ * Devuelve 0 si el texto no es válido.
+ */
+static uint64_t leer_tamano(const char *texto) {
+    char *fin;
+    errno = 0;
+    unsigned long long n = strtoull(texto, &fin, 10);
+    if (fin == texto || errno != 0 || *texto == '-') return 0;
+    int desplazamiento = 0;
+    if (*fin == 'K' || *fin == 'k') desplazamiento = 10;
+    else if (*fin == 'M' || *fin == 'm') desplazamiento = 20;
+    else if (*fin == 'G' || *fin == 'g') desplazamiento = 30;
+    if (desplazamiento > 0) fin++;
+    if (*fin != '\0' || n > (UINT64_MAX >> desplazamiento)) return 0;
+    return (uint64_t) n << desplazamiento;
+}
+
+static void uso(const char *prog) {
+    fprintf(stderr, "Uso: %s <puerto> [opciones]\nEjemplo: %s 8080 --backlog 512 --ejecutores 2\n", prog, prog);
+    fprintf(stderr, "  -b, --backlog N           Cola de conexiones pendientes para listen (por defecto %d)\n",
+            QLEN_POR_DEFECTO);
+    fprintf(stderr, "  -e, --ejecutores N        Lanzar los comandos desde N procesos ejecutores creados al\n"
+                    "                            arrancar, en lugar de hacer fork() del servidor (máximo %d)\n",
+            MAX_EJECUTORES);
+    fprintf(stderr, "  -w, --workers N           Repartir las conexiones entre N procesos, cada uno con su\n"
+                    "                            socket (SO_REUSEPORT) y su bucle de eventos (máximo %d)\n",
+            MAX_WORKERS);
+    fprintf(stderr, "      --fijar-cpu           Fijar cada worker a una CPU distinta\n");
+    fprintf(stderr, "      --shell               Empezar cada sesión en modo shell (ver __shell)\n");
+    fprintf(stderr, "      --sin-internos        Ejecutar pwd, echo, ls, cat y stat como procesos\n");
+    fprintf(stderr, "      --sin-dns             No resolver el nombre de los clientes (sólo su IP)\n");
+    fprintf(stderr, "      --sin-compresion      No ofrecer a los clientes la salida comprimida\n");
+    fprintf(stderr, "      --io-uring            Aceptar y leer a los clientes con io_uring (si el kernel\n"
+                    "                            no lo admite se sigue con epoll)\n");
+    fprintf(stderr, "      --cache ARCHIVO       Responder desde memoria los comandos de ARCHIVO (una regla\n"
+                    "                            'TTL comando [argumentos...]' por línea)\n");
+    fprintf(stderr, "      --cache-memoria MB    Memoria máxima de la caché (por defecto %d)\n",
+            CACHE_MEMORIA_POR_DEFECTO);
+    fprintf(stderr, "      --metricas ARCHIVO    Escribir las métricas en ARCHIVO (formato de Prometheus)\n");
+    fprintf(stderr, "      --intervalo-metricas S Segundos entre escrituras de ese archivo (por defecto %d)\n",
+            INTERVALO_METRICAS_POR_DEFECTO);
+    fprintf(stderr, "      --tiempo-comando S    Terminar los comandos que sigan en curso tras S segundos\n");
+    fprintf(stderr, "      --salida-maxima N     Terminar los comandos cuya salida pase de N bytes (admite\n"
+                    "                            los sufijos K, M y G)\n");
+    fprintf(stderr, "      --limite-cpu S        Segundos de CPU por proceso lanzado (RLIMIT_CPU)\n");
+    fprintf(stderr, "      --limite-memoria N    Memoria virtual por proceso lanzado (RLIMIT_AS; K, M, G)\n");
+    fprintf(stderr, "      --inactividad S       Cerrar las sesiones que pasen S segundos sin actividad\n");
+    fprintf(stderr, "      --log-json            Escribir el log como una línea JSON por mensaje\n");
+    fprintf(stderr, "      --log-nivel NIVEL     Mostrar sólo los mensajes hasta NIVEL: error, aviso o info\n"
+                    "                            (por defecto info, todos)\n");
+    fprintf(stderr, "      --log-limite N        Mensajes informativos por segundo como máximo; el resto se\n"
+                    "                            cuenta y se omite (por defecto 0, sin límite)\n");
+    fprintf(stderr, "      --bench-lanzamiento N Comparar N lanzamientos con fork() y con un ejecutor, y salir\n");
+    fprintf(stderr, "      --bench-memoria MB    Memoria residente adicional durante la comparación\n");
 }
-//Manejo final del resultado según si hubo salida o errores.
 
 //Función principal del servidor
 int main(int argc, char *argv[]) {
     struct sockaddr_in servidor_addr;  // Estructura para dirección del servidor
-    struct sockaddr_in cliente_addr;   // Estructura para dirección del cliente
-    struct hostent* info_cliente;      // Información del hostname del cliente
-    int fd_c;                          // File descriptor del cliente
-    socklen_t longClient;              // Longitud de la estructura cliente
-    char buf_comando_raw[BUFFER_SIZE]; // Buffer para recibir comandos
-    char buf_comando_trimmed[BUFFER_SIZE];
-    char *arg_list[MAX_TOKENS];
-    int num_tokens;
-    char buffer_info_conexion_cliente[512]; // Buffer para formatear el mensaje de conexión para el cliente
+    struct epoll_event eventos[MAX_EVENTOS];
+    int backlog = QLEN_POR_DEFECTO;
+    int n_ejecutores = 0;
+    int bench_lanzamiento = 0;
+    int fijar_cpu = 0;
+    size_t bench_memoria = 0;
+    const char *archivo_cache = NULL;
+    int opcion;
+
+    static const struct option opciones[] = {
+        { "backlog",           required_argument, NULL, 'b' },
+        { "workers",           required_argument, NULL, 'w' },
+        { "fijar-cpu",         no_argument,       NULL, 'F' },
+        { "ejecutores",        required_argument, NULL, 'e' },
+        { "sin-internos",      no_argument,       NULL, 'I' },
+        { "shell",             no_argument,       NULL, 'S' },
+        { "sin-dns",           no_argument,       NULL, 'D' },
+        { "io-uring",          no_argument,       NULL, 'U' },
+        { "sin-compresion",    no_argument,       NULL, 'Z' },
+        { "cache",             required_argument, NULL, 'C' },
+        { "cache-memoria",     required_argument, NULL, 'K' },
+        { "metricas",          required_argument, NULL, 'm' },
+        { "intervalo-metricas", required_argument, NULL, 'i' },
+        { "tiempo-comando",    required_argument, NULL, 't' },
+        { "salida-maxima",     required_argument, NULL, 'o' },
+        { "limite-cpu",        required_argument, NULL, 'c' },
+        { "limite-memoria",    required_argument, NULL, 'r' },
+        { "inactividad",       required_argument, NULL, 'A' },
+        { "log-json",          no_argument,       NULL, 'j' },
+        { "log-nivel",         required_argument, NULL, 'n' },
+        { "log-limite",        required_argument, NULL, 'l' },
+        { "bench-lanzamiento", required_argument, NULL, 'L' },
+        { "bench-memoria",     required_argument, NULL, 'M' },
+        { "help",              no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    while ((opcion = getopt_long(argc, argv, "b:e:w:h", opciones, NULL)) != -1) {
+        switch (opcion) {
+            case 'b':
+                backlog = atoi(optarg);
+                if (backlog <= 0) {
+                    fprintf(stderr, "Backlog inválido: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'e':
+                n_ejecutores = atoi(optarg);
+                if (n_ejecutores < 0 || n_ejecutores > MAX_EJECUTORES) {
+                    fprintf(stderr, "Número de ejecutores inválido: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'w':
+                num_workers = atoi(optarg);
+                if (num_workers < 1 || num_workers > MAX_WORKERS) {
+                    fprintf(stderr, "Número de workers inválido: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'F':
+                fijar_cpu = 1;
+                break;
+            case 'I':
+                internos_activos = 0;
+                break;
+            case 'S':
+                modo_shell_por_defecto = 1;
+                break;
+            case 'D':
+                dns_activo = 0;
+                break;
+            case 'U':
+                motor_uring = 1;
+                break;
+            case 'Z':
+                compresion_ofrecida = 0;
+                break;
+            case 'C':
+                archivo_cache = optarg;
+                break;
+            case 'K':
+                if (atol(optarg) <= 0) {
+                    fprintf(stderr, "Memoria de la caché inválida: %s\n", optarg);
+                    exit(1);
+                }
+                cache_memoria_max = (size_t) atol(optarg) * 1024 * 1024;
+                break;
+            case 'm':
+                archivo_metricas = optarg;
+                break;
+            case 'i':
+                intervalo_metricas = atoi(optarg);
+                if (intervalo_metricas <= 0) {
+                    fprintf(stderr, "Intervalo de métricas inválido: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 't':
+                limite_tiempo_comando = atoi(optarg);
+                if (limite_tiempo_comando <= 0) {
+                    fprintf(stderr, "Tiempo máximo por comando inválido: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                limite_salida = leer_tamano(optarg);
+                if (limite_salida == 0) {
+                    fprintf(stderr, "Salida máxima inválida: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                limite_cpu = atoi(optarg);
+                if (limite_cpu <= 0) {
+                    fprintf(stderr, "Límite de CPU inválido: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'r':
+                limite_memoria = leer_tamano(optarg);
+                if (limite_memoria == 0) {
+                    fprintf(stderr, "Límite de memoria inválido: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'A':
+                limite_inactividad = atoi(optarg);
+                if (limite_inactividad <= 0) {
+                    fprintf(stderr, "Tiempo de inactividad inválido: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'j':
+                registro.json = 1;
+                break;
+            case 'n': {
+                int nivel = 0;
+                while (nivel < NUM_NIVELES && strcmp(optarg, nombres_niveles[nivel]) != 0) nivel++;
+                if (nivel == NUM_NIVELES) {
+                    fprintf(stderr, "Nivel de log inválido: %s (error, aviso o info)\n", optarg);
+                    exit(1);
+                }
+                registro.nivel = (nivel_registro_t) nivel;
+                break;
+            }
+            case 'l':
+                registro.limite = atoi(optarg);
+                if (registro.limite < 0) {
+                    fprintf(stderr, "Límite del log inválido: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'L':
+                bench_lanzamiento = atoi(optarg);
+                if (bench_lanzamiento <= 0) {
+                    fprintf(stderr, "Repeticiones inválidas: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'M':
+                bench_memoria = (size_t) atol(optarg);
+                break;
+            default:
+                uso(argv[0]);
+                exit(1);
+        }
+    }
+    fd_dev_null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    setlocale(LC_COLLATE, ""); // ls interno: mismo orden que el ls real con este entorno
+    tzset();                   // stat interno: fechas en la zona horaria local
+    if (internos_activos && !locale_compatible()) internos_activos = 0;
+    if (archivo_cache != NULL && cargar_reglas_cache(archivo_cache) == -1) exit(1);
 
-    if (argc != 2) {
-        fprintf(stderr, "Uso: %s <puerto>\nEjemplo: %s 8080\n", argv[0], argv[0]);
+    if (bench_lanzamiento > 0) {
+        if (n_ejecutores > 0 && crear_ejecutores(n_ejecutores) == -1) exit(1);
+        comparar_lanzamiento(bench_lanzamiento, bench_memoria);
+        exit(0);
+    }
+    if (argc - optind != 1) {
+        uso(argv[0]);
         exit(1);
     }
-    
-    // Configurar manejador de señales
+    const char *puerto = argv[optind];
+
+    // Configurar manejador de señales: SIGINT y SIGTERM quedan bloqueadas salvo durante
+    // epoll_pwait, para que el bucle no pierda el aviso entre comprobarlo y esperar
+    sigset_t senales_fin, mascara_espera;
+    sigemptyset(&senales_fin);
+    sigaddset(&senales_fin, SIGINT);
+    sigaddset(&senales_fin, SIGTERM);
     signal(SIGINT, signal_handler);   // Ctrl+C
     signal(SIGTERM, signal_handler);  // kill
-    
+    signal(SIGPIPE, SIG_IGN);         // Los errores de envío se atienden por sesión
+
     printf("=== SERVIDOR SSH INICIADO ===\n");
-    printf("Puerto: %s\n", argv[1]);
+    printf("Puerto: %s\n", puerto);
+    if (n_ejecutores > 0) printf("Ejecutores: %d procesos auxiliares lanzan los comandos\n", n_ejecutores);
+    printf("Comandos internos: %s\n", internos_activos ? "pwd, echo, ls, cat, stat y cd" : "sólo cd");
+    if (!dns_activo) printf("Nombres de los clientes: desactivado (sólo IP)\n");
+    if (num_reglas_cache > 0) {
+        printf("Caché de respuestas: %d reglas, hasta %zu MB%s\n", num_reglas_cache, cache_memoria_max / (1024 * 1024),
+               num_workers > 0 ? " por worker" : "");
+    }
+    if (archivo_metricas != NULL) printf("Métricas: %s (cada %d s)\n", archivo_metricas, intervalo_metricas);
+    if (limite_tiempo_comando > 0) printf("Tiempo máximo por comando: %d s\n", limite_tiempo_comando);
+    if (limite_salida > 0) printf("Salida máxima por comando: %llu bytes\n", (unsigned long long) limite_salida);
+    if (limite_cpu > 0) printf("CPU por proceso: %d s\n", limite_cpu);
+    if (limite_memoria > 0) printf("Memoria por proceso: %llu bytes\n", (unsigned long long) limite_memoria);
+    if (limite_inactividad > 0) printf("Sesiones inactivas: se cierran a los %d s\n", limite_inactividad);
+    if (num_workers > 0) {
+        printf("Workers: %d procesos%s\n", num_workers, fijar_cpu ? ", cada uno fijado a una CPU" : "");
+        supervisar_workers(fijar_cpu); // Sólo regresa en los workers
+    }
     printf("Esperando conexiones...\n\n");
-    
+
+    // Los ejecutores se crean antes que el resto, cuando el proceso aún ocupa poca memoria
+    // (tras instalar los manejadores de señales, que cada ejecutor restablece)
+    if (n_ejecutores > 0 && crear_ejecutores(n_ejecutores) == -1) exit(1);
+    sigprocmask(SIG_BLOCK, &senales_fin, &mascara_espera);
+
     // 1. Crear socket del servidor
     printf("1. Creando socket del servidor...\n");
-    fd_s = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    fd_s = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
     if (fd_s < 0) {
         perror("Error al crear socket");
         exit(1);
@@ -189,13 +6350,19 @@ int main(int argc, char *argv[]) {
         printf("   setsockopt configurado correctamente\n");
     }
     //SO_REUSEADDR permite reutilizar el puerto inmediatamente después de cerrar el servidor.
+    // Con --workers cada worker abre su propio socket en el mismo puerto (SO_REUSEPORT)
+    if (num_worker >= 0 && setsockopt(fd_s, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == -1) {
+        perror("Error en setsockopt(SO_REUSEPORT)");
+        close(fd_s);
+        exit(1);
+    }
     // 2. Inicializar estructura del servidor
     printf("2. Configurando dirección del servidor...\n");
     memset((char *) &servidor_addr, 0, sizeof(servidor_addr));
     servidor_addr.sin_family = AF_INET;             // IPv4
     servidor_addr.sin_addr.s_addr = INADDR_ANY;     // Cualquier interfaz
-    servidor_addr.sin_port = htons((u_short) atoi(argv[1])); // Puerto convertido a network byte order
-    
+    servidor_addr.sin_port = htons((u_short) atoi(puerto)); // Puerto convertido a network byte order
+
     // 3. Bind, bind() asocia el socket con la dirección y puerto especificados.
     printf("3. Haciendo bind al puerto...\n");
     if (bind(fd_s, (struct sockaddr *) &servidor_addr, sizeof(servidor_addr)) < 0) {
@@ -203,125 +6370,144 @@ int main(int argc, char *argv[]) {
         close(fd_s);
         exit(1);
     }
-    // 4. Listen, pone el socket en modo de escucha con cola de hasta QLEN (2) conexiones pendientes.
-    printf("4. Escuchando conexiones entrantes...\n\n");
-    if (listen(fd_s, QLEN) < 0) {
+    // 4. Listen, pone el socket en modo de escucha con cola de hasta 'backlog' conexiones pendientes.
+    printf("4. Escuchando conexiones entrantes (backlog %d)...\n\n", backlog);
+    if (listen(fd_s, backlog) < 0) {
         perror("Error en listen");
         close(fd_s);
         exit(1);
     }
-    
-    longClient = sizeof(cliente_addr);
-    
-    while(1) {
-        printf("Esperando cliente...\n");
-        // 5. Accept - esperar conexión de cliente, bloquea hasta que llega una conexión, retorna nuevo socket para comunicarse con el cliente.
-        fd_c = accept(fd_s, (struct sockaddr *) &cliente_addr, &longClient);
-        if (fd_c < 0) {
-            if (errno == EINTR) { printf("Accept() interrumpido. Saliendo...\n"); break; }
-            perror("Error en accept"); continue; 
-        }
-        // 6. Obtener información del cliente
-        info_cliente = gethostbyaddr((char *) &cliente_addr.sin_addr, sizeof(struct in_addr), AF_INET);
-        // Mostrar información de conexión con timestamp
-        time_t T = time(NULL);
-        struct tm tm_info = *localtime(&T);
-        
-        // Imprimir en la consola del servidor
-        printf("%02d/%02d/%04d %02d:%02d:%02d - Cliente conectado desde: ", 
-               tm_info.tm_mday, tm_info.tm_mon + 1, tm_info.tm_year + 1900, 
-               tm_info.tm_hour, tm_info.tm_min, tm_info.tm_sec);
-        if (info_cliente == NULL) {
-            printf("%s\n", inet_ntoa(cliente_addr.sin_addr));
-        } else {
-            printf("%s (%s)\n", info_cliente->h_name, inet_ntoa(cliente_addr.sin_addr));
-        }
-
-        // 7. Enviar mensaje de bienvenida
-        memset(buffer_info_conexion_cliente, 0, sizeof(buffer_info_conexion_cliente));
-        int len_escrita = snprintf(buffer_info_conexion_cliente, sizeof(buffer_info_conexion_cliente),
-                 "%02d/%02d/%04d %02d:%02d:%02d - Cliente conectado desde: ",
-                 tm_info.tm_mday, tm_info.tm_mon + 1, tm_info.tm_year + 1900,
-                 tm_info.tm_hour, tm_info.tm_min, tm_info.tm_sec);
-        if (info_cliente == NULL) {
-            snprintf(buffer_info_conexion_cliente + len_escrita, sizeof(buffer_info_conexion_cliente) - len_escrita,
-                     "%s\n", inet_ntoa(cliente_addr.sin_addr));
-        } else {
-            snprintf(buffer_info_conexion_cliente + len_escrita, sizeof(buffer_info_conexion_cliente) - len_escrita,
-                     "%s (%s)\n", info_cliente->h_name, inet_ntoa(cliente_addr.sin_addr));
+
+    // 5. Bucle de eventos: un solo hilo atiende el socket de escucha, los clientes y los pipes
+    fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (fd_epoll < 0) {
+        perror("Error en epoll_create1");
+        close(fd_s);
+        exit(1);
+    }
+    if (motor_uring && iniciar_uring() == -1) {
+        perror("[SERVIDOR] io_uring no disponible, se usará epoll");
+        if (uring.fd != -1) close(uring.fd);
+        uring.fd = -1;
+        motor_uring = 0;
+    } else if (motor_uring) {
+        printf("Motor io_uring: accept y recv multishot con %d buffers de %d bytes%s\n",
+               URING_NUM_BUFFERS, BUFFER_SIZE, uring_envio_activo ? ", tramas con send y splice enlazados" : "");
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &f_escucha };
+    int error = motor_uring ? uring_armar_aceptar() : epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_s, &ev);
+    if (error == -1 || registrar_ejecutores() == -1) {
+        perror("Error en epoll_ctl (escucha)");
+        close(fd_s);
+        exit(1);
+    }
+    if (dns_activo && iniciar_resolutor() == -1) {
+        perror("[SERVIDOR] No se pudo iniciar la resolución de nombres, se mostrarán sólo las IP");
+        dns_activo = 0;
+    }
+    iniciar_registro();
+    if (num_worker >= 0) registrar(NIVEL_INFO, 0, "Worker %d (PID %d) esperando clientes...", num_worker, (int) getpid());
+    else registrar(NIVEL_INFO, 0, "Esperando clientes...");
+    metricas.inicio_ns = ahora_ns();
+    rueda.tic = metricas.inicio_ns / RUEDA_TIC_NS;
+    uint64_t fin_apagado = 0; // Límite para cerrar las sesiones (0: sin apagado en curso)
+
+    while (1) {
+        if (terminar && fin_apagado == 0) {
+            iniciar_apagado();
+            fin_apagado = ahora_ns() + TIEMPO_APAGADO_MS * 1000000ULL;
         }
-        // Enviar esta información formateada al cliente
-        if (send(fd_c, buffer_info_conexion_cliente, strlen(buffer_info_conexion_cliente), 0) < 0) {
-            perror("Error al enviar info de conexión al cliente");
+        if (fin_apagado != 0 && (sesiones == NULL || ahora_ns() >= fin_apagado)) break;
+        int espera = (num_hijos_pendientes > 0 || sesiones_sin_pidfd > 0) ? INTERVALO_RECOLECCION_MS : -1;
+        if (sumas_pendientes > 0) espera = 0;
+        if (fin_apagado != 0) {
+            int hasta_fin = (int) ((fin_apagado - ahora_ns()) / 1000000) + 1;
+            if (espera == -1 || hasta_fin < espera) espera = hasta_fin;
         }
-        // ---- FIN DE NUEVO ----
-        
-        const char* bienvenida_msg = "Conexión SSH simulada. Escriba comandos o 'salir'/'exit' para desconectar.\n";
-        if (send(fd_c, bienvenida_msg, strlen(bienvenida_msg), 0) < 0) {
-            perror("Error al enviar mensaje de bienvenida"); close(fd_c); continue;
+        if (rueda.programados > 0) {
+            int hasta_tic = espera_rueda(ahora_ns());
+            if (hasta_tic != -1 && (espera == -1 || hasta_tic < espera)) espera = hasta_tic;
         }
-        // 8. Bucle de comunicación con el cliente
-        do {
-            // Limpiar buffer de comando
-            memset(buf_comando_raw, '\0', sizeof(buf_comando_raw));
-            memset(buf_comando_trimmed, '\0', sizeof(buf_comando_trimmed));
-            
-            // Recibir comando del cliente
-            int bytes_recibidos = recv(fd_c, buf_comando_raw, sizeof(buf_comando_raw) - 1, 0);
-            
-            if (bytes_recibidos <= 0) {
-                if (bytes_recibidos != 0) perror("Cliente desconectado inesperadamente");
-                break; 
-            }
-            
-            // Null-terminate y limpiar saltos de línea
-            buf_comando_raw[bytes_recibidos] = '\0';
-            strncpy(buf_comando_trimmed, buf_comando_raw, sizeof(buf_comando_trimmed) -1);
-            buf_comando_trimmed[strcspn(buf_comando_trimmed, "\r\n")] = 0;
-            trim(buf_comando_trimmed);
-            
-            printf("Comando recibido: '%s'\n", buf_comando_trimmed);
-            
-            // Verificar comandos de salida
-            if (strcmp(buf_comando_trimmed, "salir") == 0 || strcmp(buf_comando_trimmed, "exit") == 0) {
-                const char* despedida_msg = "Desconectando. ¡Hasta luego!\n";
-                send(fd_c, despedida_msg, strlen(despedida_msg), 0);
-                break;
+        if (archivo_metricas != NULL) {
+            uint64_t ahora = ahora_ns();
+            if (ahora >= proxima_escritura_metricas) {
+                escribir_archivo_metricas();
+                proxima_escritura_metricas = ahora + (uint64_t) intervalo_metricas * 1000000000ULL;
             }
-
-            // Verificar comando vacío
-            if (strlen(buf_comando_trimmed) == 0) {
-                const char* error_vacio_msg = "Error: Comando vacío recibido.\n";
-                send(fd_c, error_vacio_msg, strlen(error_vacio_msg), 0);
-                send(fd_c, CMD_EOF_MARKER, strlen(CMD_EOF_MARKER), 0);
-                printf("Ejecutando comando: \n");
-                printf("Respuesta enviada (%zu bytes)\n", strlen(error_vacio_msg));
+            int hasta_metricas = (int) ((proxima_escritura_metricas - ahora) / 1000000) + 1;
+            if (espera == -1 || hasta_metricas < espera) espera = hasta_metricas;
+        }
+        if (motor_uring) uring_enviar(); // Todas las peticiones de la vuelta anterior juntas
+        int n = epoll_pwait(fd_epoll, eventos, MAX_EVENTOS, espera, &mascara_espera);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Error en epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            fuente_t *f = eventos[i].data.ptr;
+            uint32_t e = eventos[i].events;
+            if (f->tipo == FUENTE_ESCUCHA) {
+                aceptar_conexiones();
                 continue;
             }
-            
-            // Ejecutar comando y obtener resultado
-            printf("[SERVIDOR ]Ejecutando comando: %s\n", buf_comando_trimmed);
-
-            num_tokens = split(buf_comando_trimmed, arg_list);
-            ssize_t bytes_respuesta_payload = 0;
-
-            if (num_tokens > 0) {
-                bytes_respuesta_payload = ejecutar_y_transmitir_comando(arg_list[0], arg_list, fd_c);
-                for (int i = 0; i < num_tokens; i++) { free(arg_list[i]); arg_list[i] = NULL; }
-            } else {
-                 const char* err_msg_proc = "Error interno del servidor.\n";
-                 send(fd_c, err_msg_proc, strlen(err_msg_proc), 0);
-                 send(fd_c, CMD_EOF_MARKER, strlen(CMD_EOF_MARKER), 0);
-                 bytes_respuesta_payload = strlen(err_msg_proc);
-            }
-            printf("Respuesta enviada (%zd bytes)\n", bytes_respuesta_payload);
-        } while (1); 
-        // 9. Cerrar conexión con cliente actual
-        printf("Cerrando conexión con cliente...\n\n");
-        close(fd_c);
+            if (f->tipo == FUENTE_EJECUTOR) {
+                atender_ejecutor(f->indice);
+                continue;
+            }
+            if (f->tipo == FUENTE_RESOLUTOR) {
+                atender_resolutor();
+                continue;
+            }
+            if (f->tipo == FUENTE_URING) {
+                atender_uring();
+                continue;
+            }
+            sesion_t *s = f->sesion;
+            canal_t *c = f->canal;
+            if (s->fd == -1) continue; // Cerrada por un evento anterior de esta misma iteración
+            if (f->tipo == FUENTE_PIPE) {
+                if (c->fd_pipe != -1) leer_salida_hijo(c);
+                continue;
+            }
+            if (f->tipo == FUENTE_HIJO) {
+                if (c->fd_hijo != -1) esperar_hijo(c);
+                continue;
+            }
+            if (f->tipo == FUENTE_SHELL) {
+                if (c->fd_shell_salida != -1) leer_salida_shell(c);
+                continue;
+            }
+            // FUENTE_CLIENTE
+            if (e & EPOLLOUT) vaciar_salida(s);
+            if (s->fd == -1) continue;
+            if ((e & EPOLLIN) && s->estado == SESION_ACTIVA) leer_cliente(s);
+            if (s->fd == -1) continue;
+            if (e & (EPOLLERR | EPOLLHUP)) { cerrar_sesion(s); continue; }
+            if ((e & EPOLLRDHUP) && !(s->eventos_cliente & EPOLLIN)) {
+                // El cliente se fue mientras no se leía su socket (cierre o colas llenas)
+                cerrar_sesion(s);
+            }
+        }
+        if (sesiones_sin_pidfd > 0) {
+            sesion_t *sig;
+            for (sesion_t *s = sesiones; s != NULL; s = sig) {
+                sig = s->sig;
+                for (int i = 0; i < MAX_CANALES && s->fd != -1; i++) {
+                    if (s->canales[i] != NULL && s->canales[i]->sondeo_hijo) esperar_hijo(s->canales[i]);
+                }
+            }
+        }
+        if (sumas_pendientes > 0) avanzar_sumas();
+        if (rueda.programados > 0) atender_temporizadores();
+        liberar_sesiones_cerradas();
+        if (num_hijos_pendientes > 0) recolectar_pendientes();
     }
-    // 10. Cerrar servidor (nunca debería llegar aquí en el bucle infinito)
-    close(fd_s);
+    // 6. Cerrar servidor: tras el apagado ordenado (o si falla epoll)
+    terminar_servidor();
+    if (fd_s != -1) close(fd_s);
+    terminar_registro();
+    printf("[SERVIDOR] Servidor cerrado\n");
     exit(0);
     return 0;
-}
\ No newline at end of file
+}